@@ -16,7 +16,10 @@ unsigned char const *sounddata_data=0;
 int sounddata_length=0;
 volatile uint16_t sample;
 byte lastSample;
-int counter = 0;
+// Timer 2 overflows at 16MHz / 256 = 62500Hz; a new sample every SAMPLE_RATE / 62500 of an
+// overflow, by carrying the remainder over (phase accumulator), so any rate up to 62500Hz works.
+#define PWM_RATE 62500UL
+uint16_t phase = 0;
 
 
 void startPlayback(unsigned char const *data, int lengthe)
@@ -58,9 +61,9 @@ void stopPlayback()
 }
 
 ISR(TIMER2_OVF_vect) {
-  counter++;
-  if(counter == 8) {
-    counter = 0;
+  // phase + SAMPLE_RATE >= PWM_RATE, without overflowing 16 bits
+  if(phase >= PWM_RATE - SAMPLE_RATE) {
+    phase -= PWM_RATE - SAMPLE_RATE;
     if (sample >= sounddata_length) {
       if (sample == sounddata_length + lastSample) {
         stopPlayback();
@@ -77,6 +80,9 @@ ISR(TIMER2_OVF_vect) {
     ++sample;
     
   }
+  else {
+    phase += SAMPLE_RATE;
+  }
 }
 
 
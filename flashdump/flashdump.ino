@@ -104,7 +104,7 @@ void TIMER2_Interrupt() {
     
 //    if(value != -1) {
       if(teller < 1024) {
-        brol[teller] = fb->readItemAtIndex(3, teller);  
+        brol[teller] = fb->readItemCached(3, teller); // one page read every 256 samples instead of a read command per sample
         teller++;
       }
 //    } else if(teller>0) stops++;
@@ -173,6 +173,13 @@ if(teller==1024) {
   for(uint16_t i = 0; i < 1024; i++) {
     printHex(brol[i]);
   }
+  Serial.println();
+  Serial.print("cache hits: ");
+  Serial.print(fb->cacheHits());
+  Serial.print(" misses: ");
+  Serial.print(fb->cacheMisses());
+  Serial.print(" prefetches: ");
+  Serial.println(fb->cachePrefetches());
   }
 }
 }
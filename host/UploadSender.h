@@ -0,0 +1,128 @@
+// Sender side of the windowed upload protocol (SerialUpload.h), the same
+// logic as serialcomtest/app.js: keep every credited frame in flight, go back
+// to the oldest unacked frame on a nack or a timeout.
+//
+//   UploadSender s(id, data, len);           (or s(id, data, len, FLASHBUFFER_FORMAT_IMA_ADPCM))
+//   feed received bytes to s.receive(b, nowNs); s.poll(nowNs, tx) appends frames to send.
+
+#ifndef _HOST_UPLOADSENDER_H_
+#define _HOST_UPLOADSENDER_H_
+
+#include <SerialUpload.h>
+#include <vector>
+
+class UploadSender {
+public:
+  UploadSender(uint8_t id, const uint8_t *data, uint32_t length, uint8_t format = FLASHBUFFER_FORMAT_PCM8,
+               uint64_t timeoutNs = 300000000ULL)
+    : id(id), format(format), data(data), length(length), timeoutNs(timeoutNs) {
+    frames = 1 + (length + UPLOAD_FRAME_PAYLOAD - 1) / UPLOAD_FRAME_PAYLOAD; // begin + data
+    base = next = 0;
+    limit = 1; // the begin frame needs no credit
+    done = refused = false;
+    lastProgressNs = 0;
+    framesSent = resentFrames = nacks = timeouts = badFrames = 0;
+    rxPos = 0;
+    hunting = true;
+  }
+
+  bool finished() const { return done; }
+  // the device nacked the begin frame without credits: it doesn't take the id
+  bool rejected() const { return refused; }
+  // every frame the credits allow is out, but not the whole item: the device holds the line up
+  bool waitingForCredits() const { return !done && next >= limit && next < frames; }
+  // every frame is out, the device is still writing the last pages
+  bool allSent() const { return next >= frames; }
+
+  void receive(uint8_t b, uint64_t nowNs) {
+    if(hunting) {
+      if(b == UPLOAD_FRAME_START) {
+        hunting = false;
+        rxPos = 0;
+      }
+      return;
+    }
+    rx[rxPos++] = b;
+    if(rxPos == 3 && rx[2] > 1) {
+      badFrames++;
+      hunting = true;
+      return;
+    }
+    if(rxPos < 3 || rxPos < 5u + rx[2]) return;
+    hunting = true;
+    uint16_t crc = uploadCrc16(0xFFFF, rx, 3 + rx[2]);
+    if(rx[3 + rx[2]] != (uint8_t)(crc >> 8) || rx[4 + rx[2]] != (uint8_t)crc) {
+      badFrames++;
+      return;
+    }
+    handle(rx[0], rx[1], rx[2] ? rx[3] : 0, nowNs);
+  }
+
+  // appends the frames that may go out now to tx
+  void poll(uint64_t nowNs, std::vector<uint8_t> &tx) {
+    if(done) return;
+    if(framesSent == 0) lastProgressNs = nowNs;
+    if(nowNs - lastProgressNs > timeoutNs) {
+      // nothing heard for a while: send again from the oldest unacked frame, or the last one
+      // to get the 'F' again when everything was acked
+      timeouts++;
+      next = base < frames ? base : frames - 1;
+      lastProgressNs = nowNs;
+    }
+    while(next < limit && next < frames) {
+      uint8_t frame[6 + UPLOAD_FRAME_PAYLOAD];
+      uint16_t n;
+      if(next == 0) {
+        uint8_t begin[5] = { id, (uint8_t)(length >> 16), (uint8_t)(length >> 8), (uint8_t)length, format };
+        n = uploadFrame(frame, UPLOAD_BEGIN, 0, begin, format == FLASHBUFFER_FORMAT_PCM8 ? 4 : 5);
+      } else {
+        uint32_t offset = (next - 1) * UPLOAD_FRAME_PAYLOAD;
+        uint32_t len = length - offset < UPLOAD_FRAME_PAYLOAD ? length - offset : UPLOAD_FRAME_PAYLOAD;
+        n = uploadFrame(frame, UPLOAD_DATA, (uint8_t)next, data + offset, len);
+      }
+      tx.insert(tx.end(), frame, frame + n);
+      if(next < sentHigh) resentFrames++;
+      else sentHigh = next + 1;
+      framesSent++;
+      next++;
+    }
+  }
+
+  uint32_t framesSent, resentFrames, nacks, timeouts, badFrames;
+
+private:
+  void handle(uint8_t type, uint8_t seq, uint8_t newLimit, uint64_t nowNs) {
+    // 8 bit sequence numbers back to frame numbers, relative to the oldest unacked frame
+    uint32_t ack = base + (uint8_t)(seq - (uint8_t)base);
+    if(ack > sentHigh) return; // stale
+    if(type == UPLOAD_FINISHED) {
+      // sent with the frame after the last one: a late 'F' of the item before doesn't count
+      if((uint8_t)seq == (uint8_t)frames) done = true;
+      return;
+    }
+    if(type != UPLOAD_ACK && type != UPLOAD_NACK) return;
+    if(ack > base || type == UPLOAD_NACK) lastProgressNs = nowNs;
+    base = ack;
+    limit = ack + (uint8_t)(newLimit - seq);
+    if(type == UPLOAD_NACK) {
+      nacks++;
+      next = base;
+      if(ack == 0 && limit == 0) refused = true;
+    } else if(next < base) {
+      next = base;
+    }
+  }
+
+  uint8_t id, format;
+  const uint8_t *data;
+  uint32_t length;
+  uint64_t timeoutNs;
+  uint32_t frames, base, next, limit, sentHigh = 0;
+  bool done, refused;
+  uint64_t lastProgressNs;
+  uint8_t rx[6];
+  uint8_t rxPos;
+  bool hunting;
+};
+
+#endif
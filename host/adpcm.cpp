@@ -0,0 +1,58 @@
+// Encodes 8 bit unsigned raw PCM (what the uploader sends as is) into an IMA ADPCM item for
+// FlashBuffer, to upload with: ./uploader port out.ima:<id>:adpcm
+// Prints the sizes and the signal to noise ratio of the round trip.
+// Build: see host/README.md
+//
+//   ./adpcm in.raw out.ima
+
+#include <ImaAdpcm.h>
+#include <math.h>
+#include <stdio.h>
+#include <vector>
+
+int main(int argc, char **argv) {
+  if(argc != 3) {
+    fprintf(stderr, "usage: %s in.raw out.ima\n", argv[0]);
+    return 1;
+  }
+  FILE *in = fopen(argv[1], "rb");
+  if(!in) {
+    perror(argv[1]);
+    return 1;
+  }
+  std::vector<uint8_t> pcm;
+  uint8_t buf[4096];
+  size_t n;
+  while((n = fread(buf, 1, sizeof(buf), in)) > 0) pcm.insert(pcm.end(), buf, buf + n);
+  fclose(in);
+  if(pcm.empty()) {
+    fprintf(stderr, "%s is empty\n", argv[1]);
+    return 1;
+  }
+
+  std::vector<uint8_t> ima(imaAdpcmBytes(pcm.size()) + 1);
+  ImaAdpcmEncoder encoder;
+  uint32_t bytes = encoder.encode(&pcm[0], pcm.size(), &ima[0]);
+  bytes += encoder.finish(&ima[bytes]);
+  ima.resize(bytes);
+
+  // decode it again the way FlashPlayer does, for the error
+  std::vector<uint8_t> out(imaAdpcmSamples(bytes));
+  ImaAdpcmDecoder decoder;
+  decoder.decode(&ima[0], bytes, &out[0]);
+  double signal = 0, noise = 0;
+  for(size_t i = 0; i < pcm.size(); i++) {
+    double s = pcm[i] - 128.0, e = (double)out[i] - pcm[i];
+    signal += s * s;
+    noise += e * e;
+  }
+
+  FILE *f = fopen(argv[2], "wb");
+  if(!f || fwrite(&ima[0], 1, bytes, f) != bytes || fclose(f) != 0) {
+    perror(argv[2]);
+    return 1;
+  }
+  printf("%u samples -> %u bytes (%.1f%%), SNR %.1f dB\n", (unsigned)pcm.size(), bytes, 100.0 * bytes / pcm.size(),
+         noise > 0 ? 10 * log10(signal / noise) : INFINITY);
+  return 0;
+}
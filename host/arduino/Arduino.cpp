@@ -0,0 +1,304 @@
+#include <Arduino.h>
+#include <HostEmulator.h>
+
+#include <deque>
+#include <vector>
+
+HostCosts hostCosts = { 500, 2000, 500, 125, 2000 };
+HardwareSerial Serial;
+
+// ---------------------------------------------------------------------------
+// virtual clock and periodic tasks
+
+struct TaskSlot {
+  HostTask task;
+  uint32_t periodNs;
+  uint64_t due;
+};
+
+static uint64_t now = 0;
+static uint64_t taskNanos = 0;
+static uint64_t sleepNanos = 0;
+static bool eventPending = false;
+static bool inTask = false;
+static int interruptsMasked = 0;
+static std::vector<TaskSlot> tasks;
+
+uint64_t hostNanos() {
+  return now;
+}
+
+uint64_t hostTaskNanos() {
+  return taskNanos;
+}
+
+uint64_t hostSleepNanos() {
+  return sleepNanos;
+}
+
+void hostResetClock() {
+  now = 0;
+  taskNanos = 0;
+  sleepNanos = 0;
+  for(size_t i = 0; i < tasks.size(); i++) {
+    if(tasks[i].task) tasks[i].due = tasks[i].periodNs;
+  }
+}
+
+static int nextDueTask(uint64_t limit) {
+  int found = -1;
+  for(size_t i = 0; i < tasks.size(); i++) {
+    if(tasks[i].task && tasks[i].due <= limit && (found < 0 || tasks[i].due < tasks[found].due)) found = i;
+  }
+  return found;
+}
+
+void hostAdvance(uint64_t ns) {
+  uint64_t target = now + ns;
+  if(inTask || interruptsMasked) {
+    // handlers do not preempt each other; masked tasks fire once interrupts() is called
+    now = target;
+    return;
+  }
+  int t;
+  while((t = nextDueTask(target)) >= 0) {
+    if(tasks[t].due > now) now = tasks[t].due;
+    TaskSlot &slot = tasks[t];
+    slot.due += slot.periodNs;
+    uint64_t before = now;
+    inTask = true;
+    slot.task();
+    inTask = false;
+    // time spent in the handler delays whatever was running in the foreground
+    taskNanos += now - before;
+    target += now - before;
+    eventPending = true;
+  }
+  now = target;
+}
+
+void hostWaitForEvent() {
+  if(!eventPending && !inTask && !interruptsMasked) {
+    int t = nextDueTask(UINT64_MAX);
+    if(t >= 0) {
+      uint64_t wait = tasks[t].due > now ? tasks[t].due - now : 0;
+      sleepNanos += wait;
+      hostAdvance(wait);
+    }
+  }
+  eventPending = false;
+}
+
+int hostAddTask(uint32_t periodNs, HostTask task) {
+  TaskSlot slot = { task, periodNs ? periodNs : 1, now + (periodNs ? periodNs : 1) };
+  for(size_t i = 0; i < tasks.size(); i++) {
+    if(!tasks[i].task) {
+      tasks[i] = slot;
+      return i;
+    }
+  }
+  tasks.push_back(slot);
+  return tasks.size() - 1;
+}
+
+void hostRemoveTask(int handle) {
+  if(handle >= 0 && (size_t)handle < tasks.size()) tasks[handle].task = 0;
+}
+
+unsigned long millis(void) {
+  return now / 1000000ULL;
+}
+
+unsigned long micros(void) {
+  return now / 1000ULL;
+}
+
+void delay(unsigned long ms) {
+  hostAdvance((uint64_t)ms * 1000000ULL);
+}
+
+void delayMicroseconds(unsigned int us) {
+  hostAdvance((uint64_t)us * 1000ULL);
+}
+
+void noInterrupts(void) {
+  interruptsMasked++;
+}
+
+void interrupts(void) {
+  if(interruptsMasked > 0 && --interruptsMasked == 0) hostAdvance(0);
+}
+
+// ---------------------------------------------------------------------------
+// pins and SPI chip selects
+
+static uint8_t pinLevel[64];
+static std::vector<SpiDevice *> devices;
+static std::vector<SpiDevice *> selected; // more than one: both drive MISO
+static uint64_t collisions = 0;
+
+SpiDevice::SpiDevice(uint8_t csPin) : _csPin(csPin) {
+  devices.push_back(this);
+}
+
+SpiDevice::~SpiDevice() {
+  for(size_t i = 0; i < devices.size(); i++) {
+    if(devices[i] == this) devices.erase(devices.begin() + i);
+  }
+  for(size_t i = 0; i < selected.size(); i++) {
+    if(selected[i] == this) selected.erase(selected.begin() + i);
+  }
+}
+
+SpiDevice *hostSelectedSpiDevice() {
+  return selected.empty() ? 0 : selected[0];
+}
+
+uint8_t hostSpiExchange(uint8_t mosi) {
+  if(selected.size() > 1) collisions++;
+  // every selected device sees the byte; MISO is whatever survives the contention
+  uint8_t miso = 0xFF;
+  for(size_t i = 0; i < selected.size(); i++) miso &= selected[i]->transfer(mosi);
+  return miso;
+}
+
+uint64_t hostSpiCollisions() {
+  return collisions;
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  (void)pin;
+  (void)mode;
+}
+
+void digitalWrite(uint8_t pin, uint8_t val) {
+  hostAdvance(hostCosts.digitalWriteNs);
+  hostPinWrite(pin, val);
+}
+
+void hostPinWrite(uint8_t pin, uint8_t val) {
+  val = val ? HIGH : LOW;
+  if(pin >= sizeof(pinLevel) || pinLevel[pin] == val) {
+    if(pin < sizeof(pinLevel)) pinLevel[pin] = val;
+    return;
+  }
+  pinLevel[pin] = val;
+  for(size_t i = 0; i < devices.size(); i++) {
+    if(devices[i]->csPin() != pin) continue;
+    if(val == LOW) {
+      selected.push_back(devices[i]);
+      devices[i]->select();
+    } else {
+      for(size_t j = 0; j < selected.size(); j++) {
+        if(selected[j] == devices[i]) selected.erase(selected.begin() + j);
+      }
+      devices[i]->deselect();
+    }
+  }
+}
+
+int digitalRead(uint8_t pin) {
+  return pin < sizeof(pinLevel) ? pinLevel[pin] : LOW;
+}
+
+// ---------------------------------------------------------------------------
+// Serial
+
+static std::deque<uint8_t> serialIn;
+
+static void stdoutSink(uint8_t b) {
+  putchar(b);
+}
+
+static void (*serialOut)(uint8_t) = stdoutSink;
+
+void hostSerialInput(const uint8_t *data, size_t len) {
+  serialIn.insert(serialIn.end(), data, data + len);
+}
+
+void hostSetSerialOutput(void (*sink)(uint8_t b)) {
+  serialOut = sink ? sink : stdoutSink;
+}
+
+void HardwareSerial::begin(unsigned long baud) {
+  (void)baud;
+}
+
+void HardwareSerial::end() {
+}
+
+int HardwareSerial::available() {
+  return serialIn.size();
+}
+
+int HardwareSerial::read() {
+  if(serialIn.empty()) return -1;
+  int b = serialIn.front();
+  serialIn.pop_front();
+  return b;
+}
+
+int HardwareSerial::peek() {
+  return serialIn.empty() ? -1 : serialIn.front();
+}
+
+void HardwareSerial::flush() {
+  fflush(stdout);
+}
+
+size_t HardwareSerial::write(uint8_t b) {
+  serialOut(b);
+  return 1;
+}
+
+size_t HardwareSerial::write(const uint8_t *buf, size_t len) {
+  for(size_t i = 0; i < len; i++) serialOut(buf[i]);
+  return len;
+}
+
+size_t HardwareSerial::write(const char *str) {
+  return write((const uint8_t *)str, strlen(str));
+}
+
+size_t HardwareSerial::print(const char *str) {
+  return write(str);
+}
+
+size_t HardwareSerial::print(char c) {
+  return write((uint8_t)c);
+}
+
+size_t HardwareSerial::print(unsigned long n, int base) {
+  char tmp[33];
+  snprintf(tmp, sizeof(tmp), base == HEX ? "%lX" : "%lu", n);
+  return write(tmp);
+}
+
+size_t HardwareSerial::print(long n, int base) {
+  if(base == HEX) return print((unsigned long)n, base);
+  char tmp[33];
+  snprintf(tmp, sizeof(tmp), "%ld", n);
+  return write(tmp);
+}
+
+size_t HardwareSerial::print(unsigned char n, int base) {
+  return print((unsigned long)n, base);
+}
+
+size_t HardwareSerial::print(int n, int base) {
+  return print((long)n, base);
+}
+
+size_t HardwareSerial::print(unsigned int n, int base) {
+  return print((unsigned long)n, base);
+}
+
+size_t HardwareSerial::print(double n, int digits) {
+  char tmp[48];
+  snprintf(tmp, sizeof(tmp), "%.*f", digits, n);
+  return write(tmp);
+}
+
+size_t HardwareSerial::println() {
+  return write("\r\n");
+}
@@ -0,0 +1,74 @@
+// Minimal Arduino core for building the sketches' libraries on a Linux host.
+// Only what SPIFlash/FlashBuffer and the test sketches touch is provided.
+// Time is virtual: it only moves when the emulated hardware (SPI bus, delay())
+// spends it, see HostEmulator.h.
+
+#ifndef _HOST_ARDUINO_H_
+#define _HOST_ARDUINO_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT  0x0
+#define OUTPUT 0x1
+
+#define DEC 10
+#define HEX 16
+
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+
+#define B00100000 0x20
+#define B00110000 0x30
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+void noInterrupts(void);
+void interrupts(void);
+
+class HardwareSerial {
+public:
+  void begin(unsigned long baud);
+  void end();
+  int available();
+  int read();
+  int peek();
+  void flush();
+  size_t write(uint8_t b);
+  size_t write(const uint8_t *buf, size_t len);
+  size_t write(const char *str);
+  size_t print(const char *str);
+  size_t print(char c);
+  size_t print(unsigned char n, int base = DEC);
+  size_t print(int n, int base = DEC);
+  size_t print(unsigned int n, int base = DEC);
+  size_t print(long n, int base = DEC);
+  size_t print(unsigned long n, int base = DEC);
+  size_t print(double n, int digits = 2);
+  size_t println();
+  template <typename T> size_t println(T value) { size_t n = print(value); return n + println(); }
+  template <typename T> size_t println(T value, int base) { size_t n = print(value, base); return n + println(); }
+  operator bool() { return true; }
+};
+
+extern HardwareSerial Serial;
+
+// the nRF51 registers an RFduino sketch gets from its core (NRF_GPIO, NRF_SPI0)
+#include <HostNrf51.h>
+
+#endif
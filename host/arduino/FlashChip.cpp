@@ -0,0 +1,275 @@
+#include <FlashChip.h>
+#include <SPI.h>
+
+#define STATUS_BUSY 0x01
+#define STATUS_WEL  0x02
+
+FlashChip::FlashChip(uint8_t csPin, uint32_t capacity, uint32_t jedecId)
+  : SpiDevice(csPin), _capacity(capacity), _jedecId(jedecId) {
+  // W25Q80-ish typical figures
+  timing.pageProgramNs = 700000;
+  timing.erase4KNs = 30000000;
+  timing.erase32KNs = 120000000;
+  timing.erase64KNs = 150000000;
+  timing.chipEraseNs = 2000000000;
+  timing.wakeNs = 30000; // AT25DF, the slowest of the supported parts (W25Q: 3 us)
+  faultProgram = 0xFFFFFFFF;
+  faultMask = 0;
+  _mem = new uint8_t[_capacity];
+  eraseAll();
+  resetStats();
+  _selected = false;
+  _wel = false;
+  _sleeping = false;
+  _busyUntil = 0;
+  _awakeAt = 0;
+  fastReads = 0;
+}
+
+FlashChip::~FlashChip() {
+  delete[] _mem;
+}
+
+void FlashChip::eraseAll() {
+  memset(_mem, 0xFF, _capacity);
+  // also idle, as if freshly powered up: a program or erase still running would otherwise
+  // keep BUSY set until the old time comes round again after hostResetClock()
+  _busyUntil = 0;
+  _wel = false;
+  _sleeping = false;
+  _awakeAt = 0;
+}
+
+void FlashChip::resetStats() {
+  memset(&stats, 0, sizeof(stats));
+  _sleptAt = hostNanos();
+}
+
+uint64_t FlashChip::sleepNanos() const {
+  return stats.sleepNanos + (_sleeping ? hostNanos() - _sleptAt : 0);
+}
+
+bool FlashChip::busy() const {
+  return hostNanos() < _busyUntil;
+}
+
+uint8_t FlashChip::status() const {
+  return (busy() ? STATUS_BUSY : 0) | (_wel ? STATUS_WEL : 0);
+}
+
+void FlashChip::select() {
+  _selected = true;
+  _pos = 0;
+  _addr = 0;
+  _pageFill = 0;
+  _ignored = false;
+  stats.transactions++;
+}
+
+// address/dummy and data lines of the current command when it is a read this chip has
+bool FlashChip::readFormat(uint8_t &addressLines, uint8_t &dataLines, uint8_t &dummyBytes) const {
+  addressLines = dataLines = 1;
+  dummyBytes = 1;
+  switch(_cmd) {
+  case 0x03: dummyBytes = 0; return true;
+  case 0x0B: return true;
+  case 0x5A: return fastReads != 0; // SFDP, read like 0x0B
+  case 0x3B: dataLines = 2; return fastReads & FLASHCHIP_READ_112;
+  case 0xBB: addressLines = dataLines = 2; return fastReads & FLASHCHIP_READ_122; // mode byte
+  case 0x6B: dataLines = 4; return fastReads & FLASHCHIP_READ_114;
+  case 0xEB: addressLines = dataLines = 4; dummyBytes = 3; return fastReads & FLASHCHIP_READ_144; // mode + 4 dummy clocks
+  }
+  return false;
+}
+
+uint8_t FlashChip::expectedLines(uint32_t pos) const {
+  uint8_t addressLines, dataLines, dummyBytes;
+  if(pos == 0 || !readFormat(addressLines, dataLines, dummyBytes)) return 1;
+  return pos <= 3u + dummyBytes ? addressLines : dataLines;
+}
+
+// SFDP: header, one parameter header, the basic flash parameter table (JESD216) at 0x30
+uint8_t FlashChip::sfdp(uint32_t addr) const {
+  static const uint8_t header[16] = { 'S', 'F', 'D', 'P', 0x00, 0x01, 0x00, 0xFF,
+                                      0x00, 0x00, 0x01, 9, 0x30, 0x00, 0x00, 0xFF };
+  if(addr < 16) return header[addr];
+  if(addr < 0x30 || addr >= 0x30 + 9 * 4) return 0xFF;
+  uint32_t dword[9];
+  memset(dword, 0xFF, sizeof(dword));
+  // 4K erase (0x20), 3 byte addresses, the fast reads present
+  dword[0] = 0xFF800000UL | 0x20 << 8 | 0x04 | 0x01;
+  if(fastReads & FLASHCHIP_READ_112) dword[0] |= 1UL << 16;
+  if(fastReads & FLASHCHIP_READ_122) dword[0] |= 1UL << 20;
+  if(fastReads & FLASHCHIP_READ_144) dword[0] |= 1UL << 21;
+  if(fastReads & FLASHCHIP_READ_114) dword[0] |= 1UL << 22;
+  dword[1] = _capacity * 8 - 1;
+  // opcode << 8 | mode clocks << 5 | dummy clocks, two per dword
+  dword[2] = (fastReads & FLASHCHIP_READ_144 ? 0xEB44UL : 0) | (fastReads & FLASHCHIP_READ_114 ? 0x6B08UL << 16 : 0);
+  dword[3] = (fastReads & FLASHCHIP_READ_112 ? 0x3B08UL : 0) | (fastReads & FLASHCHIP_READ_122 ? 0xBB80UL << 16 : 0);
+  addr -= 0x30;
+  return dword[addr / 4] >> (addr % 4 * 8);
+}
+
+uint8_t FlashChip::transfer(uint8_t mosi) {
+  if(!_selected) return 0xFF;
+  stats.spiBytes++;
+  stats.busNanos += SPI.byteNanos();
+  uint32_t pos = _pos++;
+  if(SPI.dataLines() != (pos == 0 ? 1 : expectedLines(pos))) {
+    stats.lineErrors++;
+    return 0xFF;
+  }
+  if(pos == 0) {
+    _cmd = mosi;
+    stats.commands[_cmd]++;
+    if(_sleeping && _cmd != 0xAB) {
+      _ignored = true;
+      stats.sleepViolations++;
+    } else if(!_sleeping && hostNanos() < _awakeAt) {
+      _ignored = true;
+      stats.wakeViolations++;
+    } else if(busy() && _cmd != 0x05) {
+      _ignored = true;
+      stats.busyViolations++;
+    }
+    if(_cmd == 0x05) stats.statusPolls++;
+    if(_cmd == 0x02) memset(_pageTouched, 0, sizeof(_pageTouched));
+    return 0xFF;
+  }
+  if(_ignored) return 0xFF;
+
+  switch(_cmd) {
+  case 0x05: // read status, repeats while clocked
+    return status();
+  case 0x9F: // JEDEC id: manufacturer, type, capacity
+    if(pos <= 3) return _jedecId >> (24 - 8 * pos);
+    return 0xFF;
+  case 0x4B: // unique id after 4 dummy bytes
+    if(pos >= 5 && pos < 13) return 0xA0 + pos - 5;
+    return 0xFF;
+  case 0xAB: // release from deep power-down (device id after 3 dummies)
+    return pos >= 4 ? 0x13 : 0xFF;
+  case 0x03:
+  case 0x0B:
+  case 0x3B:
+  case 0xBB:
+  case 0x6B:
+  case 0xEB:
+  case 0x5A: {
+    uint8_t addressLines, dataLines, dummyBytes;
+    if(!readFormat(addressLines, dataLines, dummyBytes)) return 0xFF;
+    if(pos <= 3) {
+      _addr = (_addr << 8) | mosi;
+      return 0xFF;
+    }
+    if(pos <= 3u + dummyBytes) return 0xFF; // mode bits and dummy clocks
+    if(_cmd == 0x5A) return sfdp(_addr++);
+    stats.bytesRead++;
+    return _mem[_addr++ & (_capacity - 1)];
+  }
+  case 0x02: {
+    if(pos <= 3) {
+      _addr = (_addr << 8) | mosi;
+      return 0xFF;
+    }
+    // the latch wraps inside the page; only the last 256 bytes survive
+    uint8_t column = (_addr + _pageFill) & 0xFF;
+    _page[column] = mosi;
+    _pageTouched[column] = true;
+    _pageFill++;
+    stats.bytesProgrammed++;
+    return 0xFF;
+  }
+  case 0x20:
+  case 0x52:
+  case 0xD8:
+    if(pos <= 3) _addr = (_addr << 8) | mosi;
+    return 0xFF;
+  case 0x01: // write status: no protection bits are modelled
+    return 0xFF;
+  default:
+    return 0xFF;
+  }
+}
+
+void FlashChip::deselect() {
+  if(!_selected) return;
+  _selected = false;
+  if(_pos == 0 || _ignored) return;
+  finishCommand();
+}
+
+void FlashChip::finishCommand() {
+  switch(_cmd) {
+  case 0x06:
+    _wel = true;
+    break;
+  case 0x04:
+    _wel = false;
+    break;
+  case 0x01:
+    if(!_wel) stats.rejectedWrites++;
+    _wel = false;
+    break;
+  case 0x02:
+    if(_pos < 4) break;
+    program();
+    break;
+  case 0x20:
+    if(_pos >= 4 && erase(4096, timing.erase4KNs)) stats.erase4K++;
+    break;
+  case 0x52:
+    if(_pos >= 4 && erase(32768, timing.erase32KNs)) stats.erase32K++;
+    break;
+  case 0xD8:
+    if(_pos >= 4 && erase(65536, timing.erase64KNs)) stats.erase64K++;
+    break;
+  case 0x60:
+  case 0xC7:
+    if(erase(_capacity, timing.chipEraseNs)) stats.chipErases++;
+    break;
+  case 0xB9:
+    _sleeping = true;
+    _sleptAt = hostNanos();
+    break;
+  case 0xAB:
+    if(_sleeping) {
+      stats.sleepNanos += hostNanos() - _sleptAt;
+      _awakeAt = hostNanos() + timing.wakeNs;
+    }
+    _sleeping = false;
+    break;
+  }
+}
+
+void FlashChip::program() {
+  if(!_wel) {
+    stats.rejectedWrites++;
+    return;
+  }
+  uint32_t pageBase = _addr & ~(uint32_t)0xFF & (_capacity - 1);
+  int16_t last = -1;
+  for(uint16_t i = 0; i < 256; i++) {
+    if(!_pageTouched[i]) continue;
+    uint8_t &cell = _mem[pageBase + i];
+    if((cell & _page[i]) != _page[i]) stats.programConflicts++;
+    cell &= _page[i];
+    last = i;
+  }
+  if(stats.pagePrograms == faultProgram && last >= 0) _mem[pageBase + last] |= faultMask;
+  stats.pagePrograms++;
+  _wel = false;
+  _busyUntil = hostNanos() + timing.pageProgramNs;
+}
+
+bool FlashChip::erase(uint32_t size, uint32_t ns) {
+  if(!_wel) {
+    stats.rejectedWrites++;
+    return false;
+  }
+  uint32_t base = _addr & ~(size - 1) & (_capacity - 1);
+  memset(_mem + base, 0xFF, size);
+  _wel = false;
+  _busyUntil = hostNanos() + ns;
+  return true;
+}
@@ -0,0 +1,113 @@
+// In-memory model of a 256 byte/page SPI NOR flash (W25X/S25FL style) for the
+// host build. It decodes the command set SPIFlash uses, keeps WEL/BUSY status
+// with datasheet-like program and erase times on the virtual clock, and only
+// lets page program clear bits (erase-before-write). Everything that crosses
+// the bus is counted so FlashBuffer changes can be measured.
+//
+// With fastReads set the chip also has an SFDP table (0x5A) advertising the
+// dual/quad reads it decodes: 0x3B (1-1-2), 0xBB (1-2-2), 0x6B (1-1-4) and
+// 0xEB (1-4-4), W25Q dummy cycles. Bytes clocked over a different number of
+// data lines (SPI.dataLines()) than the command expects are counted and read
+// as 0xFF.
+//
+// Deep power-down (0xB9) lasts until the release command (0xAB); the chip ignores
+// everything else meanwhile and for timing.wakeNs after the release. Both are
+// counted, and so is the time spent in deep power-down.
+//
+// A weak cell can be modelled with faultProgram: in that page program (its stats.pagePrograms
+// number) the faultMask bits of the last byte programmed stay 1.
+
+#ifndef _HOST_FLASHCHIP_H_
+#define _HOST_FLASHCHIP_H_
+
+#include <HostEmulator.h>
+
+#define FLASHCHIP_READ_112 0x01
+#define FLASHCHIP_READ_122 0x02
+#define FLASHCHIP_READ_114 0x04
+#define FLASHCHIP_READ_144 0x08
+#define FLASHCHIP_READ_ALL 0x0F
+
+struct FlashTiming {
+  uint32_t pageProgramNs;
+  uint32_t erase4KNs;
+  uint32_t erase32KNs;
+  uint32_t erase64KNs;
+  uint32_t chipEraseNs;
+  uint32_t wakeNs;            // release from deep power-down (tRES1)
+};
+
+struct FlashStats {
+  uint64_t spiBytes;          // every byte clocked while selected, command bytes included
+  uint64_t busNanos;          // time those bytes took on the bus
+  uint32_t transactions;      // chip select low/high pairs
+  uint32_t commands[256];     // transactions per opcode
+  uint64_t bytesRead;         // data bytes returned by the read commands
+  uint64_t bytesProgrammed;   // data bytes latched by 0x02
+  uint32_t pagePrograms;
+  uint32_t erase4K;
+  uint32_t erase32K;
+  uint32_t erase64K;
+  uint32_t chipErases;
+  uint32_t programConflicts;  // page program tried to turn a 0 bit back into 1
+  uint32_t rejectedWrites;    // program/erase without WEL set
+  uint32_t busyViolations;    // commands other than status read while BUSY
+  uint32_t statusPolls;       // 0x05 transactions
+  uint32_t lineErrors;        // bytes clocked over the wrong number of data lines
+  uint32_t sleepViolations;   // commands other than 0xAB in deep power-down
+  uint32_t wakeViolations;    // commands before wakeNs had passed after 0xAB
+  uint64_t sleepNanos;        // time in deep power-down, up to the last release
+};
+
+class FlashChip : public SpiDevice {
+public:
+  // default: 1 MByte, JEDEC 01 40 14 (the 0x140 part FlashBuffer expects)
+  FlashChip(uint8_t csPin, uint32_t capacity = 1UL << 20, uint32_t jedecId = 0x014014);
+  ~FlashChip();
+
+  void select();
+  void deselect();
+  uint8_t transfer(uint8_t mosi);
+
+  uint8_t *memory() { return _mem; }
+  uint32_t capacity() const { return _capacity; }
+  void eraseAll();               // back to factory state and idle, stats untouched
+  bool busy() const;
+  bool sleeping() const { return _sleeping; }
+  uint64_t sleepNanos() const;   // stats.sleepNanos plus the deep power-down going on now
+
+  FlashTiming timing;
+  FlashStats stats;
+  uint8_t fastReads;             // FLASHCHIP_READ_... the chip has (and SFDP); 0: neither (default)
+  uint32_t faultProgram;         // page program that goes wrong, 0xFFFFFFFF: none (default)
+  uint8_t faultMask;
+  void resetStats();
+
+private:
+  void finishCommand();
+  void program();
+  bool erase(uint32_t size, uint32_t ns);
+  uint8_t status() const;
+  bool readFormat(uint8_t &addressLines, uint8_t &dataLines, uint8_t &dummyBytes) const;
+  uint8_t expectedLines(uint32_t pos) const;
+  uint8_t sfdp(uint32_t addr) const;
+
+  uint8_t *_mem;
+  uint32_t _capacity;
+  uint32_t _jedecId;
+  bool _selected;
+  bool _wel;
+  bool _sleeping;
+  bool _ignored;
+  uint64_t _busyUntil;
+  uint64_t _sleptAt;             // start of the current deep power-down
+  uint64_t _awakeAt;             // end of the last release
+  uint8_t _cmd;
+  uint32_t _pos;                 // bytes received in this transaction
+  uint32_t _addr;
+  uint8_t _page[256];
+  uint16_t _pageFill;
+  bool _pageTouched[256];
+};
+
+#endif
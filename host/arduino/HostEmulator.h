@@ -0,0 +1,69 @@
+// Host-only hooks behind the Arduino shims.
+//
+// Virtual clock: nothing runs in real time. Time moves forward when the
+// emulated MCU spends it (SPI transfers, digitalWrite, delay()). Periodic
+// tasks stand in for timer and UART interrupts; they fire whenever the clock
+// passes their due time, unless noInterrupts() is in effect.
+//
+// SPI devices: every SpiDevice is bound to a chip select pin. Pulling that pin
+// low through digitalWrite() (or NRF_GPIO->OUTCLR, see HostNrf51.h) selects
+// it, and SPI.transfer() (or NRF_SPI0->TXD) clocks bytes into the selected
+// device.
+
+#ifndef _HOST_EMULATOR_H_
+#define _HOST_EMULATOR_H_
+
+#include <Arduino.h>
+
+// MCU-side costs charged to the virtual clock, in nanoseconds.
+// Defaults are rough figures for the RFduino (nRF51 at 16 MHz).
+struct HostCosts {
+  uint32_t digitalWriteNs;   // one digitalWrite() call
+  uint32_t spiBeginNs;       // SPI.begin()/setFrequency() reconfiguring the peripheral
+  uint32_t spiByteGapNs;     // per SPI.transfer() call on top of the 8 clock periods
+  uint32_t registerNs;       // one access to a peripheral register (NRF_GPIO, NRF_SPI0, ...)
+  uint32_t interruptNs;      // entering and leaving an attachInterrupt() handler (HostNrf51.h)
+};
+extern HostCosts hostCosts;
+
+uint64_t hostNanos();
+void hostAdvance(uint64_t ns);
+void hostResetClock();
+// total time spent inside periodic tasks ("interrupt handlers")
+uint64_t hostTaskNanos();
+// WFE: returns at once when a task ran since the last call (the event register), otherwise
+// sleeps until the next one is due and runs it; the time asleep adds up in hostSleepNanos()
+void hostWaitForEvent();
+uint64_t hostSleepNanos();
+
+typedef void (*HostTask)();
+int hostAddTask(uint32_t periodNs, HostTask task);
+void hostRemoveTask(int handle);
+
+class SpiDevice {
+public:
+  SpiDevice(uint8_t csPin);
+  virtual ~SpiDevice();
+  virtual void select() {}
+  virtual void deselect() {}
+  virtual uint8_t transfer(uint8_t mosi) = 0;
+  uint8_t csPin() const { return _csPin; }
+private:
+  uint8_t _csPin;
+};
+
+// device with its chip select currently low, or 0
+SpiDevice *hostSelectedSpiDevice();
+// clocks one byte through every selected device; with two selected at once the byte is counted
+// as a collision and both devices see it (the result is garbage, as on the real bus)
+uint8_t hostSpiExchange(uint8_t mosi);
+uint64_t hostSpiCollisions();
+// sets a pin without the cost of digitalWrite() (the register stand-ins charge their own)
+void hostPinWrite(uint8_t pin, uint8_t val);
+
+// Serial: bytes handed to hostSerialInput() are returned by Serial.read();
+// bytes the sketch writes go to the output sink (stdout unless replaced)
+void hostSerialInput(const uint8_t *data, size_t len);
+void hostSetSerialOutput(void (*sink)(uint8_t b));
+
+#endif
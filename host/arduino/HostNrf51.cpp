@@ -0,0 +1,446 @@
+#include <Arduino.h>
+#include <SPI.h>
+#include <HostEmulator.h>
+
+#include <memory>
+
+HostGpio hostGpio;
+HostSpi hostSpi0;
+
+static void writePins(uint32_t mask, uint8_t level) {
+  hostAdvance(hostCosts.registerNs);
+  for(uint8_t pin = 0; pin < 32; pin++) {
+    if(mask & 1UL << pin) hostPinWrite(pin, level);
+  }
+}
+
+void HostGpioOutset::operator=(uint32_t mask) {
+  writePins(mask, HIGH);
+}
+
+void HostGpioOutclr::operator=(uint32_t mask) {
+  writePins(mask, LOW);
+}
+
+// bytes on their way: [0] is in RXD (or still shifting), [1] queued behind it
+static struct {
+  uint8_t rx[2];
+  uint64_t doneAt[2];
+  uint8_t count;
+  bool eventCleared; // EVENTS_READY of rx[0] already cleared
+  uint32_t overruns;
+} spi;
+
+void HostSpiTxd::operator=(uint32_t value) {
+  hostAdvance(hostCosts.registerNs);
+  if(spi.count == 2) {
+    spi.overruns++;
+    return;
+  }
+  // the devices see the byte now; it is done one byte time after the one before it
+  uint64_t start = hostNanos();
+  if(spi.count > 0 && spi.doneAt[spi.count - 1] > start) start = spi.doneAt[spi.count - 1];
+  spi.doneAt[spi.count] = start + SPI.byteNanos();
+  spi.rx[spi.count] = hostSpiExchange(value);
+  spi.count++;
+}
+
+HostSpiRxd::operator uint32_t() {
+  hostAdvance(hostCosts.registerNs);
+  if(spi.count == 0) return 0;
+  uint8_t b = spi.rx[0];
+  spi.rx[0] = spi.rx[1];
+  spi.doneAt[0] = spi.doneAt[1];
+  spi.count--;
+  spi.eventCleared = false;
+  return b;
+}
+
+HostSpiReady::operator uint32_t() {
+  // polling: each read costs a register access, so a wait loop moves the clock on
+  hostAdvance(hostCosts.registerNs);
+  return spi.count > 0 && !spi.eventCleared && spi.doneAt[0] <= hostNanos();
+}
+
+void HostSpiReady::operator=(uint32_t value) {
+  hostAdvance(hostCosts.registerNs);
+  if(value == 0 && spi.count > 0 && spi.doneAt[0] <= hostNanos()) spi.eventCleared = true;
+}
+
+uint32_t hostSpiOverruns() {
+  return spi.overruns;
+}
+
+// ---------------------------------------------------------------------------
+// TIMER0-2, PPI, GPIOTE and CLOCK, one 16 MHz cycle at a time
+
+#define REG_BASE 0x40000000UL
+#define POLL_NS 1000 // interrupts are taken on the next microsecond
+#define AT(reg) std::addressof(reg)
+
+HostPeripherals hostPeripherals;
+
+static struct {
+  uint64_t tick;
+  uint32_t counter[3];
+  bool running[3];
+  bool clearNext[3];    // CLEAR short: back to 0 instead of the next increment
+  uint32_t queue[16];   // task addresses PPI triggers on the next cycle
+  uint8_t queued;
+  bool polling;
+  uint8_t out[4];       // GPIOTE task pin levels
+  void (*handler[4])(); // TIMER0-2, UART0
+  uint32_t irqs[4];
+  void (*trace)(uint8_t pin, uint8_t level, uint64_t tick);
+} hw;
+
+static int irqSlot(IRQn_Type irq) {
+  return irq == UART0_IRQn ? 3 : irq - TIMER0_IRQn;
+}
+
+static HostReg *regAt(uint32_t address) {
+  uint32_t offset = address - REG_BASE;
+  if(address < REG_BASE || offset >= sizeof(hostPeripherals) || offset % sizeof(HostReg)) return 0;
+  return (HostReg *)((char *)&hostPeripherals + offset);
+}
+
+static int timerOf(HostReg *r) {
+  for(int t = 0; t < 3; t++) {
+    if(r >= (HostReg *)&hostPeripherals.timer[t] && r < (HostReg *)(&hostPeripherals.timer[t] + 1)) return t;
+  }
+  return -1;
+}
+
+static uint32_t counterMask(int t) {
+  static const uint32_t masks[] = { 0xFFFF, 0xFF, 0xFFFFFF, 0xFFFFFFFF };
+  return masks[hostPeripherals.timer[t].BITMODE.value & 3];
+}
+
+static void event(HostReg *e) {
+  HostPpi &ppi = hostPeripherals.ppi;
+  uint32_t address = &*e;
+  for(int ch = 0; ch < 16; ch++) {
+    if(!(ppi.CHEN.value & 1UL << ch) || ppi.CH[ch].EEP.value != address) continue;
+    uint32_t task = ppi.CH[ch].TEP.value;
+    bool twice = false;
+    for(uint8_t i = 0; i < hw.queued; i++) twice |= hw.queue[i] == task;
+    if(!twice && hw.queued < sizeof(hw.queue) / sizeof(hw.queue[0])) hw.queue[hw.queued++] = task;
+  }
+}
+
+static void compare(int t) {
+  HostTimer &timer = hostPeripherals.timer[t];
+  for(int i = 0; i < 4; i++) {
+    if(hw.counter[t] != (timer.CC[i].value & counterMask(t))) continue;
+    timer.EVENTS_COMPARE[i].value = 1;
+    event(AT(timer.EVENTS_COMPARE[i]));
+    if(timer.SHORTS.value & 1UL << i) hw.clearNext[t] = true;
+    if(timer.SHORTS.value & 1UL << (8 + i)) hw.running[t] = false;
+  }
+}
+
+static void increment(int t) {
+  hw.counter[t] = hw.clearNext[t] ? 0 : (hw.counter[t] + 1) & counterMask(t);
+  hw.clearNext[t] = false;
+  compare(t);
+}
+
+static void setOut(int ch, uint8_t level) {
+  if(hw.out[ch] == level) return;
+  hw.out[ch] = level;
+  uint8_t pin = (hostPeripherals.gpiote.CONFIG[ch].value >> 8) & 31;
+  hostPinWrite(pin, level);
+  if(hw.trace) hw.trace(pin, level, hw.tick);
+}
+
+// ---------------------------------------------------------------------------
+// UART0
+
+#define UART_FIFO 6
+
+static struct {
+  uint8_t fifo[UART_FIFO]; // [0] is in RXD
+  uint8_t count;
+  bool rxOn, txOn, txBusy;
+  uint64_t txDone;
+  int task;
+  uint32_t baudrate;       // BAUDRATE the task was set up for
+  uint32_t overruns;
+  bool inHandler;
+  void (*sink)(uint8_t b);
+} uart = { {0}, 0, false, false, false, 0, -1, 0, 0, false, 0 };
+
+static uint64_t uartByteNs() {
+  // BAUDRATE is baud * 2^32 / 16 MHz; a byte is 10 bits with start and stop
+  uint64_t baud = ((uint64_t)hostPeripherals.uart0.BAUDRATE.value * 16000000ULL) >> 32;
+  return baud ? 10000000000ULL / baud : 1000000;
+}
+
+static void uartIrq() {
+  HostUart &u = hostPeripherals.uart0;
+  uint32_t pending = (u.EVENTS_RXDRDY.value ? UART_INTENSET_RXDRDY_Msk : 0) |
+                     (u.EVENTS_TXDRDY.value ? UART_INTENSET_TXDRDY_Msk : 0) |
+                     (u.EVENTS_ERROR.value ? UART_INTENSET_ERROR_Msk : 0);
+  void (*handler)() = hw.handler[irqSlot(UART0_IRQn)];
+  if(!handler || uart.inHandler || !(pending & u.INTENSET.value)) return;
+  uart.inHandler = true;
+  hostAdvance(hostCosts.interruptNs);
+  hw.irqs[irqSlot(UART0_IRQn)]++;
+  handler();
+  uart.inHandler = false;
+}
+
+static void uartSync() {
+  if(uart.txBusy && uart.txDone <= hostNanos()) {
+    uart.txBusy = false;
+    hostPeripherals.uart0.EVENTS_TXDRDY.value = 1;
+  }
+}
+
+static void uartPoll() {
+  uartSync();
+  uartIrq();
+}
+
+static void uartStart() {
+  if(uart.task >= 0 && uart.baudrate == hostPeripherals.uart0.BAUDRATE.value) return;
+  hostRemoveTask(uart.task);
+  uart.baudrate = hostPeripherals.uart0.BAUDRATE.value;
+  uart.task = hostAddTask(uartByteNs() / 2, uartPoll);
+}
+
+static void uartTask(HostReg *r) {
+  HostUart &u = hostPeripherals.uart0;
+  if(r == AT(u.TASKS_STARTRX)) uart.rxOn = true;
+  else if(r == AT(u.TASKS_STOPRX)) uart.rxOn = false;
+  else if(r == AT(u.TASKS_STARTTX) || r == AT(u.TASKS_STOPTX)) {
+    uart.txOn = r == AT(u.TASKS_STARTTX);
+    uart.txBusy = false; // a byte still going out is cut off
+  }
+  else return;
+  if(uart.rxOn || uart.txOn) uartStart();
+}
+
+static void uartSend(uint8_t b) {
+  if(!uart.txOn || hostPeripherals.uart0.ENABLE.value != UART_ENABLE_ENABLE_Enabled) return;
+  uint64_t start = uart.txBusy && uart.txDone > hostNanos() ? uart.txDone : hostNanos();
+  uart.txBusy = true;
+  uart.txDone = start + uartByteNs();
+  if(uart.sink) uart.sink(b);
+}
+
+static uint8_t uartRead() {
+  if(uart.count == 0) return 0;
+  uint8_t b = uart.fifo[0];
+  memmove(uart.fifo, uart.fifo + 1, --uart.count);
+  if(uart.count) hostPeripherals.uart0.EVENTS_RXDRDY.value = 1; // the next byte moves into RXD
+  return b;
+}
+
+void hostUartInput(const uint8_t *data, size_t len) {
+  HostUart &u = hostPeripherals.uart0;
+  if(!uart.rxOn || u.ENABLE.value != UART_ENABLE_ENABLE_Enabled) return;
+  for(size_t i = 0; i < len; i++) {
+    if(uart.count == UART_FIFO) {
+      uart.overruns++;
+      u.ERRORSRC.value |= UART_ERRORSRC_OVERRUN_Msk;
+      u.EVENTS_ERROR.value = 1;
+      continue;
+    }
+    uart.fifo[uart.count++] = data[i];
+    if(uart.count == 1) u.EVENTS_RXDRDY.value = 1;
+  }
+  uartSync();
+  uartIrq();
+}
+
+void hostSetUartOutput(void (*sink)(uint8_t b)) {
+  uart.sink = sink;
+}
+
+uint32_t hostUartOverruns() {
+  return uart.overruns;
+}
+
+// ---------------------------------------------------------------------------
+
+static void runTask(HostReg *r) {
+  int t = timerOf(r);
+  if(t >= 0) {
+    HostTimer &timer = hostPeripherals.timer[t];
+    if(r == AT(timer.TASKS_START)) hw.running[t] = true;
+    else if(r == AT(timer.TASKS_STOP)) hw.running[t] = false;
+    else if(r == AT(timer.TASKS_COUNT)) {
+      if(timer.MODE.value == TIMER_MODE_MODE_Counter && hw.running[t]) increment(t);
+    } else if(r == AT(timer.TASKS_CLEAR)) {
+      hw.counter[t] = 0;
+      hw.clearNext[t] = false;
+    } else if(r >= timer.TASKS_CAPTURE && r < timer.TASKS_CAPTURE + 4) {
+      timer.CC[r - timer.TASKS_CAPTURE].value = hw.counter[t];
+    }
+    return;
+  }
+  HostPpi &ppi = hostPeripherals.ppi;
+  for(int g = 0; g < 4; g++) {
+    if(r == AT(ppi.TASKS_CHG[g].EN)) ppi.CHEN.value |= ppi.CHG[g].value;
+    if(r == AT(ppi.TASKS_CHG[g].DIS)) ppi.CHEN.value &= ~ppi.CHG[g].value;
+  }
+  HostGpiote &gpiote = hostPeripherals.gpiote;
+  for(int ch = 0; ch < 4; ch++) {
+    uint32_t config = gpiote.CONFIG[ch].value;
+    if(r != AT(gpiote.TASKS_OUT[ch]) || (config & 3) != 3) continue;
+    uint8_t polarity = (config >> 16) & 3;
+    setOut(ch, polarity == NRF_GPIOTE_POLARITY_TOGGLE ? !hw.out[ch] : polarity == NRF_GPIOTE_POLARITY_LOTOHI);
+  }
+  if(r == AT(hostPeripherals.clock.TASKS_HFCLKSTART)) hostPeripherals.clock.EVENTS_HFCLKSTARTED.value = 1;
+  uartTask(r);
+}
+
+static bool isTask(HostReg *r) {
+  int t = timerOf(r);
+  if(t >= 0) return r < hostPeripherals.timer[t].EVENTS_COMPARE;
+  HostPpi &ppi = hostPeripherals.ppi;
+  if(r >= (HostReg *)ppi.TASKS_CHG && r < (HostReg *)(ppi.TASKS_CHG + 4)) return true;
+  HostGpiote &gpiote = hostPeripherals.gpiote;
+  if(r >= gpiote.TASKS_OUT && r < gpiote.TASKS_OUT + 4) return true;
+  HostUart &uart0 = hostPeripherals.uart0;
+  if(r >= AT(uart0.TASKS_STARTRX) && r <= AT(uart0.TASKS_STOPTX)) return true;
+  return r == AT(hostPeripherals.clock.TASKS_HFCLKSTART);
+}
+
+static void step() {
+  hw.tick++;
+  uint32_t tasks[sizeof(hw.queue) / sizeof(hw.queue[0])];
+  uint8_t n = hw.queued;
+  memcpy(tasks, hw.queue, n * sizeof(tasks[0]));
+  hw.queued = 0;
+  for(uint8_t i = 0; i < n; i++) {
+    HostReg *r = regAt(tasks[i]);
+    if(r) runTask(r);
+  }
+  for(int t = 0; t < 3; t++) {
+    HostTimer &timer = hostPeripherals.timer[t];
+    if(!hw.running[t] || timer.MODE.value != TIMER_MODE_MODE_Timer) continue;
+    if(hw.tick & ((1ULL << (timer.PRESCALER.value & 15)) - 1)) continue;
+    increment(t);
+  }
+}
+
+// brings the peripherals up to the virtual clock
+static void sync() {
+  uint64_t target = hostNanos() * 16 / 1000;
+  if(!hw.polling || target < hw.tick) {
+    // nothing started yet, or the clock was reset
+    hw.tick = target;
+    return;
+  }
+  while(hw.tick < target) step();
+}
+
+static bool irqPending(int t) {
+  HostTimer &timer = hostPeripherals.timer[t];
+  for(int i = 0; i < 4; i++) {
+    if(timer.EVENTS_COMPARE[i].value && timer.INTENSET.value & 1UL << (16 + i)) return true;
+  }
+  return false;
+}
+
+static void poll() {
+  sync();
+  for(int t = 0; t < 3; t++) {
+    if(!hw.handler[t] || !irqPending(t)) continue;
+    hostAdvance(hostCosts.interruptNs);
+    hw.irqs[t]++;
+    hw.handler[t]();
+  }
+}
+
+HostReg &HostReg::operator=(uint32_t v) {
+  hostAdvance(hostCosts.registerNs);
+  sync();
+  HostTimer *timer = timerOf(this) >= 0 ? &hostPeripherals.timer[timerOf(this)] : 0;
+  HostPpi &ppi = hostPeripherals.ppi;
+  HostGpiote &gpiote = hostPeripherals.gpiote;
+  HostUart &uart0 = hostPeripherals.uart0;
+  uartSync();
+  if(isTask(this)) {
+    if(!v) return *this;
+    if(timer && this == AT(timer->TASKS_START) && !hw.polling) {
+      hw.polling = true;
+      hw.tick = hostNanos() * 16 / 1000;
+      hostAddTask(POLL_NS, poll);
+    }
+    runTask(this);
+  } else if(timer && this == AT(timer->INTENSET)) {
+    value |= v;
+  } else if(timer && this == AT(timer->INTENCLR)) {
+    timer->INTENSET.value &= ~v;
+  } else if(this == AT(uart0.INTENSET)) {
+    value |= v;
+  } else if(this == AT(uart0.INTENCLR)) {
+    uart0.INTENSET.value &= ~v;
+  } else if(this == AT(uart0.ERRORSRC)) {
+    value &= ~v; // write 1 to clear
+  } else if(this == AT(uart0.TXD)) {
+    uartSend(v);
+  } else if(this == AT(ppi.CHENSET)) {
+    ppi.CHEN.value |= v;
+  } else if(this == AT(ppi.CHENCLR)) {
+    ppi.CHEN.value &= ~v;
+  } else if(this >= gpiote.CONFIG && this < gpiote.CONFIG + 4) {
+    value = v;
+    // task mode drives the pin from OUTINIT on
+    if((v & 3) == 3) setOut(this - gpiote.CONFIG, (v >> 20) & 1);
+  } else {
+    value = v;
+  }
+  return *this;
+}
+
+HostReg::operator uint32_t() {
+  hostAdvance(hostCosts.registerNs);
+  sync();
+  int t = timerOf(this);
+  if(t >= 0 && this == AT(hostPeripherals.timer[t].INTENCLR)) return hostPeripherals.timer[t].INTENSET.value;
+  HostPpi &ppi = hostPeripherals.ppi;
+  if(this == AT(ppi.CHENSET) || this == AT(ppi.CHENCLR)) return ppi.CHEN.value;
+  HostUart &uart0 = hostPeripherals.uart0;
+  uartSync();
+  if(this == AT(uart0.INTENCLR)) return uart0.INTENSET.value;
+  if(this == AT(uart0.RXD)) return uartRead();
+  return value;
+}
+
+uint32_t HostReg::operator&() {
+  return REG_BASE + (uint32_t)((char *)this - (char *)&hostPeripherals);
+}
+
+void attachInterrupt(IRQn_Type irq, void (*handler)(void)) {
+  hw.handler[irqSlot(irq)] = handler;
+}
+
+void detachInterrupt(IRQn_Type irq) {
+  hw.handler[irqSlot(irq)] = 0;
+}
+
+uint32_t hostInterrupts(IRQn_Type irq) {
+  return hw.irqs[irqSlot(irq)];
+}
+
+uint64_t hostPeripheralTicks() {
+  sync();
+  return hw.tick;
+}
+
+void hostSetPinTrace(void (*trace)(uint8_t pin, uint8_t level, uint64_t tick)) {
+  hw.trace = trace;
+}
+
+void nrf_gpiote_task_config(uint32_t channel, uint32_t pin, nrf_gpiote_polarity_t polarity,
+                            nrf_gpiote_outinit_t initial) {
+  hostPeripherals.gpiote.CONFIG[channel] = 3 | pin << 8 | (uint32_t)polarity << 16 | (uint32_t)initial << 20;
+}
+
+void nrf_gpiote_unconfig(uint32_t channel) {
+  hostPeripherals.gpiote.CONFIG[channel] = 0;
+}
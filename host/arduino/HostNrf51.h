@@ -0,0 +1,209 @@
+// Host stand-ins for the few nRF51 peripheral registers the library drives
+// directly (see SpiBus.h): GPIO OUTSET/OUTCLR for chip selects and the SPI0
+// master, and __WFE() (PlaybackScheduler.h), which sleeps until the next task. Like the real SPI master, TXD and RXD are double buffered: a second
+// byte can be queued while the first one shifts, and every byte raises
+// EVENTS_READY when it lands in RXD. Bytes shift out back to back at
+// SPI.frequency() over SPI.dataLines(); every register access costs
+// hostCosts.registerNs.
+//
+// TIMER0-2, PPI, GPIOTE and the HFCLK start for the PWM output (PwmPlayer.h,
+// the rfduino2timersaudio engine) are modelled cycle by cycle at 16 MHz: the
+// timers count (0..CC with a CLEAR short, CC + 1 ticks), COMPARE events go
+// through the enabled PPI channels to their tasks one cycle later (tasks hit
+// twice in the same cycle run once), PPI channel groups switch channels on and
+// off, and a GPIOTE task toggles its pin. The hardware catches up with the
+// virtual clock on every register access and every microsecond; a TIMER
+// interrupt with a pending enabled event runs its attachInterrupt() handler
+// at the next microsecond, charged hostCosts.interruptNs on top.
+//
+// UART0 (UploadUart.h) is modelled a byte at a time: a byte handed to
+// hostUartInput() lands in the 6 byte receive FIFO at once (the caller paces
+// the line), or is lost with an OVERRUN error when the FIFO is full. RXDRDY
+// stays set while bytes wait, reading RXD moves the next one in. A byte
+// written to TXD goes to the output sink at once and raises TXDRDY one byte
+// time (at the BAUDRATE setting) later. The interrupt handler runs as soon as
+// an enabled event is pending, from hostUartInput() and on a task every half
+// byte time.
+
+#ifndef _HOST_NRF51_H_
+#define _HOST_NRF51_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct HostGpioOutset {
+  void operator=(uint32_t mask);
+};
+
+struct HostGpioOutclr {
+  void operator=(uint32_t mask);
+};
+
+struct HostGpio {
+  HostGpioOutset OUTSET;
+  HostGpioOutclr OUTCLR;
+};
+
+struct HostSpiTxd {
+  void operator=(uint32_t value);
+};
+
+struct HostSpiRxd {
+  operator uint32_t();
+};
+
+struct HostSpiReady {
+  operator uint32_t();
+  void operator=(uint32_t value);
+};
+
+struct HostSpi {
+  HostSpiTxd TXD;
+  HostSpiRxd RXD;
+  HostSpiReady EVENTS_READY;
+};
+
+extern HostGpio hostGpio;
+extern HostSpi hostSpi0;
+
+// bytes queued in TXD while both buffers were full (lost on the real chip)
+uint32_t hostSpiOverruns();
+
+void hostWaitForEvent(); // HostEmulator.h
+#define __WFE() hostWaitForEvent()
+
+#define NRF_GPIO (&hostGpio)
+#define NRF_SPI0 (&hostSpi0)
+
+// A register of the cycle modelled peripherals: accesses go through the model,
+// and its address (&reg) is what the PPI EEP/TEP registers take.
+struct HostReg {
+  HostReg &operator=(uint32_t v);
+  operator uint32_t();
+  uint32_t operator&();
+  uint32_t value;
+};
+
+struct HostTimer {
+  HostReg TASKS_START, TASKS_STOP, TASKS_COUNT, TASKS_CLEAR;
+  HostReg TASKS_CAPTURE[4];
+  HostReg EVENTS_COMPARE[4];
+  HostReg SHORTS, INTENSET, INTENCLR, MODE, BITMODE, PRESCALER;
+  HostReg CC[4];
+};
+
+struct HostPpiTasksChg {
+  HostReg EN, DIS;
+};
+
+struct HostPpiCh {
+  HostReg EEP, TEP;
+};
+
+struct HostPpi {
+  HostPpiTasksChg TASKS_CHG[4];
+  HostReg CHEN, CHENSET, CHENCLR;
+  HostPpiCh CH[16];
+  HostReg CHG[4];
+};
+
+struct HostGpiote {
+  HostReg TASKS_OUT[4];
+  HostReg EVENTS_IN[4];
+  HostReg CONFIG[4];
+};
+
+struct HostClock {
+  HostReg TASKS_HFCLKSTART;
+  HostReg EVENTS_HFCLKSTARTED;
+};
+
+struct HostUart {
+  HostReg TASKS_STARTRX, TASKS_STOPRX, TASKS_STARTTX, TASKS_STOPTX;
+  HostReg EVENTS_RXDRDY, EVENTS_TXDRDY, EVENTS_ERROR;
+  HostReg INTENSET, INTENCLR, ERRORSRC, ENABLE;
+  HostReg PSELRTS, PSELTXD, PSELCTS, PSELRXD;
+  HostReg RXD, TXD, BAUDRATE, CONFIG;
+};
+
+struct HostPeripherals {
+  HostTimer timer[3];
+  HostPpi ppi;
+  HostGpiote gpiote;
+  HostClock clock;
+  HostUart uart0;
+};
+
+extern HostPeripherals hostPeripherals;
+
+#define NRF_TIMER0 (&hostPeripherals.timer[0])
+#define NRF_TIMER1 (&hostPeripherals.timer[1])
+#define NRF_TIMER2 (&hostPeripherals.timer[2])
+#define NRF_PPI (&hostPeripherals.ppi)
+#define NRF_GPIOTE (&hostPeripherals.gpiote)
+#define NRF_CLOCK (&hostPeripherals.clock)
+#define NRF_UART0 (&hostPeripherals.uart0)
+
+typedef enum { UART0_IRQn = 2, TIMER0_IRQn = 8, TIMER1_IRQn = 9, TIMER2_IRQn = 10 } IRQn_Type;
+void attachInterrupt(IRQn_Type irq, void (*handler)(void));
+void detachInterrupt(IRQn_Type irq);
+// handler calls so far
+uint32_t hostInterrupts(IRQn_Type irq);
+// 16 MHz cycles the peripherals have run, and a hook called on every pin GPIOTE changes
+uint64_t hostPeripheralTicks();
+void hostSetPinTrace(void (*trace)(uint8_t pin, uint8_t level, uint64_t tick));
+// bytes arriving at UART0's RXD pin, and a sink for the ones it sends
+void hostUartInput(const uint8_t *data, size_t len);
+void hostSetUartOutput(void (*sink)(uint8_t b));
+// bytes lost because the receive FIFO was full
+uint32_t hostUartOverruns();
+
+#define TIMER_MODE_MODE_Timer 0
+#define TIMER_MODE_MODE_Counter 1
+#define TIMER_BITMODE_BITMODE_16Bit 0
+#define TIMER_BITMODE_BITMODE_08Bit 1
+#define TIMER_BITMODE_BITMODE_24Bit 2
+#define TIMER_BITMODE_BITMODE_32Bit 3
+#define TIMER_INTENSET_COMPARE0_Pos 16
+#define TIMER_INTENSET_COMPARE1_Pos 17
+#define TIMER_INTENSET_COMPARE2_Pos 18
+#define TIMER_INTENSET_COMPARE3_Pos 19
+#define TIMER_INTENSET_COMPARE0_Msk (1UL << TIMER_INTENSET_COMPARE0_Pos)
+#define TIMER_INTENSET_COMPARE1_Msk (1UL << TIMER_INTENSET_COMPARE1_Pos)
+#define TIMER_INTENSET_COMPARE2_Msk (1UL << TIMER_INTENSET_COMPARE2_Pos)
+#define TIMER_INTENSET_COMPARE3_Msk (1UL << TIMER_INTENSET_COMPARE3_Pos)
+#define TIMER_INTENSET_COMPARE0_Enabled 1
+#define TIMER_INTENSET_COMPARE1_Enabled 1
+#define TIMER_SHORTS_COMPARE0_CLEAR_Pos 0
+#define TIMER_SHORTS_COMPARE3_CLEAR_Pos 3
+#define TIMER_SHORTS_COMPARE0_CLEAR_Enabled 1
+#define TIMER_SHORTS_COMPARE3_CLEAR_Enabled 1
+#define UART_ENABLE_ENABLE_Enabled 4
+#define UART_INTENSET_RXDRDY_Pos 2
+#define UART_INTENSET_TXDRDY_Pos 7
+#define UART_INTENSET_ERROR_Pos 9
+#define UART_INTENSET_RXDRDY_Msk (1UL << UART_INTENSET_RXDRDY_Pos)
+#define UART_INTENSET_TXDRDY_Msk (1UL << UART_INTENSET_TXDRDY_Pos)
+#define UART_INTENSET_ERROR_Msk (1UL << UART_INTENSET_ERROR_Pos)
+#define UART_ERRORSRC_OVERRUN_Msk 1UL
+#define PPI_CHEN_CH0_Pos 0
+#define PPI_CHEN_CH1_Pos 1
+#define PPI_CHEN_CH2_Pos 2
+#define PPI_CHEN_CH0_Enabled 1
+#define PPI_CHEN_CH1_Enabled 1
+#define PPI_CHEN_CH2_Enabled 1
+
+typedef enum {
+  NRF_GPIOTE_POLARITY_LOTOHI = 1,
+  NRF_GPIOTE_POLARITY_HITOLO = 2,
+  NRF_GPIOTE_POLARITY_TOGGLE = 3
+} nrf_gpiote_polarity_t;
+
+typedef enum { NRF_GPIOTE_INITIAL_VALUE_LOW = 0, NRF_GPIOTE_INITIAL_VALUE_HIGH = 1 } nrf_gpiote_outinit_t;
+
+// nrf_gpiote.h
+void nrf_gpiote_task_config(uint32_t channel, uint32_t pin, nrf_gpiote_polarity_t polarity,
+                            nrf_gpiote_outinit_t initial);
+void nrf_gpiote_unconfig(uint32_t channel);
+
+#endif
@@ -0,0 +1,33 @@
+#include <SPI.h>
+#include <HostEmulator.h>
+
+SPIClass SPI;
+
+void SPIClass::begin() {
+  hostAdvance(hostCosts.spiBeginNs);
+}
+
+void SPIClass::end() {
+}
+
+void SPIClass::setBitOrder(uint8_t order) {
+  (void)order;
+}
+
+void SPIClass::setDataMode(uint8_t mode) {
+  (void)mode;
+}
+
+void SPIClass::setClockDivider(uint8_t div) {
+  (void)div;
+}
+
+void SPIClass::setFrequency(int khz) {
+  _khz = khz > 0 ? khz : 4000;
+}
+
+uint8_t SPIClass::transfer(uint8_t data) {
+  // 8 bits over the data lines plus the per-call overhead of a polled single byte transfer
+  hostAdvance(byteNanos() + hostCosts.spiByteGapNs);
+  return hostSpiExchange(data);
+}
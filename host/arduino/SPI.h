@@ -0,0 +1,46 @@
+// Host stand-in for the RFduino SPI library. Bytes go to whichever emulated
+// SpiDevice currently has its chip select pulled low (see HostEmulator.h),
+// and every transfer spends bus time on the virtual clock.
+
+#ifndef _HOST_SPI_H_
+#define _HOST_SPI_H_
+
+#include <Arduino.h>
+
+#define SPI_MODE0 0x00
+#define SPI_MODE1 0x04
+#define SPI_MODE2 0x08
+#define SPI_MODE3 0x0C
+
+#define LSBFIRST 0
+#define MSBFIRST 1
+
+#define SPI_CLOCK_DIV2 2
+#define SPI_CLOCK_DIV4 4
+
+// host only: the bus can clock data over 2 or 4 lines (dual/quad SPI flash reads)
+#define SPI_HAS_DATA_LINES
+
+class SPIClass {
+public:
+  void begin();
+  void end();
+  void setBitOrder(uint8_t order);
+  void setDataMode(uint8_t mode);
+  void setClockDivider(uint8_t div);
+  void setFrequency(int khz);
+  uint8_t transfer(uint8_t data);
+  void setDataLines(uint8_t lines) { _lines = lines == 2 || lines == 4 ? lines : 1; }
+  // host only: current bus clock and data lines
+  uint32_t frequency() { return _khz * 1000UL; }
+  uint8_t dataLines() { return _lines; }
+  // time one byte takes on the bus
+  uint32_t byteNanos() { return 8000000ULL / _khz / _lines; }
+private:
+  int _khz = 4000;
+  uint8_t _lines = 1;
+};
+
+extern SPIClass SPI;
+
+#endif
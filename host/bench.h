@@ -0,0 +1,98 @@
+// Shared pieces of the host benchmarks: the emulated chip on the FlashBuffer
+// pin, the serial ring, a serialcomtest-style uploader and test audio.
+
+#ifndef _HOST_BENCH_H_
+#define _HOST_BENCH_H_
+
+#include <SPI.h>
+#include <SPIFlash.h>
+#include <HostEmulator.h>
+#include <FlashChip.h>
+
+#define FLASH_CS_PIN 2
+
+// the whole chip the descriptor names, the layout may use less of it (FLASHBUFFER_BLOCKS)
+static FlashChip chip(FLASH_CS_PIN, 1UL << FLASHBUFFER_CHIP_SHIFT, FLASHBUFFER_CHIP_JEDEC);
+static SerialBuffer ring;
+
+// Host side of the serialcomtest upload: one byte per UART frame into the
+// ring, stop on a full ring, continue when FlashBuffer calls uartResume.
+static struct {
+  const uint8_t *data;
+  uint32_t length, sent, pauses;
+  boolean paused;
+} uart;
+
+static inline void uartReceive() {
+  if(uart.paused || uart.sent >= uart.length) return;
+  if(ring.add(uart.data[uart.sent]) == -1) {
+    uart.paused = true;
+    uart.pauses++;
+  } else {
+    uart.sent++;
+  }
+}
+
+static inline void uartResume() {
+  uart.paused = false;
+}
+
+static inline void makeAudio(uint8_t *buf, uint32_t len, uint32_t seed) {
+  // 8 bit unsigned PCM, a couple of tones plus noise, never constant
+  uint32_t x = seed * 2654435761u + 1;
+  for(uint32_t i = 0; i < len; i++) {
+    x = x * 1103515245u + 12345u;
+    int v = 128 + (int)((i * (3 + seed)) & 63) - 32 + (int)((x >> 24) & 15) - 8;
+    buf[i] = (uint8_t)v;
+  }
+}
+
+static inline double seconds(uint64_t ns) {
+  return ns / 1e9;
+}
+
+struct Measure {
+  uint64_t startNs;
+  FlashStats start;
+  void begin() {
+    startNs = hostNanos();
+    start = chip.stats;
+  }
+  uint64_t ns() const { return hostNanos() - startNs; }
+  uint64_t spiBytes() const { return chip.stats.spiBytes - start.spiBytes; }
+  uint64_t busNs() const { return chip.stats.busNanos - start.busNanos; }
+  uint32_t erases() const {
+    return chip.stats.erase4K + chip.stats.erase32K + chip.stats.erase64K
+         - start.erase4K - start.erase32K - start.erase64K;
+  }
+};
+
+static inline FlashBuffer *mountFresh() {
+  chip.eraseAll();
+  chip.resetStats();
+  hostResetClock();
+  FlashBuffer *fb = new FlashBuffer(FLASH_CS_PIN);
+  fb->setResumeCallback(uartResume);
+  return fb;
+}
+
+// Upload one item the way serialcomtest does: start writing once 256 bytes
+// have arrived. Returns the modelled upload time from the first byte on.
+static inline uint64_t upload(FlashBuffer *fb, uint8_t id, const uint8_t *data, uint32_t len, uint32_t baud, Measure &m,
+                              uint8_t format = FLASHBUFFER_FORMAT_PCM8) {
+  ring.reset();
+  uart.data = data;
+  uart.length = len;
+  uart.sent = 0;
+  uart.pauses = 0;
+  uart.paused = false;
+  int task = hostAddTask(10000000000ULL / baud, uartReceive);
+  m.begin();
+  while(ring.numberOfElements() < 256 && uart.sent < len) delay(1);
+  fb->writeItemToFlash(id, len, ring, format);
+  uint64_t ns = m.ns();
+  hostRemoveTask(task);
+  return ns;
+}
+
+#endif
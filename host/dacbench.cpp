@@ -0,0 +1,166 @@
+// DAC and flash on one SPI bus: FlashPlayer plays an item from flash while the sample interrupt
+// writes every sample to a 12 bit SPI DAC (MCP4921 style, latched on CS high) at 16/32 kHz.
+// Compares the interrupt of rfduino1timer (digitalWrite chip select + SPI.transfer per byte,
+// straight onto the bus, even in the middle of a flash read) with SpiBus::post() (register
+// chip select, held back while a flash read is on the bus), the latter with full page reads
+// and with reads capped by FlashBuffer::setMaxBurst(). Reports what the interrupt costs per
+// sample, bus collisions, writes held back / dropped, DAC samples lost, wrong or late, and
+// whether the flash reads survived.
+// Build: see host/README.md
+
+#include "bench.h"
+#include <FlashPlayer.h>
+#include <vector>
+
+#define DAC_CS_PIN 3
+
+// latches the 2 byte word it received when its chip select goes high
+class Dac : public SpiDevice {
+public:
+  Dac() : SpiDevice(DAC_CS_PIN) {}
+  void select() { count = 0; }
+  uint8_t transfer(uint8_t mosi) {
+    if(count < 2) word[count] = mosi;
+    count++;
+    return 0xFF; // doesn't drive MISO
+  }
+  void deselect() {
+    if(count != 2) {
+      malformed++;
+      return;
+    }
+    latched.push_back(word[0] << 8 | word[1]);
+    latchedAt.push_back(hostNanos());
+  }
+  std::vector<uint16_t> latched;
+  std::vector<uint64_t> latchedAt;
+  uint32_t malformed = 0;
+private:
+  uint8_t word[2];
+  uint8_t count = 0;
+};
+
+static Dac dac;
+
+static struct {
+  FlashPlayer *player;
+  const uint8_t *expect;
+  uint32_t length, pos, errors;
+  std::vector<uint8_t> sent;       // what the interrupt wrote, in order
+  std::vector<uint64_t> sentAt;
+} out;
+
+// the DAC word: the sample as the top 8 of the 12 bits; the 4 bits below carry a sequence
+// number here, so the bench can tell which sample got latched
+static inline void dacWord(uint8_t s, uint8_t *word) {
+  uint8_t tag = out.sent.size() & 15;
+  word[0] = B00110000 | (s >> 4);
+  word[1] = (s << 4) | tag;
+  out.sent.push_back(s);
+  out.sentAt.push_back(hostNanos());
+}
+
+// rfduino1timer's writeToDac()
+static void writeToDacDirect(uint8_t s) {
+  uint8_t word[2];
+  dacWord(s, word);
+  digitalWrite(DAC_CS_PIN, LOW);
+  SPI.transfer(word[0]);
+  SPI.transfer(word[1]);
+  digitalWrite(DAC_CS_PIN, HIGH);
+}
+
+static void writeToDacPosted(uint8_t s) {
+  uint8_t word[2];
+  dacWord(s, word);
+  SpiBus::post(DAC_CS_PIN, word, 2);
+}
+
+static void (*writeToDac)(uint8_t s);
+
+static void sampleInterrupt() {
+  int s = out.player->nextSample();
+  if(s < 0) return;
+  writeToDac(s);
+  if(out.player->samplesPlayed() > out.pos) {
+    if(out.pos >= out.length || s != out.expect[out.pos]) out.errors++;
+    out.pos++;
+  }
+}
+
+static void play(FlashBuffer *fb, const uint8_t *data, uint32_t len, uint32_t rate, const char *name,
+                 void (*write)(uint8_t), uint16_t maxBurst) {
+  FlashPlayer player(*fb);
+  fb->setMaxBurst(maxBurst);
+  out.player = &player;
+  out.expect = data;
+  out.length = len;
+  out.pos = out.errors = 0;
+  out.sent.clear();
+  out.sentAt.clear();
+  dac.latched.clear();
+  dac.latchedAt.clear();
+  dac.malformed = 0;
+  writeToDac = write;
+  uint64_t collisions = hostSpiCollisions(), taskNs = hostTaskNanos();
+  uint32_t deferred = SpiBus::deferred(), dropped = SpiBus::dropped();
+  Measure m;
+  m.begin();
+  player.start(1);
+  int task = hostAddTask(1000000000ULL / rate, sampleInterrupt);
+  while(player.isPlaying()) {
+    player.refill();
+    delayMicroseconds(200); // rest of loop()
+  }
+  hostRemoveTask(task);
+  uint64_t ns = m.ns();
+
+  // walk the latched words: each is the newest sample written before it was latched that has its
+  // sequence number (held back writes only ever get replaced by newer ones)
+  uint32_t wrong = 0, late = 0;
+  uint64_t worst = 0, period = 1000000000ULL / rate;
+  size_t next = 0, newest = 0;
+  for(size_t i = 0; i < dac.latched.size(); i++) {
+    uint8_t tag = dac.latched[i] & 15;
+    while(newest + 1 < out.sent.size() && out.sentAt[newest + 1] <= dac.latchedAt[i]) newest++;
+    size_t k = newest;
+    while(k > next && (k & 15) != tag) k--;
+    if(k >= out.sent.size() || (k & 15) != tag || (dac.latched[i] >> 4 & 0xFF) != out.sent[k] || (dac.latched[i] >> 12) != 3) {
+      wrong++;
+      continue;
+    }
+    uint64_t delay = dac.latchedAt[i] - out.sentAt[k];
+    if(delay > worst) worst = delay;
+    if(delay > period) late++;
+    next = k + 1;
+  }
+  uint32_t samples = out.sent.size();
+  uint32_t lost = samples > dac.latched.size() ? samples - dac.latched.size() : 0;
+  printf("  %5u Hz %-22s burst %3u  ISR %5.0f ns/sample  %6llu collisions  %6u held %5u dropped"
+         "  DAC: %5u lost %2u torn %6u wrong %5u late (max %5.1f us)  flash: %6u bad %5u underruns  bus %4.1f%%\n",
+         rate, name, maxBurst, (double)(hostTaskNanos() - taskNs) / (samples ? samples : 1),
+         (unsigned long long)(hostSpiCollisions() - collisions), SpiBus::deferred() - deferred,
+         SpiBus::dropped() - dropped, lost, dac.malformed, wrong, late, worst / 1000.0,
+         out.errors + (len - out.pos), player.underruns(), 100.0 * m.busNs() / ns);
+}
+
+int main() {
+  const uint32_t len = 160000;
+  const uint32_t rates[] = { 16000, 32000 };
+  uint8_t *data = new uint8_t[len];
+  makeAudio(data, len, 7);
+  FlashBuffer *fb = mountFresh();
+  Measure m;
+  upload(fb, 1, data, len, 1000000, m);
+
+  printf("DAC (CS %u) and flash (CS %u) on one bus, %u byte item, SPI %u kHz\n", DAC_CS_PIN, FLASH_CS_PIN, len,
+         SPI.frequency() / 1000);
+  for(unsigned r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+    play(fb, data, len, rates[r], "digitalWrite+transfer", writeToDacDirect, 256);
+    play(fb, data, len, rates[r], "SpiBus::post", writeToDacPosted, 256);
+    play(fb, data, len, rates[r], "SpiBus::post", writeToDacPosted, 6);
+  }
+  delete fb;
+  delete[] data;
+  return 0;
+}
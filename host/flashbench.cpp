@@ -0,0 +1,543 @@
+// FlashBuffer benchmark on the host: runs the unmodified SPIFlash library
+// against the FlashChip model and reports upload and playback figures for
+// typical 8 kHz / 8 bit audio item sizes. All times are modelled (virtual
+// clock), so numbers are reproducible run to run. Build: see host/README.md
+
+#include "bench.h"
+
+// Playback side: empties the ring as fast as it fills and checks every byte.
+static struct {
+  const uint8_t *expect;
+  uint32_t length, pos, errors, underruns;
+} sink;
+
+static void resetSink(const uint8_t *expect, uint32_t length) {
+  sink.expect = expect;
+  sink.length = length;
+  sink.pos = sink.errors = sink.underruns = 0;
+}
+
+static void drainRing() {
+  int b;
+  while((b = ring.remove()) != -1) {
+    if(b != sink.expect[sink.pos++]) sink.errors++;
+  }
+}
+
+// 8 kHz sample interrupt taking one byte per tick
+static void audioInterrupt() {
+  int b = ring.remove();
+  if(b == -1) {
+    if(sink.pos < sink.length) sink.underruns++;
+    return;
+  }
+  if(b != sink.expect[sink.pos++]) sink.errors++;
+}
+
+static void printRow(const char *what, uint32_t len, uint64_t ns, uint64_t spiBytes, uint64_t busNs, const char *extra) {
+  printf("  %-22s %8.1f KB/s  %6.2f SPI B/B  bus %5.1f%%  %s\n", what,
+         len / 1024.0 / seconds(ns), (double)spiBytes / len, 100.0 * busNs / ns, extra);
+}
+
+static void benchItem(uint32_t len) {
+  const uint32_t bauds[] = { 57600, 1000000 };
+  uint8_t *data = new uint8_t[len];
+  makeAudio(data, len, len);
+  FlashBuffer *fb = 0;
+  const uint8_t id = 3;
+  char what[32], extra[96];
+  Measure m;
+  uint64_t ns;
+
+  printf("item %u bytes (%.2f s at 8 kHz)\n", len, len / 8000.0);
+  for(unsigned b = 0; b < sizeof(bauds) / sizeof(bauds[0]); b++) {
+    delete fb;
+    fb = mountFresh();
+    ns = upload(fb, id, data, len, bauds[b], m);
+    snprintf(what, sizeof(what), "write @%u baud", bauds[b]);
+    snprintf(extra, sizeof(extra), "%.0f%% of line rate, %u pauses, %u erases, %u programs",
+             100.0 * len * 10 / bauds[b] / seconds(ns), uart.pauses, m.erases(),
+             chip.stats.pagePrograms - m.start.pagePrograms);
+    printRow(what, len, ns, m.spiBytes(), m.busNs(), extra);
+  }
+
+  uint32_t length;
+  int task = hostAddTask(1000, drainRing);
+  resetSink(data, len);
+  m.begin();
+  fb->readItemFromFlash(id, length, ring);
+  drainRing();
+  ns = m.ns();
+  snprintf(extra, sizeof(extra), "%.1fx realtime, %u bad bytes", len / 8000.0 / seconds(ns), sink.errors + (len - sink.pos));
+  printRow("readItemFromFlash", len, ns, m.spiBytes(), m.busNs(), extra);
+
+  resetSink(data, len);
+  m.begin();
+  fb->fastReadItemFromFlash(id, length, ring);
+  drainRing();
+  ns = m.ns();
+  snprintf(extra, sizeof(extra), "%.1fx realtime, %u bad bytes", len / 8000.0 / seconds(ns), sink.errors + (len - sink.pos));
+  printRow("fastReadItemFromFlash", len, ns, m.spiBytes(), m.busNs(), extra);
+
+  ItemCursor cursor;
+  resetSink(data, len);
+  m.begin();
+  fb->openItem(id, cursor);
+  while(cursor.remaining > 0) fb->readItemChunk(cursor, ring);
+  drainRing();
+  ns = m.ns();
+  snprintf(extra, sizeof(extra), "%.1fx realtime, %u bad bytes", len / 8000.0 / seconds(ns), sink.errors + (len - sink.pos));
+  printRow("readItemChunk", len, ns, m.spiBytes(), m.busNs(), extra);
+  hostRemoveTask(task);
+
+  // real-time playback: the sample interrupt empties the ring, loop() tops it up
+  ring.reset();
+  resetSink(data, len);
+  m.begin();
+  fb->openItem(id, cursor);
+  fb->readItemChunk(cursor, ring); // prime the ring before starting the timer
+  task = hostAddTask(125000, audioInterrupt);
+  while(sink.pos < len) {
+    fb->readItemChunk(cursor, ring);
+    delayMicroseconds(100); // rest of loop()
+  }
+  ns = m.ns();
+  hostRemoveTask(task);
+  snprintf(extra, sizeof(extra), "%u underruns, %u bad bytes", sink.underruns, sink.errors);
+  printRow("8 kHz playback (chunks)", len, ns, m.spiBytes(), m.busNs(), extra);
+
+  uint32_t bad = 0;
+  m.begin();
+  for(uint32_t i = 0; i < len; i++) {
+    if(fb->readItemAtIndex(id, i) != data[i]) bad++;
+  }
+  ns = m.ns();
+  snprintf(extra, sizeof(extra), "%.1fx realtime, %u bad bytes", len / 8000.0 / seconds(ns), bad);
+  printRow("readItemAtIndex", len, ns, m.spiBytes(), m.busNs(), extra);
+
+  bad = 0;
+  fb->resetCacheStats();
+  m.begin();
+  for(uint32_t i = 0; i < len; i++) {
+    if(fb->readItemCached(id, i) != data[i]) bad++;
+  }
+  ns = m.ns();
+  snprintf(extra, sizeof(extra), "%.1fx realtime, %u bad bytes, %u hits %u misses %u prefetches", len / 8000.0 / seconds(ns), bad,
+           fb->cacheHits(), fb->cacheMisses(), fb->cachePrefetches());
+  printRow("readItemCached", len, ns, m.spiBytes(), m.busNs(), extra);
+
+  delete fb;
+  delete[] data;
+}
+
+// bad bytes of item id against data, reading it back in page bursts; len + 1 if it is missing
+static uint32_t checkItem(FlashBuffer *fb, uint8_t id, const uint8_t *data, uint32_t len) {
+  ItemCursor cursor;
+  if(fb->getItemLength(id) != len || !fb->openItem(id, cursor)) return len + 1;
+  uint8_t buf[FLASHBUFFER_PAGE_SIZE];
+  uint32_t bad = 0, pos = 0;
+  while(cursor.remaining > 0) {
+    uint16_t n = fb->readItemBytes(cursor, buf, sizeof(buf));
+    for(uint16_t i = 0; i < n; i++) {
+      if(buf[i] != data[pos + i]) bad++;
+    }
+    pos += n;
+  }
+  return bad;
+}
+
+// Keep uploading until the ring of 64K blocks has wrapped, to count the
+// erases a full chip costs per uploaded megabyte. With FLASHBUFFER_BLOCKS below the size of
+// the chip the log wraps short of its end: nothing beyond the layout may change.
+static void benchWrap(uint32_t len, uint32_t baud) {
+  uint8_t *data = new uint8_t[len];
+  makeAudio(data, len, 7);
+  FlashBuffer *fb = mountFresh();
+  uint32_t total = 0, pauses = 0;
+  uint64_t ns = 0;
+  Measure all;
+  all.begin();
+  for(uint8_t n = 0; total < FLASHBUFFER_CAPACITY + FLASHBUFFER_CAPACITY / 2; n++) {
+    Measure m;
+    ns += upload(fb, 1 + n % 30, data, len, baud, m);
+    pauses += uart.pauses;
+    while(fb->eraseStep() != FLASHBUFFER_WRITE_IDLE) delay(1); // idle between uploads
+    total += len;
+  }
+  printf("wrap: %u items of %u bytes (%.2f MB), UART %u baud\n", total / len, len, total / 1048576.0, baud);
+  uint32_t e4 = chip.stats.erase4K - all.start.erase4K, e32 = chip.stats.erase32K - all.start.erase32K;
+  uint32_t e64 = chip.stats.erase64K - all.start.erase64K;
+  double eraseMs = ((double)e4 * chip.timing.erase4KNs + (double)e32 * chip.timing.erase32KNs
+                  + (double)e64 * chip.timing.erase64KNs) / 1e6;
+  printf("  %.1f KB/s, %u pauses, %u erases (4K/32K/64K %u/%u/%u, %.0f ms per MB), %u page programs, %u program conflicts\n",
+         total / 1024.0 / seconds(ns), pauses, all.erases(), e4, e32, e64, eraseMs / (total / 1048576.0),
+         chip.stats.pagePrograms, chip.stats.programConflicts);
+  printf("  %u relocations, %u evictions, write amplification %.2f\n", fb->relocations(), fb->evictions(),
+         (double)fb->bytesProgrammed() / fb->bytesWritten());
+  uint32_t outside = 0, items = 0, bad = 0, badRemount = 0;
+  for(uint32_t i = FLASHBUFFER_CAPACITY; i < chip.capacity(); i++) {
+    if(chip.memory()[i] != 0xFF) outside++;
+  }
+  FlashBuffer *remounted = new FlashBuffer(FLASH_CS_PIN);
+  for(uint8_t id = 1; id <= 30; id++) {
+    if(!fb->getItemLength(id)) continue;
+    items++;
+    bad += checkItem(fb, id, data, len);
+    badRemount += checkItem(remounted, id, data, len);
+  }
+  printf("  %u bytes changed beyond the %u KB layout, %u items read back: %u bad bytes, %u after a remount\n",
+         outside, FLASHBUFFER_CAPACITY / 1024, items, bad, badRemount);
+  delete remounted;
+  delete fb;
+  delete[] data;
+}
+
+// A chip mostly full of assets, one short prompt rewritten over and over: the cleaner has to
+// relocate the assets in its way instead of dropping them, and the erases spread over all blocks.
+static void benchHotPrompt(uint8_t assets, uint32_t assetLen, uint32_t promptLen, uint16_t rewrites) {
+  uint8_t *asset = new uint8_t[assetLen];
+  uint8_t *prompt = new uint8_t[promptLen];
+  FlashBuffer *fb = mountFresh();
+  Measure m;
+  for(uint8_t id = 0; id < assets; id++) {
+    makeAudio(asset, assetLen, 100 + id);
+    upload(fb, id, asset, assetLen, 1000000, m);
+    while(fb->eraseStep() != FLASHBUFFER_WRITE_IDLE) delay(1);
+  }
+  fb->resetWriteStats();
+  Measure all;
+  all.begin();
+  uint64_t worstNs = 0;
+  for(uint16_t n = 0; n < rewrites; n++) {
+    makeAudio(prompt, promptLen, n);
+    uint64_t ns = upload(fb, 100, prompt, promptLen, 1000000, m);
+    if(ns > worstNs) worstNs = ns;
+    while(fb->eraseStep() != FLASHBUFFER_WRITE_IDLE) delay(1);
+  }
+  double amplification = (double)fb->bytesProgrammed() / fb->bytesWritten();
+  uint32_t relocations = fb->relocations(), evictions = fb->evictions();
+  // every asset must have survived, also after a remount
+  delete fb;
+  fb = new FlashBuffer(FLASH_CS_PIN);
+  uint32_t lost = 0, bad = 0;
+  for(uint8_t id = 0; id < assets; id++) {
+    makeAudio(asset, assetLen, 100 + id);
+    if(fb->getItemLength(id) != assetLen) {
+      lost++;
+      continue;
+    }
+    for(uint32_t i = 0; i < assetLen; i++) {
+      if(fb->readItemCached(id, i) != asset[i]) bad++;
+    }
+  }
+  for(uint32_t i = 0; i < promptLen; i++) {
+    if(fb->readItemCached(100, i) != prompt[i]) bad++;
+  }
+  uint16_t minErases = 0xFFFF, maxErases = 0;
+  for(uint16_t block = 0; block < FLASHBUFFER_BLOCKS; block++) {
+    uint16_t count = fb->eraseCount(block);
+    if(count < minErases) minErases = count;
+    if(count > maxErases) maxErases = count;
+  }
+  printf("hot prompt: %u x %u bytes rewritten over %u assets of %u bytes (%.0f%% full)\n", rewrites, promptLen,
+         assets, assetLen, 100.0 * assets * assetLen / FLASHBUFFER_CHECKPOINT_ADDRESS);
+  printf("  write amplification %.2f (%u relocations, %u evictions), %u erases, block erase counts %u..%u\n",
+         amplification, relocations, evictions, all.erases(),
+         minErases, maxErases);
+  printf("  slowest upload %.0f ms, %u assets lost, %u bad bytes\n", worstNs / 1e6, lost, bad);
+  delete fb;
+  delete[] asset;
+  delete[] prompt;
+}
+
+// Streams (openStream/closeStream): a microphone interrupt appending one sample at a time, or
+// loop() appending as fast as the pages are programmed, without the length known up front.
+static struct {
+  FlashBuffer *fb;
+  const uint8_t *data;
+  uint32_t length, sent, overruns;
+} mic;
+
+// sample interrupt: a sample the ring has no room for is lost (the bench keeps the data in order)
+static void micSample() {
+  if(mic.sent >= mic.length) return;
+  if(mic.fb->appendStream(&mic.data[mic.sent], 1)) mic.sent++;
+  else mic.overruns++;
+}
+
+// a chip that has been written for a while: live assets 1..4, the rest of the log dead
+static FlashBuffer *mountUsed(const uint8_t *asset, uint32_t assetLen) {
+  FlashBuffer *fb = mountFresh();
+  Measure m;
+  for(uint8_t n = 0; n < 24; n++) {
+    upload(fb, 1 + n % 4, asset, assetLen, 1000000, m);
+  }
+  while(fb->eraseStep() != FLASHBUFFER_WRITE_IDLE) delay(1);
+  return fb;
+}
+
+static uint32_t lostAssets(FlashBuffer *fb, const uint8_t *asset, uint32_t assetLen) {
+  uint32_t lost = 0;
+  for(uint8_t id = 1; id <= 4; id++) {
+    if(checkItem(fb, id, asset, assetLen)) lost++;
+  }
+  return lost;
+}
+
+static void benchStream(uint32_t len) {
+  const uint8_t id = 9;
+  const uint32_t assetLen = len / 4;
+  uint8_t *data = new uint8_t[len];
+  uint8_t *asset = new uint8_t[assetLen];
+  makeAudio(data, len, 5);
+  makeAudio(asset, assetLen, 6);
+  char extra[112];
+  Measure m;
+  printf("streams: %u bytes, ring %u bytes, 4K erase %.0f ms\n", len, RING_SIZE, chip.timing.erase4KNs / 1e6);
+
+  // loop() producing the data: the writer takes it as fast as the chip programs pages
+  for(int stream = 0; stream < 2; stream++) {
+    FlashBuffer *fb = mountFresh();
+    ring.reset();
+    m.begin();
+    if(stream) fb->openStream(id, ring);
+    else fb->startItem(id, len, ring);
+    uint32_t sent = 0;
+    while(fb->writing()) {
+      if(sent < len) {
+        sent += stream ? fb->appendStream(data + sent, len - sent < 0xFFFF ? len - sent : 0xFFFF)
+                       : ring.add(data + sent, len - sent < 0xFFFF ? len - sent : 0xFFFF);
+        if(sent == len && stream) fb->closeStream();
+      }
+      fb->writeStep();
+    }
+    // the figures of the write alone, before the item is read back
+    uint64_t ns = m.ns(), spiBytes = m.spiBytes(), busNs = m.busNs();
+    uint32_t bad = checkItem(fb, id, data, len);
+    delete fb;
+    fb = new FlashBuffer(FLASH_CS_PIN);
+    snprintf(extra, sizeof(extra), "%u page programs, %u bad bytes, %u after a remount",
+             chip.stats.pagePrograms - m.start.pagePrograms, bad, checkItem(fb, id, data, len));
+    printRow(stream ? "openStream..closeStream" : "startItem (length known)", len, ns, spiBytes, busNs, extra);
+    delete fb;
+  }
+
+  // a microphone on a used chip: the stream erases ahead of itself while it records
+  const uint32_t rates[] = { 8000, 16000, 32000, 48000 };
+  for(unsigned r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+    FlashBuffer *fb = mountUsed(asset, assetLen);
+    ring.reset();
+    mic.fb = fb;
+    mic.data = data;
+    mic.length = len;
+    mic.sent = mic.overruns = 0;
+    m.begin();
+    fb->openStream(id, ring);
+    int task = hostAddTask(1000000000UL / rates[r], micSample);
+    while(mic.sent < len && fb->streaming()) { // it closes itself when the log is out of room
+      if(fb->writeStep() == FLASHBUFFER_WRITE_WAITING) delayMicroseconds(50);
+    }
+    hostRemoveTask(task);
+    fb->closeStream();
+    while(fb->writeStep() != FLASHBUFFER_WRITE_IDLE) {
+    }
+    uint64_t ns = m.ns(), spiBytes = m.spiBytes(), busNs = m.busNs();
+    uint32_t erases = m.erases();
+    uint32_t bad = checkItem(fb, id, data, len);
+    delete fb;
+    fb = new FlashBuffer(FLASH_CS_PIN);
+    char what[32];
+    snprintf(what, sizeof(what), "mic @%u Hz", rates[r]);
+    snprintf(extra, sizeof(extra), "%u overruns, %u erases, %u bad bytes, %u after a remount, %u assets lost",
+             mic.overruns, erases, bad, checkItem(fb, id, data, len), lostAssets(fb, asset, assetLen));
+    printRow(what, len, ns, spiBytes, busNs, extra);
+    delete fb;
+  }
+
+  // no end: the stream goes on through the dead flash and stops short of the oldest live asset
+  FlashBuffer *fb = mountUsed(asset, assetLen);
+  ring.reset();
+  fb->openStream(id, ring);
+  uint32_t sent = 0;
+  while(fb->writing()) {
+    if(fb->streaming()) sent += fb->appendStream(data + sent % len, len - sent % len < 0xFFFF ? len - sent % len : 0xFFFF);
+    fb->writeStep();
+  }
+  uint32_t kept = fb->getItemLength(id), bad = 0;
+  for(uint32_t i = 0; i < kept; i++) {
+    if(fb->readItemCached(id, i) != data[i % len]) bad++;
+  }
+  delete fb;
+  fb = new FlashBuffer(FLASH_CS_PIN);
+  printf("  endless stream: closed itself at %u bytes (%.0f%% of the chip), %u left in the ring, %u bad bytes, "
+         "%u after a remount, %u assets lost\n", kept, 100.0 * kept / FLASHBUFFER_CAPACITY, sent - kept, bad,
+         fb->getItemLength(id) == kept ? 0 : kept, lostAssets(fb, asset, assetLen));
+  delete fb;
+
+  // power lost in the middle of a stream: the open record is dropped, the log goes on behind it
+  fb = mountUsed(asset, assetLen);
+  ring.reset();
+  fb->openStream(id, ring);
+  sent = 0;
+  while(sent < len / 2) {
+    sent += fb->appendStream(data + sent, len / 2 - sent < 0xFFFF ? len / 2 - sent : 0xFFFF);
+    fb->writeStep();
+  }
+  delete fb;
+  fb = new FlashBuffer(FLASH_CS_PIN);
+  fb->setResumeCallback(uartResume);
+  uint32_t torn = fb->getItemLength(id);
+  upload(fb, id, data, len, 1000000, m);
+  uint32_t lost = lostAssets(fb, asset, assetLen);
+  delete fb;
+  fb = new FlashBuffer(FLASH_CS_PIN);
+  printf("  power lost mid-stream: %u bytes of it indexed after the remount, the next upload %u bad bytes, %u assets lost\n",
+         torn, checkItem(fb, id, data, len), lost + lostAssets(fb, asset, assetLen));
+  delete fb;
+  delete[] data;
+  delete[] asset;
+}
+
+static const char *checkNames[] = { "ok", "BAD", "unknown" };
+
+// what each read path says about item id: the return values of the blocking reads, checkItem()
+// after cursor reads (whole, and with the first byte skipped) and verifyItem()
+static void printChecks(FlashBuffer *fb, uint8_t id, const uint8_t *data, uint32_t len, const char *what) {
+  uint32_t length;
+  int task = hostAddTask(1000, drainRing);
+  ring.reset();
+  resetSink(data, len);
+  int slow = fb->readItemFromFlash(id, length, ring);
+  drainRing();
+  resetSink(data, len);
+  int fast = fb->fastReadItemFromFlash(id, length, ring);
+  drainRing();
+  hostRemoveTask(task);
+  ItemCursor cursor;
+  fb->openItem(id, cursor);
+  while(cursor.remaining > 0) {
+    ring.reset();
+    fb->readItemChunk(cursor, ring);
+  }
+  uint8_t chunk = fb->checkItem(cursor);
+  fb->openItem(id, cursor);
+  fb->skipItemBytes(cursor, 1);
+  uint8_t buf[FLASHBUFFER_PAGE_SIZE];
+  while(cursor.remaining > 0) fb->readItemBytes(cursor, buf, sizeof(buf));
+  uint8_t skipped = fb->checkItem(cursor);
+  printf("  %-22s readItemFromFlash %2d, fastReadItemFromFlash %2d, readItemChunk %-7s skipped %-7s verifyItem %s\n",
+         what, slow, fast, checkNames[chunk], checkNames[skipped], checkNames[fb->verifyItem(id)]);
+}
+
+// Item CRCs: every read path on an intact item, after a bit flipped in the chip (retention) and
+// after a remount; then uploads with and without the read-after-write pass, and with one page
+// program that leaves a bit at 1 (a worn cell).
+static void benchIntegrity(uint32_t len) {
+  const uint8_t id = 5;
+  uint8_t *data = new uint8_t[len];
+  makeAudio(data, len, 7);
+  char what[32], extra[112];
+  Measure m;
+  printf("item CRCs: %u byte item\n", len);
+  FlashBuffer *fb = mountFresh();
+  upload(fb, id, data, len, 1000000, m);
+  printChecks(fb, id, data, len, "intact");
+  ItemCursor cursor;
+  fb->openItem(id, cursor);
+  fb->skipItemBytes(cursor, len / 2);
+  chip.memory()[cursor.address] ^= 0x10;
+  printChecks(fb, id, data, len, "1 bit flipped");
+  delete fb;
+  fb = new FlashBuffer(FLASH_CS_PIN);
+  printChecks(fb, id, data, len, "remounted");
+  delete fb;
+
+  for(int worn = 0; worn < 2; worn++) {
+    for(int verify = 0; verify < 2; verify++) {
+      fb = mountFresh();
+      fb->setVerify(verify);
+      if(worn) chip.faultProgram = chip.stats.pagePrograms + 100;
+      chip.faultMask = 0x04;
+      uint64_t ns = upload(fb, id, data, len, 1000000, m);
+      uint64_t spiBytes = m.spiBytes(), busNs = m.busNs();
+      chip.faultProgram = 0xFFFFFFFF;
+      uint32_t length;
+      int task = hostAddTask(1000, drainRing);
+      resetSink(data, len);
+      int read = fb->getItemLength(id) ? fb->fastReadItemFromFlash(id, length, ring) : -1;
+      drainRing();
+      hostRemoveTask(task);
+      snprintf(what, sizeof(what), "%s%s", worn ? "worn cell, " : "", verify ? "verified" : "unverified");
+      snprintf(extra, sizeof(extra), "%u failures, item %s, fastReadItemFromFlash %d, %u bad bytes",
+               fb->verifyFailures(), fb->getItemLength(id) ? "indexed" : "missing", read, sink.errors);
+      printRow(what, len, ns, spiBytes, busNs, extra);
+      if(worn && verify) {
+        // the sender is told to send it again
+        ns = upload(fb, id, data, len, 1000000, m);
+        spiBytes = m.spiBytes();
+        busNs = m.busNs();
+        snprintf(extra, sizeof(extra), "%u failures, item %s, %u bad bytes", fb->verifyFailures(),
+                 fb->getItemLength(id) ? "indexed" : "missing", checkItem(fb, id, data, len));
+        printRow("  uploaded again", len, ns, spiBytes, busNs, extra);
+      }
+      delete fb;
+    }
+  }
+  delete[] data;
+}
+
+// Many small items: every id must stay reachable, also after a remount,
+// and lookups must not touch the bus.
+static void benchDirectory(uint8_t items, uint32_t len) {
+  uint8_t *data = new uint8_t[len];
+  makeAudio(data, len, 11);
+  FlashBuffer *fb = mountFresh();
+  for(uint8_t id = 0; id < items; id++) {
+    Measure m;
+    upload(fb, id, data, len, 1000000, m);
+  }
+  Measure m;
+  m.begin();
+  uint32_t wrong = 0;
+  for(uint8_t id = 0; id < items; id++) {
+    if(fb->getItemLength(id) != len) wrong++;
+  }
+  if(fb->getItemLength(items) != 0) wrong++;
+  uint64_t lookupBytes = m.spiBytes();
+  delete fb;
+
+  m.begin();
+  fb = new FlashBuffer(FLASH_CS_PIN);
+  uint64_t mountNs = m.ns();
+  uint64_t mountBytes = m.spiBytes();
+  for(uint8_t id = 0; id < items; id++) {
+    if(fb->getItemLength(id) != len) wrong++;
+  }
+  printf("directory: %u items of %u bytes\n", items, len);
+  printf("  %u indexed, %u wrong lengths, %llu SPI bytes for %u lookups, remount %.1f ms (%llu SPI bytes) with %u items\n",
+         items, wrong, (unsigned long long)lookupBytes, items + 1, mountNs / 1e6, (unsigned long long)mountBytes, fb->itemCount());
+  delete fb;
+  delete[] data;
+}
+
+int main() {
+  // UI beep, short prompt, sentence, long loop crossing 64K blocks
+  const uint32_t sizes[] = { 2000, 8000, 40000, 160000 };
+  printf("SPI %u kHz, chip %u KB (log on %u KB), page program %.1f ms, 64K erase %.0f ms\n\n",
+         SPI.frequency() / 1000, chip.capacity() / 1024, FLASHBUFFER_CAPACITY / 1024,
+         chip.timing.pageProgramNs / 1e6, chip.timing.erase64KNs / 1e6);
+  for(unsigned s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    benchItem(sizes[s]);
+    printf("\n");
+  }
+  benchDirectory(100, 500);
+  benchWrap(40000, 1000000);
+  benchWrap(40000, 57600);
+  benchHotPrompt(16, 40000, 8000, 300);
+  printf("\n");
+  // the stream and four assets a quarter of its size, with room to spare on a small layout
+  benchStream(FLASHBUFFER_CAPACITY / 6 < 160000 ? FLASHBUFFER_CAPACITY / 6 : 160000);
+  printf("\n");
+  benchIntegrity(160000);
+  return 0;
+}
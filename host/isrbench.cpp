@@ -0,0 +1,144 @@
+// What the sample interrupt costs per sample: FlashPlayer::nextSample() and
+// FlashMixer::nextSample() with 1..4 voices, at the item's own rate and
+// resampled, timed on the host CPU (real time, not the emulated clock) in
+// batches between refills. Each case runs RUNS times over the same samples
+// and every batch counts with its fastest time, so a batch the host preempted
+// or slowed down in one run doesn't show up in the figure. Host
+// nanoseconds don't translate into nRF51 cycles, the ratios between the cases do. Also checks the resampled output
+// against a reference interpolation and lists the TIMER1 settings per rate.
+// Build: see host/README.md
+
+#include "bench.h"
+#include <FlashMixer.h>
+#include <SampleClock.h>
+#include <time.h>
+
+#define BATCH 64 // samples per timed batch: less than one player buffer, even at 4 input samples per output
+#define SAMPLES 400000
+#define BATCHES (SAMPLES / BATCH)
+#define RUNS 15 // of SAMPLES each
+
+static uint64_t realNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static volatile uint32_t sink; // keeps the samples from being optimised away
+static uint64_t fastest[BATCHES]; // per batch over the runs
+
+static void resetFastest() {
+  for(uint32_t b = 0; b < BATCHES; b++) fastest[b] = ~0ULL;
+}
+
+static void batchTime(uint32_t b, uint64_t ns) {
+  if(ns < fastest[b]) fastest[b] = ns;
+}
+
+// ns per sample over all batches at their fastest
+static double fastestPerSample() {
+  uint64_t ns = 0;
+  for(uint32_t b = 0; b < BATCHES; b++) ns += fastest[b];
+  return (double)ns / (BATCHES * BATCH);
+}
+
+static double timePlayer(FlashBuffer *fb, uint8_t id) {
+  resetFastest();
+  for(int run = 0; run < RUNS; run++) {
+    FlashPlayer player(*fb);
+    player.start(id, true);
+    for(uint32_t b = 0; b < BATCHES; b++) {
+      player.refill();
+      uint64_t t = realNanos();
+      for(int i = 0; i < BATCH; i++) sink += player.nextSample();
+      batchTime(b, realNanos() - t);
+    }
+  }
+  return fastestPerSample();
+}
+
+static double timeMixer(FlashBuffer *fb, uint16_t rate, const uint8_t *ids, uint8_t voices) {
+  resetFastest();
+  for(int run = 0; run < RUNS; run++) {
+    FlashMixer mixer(*fb, rate);
+    for(uint8_t v = 0; v < voices; v++) mixer.play(ids[v], FLASHMIXER_UNITY / voices, true);
+    for(uint32_t b = 0; b < BATCHES; b++) {
+      mixer.refill();
+      uint64_t t = realNanos();
+      for(int i = 0; i < BATCH; i++) sink += mixer.nextSample();
+      batchTime(b, realNanos() - t);
+    }
+  }
+  return fastestPerSample();
+}
+
+// one voice of item id at output rate against linear interpolation of data computed here
+static uint32_t checkResampling(FlashBuffer *fb, uint8_t id, const uint8_t *data, uint32_t len, uint16_t rate) {
+  FlashMixer mixer(*fb, rate);
+  mixer.play(id);
+  uint32_t step = ((uint32_t)fb->getItemSampleRate(id) << 16) / rate;
+  uint64_t phase = 0;
+  uint32_t bad = 0, outputs = 0;
+  while(mixer.isPlaying(0)) {
+    mixer.refill();
+    for(int i = 0; i < BATCH && mixer.isPlaying(0); i++) {
+      int s = mixer.nextSample();
+      if(!mixer.isPlaying(0)) break; // the input ran out on this one
+      // after output k the mixer has fetched j = k * step input samples and interpolates between
+      // the last two of them (silence before the first)
+      phase += step;
+      uint32_t j = phase >> 16;
+      int a = j >= 2 ? data[j - 2] : 128, b = j >= 1 ? data[j - 1] : 128;
+      int expect = a + ((b - a) * (int)((phase & 0xFFFF) >> 8) >> 8);
+      if(s != expect) bad++;
+      outputs++;
+    }
+  }
+  printf("  %5u Hz item -> %5u Hz: %u output samples (%u expected), %u bad\n",
+         fb->getItemSampleRate(id), rate, outputs, (uint32_t)((uint64_t)len * rate / fb->getItemSampleRate(id)), bad);
+  return bad;
+}
+
+int main() {
+  const uint32_t len = 100000;
+  uint8_t *data = new uint8_t[len];
+  makeAudio(data, len, 11);
+  FlashBuffer *fb = mountFresh();
+  Measure m;
+  upload(fb, 1, data, len, 1000000, m, FLASHBUFFER_FORMAT_PCM8 | FLASHBUFFER_RATE_8000);
+  upload(fb, 2, data, len, 1000000, m, FLASHBUFFER_FORMAT_PCM8 | FLASHBUFFER_RATE_16000);
+  upload(fb, 3, data, len, 1000000, m, FLASHBUFFER_FORMAT_PCM8 | FLASHBUFFER_RATE_22050);
+  upload(fb, 4, data, len, 1000000, m, FLASHBUFFER_FORMAT_PCM8 | FLASHBUFFER_RATE_11025);
+
+  printf("sample interrupt cost on this host, ns per output sample (every batch at its fastest of %u runs)\n", RUNS);
+  double base = timePlayer(fb, 1);
+  printf("  FlashPlayer                          %6.1f ns\n", base);
+  const uint8_t same[] = { 1, 1, 1, 1 }, mixed[] = { 1, 2, 3, 4 };
+  for(uint8_t voices = 1; voices <= FLASHMIXER_VOICES && voices <= 4; voices *= 2) {
+    double ns = timeMixer(fb, 8000, same, voices);
+    printf("  FlashMixer %u voice%s, 8 kHz items      %6.1f ns  %4.1fx\n", voices, voices > 1 ? "s" : " ", ns, ns / base);
+  }
+  for(uint8_t voices = 1; voices <= FLASHMIXER_VOICES && voices <= 4; voices *= 2) {
+    double ns = timeMixer(fb, 16000, mixed + 4 - voices, voices);
+    printf("  FlashMixer %u voice%s, resampled to 16k %6.1f ns  %4.1fx\n", voices, voices > 1 ? "s" : " ", ns, ns / base);
+  }
+
+  printf("resampling (linear, 16.16 phase)\n");
+  checkResampling(fb, 2, data, len, 8000);
+  checkResampling(fb, 1, data, len, 22050);
+  checkResampling(fb, 4, data, len, 16000);
+
+  printf("TIMER1 settings\n");
+  const uint16_t rates[] = { 8000, 11025, 12000, 16000, 22050, 24000, 32000, 44100, 48000 };
+  for(unsigned i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+    SampleClock clock = sampleClockFor(rates[i]);
+    uint8_t bits = flashBufferRateBits(rates[i]);
+    printf("  %5u Hz: prescaler %u compare %5u -> %9.2f Hz (%+.3f%%), format bits 0x%02X\n", rates[i], clock.prescaler,
+           clock.compare, (double)(SAMPLE_CLOCK_HZ >> clock.prescaler) / (clock.compare + 1),
+           100.0 * ((double)(SAMPLE_CLOCK_HZ >> clock.prescaler) / (clock.compare + 1) / rates[i] - 1), bits);
+    if(flashBufferSampleRate(bits) != rates[i]) printf("    rate bits don't round trip\n");
+  }
+  delete fb;
+  delete[] data;
+  return 0;
+}
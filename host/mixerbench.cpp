@@ -0,0 +1,115 @@
+// FlashMixer on the host: a looping background item at half volume, a flash
+// beep and a loud PROGMEM beep started over it now and then, mixed in the
+// sample interrupt while loop() refills and stalls. Every output sample is
+// checked against a mix computed from the sources, including the clipping.
+// Build: see host/README.md
+
+#include "bench.h"
+#include <FlashMixer.h>
+#include <vector>
+
+static const uint8_t PROGMEM beep[] = {
+  228, 228, 228, 228, 228, 228, 228, 228, 28, 28, 28, 28, 28, 28, 28, 28,
+};
+
+struct Start {
+  uint32_t at, end; // output samples the voice plays for: [at, end)
+  const uint8_t *data;
+  uint32_t length;
+  uint16_t gain;
+};
+
+static struct {
+  FlashMixer *mixer;
+  std::vector<uint8_t> samples;
+} out;
+
+// the TIMER1 interrupt of a mixing sketch
+static void sampleInterrupt() {
+  out.samples.push_back(out.mixer->nextSample());
+}
+
+static void run(FlashBuffer *fb, const uint8_t *background, uint32_t bgLen, const uint8_t *click, uint32_t clickLen,
+                uint32_t rate, uint32_t stallUs) {
+  FlashMixer mixer(*fb);
+  out.mixer = &mixer;
+  out.samples.clear();
+  std::vector<Start> starts;
+  const uint32_t total = rate * 10; // 10 s of output
+  out.samples.reserve(total + rate);
+  Measure m;
+  m.begin();
+  mixer.play(1, FLASHMIXER_UNITY / 2, true);
+  starts.push_back(Start { 0, UINT32_MAX, background, bgLen, FLASHMIXER_UNITY / 2 });
+  int task = hostAddTask(1000000000ULL / rate, sampleInterrupt);
+  uint32_t loops = 0, next = rate / 4, beeps = 0;
+  int8_t toneVoice = -1;
+  while(out.samples.size() < total) {
+    mixer.refill();
+    uint32_t now = out.samples.size();
+    if(toneVoice >= 0 && now >= starts.back().at + rate / 20) {
+      // the repeating PROGMEM tone is stopped by loop(), 50 ms in
+      mixer.stop(toneVoice);
+      starts.back().end = now;
+      toneVoice = -1;
+    }
+    if(now >= next) {
+      // a UI beep every 300 ms, from flash and from PROGMEM by turns
+      if(beeps++ & 1) {
+        toneVoice = mixer.playProgmem(beep, sizeof(beep), 2 * FLASHMIXER_UNITY, true); // loud enough to clip
+        if(toneVoice >= 0) starts.push_back(Start { now, UINT32_MAX, beep, sizeof(beep), 2 * FLASHMIXER_UNITY });
+      } else if(mixer.play(2) >= 0) {
+        // start() reads the first buffers first: the voice joins the mix after that
+        uint32_t at = out.samples.size();
+        starts.push_back(Start { at, at + clickLen, click, clickLen, FLASHMIXER_UNITY });
+      }
+      next = now + rate * 3 / 10;
+    }
+    delayMicroseconds(200); // rest of loop()
+    if(++loops % 100 == 0) delayMicroseconds(stallUs);
+  }
+  hostRemoveTask(task);
+  uint64_t ns = m.ns();
+
+  uint32_t bad = 0, clipped = 0;
+  for(uint32_t i = 0; i < out.samples.size(); i++) {
+    int32_t sum = 0;
+    for(size_t j = 0; j < starts.size(); j++) {
+      const Start &s = starts[j];
+      if(i < s.at || i >= s.end) continue;
+      sum += (int32_t)(s.data[(i - s.at) % s.length] - 128) * s.gain;
+    }
+    int32_t v = (sum >> 8) + 128;
+    if(v < 0 || v > 255) clipped++;
+    v = v < 0 ? 0 : v > 255 ? 255 : v;
+    if(out.samples[i] != v) bad++;
+  }
+  printf("  %5u Hz  stall %5u us  %u voices started  %5u underruns  %u bad  %u clipped (%u expected)  bus %4.1f%%\n",
+         rate, stallUs, (unsigned)starts.size(), mixer.underruns(), bad, mixer.clipped(), clipped, 100.0 * m.busNs() / ns);
+}
+
+int main() {
+  const uint32_t bgLen = 40000, clickLen = 1600; // the background loops at every rate
+  const uint32_t rates[] = { 8000, 16000, 32000 };
+  const uint32_t stalls[] = { 0, 5000, 15000 };
+  uint8_t *background = new uint8_t[bgLen];
+  uint8_t *click = new uint8_t[clickLen];
+  makeAudio(background, bgLen, 7);
+  makeAudio(click, clickLen, 8);
+  FlashBuffer *fb = mountFresh();
+  Measure m;
+  upload(fb, 1, background, bgLen, 1000000, m);
+  upload(fb, 2, click, clickLen, 1000000, m);
+
+  printf("FlashMixer, %u voices, looping %u byte background + beeps, 2 x %u sample buffers per voice\n",
+         FLASHMIXER_VOICES, bgLen, FLASHPLAYER_BUFFER_SIZE);
+  for(unsigned r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+    for(unsigned s = 0; s < sizeof(stalls) / sizeof(stalls[0]); s++) {
+      run(fb, background, bgLen, click, clickLen, rates[r], stalls[s]);
+    }
+  }
+  delete fb;
+  delete[] background;
+  delete[] click;
+  return 0;
+}
@@ -0,0 +1,343 @@
+// Packs a directory of WAV files into a complete flash image for FlashBuffer, plus a manifest of
+// what went where. Each file is mixed down to mono, resampled to a rate FlashBuffer stores (its own
+// rate, or -r for all) with a windowed sinc filter, rounded to 8 bit unsigned PCM and optionally
+// coded as IMA ADPCM (-a). The items are written by FlashBuffer itself, through the emulated chip,
+// so headers, block erase counts, the index record and the checkpoint journal are laid out exactly
+// as the library lays them out. The image is then mounted again on a second emulated chip and
+// every item is read back, compared and checked against its CRC before the files are written.
+//
+// Item ids come from a leading number in the file name (3-beep.wav is item 3), the other files
+// get the free ids from 1 on, in name order. The image is the whole chip (FLASHBUFFER_CAPACITY,
+// see the chip descriptor in SPIFlash.h), ready for a flash programmer or a bulk write.
+// Build: see host/README.md
+//
+//   ./packer [-r rate] [-a] wavdir out.img out.manifest
+
+#include <SPI.h>
+#include <SPIFlash.h>
+#include <ImaAdpcm.h>
+#include <HostEmulator.h>
+#include <FlashChip.h>
+
+#include <algorithm>
+#include <ctype.h>
+#include <dirent.h>
+#include <math.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#define PACK_CS_PIN 2
+#define VERIFY_CS_PIN 4
+#define SINC_ZEROS 16 // zero crossings of the resampling filter on either side
+
+struct Asset {
+  std::string file;
+  int id;
+  uint32_t sourceRate;
+  uint16_t channels, bits;
+  uint32_t sourceFrames;
+  uint16_t rate;
+  uint8_t format;
+  uint32_t samples, clipped;
+  std::vector<uint8_t> payload;
+};
+
+static uint32_t le(const uint8_t *p, int n) {
+  uint32_t v = 0;
+  for(int i = n - 1; i >= 0; i--) v = v << 8 | p[i];
+  return v;
+}
+
+// mono samples in -1..1 from a PCM (8/16/24/32 bit) or float (32 bit) WAV file
+static bool readWav(const std::string &path, Asset &a, std::vector<double> &mono) {
+  FILE *f = fopen(path.c_str(), "rb");
+  if(!f) {
+    perror(path.c_str());
+    return false;
+  }
+  std::vector<uint8_t> wav;
+  uint8_t buf[65536];
+  size_t n;
+  while((n = fread(buf, 1, sizeof(buf), f)) > 0) wav.insert(wav.end(), buf, buf + n);
+  fclose(f);
+  if(wav.size() < 12 || memcmp(&wav[0], "RIFF", 4) || memcmp(&wav[8], "WAVE", 4)) {
+    fprintf(stderr, "%s: not a WAV file\n", path.c_str());
+    return false;
+  }
+  uint16_t tag = 0, blockAlign = 0;
+  const uint8_t *data = 0;
+  uint32_t dataSize = 0;
+  for(size_t pos = 12; pos + 8 <= wav.size();) {
+    uint32_t size = le(&wav[pos + 4], 4);
+    const uint8_t *body = &wav[pos + 8];
+    if(size > wav.size() - pos - 8) size = wav.size() - pos - 8; // truncated file: take what is there
+    if(!memcmp(&wav[pos], "fmt ", 4) && size >= 16) {
+      tag = le(body, 2);
+      a.channels = le(body + 2, 2);
+      a.sourceRate = le(body + 4, 4);
+      blockAlign = le(body + 12, 2);
+      a.bits = le(body + 14, 2);
+      if(tag == 0xFFFE && size >= 26) tag = le(body + 24, 2); // WAVE_FORMAT_EXTENSIBLE: the sub format
+    } else if(!memcmp(&wav[pos], "data", 4)) {
+      data = body;
+      dataSize = size;
+    }
+    pos += 8 + size + (size & 1);
+  }
+  bool pcm = tag == 1 && (a.bits == 8 || a.bits == 16 || a.bits == 24 || a.bits == 32);
+  bool real = tag == 3 && a.bits == 32;
+  if(!data || !a.channels || !a.sourceRate || (!pcm && !real) || blockAlign < a.channels * a.bits / 8) {
+    fprintf(stderr, "%s: unsupported WAV format (tag %u, %u bit); PCM 8-32 bit or float 32 bit only\n",
+            path.c_str(), tag, a.bits);
+    return false;
+  }
+  a.sourceFrames = dataSize / blockAlign;
+  mono.resize(a.sourceFrames);
+  uint8_t bytes = a.bits / 8;
+  for(uint32_t i = 0; i < a.sourceFrames; i++) {
+    double sum = 0;
+    for(uint16_t c = 0; c < a.channels; c++) {
+      const uint8_t *p = data + (size_t)i * blockAlign + c * bytes;
+      if(real) {
+        uint32_t u = le(p, 4);
+        float v;
+        memcpy(&v, &u, 4);
+        sum += v;
+      } else if(bytes == 1) {
+        sum += (p[0] - 128) / 128.0;
+      } else {
+        int32_t v = (int32_t)(le(p, bytes) << (32 - a.bits)); // sign extended through the top bit
+        sum += v / 2147483648.0;
+      }
+    }
+    mono[i] = sum / a.channels;
+  }
+  return true;
+}
+
+// Band limited resampling: a sinc low-pass at the lower of the two Nyquist frequencies,
+// Blackman windowed over SINC_ZEROS zero crossings on either side.
+static std::vector<double> resample(const std::vector<double> &in, uint32_t from, uint32_t to) {
+  if(from == to) return in;
+  uint32_t frames = (uint32_t)((uint64_t)in.size() * to / from);
+  std::vector<double> out(frames);
+  double step = (double)from / to;
+  double cutoff = std::min(1.0, (double)to / from); // relative to the input Nyquist frequency
+  double half = SINC_ZEROS / cutoff;                 // filter half width in input samples
+  for(uint32_t i = 0; i < frames; i++) {
+    double center = i * step;
+    long first = (long)ceil(center - half), last = (long)floor(center + half);
+    double sum = 0, weights = 0;
+    for(long j = first; j <= last; j++) {
+      double x = j - center;
+      double t = M_PI * x * cutoff;
+      double sinc = t == 0 ? 1 : sin(t) / t;
+      double w = 0.42 + 0.5 * cos(M_PI * x / half) + 0.08 * cos(2 * M_PI * x / half);
+      weights += sinc * w;
+      if(j >= 0 && j < (long)in.size()) sum += in[j] * sinc * w;
+    }
+    out[i] = weights ? sum / weights : 0;
+  }
+  return out;
+}
+
+static bool convert(const std::string &dir, Asset &a, uint16_t rate, bool adpcm) {
+  std::vector<double> mono;
+  if(!readWav(dir + "/" + a.file, a, mono)) return false;
+  a.rate = flashBufferSampleRate(flashBufferRateBits(rate ? rate : a.sourceRate));
+  std::vector<double> out = resample(mono, a.sourceRate, a.rate);
+  std::vector<uint8_t> pcm(out.size());
+  a.clipped = 0;
+  for(size_t i = 0; i < out.size(); i++) {
+    long v = lround(out[i] * 128) + 128;
+    if(v < 0 || v > 255) a.clipped++;
+    pcm[i] = v < 0 ? 0 : v > 255 ? 255 : v;
+  }
+  a.samples = pcm.size();
+  if(!a.samples) {
+    fprintf(stderr, "%s: no samples\n", a.file.c_str());
+    return false;
+  }
+  a.format = flashBufferRateBits(a.rate);
+  if(adpcm) {
+    a.format |= FLASHBUFFER_FORMAT_IMA_ADPCM;
+    a.payload.resize(imaAdpcmBytes(a.samples) + 1);
+    ImaAdpcmEncoder encoder;
+    uint32_t bytes = encoder.encode(&pcm[0], a.samples, &a.payload[0]);
+    bytes += encoder.finish(&a.payload[bytes]);
+    a.payload.resize(bytes);
+  } else {
+    a.payload = pcm;
+  }
+  return true;
+}
+
+// feeds the payload through the ring the way the upload does, without the serial line
+static void writeItem(FlashBuffer &fb, const Asset &a) {
+  SerialBuffer ring;
+  ring.reset();
+  uint32_t sent = 0;
+  fb.startItem(a.id, a.payload.size(), ring, a.format);
+  while(fb.writing()) {
+    if(sent < a.payload.size()) {
+      uint32_t n = std::min<uint32_t>(ring.freeSpace(), a.payload.size() - sent);
+      sent += ring.add(&a.payload[sent], n);
+    }
+    fb.writeStep();
+  }
+}
+
+static bool verify(FlashChip &image, const std::vector<Asset> &assets) {
+  FlashChip copy(VERIFY_CS_PIN, FLASHBUFFER_CAPACITY, FLASHBUFFER_CHIP_JEDEC);
+  memcpy(copy.memory(), image.memory(), FLASHBUFFER_CAPACITY);
+  FlashBuffer fb(VERIFY_CS_PIN);
+  bool ok = fb.itemCount() == assets.size();
+  if(!ok) fprintf(stderr, "verify: %u items in the image, %u packed\n", fb.itemCount(), (unsigned)assets.size());
+  std::vector<uint8_t> back;
+  for(size_t i = 0; i < assets.size(); i++) {
+    const Asset &a = assets[i];
+    ItemCursor cursor;
+    if(!fb.openItem(a.id, cursor) || fb.getItemLength(a.id) != a.payload.size() ||
+       fb.getItemFormat(a.id) != (a.format & FLASHBUFFER_CODING_MASK) ||
+       fb.getItemSampleRate(a.id) != flashBufferSampleRate(a.format)) {
+      fprintf(stderr, "verify: item %d (%s) missing or wrong length/format\n", a.id, a.file.c_str());
+      ok = false;
+      continue;
+    }
+    back.resize(a.payload.size());
+    uint32_t got = 0;
+    while(got < back.size()) {
+      uint16_t n = fb.readItemBytes(cursor, &back[got], std::min<uint32_t>(4096, back.size() - got));
+      if(!n) break;
+      got += n;
+    }
+    if(got != back.size() || back != a.payload || fb.checkItem(cursor) != FLASHBUFFER_CHECK_OK) {
+      fprintf(stderr, "verify: item %d (%s) reads back different\n", a.id, a.file.c_str());
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+static bool hasWavSuffix(const std::string &name) {
+  if(name.size() < 4) return false;
+  std::string s = name.substr(name.size() - 4);
+  for(size_t i = 0; i < s.size(); i++) s[i] = tolower(s[i]);
+  return s == ".wav";
+}
+
+static void usage(const char *self) {
+  fprintf(stderr, "usage: %s [-r rate] [-a] wavdir out.img out.manifest\n"
+                  "  -r rate  resample everything to rate Hz (default: each file's own rate)\n"
+                  "  -a       IMA ADPCM instead of 8 bit PCM\n", self);
+}
+
+int main(int argc, char **argv) {
+  uint16_t rate = 0;
+  bool adpcm = false;
+  int opt;
+  while((opt = getopt(argc, argv, "r:a")) != -1) {
+    if(opt == 'r') rate = atoi(optarg);
+    else if(opt == 'a') adpcm = true;
+    else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if(argc - optind != 3) {
+    usage(argv[0]);
+    return 1;
+  }
+  std::string dir = argv[optind];
+  const char *imagePath = argv[optind + 1], *manifestPath = argv[optind + 2];
+
+  std::vector<Asset> assets;
+  DIR *d = opendir(dir.c_str());
+  if(!d) {
+    perror(dir.c_str());
+    return 1;
+  }
+  while(struct dirent *e = readdir(d)) {
+    if(!hasWavSuffix(e->d_name)) continue;
+    Asset a;
+    a.file = e->d_name;
+    a.id = isdigit((unsigned char)a.file[0]) ? atoi(a.file.c_str()) : -1;
+    assets.push_back(a);
+  }
+  closedir(d);
+  if(assets.empty()) {
+    fprintf(stderr, "%s: no .wav files\n", dir.c_str());
+    return 1;
+  }
+  std::sort(assets.begin(), assets.end(), [](const Asset &x, const Asset &y) { return x.file < y.file; });
+
+  // ids: 0..126, 0x7F is the index record
+  bool used[0x7F] = { false };
+  for(size_t i = 0; i < assets.size(); i++) {
+    int id = assets[i].id;
+    if(id < 0) continue;
+    if(id >= 0x7F || used[id]) {
+      fprintf(stderr, "%s: id %d %s\n", assets[i].file.c_str(), id, id >= 0x7F ? "out of range (0-126)" : "taken twice");
+      return 1;
+    }
+    used[id] = true;
+  }
+  int next = 1;
+  for(size_t i = 0; i < assets.size(); i++) {
+    if(assets[i].id >= 0) continue;
+    while(next < 0x7F && used[next]) next++;
+    if(next >= 0x7F) {
+      fprintf(stderr, "more than 127 items\n");
+      return 1;
+    }
+    assets[i].id = next;
+    used[next] = true;
+  }
+  std::sort(assets.begin(), assets.end(), [](const Asset &x, const Asset &y) { return x.id < y.id; });
+
+  uint64_t total = 0;
+  for(size_t i = 0; i < assets.size(); i++) {
+    if(!convert(dir, assets[i], rate, adpcm)) return 1;
+    total += assets[i].payload.size();
+  }
+
+  FlashChip chip(PACK_CS_PIN, FLASHBUFFER_CAPACITY, FLASHBUFFER_CHIP_JEDEC);
+  FlashBuffer fb(PACK_CS_PIN);
+  for(size_t i = 0; i < assets.size(); i++) writeItem(fb, assets[i]);
+  if(fb.evictions() || !verify(chip, assets)) {
+    fprintf(stderr, "the items (%llu bytes) do not fit in %lu bytes of flash, or the image does not mount\n",
+            (unsigned long long)total, (unsigned long)FLASHBUFFER_CAPACITY);
+    return 1;
+  }
+
+  uint32_t extent = FLASHBUFFER_CAPACITY;
+  while(extent > 0 && chip.memory()[extent - 1] == 0xFF) extent--;
+  FILE *f = fopen(imagePath, "wb");
+  if(!f || fwrite(chip.memory(), 1, FLASHBUFFER_CAPACITY, f) != FLASHBUFFER_CAPACITY || fclose(f) != 0) {
+    perror(imagePath);
+    return 1;
+  }
+  f = fopen(manifestPath, "w");
+  if(!f) {
+    perror(manifestPath);
+    return 1;
+  }
+  fprintf(f, "# FlashBuffer image %s: %lu bytes, JEDEC %06lX, %u items, %lu bytes up to the last programmed one\n",
+          imagePath, (unsigned long)FLASHBUFFER_CAPACITY, (unsigned long)FLASHBUFFER_CHIP_JEDEC, (unsigned)assets.size(),
+          (unsigned long)extent);
+  fprintf(f, "# id\tformat\trate\tsamples\tbytes\tseconds\tclipped\tfile\tsource\n");
+  for(size_t i = 0; i < assets.size(); i++) {
+    const Asset &a = assets[i];
+    fprintf(f, "%d\t%s\t%u\t%u\t%u\t%.3f\t%u\t%s\t%u Hz %u ch %u bit\n", a.id, adpcm ? "adpcm" : "pcm8", a.rate,
+            a.samples, (unsigned)a.payload.size(), (double)a.samples / a.rate, a.clipped, a.file.c_str(), a.sourceRate,
+            a.channels, a.bits);
+    printf("%3d  %-24s %6u Hz %u ch %2u bit -> %5u Hz %s, %7u bytes%s\n", a.id, a.file.c_str(), a.sourceRate,
+           a.channels, a.bits, a.rate, adpcm ? "adpcm" : "pcm8", (unsigned)a.payload.size(),
+           a.clipped ? " (clipped)" : "");
+  }
+  fclose(f);
+  printf("%u items, %llu payload bytes, image %lu bytes (%lu used), verified by mounting it again\n",
+         (unsigned)assets.size(), (unsigned long long)total, (unsigned long)FLASHBUFFER_CAPACITY, (unsigned long)extent);
+  return 0;
+}
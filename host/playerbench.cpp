@@ -0,0 +1,210 @@
+// FlashPlayer on the host: plays long items through the double buffered
+// player with the sample interrupt as a periodic task, while loop() refills
+// and now and then stalls (serial output, BLE, ...) for a while. Reports
+// underruns, checks every sample and shows how busy the SPI bus is. The same
+// audio again as IMA ADPCM, decoded by refill(). Then a spoken number prompt:
+// twelve stretches of ten "digit" items (PCM and ADPCM, some cut at both ends)
+// queued as one playlist, checked sample by sample against their
+// concatenation, and the silence between them counted; against the same
+// prompt played clip by clip with play() after the previous one ended.
+// Build: see host/README.md
+
+#include "bench.h"
+#include <FlashPlayer.h>
+#include <ImaAdpcm.h>
+
+#include <vector>
+
+static struct {
+  FlashPlayer *player;
+  const uint8_t *expect;
+  uint32_t length, pos, errors;
+  uint32_t played, silent; // prompts: samplesPlayed() last time, -1s between the first and the last sample
+} out;
+
+// the TIMER1 interrupt of rfduinoflashplayer
+static void sampleInterrupt() {
+  int s = out.player->nextSample();
+  if(s < 0) return;
+  // repeated samples of an underrun aren't part of the item
+  if(out.player->samplesPlayed() > out.pos) {
+    if(out.pos >= out.length || s != out.expect[out.pos]) out.errors++;
+    out.pos++;
+  }
+}
+
+static void play(FlashBuffer *fb, uint8_t id, const uint8_t *data, uint32_t len, uint32_t rate, uint32_t stallUs) {
+  FlashPlayer player(*fb);
+  out.player = &player;
+  out.expect = data;
+  out.length = len;
+  out.pos = out.errors = 0;
+  Measure m;
+  m.begin();
+  player.start(id);
+  int task = hostAddTask(1000000000ULL / rate, sampleInterrupt);
+  uint32_t loops = 0;
+  while(player.isPlaying()) {
+    player.refill();
+    delayMicroseconds(200); // rest of loop()
+    if(++loops % 100 == 0) delayMicroseconds(stallUs);
+  }
+  hostRemoveTask(task);
+  uint64_t ns = m.ns();
+  printf("  %5u Hz  stall %5u us  %6.2f s  %5u underruns  %u/%u samples  %u bad  bus %4.1f%%  %.2f SPI B/sample\n",
+         rate, stallUs, seconds(ns), player.underruns(), out.pos, len, out.errors + (len - out.pos),
+         100.0 * m.busNs() / ns, (double)m.spiBytes() / len);
+}
+
+// a stretch of a digit item: offset and length in samples, 0: to the end
+struct Fragment {
+  uint8_t digit;
+  uint32_t offset, length;
+};
+
+static const Fragment prompt[] = {
+  { 4, 300, 2000 }, { 2, 0, 0 }, { 7, 411, 1800 }, { 0, 505, 2525 }, { 9, 1, 0 }, { 1, 700, 1010 },
+  { 5, 0, 3000 }, { 5, 1234, 0 }, { 3, 250, 2222 }, { 8, 1009, 1 }, { 6, 99, 3333 }, { 2, 600, 0 },
+};
+#define PROMPT_LENGTH (sizeof(prompt) / sizeof(prompt[0]))
+
+// the TIMER1 interrupt playing a prompt: a sample that moved samplesPlayed() on is a new one
+static void promptInterrupt() {
+  int s = out.player->nextSample();
+  if(s < 0) {
+    if(out.pos > 0 && out.pos < out.length) out.silent++;
+    return;
+  }
+  if(out.player->samplesPlayed() != out.played) {
+    if(out.pos >= out.length || s != out.expect[out.pos]) out.errors++;
+    out.pos++;
+  }
+  out.played = out.player->samplesPlayed();
+}
+
+// The prompt as a playlist (queued as far as it fits, the rest while it plays), or clip by clip:
+// each one a list of its own, played once loop() sees the last one has ended.
+static void playPrompt(FlashBuffer *fb, uint8_t firstId, const std::vector<uint8_t> &expect, const char *name,
+                       uint32_t rate, uint32_t stallUs, boolean oneByOne) {
+  FlashPlayer player(*fb);
+  out.player = &player;
+  out.expect = &expect[0];
+  out.length = expect.size();
+  out.pos = out.errors = out.played = out.silent = 0;
+  unsigned next = 0, segments = 0;
+  uint32_t underruns = 0;
+  for(; next < PROMPT_LENGTH && (next == 0 || !oneByOne); next++) {
+    const Fragment &f = prompt[next];
+    if(!player.queue(firstId + f.digit, f.offset, f.length)) break;
+  }
+  segments = next;
+  player.play();
+  int task = hostAddTask(1000000000ULL / rate, promptInterrupt);
+  uint32_t loops = 0;
+  for(;;) {
+    if(!player.isPlaying()) {
+      underruns += player.underruns();
+      if(next == PROMPT_LENGTH) break;
+      const Fragment &f = prompt[next++];
+      player.clear();
+      player.queue(firstId + f.digit, f.offset, f.length);
+      out.played = 0; // the interrupt only gets -1s until play() is done
+      player.play();
+      segments++;
+    } else if(!oneByOne && next < PROMPT_LENGTH) {
+      const Fragment &f = prompt[next];
+      if(player.queue(firstId + f.digit, f.offset, f.length)) next++, segments++;
+    }
+    player.refill();
+    delayMicroseconds(200); // rest of loop()
+    if(++loops % 100 == 0) delayMicroseconds(stallUs);
+  }
+  hostRemoveTask(task);
+  printf("  %-5s %-11s %5u Hz  stall %5u us  %2u segments  %u/%u samples  %u bad  %5u silent (%5.1f ms)  %u underruns\n",
+         name, oneByOne ? "one by one" : "playlist", rate, stallUs, segments, out.pos, out.length,
+         out.errors + (out.length - out.pos), out.silent, out.silent * 1000.0 / rate, underruns);
+}
+
+// what a fragment of a digit plays
+static void appendFragment(std::vector<uint8_t> &expect, const uint8_t *digit, uint32_t samples, const Fragment &f) {
+  uint32_t end = f.length ? f.offset + f.length : samples;
+  expect.insert(expect.end(), digit + f.offset, digit + end);
+}
+
+int main() {
+  // 60 s at 8 kHz and 15 s at 32 kHz: far more than fits in the nRF51's own flash
+  const uint32_t len = 480000;
+  const uint32_t rates[] = { 8000, 16000, 32000 };
+  const uint32_t stalls[] = { 0, 5000, 15000 };
+  uint8_t *data = new uint8_t[len];
+  makeAudio(data, len, 5);
+  FlashBuffer *fb = mountFresh();
+  Measure m;
+  upload(fb, 3, data, len, 1000000, m);
+
+  printf("FlashPlayer, %u byte item, 2 x %u sample buffers, SPI %u kHz\n",
+         len, FLASHPLAYER_BUFFER_SIZE, SPI.frequency() / 1000);
+  for(unsigned r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+    for(unsigned s = 0; s < sizeof(stalls) / sizeof(stalls[0]); s++) {
+      play(fb, 3, data, len, rates[r], stalls[s]);
+    }
+  }
+
+  // the samples to expect are what the encoder's own decoder makes of it
+  uint8_t *ima = new uint8_t[imaAdpcmBytes(len) + 1];
+  ImaAdpcmEncoder encoder;
+  uint32_t bytes = encoder.encode(data, len, ima);
+  bytes += encoder.finish(ima + bytes);
+  uint32_t samples = imaAdpcmSamples(bytes);
+  uint8_t *decoded = new uint8_t[samples];
+  ImaAdpcmDecoder decoder;
+  decoder.decode(ima, bytes, decoded);
+  uint64_t rawNs = upload(fb, 3, data, len, 1000000, m);
+  uint64_t imaNs = upload(fb, 4, ima, bytes, 1000000, m, FLASHBUFFER_FORMAT_IMA_ADPCM);
+  printf("IMA ADPCM, %u byte item (%.0f%%), upload %.2f s instead of %.2f s\n",
+         bytes, 100.0 * bytes / len, seconds(imaNs), seconds(rawNs));
+  for(unsigned r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+    for(unsigned s = 0; s < sizeof(stalls) / sizeof(stalls[0]); s++) {
+      play(fb, 4, decoded, samples, rates[r], stalls[s]);
+    }
+  }
+
+  // the digits 0-9: items 10-19 as PCM, 20-29 as ADPCM, 0.4 to 0.6 s at 8 kHz
+  std::vector<uint8_t> pcm, adpcm;
+  std::vector<uint8_t> digits[10], digitsDecoded[10];
+  for(uint8_t d = 0; d < 10; d++) {
+    uint32_t n = 3200 + d * 173;
+    digits[d].resize(n);
+    makeAudio(&digits[d][0], n, 20 + d);
+    upload(fb, 10 + d, &digits[d][0], n, 1000000, m);
+    ImaAdpcmEncoder digitEncoder;
+    std::vector<uint8_t> codes(imaAdpcmBytes(n) + 1);
+    uint32_t b = digitEncoder.encode(&digits[d][0], n, &codes[0]);
+    b += digitEncoder.finish(&codes[b]);
+    upload(fb, 20 + d, &codes[0], b, 1000000, m, FLASHBUFFER_FORMAT_IMA_ADPCM);
+    digitsDecoded[d].resize(imaAdpcmSamples(b));
+    ImaAdpcmDecoder digitDecoder;
+    digitDecoder.decode(&codes[0], b, &digitsDecoded[d][0]);
+  }
+  for(unsigned i = 0; i < PROMPT_LENGTH; i++) {
+    uint8_t d = prompt[i].digit;
+    appendFragment(pcm, &digits[d][0], digits[d].size(), prompt[i]);
+    appendFragment(adpcm, &digitsDecoded[d][0], digitsDecoded[d].size(), prompt[i]);
+  }
+  printf("Prompt of %u fragments of 10 digit items, %u samples, playlist of %u segments\n",
+         (unsigned)PROMPT_LENGTH, (unsigned)pcm.size(), FLASHPLAYER_PLAYLIST_SIZE);
+  const uint32_t promptRates[] = { 8000, 32000 };
+  for(unsigned r = 0; r < sizeof(promptRates) / sizeof(promptRates[0]); r++) {
+    for(unsigned s = 0; s < sizeof(stalls) / sizeof(stalls[0]); s += 2) {
+      for(int oneByOne = 0; oneByOne < 2; oneByOne++) {
+        playPrompt(fb, 10, pcm, "PCM", promptRates[r], stalls[s], oneByOne);
+        playPrompt(fb, 20, adpcm, "ADPCM", promptRates[r], stalls[s], oneByOne);
+      }
+    }
+  }
+  delete fb;
+  delete[] data;
+  delete[] ima;
+  delete[] decoded;
+  return 0;
+}
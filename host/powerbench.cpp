@@ -0,0 +1,109 @@
+// Energy per second of audio: FlashPlayer with loop() spinning on refill() (rfduinoflashplayer
+// before PlaybackScheduler), with the scheduler sleeping the CPU (WFE) between sample interrupts,
+// and with the flash in deep power-down between refill bursts as well. The emulator counts the
+// time the CPU is awake and asleep, and the time the flash spends on the bus, in standby and in
+// deep power-down; the figures below turn that into an average current for the nRF51 and the
+// flash (the speaker and the PWM output pin not included). Every sample is checked.
+// Build: see host/README.md
+
+#include "bench.h"
+#include <FlashPlayer.h>
+#include <PlaybackScheduler.h>
+
+#define ITEM_SECONDS 5
+#define ISR_NS 2000   // TIMER1 interrupt entry, nextSample() and exit at 16 MHz
+#define LOOP_NS 500   // one pass through loop() without a refill
+
+// rough datasheet figures, mA
+static const struct {
+  double cpuActive;   // nRF51 running from flash at 16 MHz
+  double cpuSleep;    // System ON idle with the 16 MHz crystal, TIMER1/2, PPI and GPIOTE running
+  double flashActive; // reading at 4 MHz
+  double flashStandby;
+  double flashDown;   // deep power-down
+} power = { 4.4, 0.6, 4.0, 0.025, 0.005 };
+
+static struct {
+  FlashPlayer *player;
+  const uint8_t *expect;
+  uint32_t length, pos, errors;
+} out;
+
+static void sampleInterrupt() {
+  hostAdvance(ISR_NS);
+  int s = out.player->nextSample();
+  if(s < 0) return;
+  if(out.player->samplesPlayed() > out.pos) {
+    if(out.pos >= out.length || s != out.expect[out.pos]) out.errors++;
+    out.pos++;
+  }
+}
+
+enum { SPIN, WFE, DEEP };
+static const char *modes[] = { "loop() spins", "WFE, flash standby", "WFE + deep power-down" };
+
+static void play(FlashBuffer *fb, uint8_t id, const uint8_t *data, uint32_t len, int mode) {
+  FlashPlayer player(*fb);
+  PlaybackScheduler scheduler(*fb, player);
+  scheduler.setDeepPowerDown(mode == DEEP);
+  out.player = &player;
+  out.expect = data;
+  out.length = len;
+  out.pos = out.errors = 0;
+  player.start(id);
+  Measure m;
+  m.begin();
+  uint64_t sleep0 = hostSleepNanos(), isr0 = hostTaskNanos(), down0 = chip.sleepNanos();
+  FlashStats stats0 = chip.stats;
+  int task = hostAddTask(1000000000ULL / player.sampleRate(), sampleInterrupt);
+  while(player.isPlaying()) {
+    if(mode == SPIN) player.refill();
+    else scheduler.run();
+    hostAdvance(LOOP_NS);
+  }
+  hostRemoveTask(task);
+  fb->powerUp(); // the next start() would wake it anyway
+  double audio = (double)len / player.sampleRate();
+  double total = m.ns() / 1e9;
+  double cpuSleep = (hostSleepNanos() - sleep0) / 1e9, cpuActive = total - cpuSleep;
+  double flashActive = m.busNs() / 1e9, flashDown = (chip.sleepNanos() - down0) / 1e9;
+  double flashStandby = total - flashActive - flashDown;
+  double mA = (cpuActive * power.cpuActive + cpuSleep * power.cpuSleep + flashActive * power.flashActive +
+               flashStandby * power.flashStandby + flashDown * power.flashDown) / total;
+  printf("  %5u Hz  %-22s  CPU %6.1f / %6.1f ms/s (ISR %5.1f)  flash %5.1f / %6.1f / %6.1f ms/s  %4u wakeups  "
+         "%5.0f uA  %u underruns  %u bad  %u+%u violations\n",
+         player.sampleRate(), modes[mode], 1000 * cpuActive / audio, 1000 * cpuSleep / audio,
+         (hostTaskNanos() - isr0) / 1e6 / audio, 1000 * flashActive / audio, 1000 * flashStandby / audio,
+         1000 * flashDown / audio, scheduler.wakeups(), mA * 1000, player.underruns(), out.errors + (len - out.pos),
+         chip.stats.sleepViolations - stats0.sleepViolations, chip.stats.wakeViolations - stats0.wakeViolations);
+  if(mode == DEEP && scheduler.wakeups() == 0) {
+    printf("    DEEP POWER-DOWN NEVER USED: wake-up, refill (longest %u us) and stall margin don't fit in a buffer\n",
+           scheduler.longestRefill());
+  }
+}
+
+int main() {
+  const uint16_t rates[] = { 8000, 16000, 32000, 48000 };
+  const unsigned n = sizeof(rates) / sizeof(rates[0]);
+  uint8_t *data[n];
+  uint32_t len[n];
+  FlashBuffer *fb = mountFresh();
+  Measure m;
+  for(unsigned r = 0; r < n; r++) {
+    len[r] = (uint32_t)rates[r] * ITEM_SECONDS;
+    data[r] = new uint8_t[len[r]];
+    makeAudio(data[r], len[r], r + 1);
+    upload(fb, r + 1, data[r], len[r], 1000000, m, FLASHBUFFER_FORMAT_PCM8 | flashBufferRateBits(rates[r]));
+  }
+  printf("FlashPlayer, 2 x %u sample buffers, SPI %u kHz, flash wake-up %u us, CPU active / asleep, "
+         "flash reading / standby / deep power-down per second of audio\n",
+         FLASHPLAYER_BUFFER_SIZE, SPI.frequency() / 1000, chip.timing.wakeNs / 1000);
+  printf("currents: CPU %.1f / %.1f mA, flash %.1f / %.3f / %.3f mA\n", power.cpuActive, power.cpuSleep,
+         power.flashActive, power.flashStandby, power.flashDown);
+  for(unsigned r = 0; r < n; r++) {
+    for(int mode = SPIN; mode <= DEEP; mode++) play(fb, r + 1, data[r], len[r], mode);
+  }
+  delete fb;
+  for(unsigned r = 0; r < n; r++) delete[] data[r];
+  return 0;
+}
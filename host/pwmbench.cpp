@@ -0,0 +1,226 @@
+// PWM output through TIMER2 + PPI + GPIOTE on the cycle model of HostNrf51.h: the engine
+// rfduinoflashplayer had (rfduino2timersaudio's: a TIMER2 interrupt every 256 tick PWM period moving
+// the edges along, a TIMER1 interrupt per sample) against PwmPlayer with 2 and 3 CC slots (one
+// interrupt per sample, or per two). Every PWM period on the pin is measured and checked against
+// the sample that should be in it: the period length, and the high time bit for bit (256 + s.. for
+// the old engine, PwmPlayer::dutyTicks(s) for PwmPlayer). Samples come from a FlashPlayer item,
+// refilled from loop(). "tones" stays within 88..167, "full scale" uses all 256 levels: a 0 puts
+// both edges of the old engine on the same cycle, they toggle the pin once and the output stays
+// inverted from there on. "masked" has loop() block interrupts for 40 us every millisecond (a BLE
+// radio event, say): the old engine has two PWM periods to move the edges on, PwmPlayer a sample
+// period to refill its slots.
+// Build: see host/README.md
+
+#include "bench.h"
+#include <FlashPlayer.h>
+#include <PwmPlayer.h>
+#include <SampleClock.h>
+
+#include <vector>
+
+#define PWM_PIN 3
+#define ITEM_SECONDS 2
+#define LOOP_NS 500
+#define MASK_NS 40000 // "masked": interrupts off this long every millisecond
+#define OLD_PERIOD 256
+
+static FlashPlayer *player;
+static std::vector<uint8_t> expect;   // the sample of every period (old engine) or every sample (PwmPlayer)
+static std::vector<uint32_t> highs, periods;
+static uint64_t lastRise;
+static uint8_t held;
+
+static void trace(uint8_t pin, uint8_t level, uint64_t tick) {
+  if(pin != PWM_PIN) return;
+  if(level) {
+    if(lastRise) periods.push_back(tick - lastRise);
+    lastRise = tick;
+  } else if(lastRise) {
+    highs.push_back(tick - lastRise);
+  }
+}
+
+static void resetTrace() {
+  expect.clear();
+  highs.clear();
+  periods.clear();
+  lastRise = 0;
+  held = 128;
+}
+
+static int nextSample() {
+  int s = player->nextSample();
+  if(s >= 0) held = s;
+  return s;
+}
+
+// PwmPlayer's source: every sample it loads goes into a slot
+static int pwmSample() {
+  int s = nextSample();
+  expect.push_back(held);
+  return s;
+}
+
+// --- rfduinoflashplayer before PwmPlayer -------------------------------------------------------
+
+static uint32_t lastCc0, lastCc2;
+static bool cc0Turn;
+static volatile uint32_t sampleVal;
+
+static void oldTimer2() {
+  if(NRF_TIMER2->EVENTS_COMPARE[1] != 0 && (NRF_TIMER2->INTENSET & TIMER_INTENSET_COMPARE1_Msk) != 0) {
+    NRF_TIMER2->EVENTS_COMPARE[1] = 0;
+    NRF_TIMER2->CC[1] = NRF_TIMER2->CC[1] + OLD_PERIOD;
+    uint32_t next = sampleVal;
+    if(cc0Turn) {
+      NRF_TIMER2->CC[0] = NRF_TIMER2->CC[0] - lastCc0 + 2 * OLD_PERIOD + next;
+      lastCc0 = next;
+    } else {
+      NRF_TIMER2->CC[2] = NRF_TIMER2->CC[2] - lastCc2 + 2 * OLD_PERIOD + next;
+      lastCc2 = next;
+    }
+    cc0Turn = !cc0Turn;
+    expect.push_back(next); // the period after the next one
+  }
+}
+
+static void oldTimer1() {
+  NRF_TIMER1->EVENTS_COMPARE[0] = 0;
+  if(nextSample() >= 0) sampleVal = held;
+}
+
+static void oldStart(uint32_t rate) {
+  nrf_gpiote_task_config(0, PWM_PIN, NRF_GPIOTE_POLARITY_TOGGLE, NRF_GPIOTE_INITIAL_VALUE_LOW);
+  NRF_PPI->CH[0].EEP = (uint32_t)&NRF_TIMER2->EVENTS_COMPARE[0];
+  NRF_PPI->CH[0].TEP = (uint32_t)&NRF_GPIOTE->TASKS_OUT[0];
+  NRF_PPI->CH[1].EEP = (uint32_t)&NRF_TIMER2->EVENTS_COMPARE[1];
+  NRF_PPI->CH[1].TEP = (uint32_t)&NRF_GPIOTE->TASKS_OUT[0];
+  NRF_PPI->CH[2].EEP = (uint32_t)&NRF_TIMER2->EVENTS_COMPARE[2];
+  NRF_PPI->CH[2].TEP = (uint32_t)&NRF_GPIOTE->TASKS_OUT[0];
+  NRF_PPI->CHEN = 7;
+  NRF_TIMER2->MODE = TIMER_MODE_MODE_Timer;
+  NRF_TIMER2->BITMODE = TIMER_BITMODE_BITMODE_16Bit;
+  NRF_TIMER2->PRESCALER = 0;
+  NRF_TIMER2->SHORTS = 0;
+  NRF_TIMER2->TASKS_CLEAR = 1;
+  sampleVal = held;
+  lastCc0 = sampleVal;
+  lastCc2 = 0;
+  cc0Turn = false;
+  expect.push_back(sampleVal); // the first period
+  NRF_TIMER2->CC[0] = OLD_PERIOD + lastCc0;
+  NRF_TIMER2->CC[1] = OLD_PERIOD;
+  NRF_TIMER2->CC[2] = 0;
+  NRF_TIMER2->EVENTS_COMPARE[1] = 0; // the sketch starts from reset, the bench after other runs
+  NRF_TIMER2->INTENSET = TIMER_INTENSET_COMPARE1_Enabled << TIMER_INTENSET_COMPARE1_Pos;
+  attachInterrupt(TIMER2_IRQn, oldTimer2);
+  NRF_TIMER2->TASKS_START = 1;
+  SampleClock clock = sampleClockFor(rate);
+  NRF_TIMER1->MODE = TIMER_MODE_MODE_Timer;
+  NRF_TIMER1->BITMODE = TIMER_BITMODE_BITMODE_16Bit;
+  NRF_TIMER1->PRESCALER = clock.prescaler;
+  NRF_TIMER1->TASKS_CLEAR = 1;
+  NRF_TIMER1->CC[0] = clock.compare;
+  NRF_TIMER1->EVENTS_COMPARE[0] = 0;
+  NRF_TIMER1->INTENSET = TIMER_INTENSET_COMPARE0_Enabled << TIMER_INTENSET_COMPARE0_Pos;
+  NRF_TIMER1->SHORTS = TIMER_SHORTS_COMPARE0_CLEAR_Enabled << TIMER_SHORTS_COMPARE0_CLEAR_Pos;
+  attachInterrupt(TIMER1_IRQn, oldTimer1);
+  NRF_TIMER1->TASKS_START = 1;
+}
+
+static void oldStop() {
+  NRF_TIMER1->TASKS_STOP = 1;
+  NRF_TIMER2->TASKS_STOP = 1;
+  NRF_TIMER1->INTENCLR = 0xFFFFFFFF;
+  NRF_TIMER2->INTENCLR = 0xFFFFFFFF;
+  NRF_PPI->CHEN = 0;
+  nrf_gpiote_task_config(0, PWM_PIN, NRF_GPIOTE_POLARITY_TOGGLE, NRF_GPIOTE_INITIAL_VALUE_LOW);
+}
+
+// -----------------------------------------------------------------------------------------------
+
+static const char *engines[] = { "ISR per PWM period", "PwmPlayer, 2 slots", "PwmPlayer, 3 slots" };
+
+static void play(uint8_t id, const char *name, int engine, boolean masked = false) {
+  resetTrace();
+  player->start(id);
+  uint32_t rate = player->sampleRate();
+  PwmPlayer pwm(PWM_PIN, pwmSample, engine + 1);
+  uint64_t isr0 = hostTaskNanos(), t0 = hostNanos();
+  uint32_t irq0 = hostInterrupts(TIMER1_IRQn) + hostInterrupts(TIMER2_IRQn);
+  if(engine == 0) oldStart(rate);
+  else pwm.start(rate);
+  uint64_t nextMask = hostNanos() + 1000000;
+  while(player->isPlaying()) {
+    player->refill();
+    hostAdvance(LOOP_NS);
+    if(masked && hostNanos() >= nextMask) {
+      noInterrupts();
+      hostAdvance(MASK_NS);
+      interrupts();
+      nextMask += 1000000;
+    }
+  }
+  if(engine == 0) oldStop();
+  else pwm.stop();
+  double audio = (hostNanos() - t0) / 1e9;
+  uint32_t irqs = hostInterrupts(TIMER1_IRQn) + hostInterrupts(TIMER2_IRQn) - irq0;
+
+  // the old engine logs one sample per period, PwmPlayer one per periodsPerSample periods
+  PwmTiming timing = { OLD_PERIOD, 1 };
+  uint32_t outRate = sampleClockRate(sampleClockFor(rate));
+  if(engine) {
+    timing = pwm.timing();
+    outRate = pwmTimingRate(timing);
+  }
+  // the last periods may have been cut short by stop(); PwmPlayer's period 0 starts when the pin is
+  // configured, before the timer runs
+  uint32_t checked = 0, bad = 0;
+  for(size_t p = engine ? 1 : 0; p + 2 < highs.size(); p++) {
+    size_t s = engine ? p / timing.periodsPerSample : p;
+    if(s >= expect.size()) break;
+    uint32_t want = engine ? pwm.dutyTicks(expect[s]) : expect[s];
+    if(highs[p] != want || periods[p] != timing.period) bad++;
+    checked++;
+  }
+  printf("  %-10s %5u Hz  %-19s  carrier %5.1f kHz  %2u x %3u ticks  plays %5u Hz  %6.0f interrupts/s  "
+         "ISR %5.1f ms/s  %7u periods, %u bad  %u underruns\n",
+         name, rate, engines[engine], 16000.0 / timing.period, timing.periodsPerSample, timing.period, outRate,
+         irqs / audio, (hostTaskNanos() - isr0) / 1e6 / audio, checked, bad, player->underruns());
+}
+
+int main() {
+  const uint16_t rates[] = { 8000, 16000, 22050, 32000, 44100 };
+  const unsigned n = sizeof(rates) / sizeof(rates[0]);
+  FlashBuffer *fb = mountFresh();
+  Measure m;
+  for(unsigned r = 0; r <= n; r++) {
+    uint16_t rate = r < n ? rates[r] : 8000;
+    uint32_t len = (uint32_t)rate * ITEM_SECONDS;
+    uint8_t *data = new uint8_t[len];
+    if(r < n) {
+      makeAudio(data, len, r + 1);
+    } else {
+      uint32_t x = 1;
+      for(uint32_t i = 0; i < len; i++) {
+        x = x * 1103515245u + 12345u;
+        data[i] = i < 512 ? i : x >> 24; // every level in turn, then noise
+      }
+    }
+    upload(fb, r + 1, data, len, 1000000, m, FLASHBUFFER_FORMAT_PCM8 | flashBufferRateBits(rate));
+    delete[] data;
+  }
+  printf("PWM on pin %u, TIMER2 at 16 MHz, interrupts taken after %u ns + the handler\n", PWM_PIN,
+         hostCosts.interruptNs);
+  hostSetPinTrace(trace);
+  player = new FlashPlayer(*fb);
+  for(unsigned r = 0; r <= n; r++) {
+    for(int engine = 0; engine < 3; engine++) play(r + 1, r < n ? "tones" : "full scale", engine);
+  }
+  for(unsigned r = 0; r < 2; r++) {
+    for(int engine = 0; engine < 3; engine++) play(r + 1, "masked", engine, true);
+  }
+  delete player;
+  delete fb;
+  return 0;
+}
@@ -0,0 +1,71 @@
+// Flash read bandwidth per read command and SPI clock: SPIFlash detects each emulated chip
+// through JEDEC ID and SFDP, picks its read for the data lines wired (0x03/0x0B on MOSI/MISO,
+// 0x3B/0xBB with 2 lines, 0x6B/0xEB with 4) and reads 256 KB back in bursts of 256, 32 and 6
+// bytes (whole pages, FlashPlayer-sized and DAC-friendly reads, see FlashBuffer::setMaxBurst()).
+// Every byte is checked. "voices" is how many 8 bit 32 kHz streams the bandwidth would feed.
+// The nRF51 master has one data line and runs up to 8 MHz: more lines and faster clocks show
+// what a dual/quad capable master would get out of the same chip.
+// Build: see host/README.md
+
+#include <SPI.h>
+#include <SPIFlash.h>
+#include <HostEmulator.h>
+#include <FlashChip.h>
+
+#define OLD_CS_PIN 2
+#define W25Q_CS_PIN 4
+#define TOTAL (256UL * 1024)
+
+// the 0x140 part FlashBuffer has used so far (no SFDP), and a W25Q80 style chip with all the fast reads
+static FlashChip old(OLD_CS_PIN);
+static FlashChip w25q(W25Q_CS_PIN, 1UL << 20, 0xEF4014);
+
+static double readAll(SPIFlash &flash, FlashChip &chip, uint16_t burst, uint32_t &bad) {
+  static uint8_t buf[256];
+  uint64_t start = hostNanos();
+  for(uint32_t addr = 0; addr < TOTAL; addr += burst) {
+    uint16_t n = TOTAL - addr < burst ? TOTAL - addr : burst;
+    flash.readBytes(addr, buf, n);
+    for(uint16_t i = 0; i < n; i++) {
+      if(buf[i] != chip.memory()[addr + i]) bad++;
+    }
+  }
+  return TOTAL / 1024.0 / ((hostNanos() - start) / 1e9);
+}
+
+static void run(const char *name, FlashChip &chip, uint8_t cs, uint8_t lines) {
+  const uint16_t clocks[] = { 4000, 8000, 16000, 32000 };
+  const uint16_t bursts[] = { 256, 32, 6 };
+  SPIFlash flash(cs);
+  flash.setDataLines(lines);
+  for(unsigned c = 0; c < sizeof(clocks) / sizeof(clocks[0]); c++) {
+    flash.setClock(clocks[c]);
+    flash.initialize();
+    if(c == 0) {
+      printf("%s, %u data line%s: JEDEC %06X, %s, capacity %u KB\n", name, lines, lines > 1 ? "s" : "",
+             flash.readJedecId(), flash.capacity() ? "SFDP" : "no SFDP", flash.capacity() / 1024);
+    }
+    SPIFlashRead read = flash.readMode();
+    printf("  %5u kHz  0x%02X %u-%u-%u %u dummy  ", clocks[c], read.opcode, 1, read.addressLines, read.dataLines,
+           read.dummyBytes);
+    uint32_t bad = 0, lineErrors = chip.stats.lineErrors;
+    for(unsigned b = 0; b < sizeof(bursts) / sizeof(bursts[0]); b++) {
+      double kbs = readAll(flash, chip, bursts[b], bad);
+      printf("  %3u B: %6.1f KB/s %3u voices", bursts[b], kbs, (unsigned)(kbs * 1024 / 32000));
+    }
+    printf("  %u bad, %u line errors\n", bad, chip.stats.lineErrors - lineErrors);
+  }
+}
+
+int main() {
+  // something other than the erased state to read back
+  for(uint32_t i = 0; i < TOTAL; i++) old.memory()[i] = w25q.memory()[i] = (i * 7 + (i >> 8)) & 0xFF;
+  w25q.fastReads = FLASHCHIP_READ_ALL;
+  run("01 40 14", old, OLD_CS_PIN, 1);
+  run("EF 40 14 (W25Q80)", w25q, W25Q_CS_PIN, 1);
+  run("EF 40 14 (W25Q80)", w25q, W25Q_CS_PIN, 2);
+  run("EF 40 14 (W25Q80)", w25q, W25Q_CS_PIN, 4);
+  w25q.fastReads = FLASHCHIP_READ_112 | FLASHCHIP_READ_114;
+  run("EF 40 14, output reads only", w25q, W25Q_CS_PIN, 4);
+  return 0;
+}
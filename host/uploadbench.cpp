@@ -0,0 +1,164 @@
+// Upload throughput of the windowed protocol: runs the real serialcomtest
+// sketch against UploadSender (the app.js logic) over an emulated serial
+// line in both directions, with USB latency and optional byte errors, and
+// reads the item back from the emulated flash afterwards. Two receive paths:
+// the sketch's UploadUart (the UART interrupt drains the FIFO into the
+// receiver) and the Serial one it had before (the core's interrupt fills a
+// 64 byte buffer, serialEvent() empties it after every loop()), each also
+// with loop() busy elsewhere for 2 ms every 20 ms.
+// Build: see host/README.md
+
+#include "bench.h"
+#include "UploadSender.h"
+// prototypes the Arduino IDE would generate for the sketch
+void resume();
+#include "../serialcomtest/serialcomtest.ino"
+#include <deque>
+#include <utility>
+
+#define SERIAL_BUFFER_SIZE 64 // the core's receive buffer behind Serial
+#define BUSY_NS 2000000        // "busy": loop() is elsewhere this long...
+#define BUSY_EVERY_NS 20000000 // ...this often
+
+// bytes on the wire, with the time they can be taken off it
+typedef std::deque<std::pair<uint64_t, uint8_t> > Line;
+
+static struct {
+  uint32_t baud;
+  uint64_t byteNs, latencyNs;
+  Line toDevice, toHost;
+  uint64_t toDeviceFree, toHostFree; // when the transmitter is idle again
+  uint32_t errorEvery;               // corrupt about one byte in this many, 0: none
+  uint32_t noise, corrupted;
+  boolean serialPath;                // Serial + serialEvent() instead of UploadUart
+  uint32_t serialDrops;              // bytes the full Serial buffer lost
+  UploadSender *sender;
+} link;
+
+static void queueBytes(Line &line, uint64_t &free, const uint8_t *data, size_t len) {
+  uint64_t t = hostNanos() + link.latencyNs;
+  if(free > t) t = free;
+  for(size_t i = 0; i < len; i++) {
+    t += link.byteNs;
+    line.push_back(std::make_pair(t, data[i]));
+  }
+  free = t;
+}
+
+static uint8_t maybeCorrupt(uint8_t b) {
+  if(!link.errorEvery) return b;
+  link.noise = link.noise * 1103515245u + 12345u;
+  if((link.noise >> 8) % link.errorEvery) return b;
+  link.corrupted++;
+  return b ^ (1 << (link.noise >> 28 & 7));
+}
+
+// the byte on the device's RXD pin
+static void deviceRx() {
+  if(link.toDevice.empty() || link.toDevice.front().first > hostNanos()) return;
+  uint8_t b = maybeCorrupt(link.toDevice.front().second);
+  link.toDevice.pop_front();
+  if(!link.serialPath) hostUartInput(&b, 1);
+  else if(Serial.available() < SERIAL_BUFFER_SIZE) hostSerialInput(&b, 1); // the core's UART interrupt
+  else link.serialDrops++;
+}
+
+static void deviceTx(uint8_t b) {
+  b = maybeCorrupt(b);
+  queueBytes(link.toHost, link.toHostFree, &b, 1);
+}
+
+// the PC: takes what arrived, sends what the window allows
+static void pc() {
+  uint64_t now = hostNanos();
+  while(!link.toHost.empty() && link.toHost.front().first <= now) {
+    link.sender->receive(link.toHost.front().second, now);
+    link.toHost.pop_front();
+  }
+  std::vector<uint8_t> tx;
+  link.sender->poll(now, tx);
+  if(!tx.empty()) queueBytes(link.toDevice, link.toDeviceFree, &tx[0], tx.size());
+}
+
+static void run(const uint8_t *data, uint32_t len, uint32_t baud, uint32_t errorEvery, boolean serialPath,
+                boolean busy) {
+  chip.eraseAll();
+  chip.resetStats();
+  hostResetClock();
+  link.baud = baud;
+  link.byteNs = 10000000000ULL / baud;
+  link.latencyNs = 1000000; // USB serial adapters poll every ms
+  link.toDevice.clear();
+  link.toHost.clear();
+  link.toDeviceFree = link.toHostFree = 0;
+  link.errorEvery = errorEvery;
+  link.noise = 1;
+  link.corrupted = 0;
+  link.serialPath = serialPath;
+  link.serialDrops = 0;
+  while(Serial.available()) Serial.read();
+  UploadSender sender(3, data, len);
+  link.sender = &sender;
+  hostSetSerialOutput(deviceTx);
+  hostSetUartOutput(deviceTx);
+  setup();
+  if(serialPath) uploadUart.end(); // acks through Serial.write()
+  else uploadUart.begin(baud);
+  uint32_t overruns0 = hostUartOverruns();
+  int rx = hostAddTask(link.byteNs, deviceRx);
+  int host = hostAddTask(100000, pc);
+  uint64_t nextBusy = BUSY_EVERY_NS;
+  while(!sender.finished() && hostNanos() < 600000000000ULL) {
+    loop();
+    delayMicroseconds(10); // rest of loop()
+    if(busy && hostNanos() >= nextBusy) {
+      hostAdvance(BUSY_NS);
+      nextBusy += BUSY_EVERY_NS;
+    }
+    if(serialPath) { // what the core does after every loop() when bytes are waiting: serialEvent()
+      while(Serial.available()) receiver.receive(Serial.read());
+    }
+  }
+  uint64_t ns = hostNanos();
+  hostRemoveTask(rx);
+  hostRemoveTask(host);
+  hostSetSerialOutput(0);
+  hostSetUartOutput(0);
+  uint32_t lost = serialPath ? link.serialDrops : hostUartOverruns() - overruns0;
+
+  ItemCursor cursor;
+  uint32_t bad = len;
+  if(flashBuffer->openItem(3, cursor) && cursor.remaining == len) {
+    bad = 0;
+    uint8_t page[256];
+    for(uint32_t i = 0; i < len;) {
+      uint16_t n = flashBuffer->readItemBytes(cursor, page, sizeof(page));
+      for(uint16_t j = 0; j < n; j++) if(page[j] != data[i + j]) bad++;
+      i += n;
+    }
+  }
+  printf("  %-7s %-4s %7u baud  1/%-6u %7.1f s  %6.1f KB/s  %3.0f%% of line rate  %5u frames %4u resent %3u nacks %2u timeouts  %3u corrupted %5u lost  %u bad bytes\n",
+         serialPath ? "Serial" : "UART", busy ? "busy" : "", baud, errorEvery, seconds(ns), len / 1024.0 / seconds(ns),
+         100.0 * len * 10 / baud / seconds(ns), sender.framesSent, sender.resentFrames, sender.nacks, sender.timeouts,
+         link.corrupted, lost, bad);
+  delete flashBuffer;
+}
+
+int main() {
+  // a sound bank: about 60 s of 8 kHz audio
+  const uint32_t len = 500000;
+  uint8_t *data = new uint8_t[len];
+  makeAudio(data, len, 9);
+  printf("windowed upload of %u bytes, %u byte frames, window %u frames, 1 ms USB latency; "
+         "lost: bytes the full Serial buffer or UART FIFO dropped\n", len, UPLOAD_FRAME_PAYLOAD, UPLOAD_WINDOW);
+  const uint32_t bauds[] = { 57600, 115200, 1000000 };
+  for(int serialPath = 1; serialPath >= 0; serialPath--) {
+    for(int busy = 0; busy < 2; busy++) {
+      for(unsigned b = 0; b < sizeof(bauds) / sizeof(bauds[0]); b++) run(data, len, bauds[b], 0, serialPath, busy);
+    }
+    run(data, len, 57600, 20000, serialPath, false);
+    run(data, len, 115200, 5000, serialPath, false);
+  }
+  delete[] data;
+  return 0;
+}
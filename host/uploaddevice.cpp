@@ -0,0 +1,174 @@
+// The serialcomtest sketch on the emulated chip behind a pty, for ./uploader (or app.js) to talk
+// to on Linux. The virtual clock is held to the wall clock: the bytes written to the pty reach
+// the sketch's UART one frame time apart at the baud rate, and its answers go back with the same
+// pacing, so the uploader sees the line rate and the flash timing of the real board.
+// Every stored item is listed with its device side figures: time from the begin frame to the
+// 'F', the share of that the receive line was busy and bad frames; at the end every item on the
+// chip is read back and checked against its CRC (not earlier, the reads would hold up the line).
+// Build: see host/README.md
+//
+//   ./uploaddevice [-b baud] [-l link]      prints the pty to pass to ./uploader; ^C ends it
+
+#include "bench.h"
+// prototypes the Arduino IDE would generate for the sketch
+void resume();
+#include "../serialcomtest/serialcomtest.ino"
+
+#include <deque>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define AHEAD_NS 1000000ULL // the virtual clock may run this far ahead of the wall clock
+
+static struct {
+  int fd;
+  uint64_t byteNs;
+  std::deque<uint8_t> toDevice;                      // read from the pty, not on the "wire" yet
+  std::deque<std::pair<uint64_t, uint8_t> > toHost;  // answers, with the time they are through
+  uint64_t toHostFree;
+  uint64_t rxBytes;
+} line;
+
+static volatile sig_atomic_t quit;
+
+static void onSignal(int) {
+  quit = 1;
+}
+
+static uint64_t wallNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// the byte on the RXD pin, once per frame time
+static void deviceRx() {
+  if(line.toDevice.empty()) return;
+  uint8_t b = line.toDevice.front();
+  line.toDevice.pop_front();
+  line.rxBytes++;
+  hostUartInput(&b, 1);
+}
+
+static void deviceTx(uint8_t b) {
+  uint64_t t = hostNanos() > line.toHostFree ? hostNanos() : line.toHostFree;
+  line.toHostFree = t + line.byteNs;
+  line.toHost.push_back(std::make_pair(line.toHostFree, b));
+}
+
+// moves bytes between the pty and the emulated line
+static void pump() {
+  uint8_t buf[4096];
+  ssize_t n;
+  while(line.toDevice.size() < 65536 && (n = read(line.fd, buf, sizeof(buf))) > 0) {
+    line.toDevice.insert(line.toDevice.end(), buf, buf + n);
+  }
+  uint8_t out[256];
+  size_t len = 0;
+  while(len < sizeof(out) && !line.toHost.empty() && line.toHost.front().first <= hostNanos()) {
+    out[len++] = line.toHost.front().second;
+    line.toHost.pop_front();
+  }
+  if(len) (void)write(line.fd, out, len);
+}
+
+static int openPty(const char *link) {
+  int fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if(fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0) {
+    perror("pty");
+    return -1;
+  }
+  const char *name = ptsname(fd);
+  // the slave stays open here too: raw from the start, and no hangup when the uploader closes it
+  int slave = open(name, O_RDWR | O_NOCTTY);
+  struct termios tio;
+  if(slave < 0 || tcgetattr(slave, &tio) != 0) {
+    perror(name);
+    return -1;
+  }
+  cfmakeraw(&tio);
+  tcsetattr(slave, TCSANOW, &tio);
+  if(link) {
+    unlink(link);
+    if(symlink(name, link) != 0) {
+      perror(link);
+      return -1;
+    }
+  }
+  printf("serialcomtest on %s%s%s\n", name, link ? " = " : "", link ? link : "");
+  fflush(stdout);
+  return fd;
+}
+
+int main(int argc, char **argv) {
+  uint32_t baud = 57600;
+  const char *link = 0;
+  int opt;
+  while((opt = getopt(argc, argv, "b:l:")) != -1) {
+    if(opt == 'b') baud = atoi(optarg);
+    else if(opt == 'l') link = optarg;
+    else {
+      fprintf(stderr, "usage: %s [-b baud] [-l link]\n"
+                      "  -b baud  line rate (default 57600)\n"
+                      "  -l link  symlink to the pty\n", argv[0]);
+      return 1;
+    }
+  }
+  line.fd = openPty(link);
+  if(line.fd < 0) return 1;
+  line.byteNs = 10000000000ULL / baud;
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+
+  chip.eraseAll();
+  hostResetClock();
+  hostSetUartOutput(deviceTx);
+  setup();
+  uploadUart.begin(baud);
+  int rx = hostAddTask(line.byteNs, deviceRx);
+  uint64_t wall0 = wallNs(), itemStart = 0, itemRx = 0;
+  uint32_t bad0 = 0;
+  boolean started = false;
+  while(!quit) {
+    loop();
+    delayMicroseconds(10); // rest of loop()
+    pump();
+    if(receiver.itemStarted() != started) {
+      started = receiver.itemStarted();
+      if(started) {
+        itemStart = hostNanos();
+        itemRx = line.rxBytes;
+        bad0 = receiver.badFrames();
+      } else {
+        uint8_t id = receiver.itemId();
+        double s = seconds(hostNanos() - itemStart);
+        printf("item %3u: %8lu bytes  %7.2f s  line busy %3.0f%%  %3u bad frames\n", id,
+               (unsigned long)flashBuffer->getItemLength(id), s,
+               100.0 * (line.rxBytes - itemRx) * line.byteNs / 1e9 / s, receiver.badFrames() - bad0);
+        fflush(stdout);
+      }
+    }
+    // hold the virtual clock to the wall clock
+    uint64_t wall = wallNs() - wall0;
+    if(hostNanos() > wall + AHEAD_NS) {
+      struct pollfd pfd = { line.fd, POLLIN, 0 };
+      poll(&pfd, 1, (hostNanos() - wall) / 1000000);
+    }
+  }
+  hostRemoveTask(rx);
+  hostSetUartOutput(0);
+  static const char *checks[] = { "CRC ok", "CRC BAD", "no CRC" };
+  for(uint8_t id = 0; id < 0x7F; id++) {
+    if(flashBuffer->getItemLength(id)) printf("item %3u: %s\n", id, checks[flashBuffer->verifyItem(id)]);
+  }
+  printf("%u items, %lu of %lu pages programmed, %u bytes lost in UART overruns\n", flashBuffer->itemCount(),
+         (unsigned long)(flashBuffer->bytesProgrammed() / FLASHBUFFER_PAGE_SIZE),
+         (unsigned long)(FLASHBUFFER_CAPACITY / FLASHBUFFER_PAGE_SIZE), hostUartOverruns());
+  if(link) unlink(link);
+  return 0;
+}
@@ -0,0 +1,305 @@
+// Uploads items to serialcomtest over a serial port, in place of app.js. Each file is mapped
+// into memory and sent with UploadSender.h (the windowed protocol of SerialUpload.h): whatever
+// the credits allow goes out in one write(), and the items follow each other on the open port,
+// the next begin frame right after the 'F' of the one before. Per item and for the session it
+// prints the throughput against the line rate, the time the line stood idle because the device
+// held back credits (stalls), the wait for the last pages after the last frame, and the resends.
+// Opening the port resets the RFduino (DTR), so the first frame only goes out once the bootloader
+// and setup() have had time to finish (-w, what the board says meanwhile is dropped).
+// Build: see host/README.md
+//
+//   ./uploader [-b baud] [-w ms] port file:id[:pcm8|adpcm[:rate]] ...
+//
+// Without a board, ./uploaddevice runs the sketch on the emulated chip behind a pty (-w 0).
+
+#include "UploadSender.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define GIVE_UP_NS 10000000000ULL // nothing heard from the device for this long
+#define SETTLE_MS 2000             // default wait after opening the port (board reset)
+
+struct Item {
+  std::string file;
+  uint8_t id, format;
+  const uint8_t *data;
+  uint32_t length;
+};
+
+struct Stats {
+  uint64_t bytes, wireBytes, ns;
+  uint32_t frames, resent, nacks, timeouts, badFrames;
+  uint32_t stalls;
+  uint64_t stallNs, longestStallNs, tailNs;
+};
+
+static uint64_t nowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static speed_t speedFor(uint32_t baud) {
+  switch(baud) {
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+    case 460800: return B460800;
+    case 500000: return B500000;
+    case 921600: return B921600;
+    case 1000000: return B1000000;
+    case 2000000: return B2000000;
+    default: return 0;
+  }
+}
+
+static int openPort(const char *path, uint32_t baud) {
+  int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if(fd < 0) {
+    perror(path);
+    return -1;
+  }
+  struct termios tio;
+  if(tcgetattr(fd, &tio) != 0) {
+    perror(path);
+    close(fd);
+    return -1;
+  }
+  cfmakeraw(&tio);
+  tio.c_cflag |= CLOCAL | CREAD;
+  cfsetispeed(&tio, speedFor(baud));
+  cfsetospeed(&tio, speedFor(baud));
+  if(tcsetattr(fd, TCSANOW, &tio) != 0) {
+    perror(path);
+    close(fd);
+    return -1;
+  }
+  tcflush(fd, TCIOFLUSH);
+  return fd;
+}
+
+// file:id[:pcm8|adpcm[:rate]]
+static bool parseItem(const char *arg, Item &item) {
+  std::string s(arg);
+  size_t colon = s.find(':');
+  if(colon == std::string::npos) return false;
+  item.file = s.substr(0, colon);
+  s = s.substr(colon + 1);
+  char *end;
+  long id = strtol(s.c_str(), &end, 10);
+  if(end == s.c_str() || id < 0 || id >= 0x7F) return false; // 0x7F is the index record
+  item.id = id;
+  item.format = FLASHBUFFER_FORMAT_PCM8;
+  if(*end == 0) return true;
+  if(*end++ != ':') return false;
+  std::string coding(end), rate;
+  colon = coding.find(':');
+  if(colon != std::string::npos) {
+    rate = coding.substr(colon + 1);
+    coding = coding.substr(0, colon);
+  }
+  if(coding == "adpcm") item.format = FLASHBUFFER_FORMAT_IMA_ADPCM;
+  else if(coding != "pcm8") return false;
+  if(!rate.empty()) {
+    uint16_t hz = atoi(rate.c_str());
+    uint8_t bits = flashBufferRateBits(hz);
+    if(flashBufferSampleRate(bits) != hz) return false;
+    item.format |= bits;
+  }
+  return true;
+}
+
+static bool mapItem(Item &item) {
+  int fd = open(item.file.c_str(), O_RDONLY);
+  struct stat st;
+  if(fd < 0 || fstat(fd, &st) != 0) {
+    perror(item.file.c_str());
+    if(fd >= 0) close(fd);
+    return false;
+  }
+  if(st.st_size == 0 || st.st_size > 0xFFFFFF) {
+    fprintf(stderr, "%s: %lld bytes, an item holds 1 to 16777215\n", item.file.c_str(), (long long)st.st_size);
+    close(fd);
+    return false;
+  }
+  void *p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(p == MAP_FAILED) {
+    perror(item.file.c_str());
+    return false;
+  }
+  madvise(p, st.st_size, MADV_SEQUENTIAL);
+  item.data = (const uint8_t *)p;
+  item.length = st.st_size;
+  return true;
+}
+
+// Sends one item; false when the device stopped answering. The line is taken as busy until the
+// bytes written so far have gone out at the baud rate: a stall is the time it stands idle while
+// the sender waits for credits.
+static bool upload(int fd, const Item &item, uint32_t baud, Stats &st) {
+  UploadSender sender(item.id, item.data, item.length, item.format);
+  const uint64_t byteNs = 10000000000ULL / baud;
+  std::vector<uint8_t> tx;
+  size_t txPos = 0;
+  uint64_t start = nowNs(), lastHeard = start, lineFree = start, stallStart = 0;
+  uint8_t rx[256];
+  memset(&st, 0, sizeof(st));
+  while(!sender.finished()) {
+    if(sender.rejected()) {
+      fprintf(stderr, "item %u: the device rejected the id\n", item.id);
+      return false;
+    }
+    uint64_t now = nowNs();
+    if(txPos == tx.size()) {
+      tx.clear();
+      txPos = 0;
+    }
+    size_t before = tx.size();
+    sender.poll(now, tx);
+    if(tx.size() > before && stallStart) {
+      uint64_t from = stallStart > lineFree ? stallStart : lineFree;
+      if(now > from) {
+        st.stalls++;
+        st.stallNs += now - from;
+        if(now - from > st.longestStallNs) st.longestStallNs = now - from;
+      }
+      stallStart = 0;
+    }
+    if(!stallStart && sender.waitingForCredits()) stallStart = now;
+    if(txPos < tx.size()) {
+      ssize_t n = write(fd, &tx[txPos], tx.size() - txPos);
+      if(n < 0 && errno != EAGAIN && errno != EINTR) {
+        perror("write");
+        return false;
+      }
+      if(n > 0) {
+        txPos += n;
+        st.wireBytes += n;
+        lineFree = (lineFree > now ? lineFree : now) + n * byteNs;
+      }
+    }
+    struct pollfd pfd = { fd, (short)(POLLIN | (txPos < tx.size() ? POLLOUT : 0)), 0 };
+    if(poll(&pfd, 1, 5) < 0 && errno != EINTR) {
+      perror("poll");
+      return false;
+    }
+    if(pfd.revents & POLLIN) {
+      ssize_t n = read(fd, rx, sizeof(rx));
+      if(n > 0) {
+        now = nowNs();
+        lastHeard = now;
+        for(ssize_t i = 0; i < n; i++) sender.receive(rx[i], now);
+      }
+    }
+    if(nowNs() - lastHeard > GIVE_UP_NS) {
+      fprintf(stderr, "item %u: no answer from the device\n", item.id);
+      return false;
+    }
+  }
+  uint64_t end = nowNs();
+  st.bytes = item.length;
+  st.ns = end - start;
+  st.tailNs = end > lineFree ? end - lineFree : 0;
+  st.frames = sender.framesSent;
+  st.resent = sender.resentFrames;
+  st.nacks = sender.nacks;
+  st.timeouts = sender.timeouts;
+  st.badFrames = sender.badFrames;
+  return true;
+}
+
+static void printStats(const char *what, const Stats &st, uint32_t baud) {
+  double s = st.ns / 1e9;
+  printf("%-24s %8llu bytes %7.2f s %7.2f KB/s  line %3.0f%% (%3.0f%% with framing)  %5u frames %3u resent %3u nacks "
+         "%2u timeouts %2u bad  %4u stalls %7.1f ms (longest %5.1f ms)  last pages %5.1f ms\n",
+         what, (unsigned long long)st.bytes, s, st.bytes / 1024.0 / s, 100.0 * st.bytes * 10 / baud / s,
+         100.0 * st.wireBytes * 10 / baud / s, st.frames, st.resent, st.nacks, st.timeouts, st.badFrames, st.stalls,
+         st.stallNs / 1e6, st.longestStallNs / 1e6, st.tailNs / 1e6);
+}
+
+static void usage(const char *self) {
+  fprintf(stderr, "usage: %s [-b baud] [-w ms] port file:id[:pcm8|adpcm[:rate]] ...\n"
+                  "  -b baud  line rate (default 57600)\n"
+                  "  -w ms    wait after opening the port, for the board to come out of reset (default %u)\n"
+                  "  id       0-126; rate one of 8000, 11025, 12000, 16000, 22050, 24000, 32000, 44100, 48000\n",
+          self, SETTLE_MS);
+}
+
+int main(int argc, char **argv) {
+  uint32_t baud = 57600, settleMs = SETTLE_MS;
+  int opt;
+  while((opt = getopt(argc, argv, "b:w:")) != -1) {
+    if(opt == 'b') baud = atoi(optarg);
+    else if(opt == 'w') settleMs = atoi(optarg);
+    else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if(argc - optind < 2) {
+    usage(argv[0]);
+    return 1;
+  }
+  if(!speedFor(baud)) {
+    fprintf(stderr, "unsupported baud rate %u\n", baud);
+    return 1;
+  }
+  std::vector<Item> items;
+  for(int i = optind + 1; i < argc; i++) {
+    Item item;
+    if(!parseItem(argv[i], item)) {
+      usage(argv[0]);
+      return 1;
+    }
+    if(!mapItem(item)) return 1;
+    items.push_back(item);
+  }
+  int fd = openPort(argv[optind], baud);
+  if(fd < 0) return 1;
+  // frames sent while the board is still starting are lost; so is whatever it sends meanwhile
+  if(settleMs) {
+    struct timespec ts = { (time_t)(settleMs / 1000), (long)(settleMs % 1000) * 1000000L };
+    nanosleep(&ts, 0);
+    tcflush(fd, TCIFLUSH);
+  }
+
+  Stats total;
+  memset(&total, 0, sizeof(total));
+  for(size_t i = 0; i < items.size(); i++) {
+    Stats st;
+    if(!upload(fd, items[i], baud, st)) {
+      close(fd);
+      return 1;
+    }
+    char what[32];
+    snprintf(what, sizeof(what), "item %u (%s)", items[i].id, items[i].format & FLASHBUFFER_CODING_MASK ? "adpcm" : "pcm8");
+    printStats(what, st, baud);
+    total.bytes += st.bytes;
+    total.wireBytes += st.wireBytes;
+    total.ns += st.ns;
+    total.frames += st.frames;
+    total.resent += st.resent;
+    total.nacks += st.nacks;
+    total.timeouts += st.timeouts;
+    total.badFrames += st.badFrames;
+    total.stalls += st.stalls;
+    total.stallNs += st.stallNs;
+    total.tailNs += st.tailNs;
+    if(st.longestStallNs > total.longestStallNs) total.longestStallNs = st.longestStallNs;
+  }
+  if(items.size() > 1) printStats("session", total, baud);
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,24 @@
+// CRC32 (IEEE 802.3, reflected polynomial 0xEDB88320, as in zlib and PNG) of FlashBuffer items,
+// updated a piece at a time as the bytes go by, e.g. straight after each burst read:
+//
+//   uint32_t crc = CRC32_INIT;
+//   crc = crc32Update(crc, buf, n);   // as often as needed
+//   crc32Final(crc)                   // the checksum, crc32("123456789") == 0xCBF43926
+//
+// A table of 256 words (1 KB of program flash) and one lookup per byte: about 10 cycles a byte on the
+// nRF51's Cortex-M0 at 16 MHz, against 32 for clocking the byte in at 4 MHz.
+
+#ifndef _CRC32_H_
+#define _CRC32_H_
+
+#include <Arduino.h>
+
+#define CRC32_INIT 0xFFFFFFFFUL
+
+uint32_t crc32Update(uint32_t crc, const uint8_t *data, uint32_t n);
+
+static inline uint32_t crc32Final(uint32_t crc) {
+  return ~crc;
+}
+
+#endif
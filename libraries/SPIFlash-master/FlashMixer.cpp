@@ -0,0 +1,191 @@
+#include <FlashMixer.h>
+
+FlashMixer::FlashMixer(FlashBuffer &flashBuffer, uint16_t rate) {
+  outputRate = rate;
+  for(uint8_t v = 0; v < FLASHMIXER_VOICES; v++) {
+    voices[v].source = FLASHMIXER_IDLE;
+    voices[v].gain = FLASHMIXER_UNITY;
+    voices[v].repeat = false;
+    voices[v].data = 0;
+    voices[v].length = 0;
+    voices[v].position = 0;
+    voices[v].step = FLASHMIXER_SAME_RATE;
+    voices[v].phase = 0;
+    voices[v].a = voices[v].b = 128;
+    players[v] = new FlashPlayer(flashBuffer);
+  }
+  clipCount = 0;
+}
+
+int8_t FlashMixer::freeVoice() {
+  for(uint8_t v = 0; v < FLASHMIXER_VOICES; v++) {
+    if(voices[v].source == FLASHMIXER_IDLE) return v;
+  }
+  return -1;
+}
+
+// Starts item id on a free voice (its first buffers are read right away). Returns the voice, or -1
+// when every voice is busy or the item doesn't exist.
+int8_t FlashMixer::play(uint8_t id, uint16_t gain, boolean repeat) {
+  int8_t v = freeVoice();
+  if(v < 0 || !players[v]->start(id, repeat)) return -1;
+  startVoice(v, gain, players[v]->sampleRate());
+  voices[v].source = FLASHMIXER_FLASH;
+  return v;
+}
+
+// Starts length samples of a PROGMEM table recorded at rate Hz (0: the output rate) on a free voice;
+// -1 when every voice is busy.
+int8_t FlashMixer::playProgmem(const uint8_t *data, uint32_t length, uint16_t gain, boolean repeat, uint16_t rate) {
+  int8_t v = freeVoice();
+  if(v < 0 || length == 0) return -1;
+  voices[v].data = data;
+  voices[v].length = length;
+  voices[v].position = 0;
+  voices[v].repeat = repeat;
+  startVoice(v, gain, rate ? rate : outputRate);
+  voices[v].source = FLASHMIXER_PROGMEM;
+  return v;
+}
+
+void FlashMixer::stop(uint8_t voice) {
+  if(voice >= FLASHMIXER_VOICES) return;
+  voices[voice].source = FLASHMIXER_IDLE;
+  players[voice]->stop();
+}
+
+void FlashMixer::stopAll() {
+  for(uint8_t v = 0; v < FLASHMIXER_VOICES; v++) stop(v);
+}
+
+void FlashMixer::setGain(uint8_t voice, uint16_t gain) {
+  if(voice < FLASHMIXER_VOICES) voices[voice].gain = gain;
+}
+
+boolean FlashMixer::isPlaying(uint8_t voice) {
+  return voice < FLASHMIXER_VOICES && voices[voice].source != FLASHMIXER_IDLE;
+}
+
+void FlashMixer::startVoice(uint8_t v, uint16_t gain, uint16_t rate) {
+  voices[v].gain = gain;
+  voices[v].step = rate == outputRate ? FLASHMIXER_SAME_RATE : ((uint32_t)rate << 16) / outputRate;
+  voices[v].phase = 0;
+  voices[v].a = voices[v].b = 128; // fades in from silence over the first input sample
+}
+
+uint16_t FlashMixer::sampleRate() {
+  return outputRate;
+}
+
+uint8_t FlashMixer::voicesPlaying() {
+  uint8_t n = 0;
+  for(uint8_t v = 0; v < FLASHMIXER_VOICES; v++) {
+    if(voices[v].source != FLASHMIXER_IDLE) n++;
+  }
+  return n;
+}
+
+// the next input sample of voice v, -1 (and the voice is idle) when it's done
+int FlashMixer::fetch(uint8_t v) {
+  Voice &voice = voices[v];
+  int s;
+  if(voice.source == FLASHMIXER_FLASH) {
+    s = players[v]->nextSample();
+  } else if(voice.source == FLASHMIXER_PROGMEM) {
+    uint32_t p = voice.position;
+    if(p >= voice.length && voice.repeat) p = 0;
+    if(p < voice.length) {
+      s = pgm_read_byte(voice.data + p);
+      voice.position = p + 1;
+    } else {
+      s = -1;
+    }
+  } else {
+    return -1;
+  }
+  if(s < 0) voice.source = FLASHMIXER_IDLE;
+  return s;
+}
+
+// the next sample of every voice, around 0, times its gain: 16.8 fixed point, not saturated yet
+int32_t FlashMixer::mix() {
+  int32_t sum = 0;
+  for(uint8_t v = 0; v < FLASHMIXER_VOICES; v++) {
+    Voice &voice = voices[v];
+    if(voice.source == FLASHMIXER_IDLE) continue;
+    int s;
+    if(voice.step == FLASHMIXER_SAME_RATE) {
+      s = fetch(v);
+      if(s < 0) continue;
+    } else {
+      // step over the input samples passed since the last output sample, then interpolate
+      uint32_t phase = voice.phase + voice.step;
+      while(phase >= 0x10000UL) {
+        phase -= 0x10000UL;
+        voice.a = voice.b;
+        s = fetch(v);
+        if(s < 0) break;
+        voice.b = s;
+      }
+      if(voice.source == FLASHMIXER_IDLE) continue;
+      voice.phase = phase;
+      s = voice.a + (((int)voice.b - voice.a) * (int)(phase >> 8) >> 8);
+    }
+    sum += (int32_t)(s - 128) * voice.gain;
+  }
+  return sum;
+}
+
+// Called from the sample interrupt: the mix as an 8 bit unsigned PWM value.
+uint8_t FlashMixer::nextSample() {
+  int32_t s = (mix() >> 8) + 128;
+  if(s < 0 || s > 255) {
+    clipCount++;
+    return s < 0 ? 0 : 255;
+  }
+  return s;
+}
+
+// Called from the sample interrupt: the mix as a 12 bit unsigned DAC value.
+uint16_t FlashMixer::nextSample12() {
+  int32_t s = (mix() >> 4) + 2048;
+  if(s < 0 || s > 4095) {
+    clipCount++;
+    return s < 0 ? 0 : 4095;
+  }
+  return s;
+}
+
+// Called from loop(): one burst read per pass for the flash voice with the fewest samples left,
+// until no voice has a free buffer.
+void FlashMixer::refill() {
+  uint8_t pending = 0;
+  for(uint8_t v = 0; v < FLASHMIXER_VOICES; v++) {
+    if(voices[v].source == FLASHMIXER_FLASH) pending |= 1 << v;
+  }
+  while(pending) {
+    uint8_t next = 0;
+    uint16_t least = 0xFFFF;
+    for(uint8_t v = 0; v < FLASHMIXER_VOICES; v++) {
+      if(!(pending & 1 << v)) continue;
+      uint16_t n = players[v]->buffered();
+      if(n < least) {
+        least = n;
+        next = v;
+      }
+    }
+    if(!players[next]->refillOne()) pending &= ~(1 << next);
+  }
+}
+
+// times a flash voice had no samples ready, over all voices since they were started
+uint32_t FlashMixer::underruns() {
+  uint32_t n = 0;
+  for(uint8_t v = 0; v < FLASHMIXER_VOICES; v++) n += players[v]->underruns();
+  return n;
+}
+
+// output samples that were saturated: lower the gains if this keeps growing
+uint32_t FlashMixer::clipped() {
+  return clipCount;
+}
@@ -0,0 +1,73 @@
+// Plays several sounds at once: FlashBuffer items (each through its own FlashPlayer) and tables in
+// the on-chip flash (PROGMEM), mixed in the sample interrupt with a gain per voice. The mix is
+// summed in 32 bit fixed point and saturated once, at the output: 8 bit for the PWM sketches,
+// 12 bit for a DAC. Voices recorded at another rate than the output are resampled on the fly by
+// linear interpolation (16.16 fixed point phase); voices at the output rate are passed as is.
+// loop() refills the flash voices one burst read at a time, always the voice closest to running dry
+// first, so a looping background and a short beep share the bus fairly.
+//
+//   FlashMixer mixer(flashBuffer, 16000);        // output rate, the sample timer runs at this
+//   mixer.play(3, FLASHMIXER_UNITY / 2, true);    // background loop at half volume
+//   mixer.playProgmem(beep, sizeof(beep));       // UI beep on top of it
+//   ISR:    sampleVal = mixer.nextSample();      // or nextSample12() for a 12 bit DAC
+//   loop(): mixer.refill();
+//
+// RAM: every voice has a FlashPlayer with 2 x FLASHPLAYER_BUFFER_SIZE bytes of buffers.
+
+#ifndef _FLASHMIXER_H_
+#define _FLASHMIXER_H_
+
+#include <FlashPlayer.h>
+
+// voices playing at the same time (up to 8)
+#ifndef FLASHMIXER_VOICES
+#define FLASHMIXER_VOICES 4
+#endif
+
+#define FLASHMIXER_UNITY 256 // gain of a voice played as is; gains are 8.8 fixed point
+#define FLASHMIXER_SAME_RATE 0x10000UL
+
+#define FLASHMIXER_IDLE 0
+#define FLASHMIXER_FLASH 1
+#define FLASHMIXER_PROGMEM 2
+
+class FlashMixer {
+public:
+  FlashMixer(FlashBuffer &flashBuffer, uint16_t rate = 8000);
+  int8_t play(uint8_t id, uint16_t gain = FLASHMIXER_UNITY, boolean repeat = false);
+  int8_t playProgmem(const uint8_t *data, uint32_t length, uint16_t gain = FLASHMIXER_UNITY, boolean repeat = false,
+                     uint16_t rate = 0);
+  void stop(uint8_t voice);
+  void stopAll();
+  void setGain(uint8_t voice, uint16_t gain);
+  boolean isPlaying(uint8_t voice);
+  uint8_t voicesPlaying();
+  uint16_t sampleRate();
+  uint8_t nextSample();
+  uint16_t nextSample12();
+  void refill();
+  uint32_t underruns();
+  uint32_t clipped();
+private:
+  struct Voice {
+    volatile uint8_t source;     // FLASHMIXER_IDLE/FLASH/PROGMEM; set last when starting, so the interrupt sees a complete voice
+    volatile uint16_t gain;
+    boolean repeat;
+    const uint8_t *data;         // PROGMEM voices
+    uint32_t length;
+    volatile uint32_t position;
+    uint32_t step;               // input samples per output sample, 16.16; FLASHMIXER_SAME_RATE: no resampling
+    uint32_t phase;              // position between a and b, 16.16
+    uint8_t a, b;                // the input samples around the output sample
+  };
+  Voice voices[FLASHMIXER_VOICES];
+  FlashPlayer *players[FLASHMIXER_VOICES];
+  uint16_t outputRate;
+  volatile uint32_t clipCount;
+  int8_t freeVoice();
+  void startVoice(uint8_t v, uint16_t gain, uint16_t rate);
+  int fetch(uint8_t v);
+  int32_t mix();
+};
+
+#endif
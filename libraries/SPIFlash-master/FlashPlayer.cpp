@@ -0,0 +1,227 @@
+#include <FlashPlayer.h>
+
+FlashPlayer::FlashPlayer(FlashBuffer &flashBuffer) : flashBuffer(flashBuffer) {
+  fill[0] = fill[1] = 0;
+  current = 0;
+  position = 0;
+  playing = false;
+  endOfItem = false;
+  underrunCount = 0;
+  sampleCount = 0;
+  lastSample = 128;
+  cursor.remaining = 0;
+  segmentCount = segmentNext = 0;
+  segmentLeft = 0;
+  segmentSkip = 0;
+  repeat = false;
+  format = FLASHBUFFER_FORMAT_PCM8;
+  rate = 8000;
+}
+
+// a playlist of just the item: open it and fill both buffers, so the interrupt can be started right after this
+boolean FlashPlayer::start(uint8_t id, boolean repeat) {
+  playing = false;
+  clear();
+  return queue(id) && play(repeat);
+}
+
+// Adds a segment at the end of the playlist: length samples of the item from offset on, or the
+// rest of it. False when the list is full, the item doesn't exist or is at another sample rate
+// than the list. While the list plays this must come before it runs out.
+boolean FlashPlayer::queue(uint8_t id, uint32_t offset, uint32_t length) {
+  if(segmentCount == FLASHPLAYER_PLAYLIST_SIZE && segmentNext > 0 && !repeat) {
+    // the segments already opened aren't needed again
+    memmove(segments, segments + segmentNext, (segmentCount - segmentNext) * sizeof(segments[0]));
+    segmentCount -= segmentNext;
+    segmentNext = 0;
+  }
+  if(segmentCount == FLASHPLAYER_PLAYLIST_SIZE || flashBuffer.getItemLength(id) == 0) return false;
+  uint16_t itemRate = flashBuffer.getItemSampleRate(id);
+  if(segmentCount == 0) rate = itemRate;
+  else if(itemRate != rate) return false;
+  PlaylistSegment &segment = segments[segmentCount];
+  segment.id = id;
+  segment.offset = offset;
+  segment.length = length;
+  segmentCount++;
+  if(playing) endOfItem = false; // refill() goes on into it
+  return true;
+}
+
+// Plays the playlist from its first segment (repeat: over and over). Fills both buffers, so the
+// interrupt can be started right after this; false when none of the segments could be read.
+boolean FlashPlayer::play(boolean repeat) {
+  playing = false;
+  this->repeat = repeat;
+  segmentNext = 0;
+  cursor.remaining = 0;
+  segmentLeft = 0;
+  fill[0] = fill[1] = 0;
+  current = 0;
+  position = 0;
+  endOfItem = false;
+  underrunCount = 0;
+  sampleCount = 0;
+  refill();
+  playing = fill[0] > 0;
+  return playing;
+}
+
+void FlashPlayer::stop() {
+  playing = false;
+}
+
+// Called from the sample interrupt: the next sample, or -1 when the item has been played.
+// When refill() didn't keep up the last sample is repeated and counted as an underrun.
+int FlashPlayer::nextSample() {
+  if(!playing) return -1;
+  if(position >= fill[current]) {
+    if(position > 0) {
+      // buffer used up: hand it back to refill() and move on to the other one
+      fill[current] = 0;
+      current ^= 1;
+      position = 0;
+    }
+    if(fill[current] == 0) {
+      if(endOfItem) {
+        playing = false;
+        return -1;
+      }
+      underrunCount++;
+      return lastSample;
+    }
+  }
+  lastSample = buffers[current][position++];
+  sampleCount++;
+  return lastSample;
+}
+
+// Called from loop(): read the next part of the item into every buffer the interrupt released,
+// the one it's waiting for first.
+void FlashPlayer::refill() {
+  while(refillOne());
+}
+
+// Called from loop(): read the next part of the playlist into the buffer the interrupt needs next,
+// if it released one; false when there was nothing to read. ADPCM codes (2 samples per byte) are
+// read into the upper half of the free space and decoded in place. At the end of a segment the
+// next one is opened and the buffer filled on from it, so the interrupt sees no gap and no short
+// buffer between segments (nor at the end of a repeating list).
+boolean FlashPlayer::refillOne() {
+  uint8_t first = current; // read once: the interrupt may move on while we're reading
+  for(uint8_t i = 0; i < 2; i++) {
+    uint8_t b = first ^ i;
+    if(fill[b] != 0) continue;
+    uint16_t n = 0;
+    while(n < FLASHPLAYER_BUFFER_SIZE) {
+      if(cursor.remaining == 0 || segmentLeft == 0) {
+        if(openSegment()) continue;
+        repeat = false; // nothing left to read (or to repeat): play out what's buffered
+        break;
+      }
+      uint8_t *out = buffers[b] + n;
+      uint16_t space = FLASHPLAYER_BUFFER_SIZE - n;
+      uint16_t got;
+      if(format == FLASHBUFFER_FORMAT_IMA_ADPCM) {
+        if(space < 2) break;
+        uint8_t *codes = out + space / 2;
+        got = decoder.decode(codes, flashBuffer.readItemBytes(cursor, codes, space / 2), out);
+        if(segmentSkip > 0) {
+          uint16_t drop = got < segmentSkip ? got : segmentSkip;
+          memmove(out, out + drop, got - drop);
+          got -= drop;
+          segmentSkip -= drop;
+        }
+      } else {
+        got = flashBuffer.readItemBytes(cursor, out, space);
+      }
+      if(got > segmentLeft) got = segmentLeft;
+      segmentLeft -= got;
+      n += got;
+    }
+    if(n == 0) break;
+    fill[b] = n; // publish after the data is in place
+    if(listDone()) endOfItem = true;
+    return true;
+  }
+  if(listDone()) endOfItem = true; // only now, the interrupt may be waiting for the last buffer
+  return false;
+}
+
+// whether refill() has something to do: the interrupt released a buffer and the item isn't done
+// (cheap, for deciding whether to wake the flash up)
+boolean FlashPlayer::refillDue() {
+  return playing && !endOfItem && (fill[0] == 0 || fill[1] == 0);
+}
+
+// samples left for the interrupt before it runs dry, for deciding which player to refill first
+uint16_t FlashPlayer::buffered() {
+  uint8_t c = current;
+  uint16_t p = position, f = fill[c];
+  return (f > p ? f - p : 0) + fill[c ^ 1];
+}
+
+// empties the playlist (what is buffered still plays)
+void FlashPlayer::clear() {
+  segmentCount = segmentNext = 0;
+  repeat = false;
+}
+
+// segments not opened by refill() yet
+uint8_t FlashPlayer::segmentsLeft() {
+  return segmentCount - segmentNext;
+}
+
+// Opens the next segment that can be read, going round the list when it repeats. Seeks to its
+// offset: in an ADPCM item to the block holding it, the samples before it are decoded and dropped.
+// False at the end of the list.
+boolean FlashPlayer::openSegment() {
+  for(uint8_t tries = 0; tries < segmentCount; tries++) {
+    if(segmentNext == segmentCount) {
+      if(!repeat) return false;
+      segmentNext = 0;
+    }
+    PlaylistSegment &segment = segments[segmentNext++];
+    if(!flashBuffer.openItem(segment.id, cursor)) continue; // gone since it was queued
+    format = flashBuffer.getItemFormat(segment.id);
+    uint32_t offset = segment.offset;
+    segmentSkip = 0;
+    if(format == FLASHBUFFER_FORMAT_IMA_ADPCM) {
+      segmentSkip = offset % IMA_ADPCM_BLOCK_SAMPLES;
+      offset = offset / IMA_ADPCM_BLOCK_SAMPLES * IMA_ADPCM_BLOCK_SIZE;
+    }
+    if(offset >= cursor.remaining) continue;
+    flashBuffer.skipItemBytes(cursor, offset);
+    decoder.reset();
+    segmentLeft = segment.length ? segment.length : 0xFFFFFFFFUL;
+    if(segment.length) {
+      // no reading past the segment (an ADPCM one ends within its last block)
+      uint32_t bytes = format == FLASHBUFFER_FORMAT_IMA_ADPCM ? imaAdpcmBytes(segmentSkip + segment.length) : segment.length;
+      if(cursor.remaining > bytes) cursor.remaining = bytes;
+    }
+    return true;
+  }
+  return false;
+}
+
+// the open segment is read and no other one follows
+boolean FlashPlayer::listDone() {
+  return (cursor.remaining == 0 || segmentLeft == 0) && segmentNext == segmentCount && !repeat;
+}
+
+// the rate the item plays at, for the sample timer
+uint16_t FlashPlayer::sampleRate() {
+  return rate;
+}
+
+boolean FlashPlayer::isPlaying() {
+  return playing;
+}
+
+uint32_t FlashPlayer::underruns() {
+  return underrunCount;
+}
+
+uint32_t FlashPlayer::samplesPlayed() {
+  return sampleCount;
+}
@@ -0,0 +1,84 @@
+// Double buffered playback of a FlashBuffer item.
+// The sample interrupt takes samples from one buffer with nextSample() while loop() refills the
+// other one with a burst read (refill()). Only loop() touches the SPI bus, so the interrupt stays
+// short and can't collide with other flash transactions. IMA ADPCM items (FLASHBUFFER_FORMAT_IMA_ADPCM)
+// are decoded by refill() as well, so the interrupt always gets 8 bit PCM.
+//
+// What it plays is a playlist of segments: a stretch of an item (offset and length in samples) or
+// all of it. refill() goes on into the next segment within the buffer it is filling, so the
+// interrupt gets the segments back to back, without a gap or a stop of the sample timer: a prompt
+// put together from fragments ("four" "twenty" "seven") plays as one recording. The segments must
+// all be at the same sample rate (the timer's); loop() may queue more while the list plays.
+//
+//   FlashPlayer player(flashBuffer);
+//   player.start(3);                          // fills both buffers; start(3, true) loops the item
+//   player.queue(10); player.queue(12, 4000, 8000); player.play();   // or a playlist
+//   program the sample timer for player.sampleRate() (see SampleClock.h)
+//   ISR:    int s = player.nextSample();      // -1 once the item is done
+//   loop(): player.refill();
+
+#ifndef _FLASHPLAYER_H_
+#define _FLASHPLAYER_H_
+
+#include <SPIFlash.h>
+#include <ImaAdpcm.h>
+
+// samples per buffer (even); at 32kHz 256 samples give loop() 8ms to come back for a refill
+#ifndef FLASHPLAYER_BUFFER_SIZE
+#define FLASHPLAYER_BUFFER_SIZE 256
+#endif
+
+// segments in a playlist, 12 bytes of RAM each
+#ifndef FLASHPLAYER_PLAYLIST_SIZE
+#define FLASHPLAYER_PLAYLIST_SIZE 8
+#endif
+
+struct PlaylistSegment {
+  uint8_t id;
+  uint32_t offset; // first sample
+  uint32_t length; // samples, 0: to the end of the item
+};
+
+class FlashPlayer {
+public:
+  FlashPlayer(FlashBuffer &flashBuffer);
+  boolean start(uint8_t id, boolean repeat = false);
+  boolean queue(uint8_t id, uint32_t offset = 0, uint32_t length = 0);
+  boolean play(boolean repeat = false);
+  void clear();
+  uint8_t segmentsLeft();
+  void stop();
+  int nextSample();
+  void refill();
+  boolean refillOne();
+  boolean refillDue();
+  uint16_t buffered();
+  uint16_t sampleRate();
+  boolean isPlaying();
+  uint32_t underruns();
+  uint32_t samplesPlayed();
+private:
+  FlashBuffer &flashBuffer;
+  ItemCursor cursor;
+  PlaylistSegment segments[FLASHPLAYER_PLAYLIST_SIZE];
+  uint8_t segmentCount;
+  uint8_t segmentNext;            // the segment refill() opens next
+  uint32_t segmentLeft;           // samples of the open segment still to read
+  uint16_t segmentSkip;           // decoded samples to drop before its offset (ADPCM)
+  boolean repeat;                 // start over at the end of the list
+  uint8_t format;                 // FLASHBUFFER_FORMAT_... of the open segment's item
+  uint16_t rate;                  // Hz the list was recorded at
+  ImaAdpcmDecoder decoder;
+  uint8_t buffers[2][FLASHPLAYER_BUFFER_SIZE];
+  volatile uint16_t fill[2];      // samples in each buffer, 0: empty and owned by refill()
+  volatile uint8_t current;       // buffer the interrupt reads from
+  volatile uint16_t position;
+  volatile boolean playing;
+  volatile boolean endOfItem;     // set by refill() once the last buffer is published
+  volatile uint32_t underrunCount, sampleCount;
+  uint8_t lastSample;
+  boolean openSegment();
+  boolean listDone();
+};
+
+#endif
@@ -0,0 +1,147 @@
+#include <ImaAdpcm.h>
+
+static const int16_t stepTable[89] = {
+  7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45, 50, 55, 60, 66, 73,
+  80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307, 337, 371, 408, 449, 494,
+  544, 598, 658, 724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499,
+  2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487,
+  12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const int8_t indexTable[8] = { -1, -1, -1, -1, 2, 4, 6, 8 };
+
+// 16 bit sample to 8 bit unsigned PCM, rounded
+static inline uint8_t toPcm8(int16_t sample) {
+  if(sample >= 0x7F80) return 255;
+  return (uint8_t)((((int32_t)sample + 0x80) >> 8) + 128);
+}
+
+// the predictor and step index after code: shared by the encoder and the decoder, so they agree
+static inline void step(int16_t &predictor, uint8_t &stepIndex, uint8_t code) {
+  int16_t s = stepTable[stepIndex];
+  int32_t diff = s >> 3;
+  if(code & 4) diff += s;
+  if(code & 2) diff += s >> 1;
+  if(code & 1) diff += s >> 2;
+  int32_t p = code & 8 ? (int32_t)predictor - diff : (int32_t)predictor + diff;
+  predictor = p > 32767 ? 32767 : p < -32768 ? -32768 : p;
+  int8_t i = (int8_t)stepIndex + indexTable[code & 7];
+  stepIndex = i < 0 ? 0 : i > 88 ? 88 : i;
+}
+
+uint32_t imaAdpcmSamples(uint32_t bytes) {
+  uint32_t rest = bytes % IMA_ADPCM_BLOCK_SIZE;
+  return bytes / IMA_ADPCM_BLOCK_SIZE * IMA_ADPCM_BLOCK_SAMPLES + (rest >= 4 ? 1 + (rest - 4) * 2 : 0);
+}
+
+uint32_t imaAdpcmBytes(uint32_t samples) {
+  uint32_t rest = samples % IMA_ADPCM_BLOCK_SAMPLES;
+  return samples / IMA_ADPCM_BLOCK_SAMPLES * IMA_ADPCM_BLOCK_SIZE + (rest ? 4 + rest / 2 : 0);
+}
+
+ImaAdpcmDecoder::ImaAdpcmDecoder() {
+  reset();
+}
+
+void ImaAdpcmDecoder::reset() {
+  predictor = 0;
+  stepIndex = 0;
+  blockPos = 0;
+}
+
+uint8_t ImaAdpcmDecoder::decodeCode(uint8_t code) {
+  step(predictor, stepIndex, code);
+  return toPcm8(predictor);
+}
+
+// Decodes the next n bytes of the item into out; the pieces may split blocks and headers anywhere.
+// Returns the number of samples written. in and out may overlap as long as in starts at least
+// n bytes into out (decoding in place from the upper half of a buffer).
+uint32_t ImaAdpcmDecoder::decode(const uint8_t *in, uint32_t n, uint8_t *out) {
+  uint32_t samples = 0;
+  for(uint32_t i = 0; i < n; i++) {
+    uint8_t b = in[i];
+    if(blockPos < 4) {
+      // block header: the predictor is the first sample
+      if(blockPos == 0) predictor = b;
+      else if(blockPos == 1) predictor = (int16_t)((uint16_t)b << 8 | (uint8_t)predictor);
+      else if(blockPos == 2) stepIndex = b > 88 ? 88 : b;
+      else out[samples++] = toPcm8(predictor);
+    } else {
+      out[samples++] = decodeCode(b & 15);
+      out[samples++] = decodeCode(b >> 4);
+    }
+    if(++blockPos == IMA_ADPCM_BLOCK_SIZE) blockPos = 0;
+  }
+  return samples;
+}
+
+ImaAdpcmEncoder::ImaAdpcmEncoder() {
+  reset();
+}
+
+void ImaAdpcmEncoder::reset() {
+  predictor = 0;
+  stepIndex = 0;
+  blockPos = 0;
+  pendingCode = -1;
+}
+
+// the code that takes the predictor closest to sample, and the step it makes
+uint8_t ImaAdpcmEncoder::encodeSample(int16_t sample) {
+  int32_t diff = (int32_t)sample - predictor;
+  uint8_t code = 0;
+  if(diff < 0) {
+    code = 8;
+    diff = -diff;
+  }
+  int16_t s = stepTable[stepIndex];
+  if(diff >= s) {
+    code |= 4;
+    diff -= s;
+  }
+  if(diff >= s >> 1) {
+    code |= 2;
+    diff -= s >> 1;
+  }
+  if(diff >= s >> 2) code |= 1;
+  step(predictor, stepIndex, code);
+  return code;
+}
+
+// Encodes n 8 bit unsigned samples, appending to the stream written so far. Returns the bytes
+// written to out (about n / 2, plus 4 for every block started).
+uint32_t ImaAdpcmEncoder::encode(const uint8_t *in, uint32_t n, uint8_t *out) {
+  uint32_t bytes = 0;
+  for(uint32_t i = 0; i < n; i++) {
+    int16_t sample = (int16_t)((in[i] - 128) << 8);
+    if(blockPos == 0) {
+      // a new block starts with the sample itself, and the step index reached so far
+      predictor = sample;
+      out[bytes++] = (uint16_t)predictor;
+      out[bytes++] = (uint16_t)predictor >> 8;
+      out[bytes++] = stepIndex;
+      out[bytes++] = 0;
+      blockPos = 4;
+      continue;
+    }
+    uint8_t code = encodeSample(sample);
+    if(pendingCode < 0) {
+      pendingCode = code;
+      continue;
+    }
+    out[bytes++] = pendingCode | code << 4;
+    pendingCode = -1;
+    if(++blockPos == IMA_ADPCM_BLOCK_SIZE) blockPos = 0;
+  }
+  return bytes;
+}
+
+// writes out the last code if the samples ended half way through a byte (decodes to one more sample)
+uint32_t ImaAdpcmEncoder::finish(uint8_t *out) {
+  if(pendingCode < 0) return 0;
+  out[0] = pendingCode;
+  pendingCode = -1;
+  if(++blockPos == IMA_ADPCM_BLOCK_SIZE) blockPos = 0;
+  return 1;
+}
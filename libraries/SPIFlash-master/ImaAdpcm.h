@@ -0,0 +1,50 @@
+// 4 bit IMA ADPCM for FlashBuffer items (FLASHBUFFER_FORMAT_IMA_ADPCM), mono, in the block layout
+// of IMA ADPCM WAV files (format 0x11) with 256 byte blocks:
+//   predictor(2, little endian) | step index | 0 | 252 bytes of codes, low nibble first
+// The header is the first sample of the block, so a block holds 1 + 504 = 505 samples and can be
+// decoded on its own. Samples go in and out as 8 bit unsigned PCM, like the raw items; half the
+// flash, half the SPI reads per second of audio and half the upload time.
+//
+//   ImaAdpcmEncoder enc;   n = enc.encode(pcm, samples, out);  enc.finish(out + n);
+//   ImaAdpcmDecoder dec;   dec.reset() at the item start, then feed it the item bytes in any
+//                          pieces: samples = dec.decode(in, bytes, out)  (at most 2 per byte)
+
+#ifndef _IMAADPCM_H_
+#define _IMAADPCM_H_
+
+#include <Arduino.h>
+
+#define IMA_ADPCM_BLOCK_SIZE 256
+#define IMA_ADPCM_BLOCK_SAMPLES (1 + (IMA_ADPCM_BLOCK_SIZE - 4) * 2)
+
+// samples in an item of bytes bytes / bytes needed for samples samples
+uint32_t imaAdpcmSamples(uint32_t bytes);
+uint32_t imaAdpcmBytes(uint32_t samples);
+
+class ImaAdpcmDecoder {
+public:
+  ImaAdpcmDecoder();
+  void reset();
+  uint32_t decode(const uint8_t *in, uint32_t n, uint8_t *out);
+  uint8_t decodeCode(uint8_t code); // one 4 bit code, for decoding sample by sample (in an ISR)
+private:
+  int16_t predictor;
+  uint8_t stepIndex;
+  uint16_t blockPos; // byte position in the current block
+};
+
+class ImaAdpcmEncoder {
+public:
+  ImaAdpcmEncoder();
+  void reset();
+  uint32_t encode(const uint8_t *in, uint32_t n, uint8_t *out);
+  uint32_t finish(uint8_t *out); // the half byte still pending at the end, 0 or 1 bytes
+private:
+  int16_t predictor;
+  uint8_t stepIndex;
+  uint16_t blockPos;
+  int8_t pendingCode; // low nibble waiting for its high nibble, -1: none
+  uint8_t encodeSample(int16_t sample);
+};
+
+#endif
@@ -0,0 +1,70 @@
+#include <PlaybackScheduler.h>
+#if defined(__AVR__)
+#include <avr/sleep.h>
+#endif
+
+PlaybackScheduler::PlaybackScheduler(FlashBuffer &flashBuffer, FlashPlayer &player)
+  : flashBuffer(flashBuffer), player(player) {
+  deepPowerDown = true;
+  flashDown = false;
+  wakeCount = 0;
+  refillMax = 0;
+}
+
+// Call from loop(): wakes the flash when a refill is due, refills once it is awake and puts it
+// back into deep power-down, sleeps the CPU until the next interrupt otherwise.
+void PlaybackScheduler::run() {
+  if(player.refillDue()) {
+    if(flashDown) {
+      flashBuffer.powerUp();
+      flashDown = false;
+      wakeCount++;
+    } else {
+      uint32_t start = micros();
+      player.refill(); // waits for whatever is left of the wake-up time
+      uint32_t took = micros() - start;
+      if(took > refillMax) refillMax = took;
+      flashDown = deepPowerDown && deepPowerDownFits() && flashBuffer.powerDown();
+      return;
+    }
+  }
+  if(player.isPlaying()) waitForInterrupt();
+}
+
+// false: keep the flash in standby between refills (e.g. to compare)
+void PlaybackScheduler::setDeepPowerDown(boolean enabled) {
+  deepPowerDown = enabled;
+}
+
+// whether the other buffer outlasts waking the chip, the sample period the CPU sleeps through
+// meanwhile, the longest refill so far and a stall of loop()
+boolean PlaybackScheduler::deepPowerDownFits() {
+  uint32_t rate = player.sampleRate();
+  uint32_t budget = (uint32_t)FLASHPLAYER_BUFFER_SIZE * 1000000UL / rate;
+#ifdef PLAYBACKSCHEDULER_STALL_US
+  uint32_t stall = PLAYBACKSCHEDULER_STALL_US;
+#else
+  uint32_t stall = budget / 100 * PLAYBACKSCHEDULER_STALL_PERCENT;
+#endif
+  return SPIFLASH_WAKE_US + 1000000UL / rate + refillMax + stall <= budget;
+}
+
+uint32_t PlaybackScheduler::wakeups() {
+  return wakeCount;
+}
+
+// us, the interrupts taken meanwhile included
+uint32_t PlaybackScheduler::longestRefill() {
+  return refillMax;
+}
+
+// Sleeps until an interrupt (the sample timer) has run. An interrupt between the refillDue()
+// check and here sets the event register, so the WFE returns at once and no refill is missed.
+void PlaybackScheduler::waitForInterrupt() {
+#if defined(NRF_GPIO)
+  __WFE();
+#elif defined(__AVR__)
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  sleep_mode();
+#endif
+}
@@ -0,0 +1,50 @@
+// Power-aware playback: runs a FlashPlayer's refills from loop() and keeps the CPU and the flash
+// asleep in between. After every refill burst the flash goes into deep power-down; when the sample
+// interrupt releases a buffer the chip is woken up and the CPU sleeps (WFE) until the next
+// interrupt, so the wake-up time (SPIFLASH_WAKE_US) passes while it sleeps, and the refill follows
+// on the next pass. The rest of the time the CPU sleeps between sample interrupts.
+//
+// The wake-up comes out of the time the other buffer lasts (FLASHPLAYER_BUFFER_SIZE samples), on
+// top of the refill itself and a stall of the rest of loop() (PLAYBACKSCHEDULER_STALL_PERCENT of
+// that time). When that doesn't fit (small buffers, slow refills) the flash is left in standby
+// between refills.
+//
+//   PlaybackScheduler scheduler(flashBuffer, player);
+//   player.start(3); program the sample timer (SampleClock.h)
+//   loop(): scheduler.run();     // instead of player.refill()
+//
+// Anything else that uses flashBuffer wakes the chip by itself (SPIFlash::select()). host/powerbench.cpp
+// estimates what it saves.
+
+#ifndef _PLAYBACKSCHEDULER_H_
+#define _PLAYBACKSCHEDULER_H_
+
+#include <FlashPlayer.h>
+
+// longest the rest of loop() may keep run() from coming back (BLE, serial output, ...), as a share
+// of the time a buffer lasts: with 256 samples 25% is 8 ms at 8 kHz and 1.3 ms at 48 kHz. A
+// loop() that stalls for a fixed time defines PLAYBACKSCHEDULER_STALL_US instead; 5000 keeps the
+// flash out of deep power-down at 48 kHz.
+#ifndef PLAYBACKSCHEDULER_STALL_PERCENT
+#define PLAYBACKSCHEDULER_STALL_PERCENT 25
+#endif
+
+class PlaybackScheduler {
+public:
+  PlaybackScheduler(FlashBuffer &flashBuffer, FlashPlayer &player);
+  void run();
+  void setDeepPowerDown(boolean enabled);
+  boolean deepPowerDownFits();
+  uint32_t wakeups();
+  uint32_t longestRefill();
+private:
+  FlashBuffer &flashBuffer;
+  FlashPlayer &player;
+  boolean deepPowerDown; // allowed at all
+  boolean flashDown;     // put in deep power-down after the last refill
+  uint32_t wakeCount;
+  uint32_t refillMax;    // us
+  void waitForInterrupt();
+};
+
+#endif
@@ -0,0 +1,154 @@
+#include <PwmPlayer.h>
+
+#if defined(NRF_TIMER2)
+
+#define TIMER_COMPARE_INTS (0xFUL << TIMER_INTENSET_COMPARE0_Pos)
+
+PwmPlayer *PwmPlayer::active = 0;
+
+PwmPlayer::PwmPlayer(uint8_t pin, PwmSampleSource source, uint8_t slots) : pin(pin), source(source) {
+  this->slots = slots < 2 ? 2 : slots > 3 ? 3 : slots;
+  pwm = pwmTimingFor(8000);
+  running = false;
+  held = 128;
+  irqCompare = 0;
+  irqCount = 0;
+  sampleCount = 0;
+}
+
+static void connect(uint8_t channel, uint32_t event, uint32_t task) {
+  NRF_PPI->CH[PWMPLAYER_PPI_CHANNEL + channel].EEP = event;
+  NRF_PPI->CH[PWMPLAYER_PPI_CHANNEL + channel].TEP = task;
+}
+
+// The PPI channels, from PWMPLAYER_PPI_CHANNEL on:
+//   0            TIMER2 COMPARE[3] (period end) -> GPIOTE OUT, the rising edge
+//   1            TIMER2 COMPARE[3] -> TIMER1 COUNT
+//   2 + n        TIMER2 COMPARE[n] -> GPIOTE OUT, the falling edge of slot n, alone in group n
+//   2 + slots + 2n, 3 + slots + 2n
+//                TIMER1 COMPARE[n] (slot n done) -> group n off, group n + 1 on
+void PwmPlayer::start(uint32_t rate) {
+  stop();
+  pwm = pwmTimingFor(rate);
+  NRF_CLOCK->EVENTS_HFCLKSTARTED = 0;
+  NRF_CLOCK->TASKS_HFCLKSTART = 1;
+  while(NRF_CLOCK->EVENTS_HFCLKSTARTED == 0) {
+  }
+  // high from the start: the first period looks as if its rising edge had just gone by
+  nrf_gpiote_task_config(PWMPLAYER_GPIOTE_CHANNEL, pin, NRF_GPIOTE_POLARITY_TOGGLE, NRF_GPIOTE_INITIAL_VALUE_HIGH);
+
+  NRF_TIMER2->MODE = TIMER_MODE_MODE_Timer;
+  NRF_TIMER2->BITMODE = TIMER_BITMODE_BITMODE_16Bit;
+  NRF_TIMER2->PRESCALER = 0;
+  NRF_TIMER2->TASKS_CLEAR = 1;
+  NRF_TIMER2->INTENCLR = TIMER_COMPARE_INTS;
+  NRF_TIMER2->CC[3] = pwm.period - 1;
+  NRF_TIMER2->SHORTS = TIMER_SHORTS_COMPARE3_CLEAR_Enabled << TIMER_SHORTS_COMPARE3_CLEAR_Pos;
+  for(uint8_t n = 0; n < slots; n++) load(n);
+
+  // CC[n] is the period count slot n ends at, moved on by a round of slots samples once it passed
+  NRF_TIMER1->MODE = TIMER_MODE_MODE_Counter;
+  NRF_TIMER1->BITMODE = TIMER_BITMODE_BITMODE_16Bit;
+  NRF_TIMER1->SHORTS = 0;
+  NRF_TIMER1->TASKS_CLEAR = 1;
+  NRF_TIMER1->INTENCLR = TIMER_COMPARE_INTS;
+  for(uint8_t n = 0; n < slots; n++) {
+    NRF_TIMER1->CC[n] = (n + 1) * pwm.periodsPerSample;
+    NRF_TIMER1->EVENTS_COMPARE[n] = 0;
+  }
+
+  uint32_t out = (uint32_t)&NRF_GPIOTE->TASKS_OUT[PWMPLAYER_GPIOTE_CHANNEL];
+  connect(0, (uint32_t)&NRF_TIMER2->EVENTS_COMPARE[3], out);
+  connect(1, (uint32_t)&NRF_TIMER2->EVENTS_COMPARE[3], (uint32_t)&NRF_TIMER1->TASKS_COUNT);
+  for(uint8_t n = 0; n < slots; n++) {
+    uint8_t next = (n + 1) % slots;
+    connect(2 + n, (uint32_t)&NRF_TIMER2->EVENTS_COMPARE[n], out);
+    NRF_PPI->CHG[PWMPLAYER_PPI_GROUP + n] = 1UL << (PWMPLAYER_PPI_CHANNEL + 2 + n);
+    connect(2 + slots + 2 * n, (uint32_t)&NRF_TIMER1->EVENTS_COMPARE[n],
+            (uint32_t)&NRF_PPI->TASKS_CHG[PWMPLAYER_PPI_GROUP + n].DIS);
+    connect(3 + slots + 2 * n, (uint32_t)&NRF_TIMER1->EVENTS_COMPARE[n],
+            (uint32_t)&NRF_PPI->TASKS_CHG[PWMPLAYER_PPI_GROUP + next].EN);
+  }
+  // everything but the falling edges of slots 1.. for now
+  uint32_t idle = ((1UL << (slots - 1)) - 1) << (PWMPLAYER_PPI_CHANNEL + 3);
+  NRF_PPI->CHENSET = channelMask() & ~idle;
+
+  // the first interrupt comes when the last slot starts
+  active = this;
+  irqCompare = slots - 2;
+  NRF_TIMER1->INTENSET = 1UL << (TIMER_INTENSET_COMPARE0_Pos + irqCompare);
+  attachInterrupt(TIMER1_IRQn, timerInterrupt);
+  running = true;
+  NRF_TIMER1->TASKS_START = 1;
+  NRF_TIMER2->TASKS_START = 1;
+}
+
+// stops the timers and leaves the pin low
+void PwmPlayer::stop() {
+  if(!running) return;
+  NRF_TIMER2->TASKS_STOP = 1;
+  NRF_TIMER1->TASKS_STOP = 1;
+  NRF_TIMER1->INTENCLR = TIMER_COMPARE_INTS;
+  NRF_PPI->CHENCLR = channelMask();
+  nrf_gpiote_task_config(PWMPLAYER_GPIOTE_CHANNEL, pin, NRF_GPIOTE_POLARITY_TOGGLE, NRF_GPIOTE_INITIAL_VALUE_LOW);
+  running = false;
+}
+
+boolean PwmPlayer::isRunning() {
+  return running;
+}
+
+PwmTiming PwmPlayer::timing() {
+  return pwm;
+}
+
+// ticks a sample keeps the pin high per PWM period
+uint16_t PwmPlayer::dutyTicks(uint8_t sample) {
+  return PWMPLAYER_MARGIN + ((uint32_t)sample * (pwm.period - 2 * PWMPLAYER_MARGIN) >> 8);
+}
+
+uint32_t PwmPlayer::interruptCount() {
+  return irqCount;
+}
+
+// samples taken from the source, the ones still queued in the slots included
+uint32_t PwmPlayer::samplesLoaded() {
+  return sampleCount;
+}
+
+uint32_t PwmPlayer::channelMask() {
+  return ((1UL << (2 + 3 * slots)) - 1) << PWMPLAYER_PPI_CHANNEL;
+}
+
+// the rising edge comes when TIMER2 turns from period - 1 to 0, so compare value c ends the
+// high time c + 1 ticks later
+void PwmPlayer::load(uint8_t slot) {
+  int s = source();
+  if(s >= 0) held = s;
+  sampleCount++;
+  NRF_TIMER2->CC[slot] = dutyTicks(held) - 1;
+}
+
+void PwmPlayer::timerInterrupt() {
+  active->refillSlots();
+}
+
+// The slot after irqCompare has just started: the others are done (their channels are off) and
+// take the samples that follow it, in the order they will play.
+void PwmPlayer::refillSlots() {
+  NRF_TIMER1->EVENTS_COMPARE[irqCompare] = 0;
+  NRF_TIMER1->INTENCLR = 1UL << (TIMER_INTENSET_COMPARE0_Pos + irqCompare);
+  uint8_t playing = (irqCompare + 1) % slots;
+  for(uint8_t i = 1; i < slots; i++) {
+    uint8_t slot = (playing + i) % slots;
+    load(slot);
+    NRF_TIMER1->CC[slot] = (NRF_TIMER1->CC[slot] + (uint32_t)slots * pwm.periodsPerSample) & 0xFFFF;
+  }
+  // next time when the last slot loaded here starts; its event from the last round is stale
+  irqCompare = (playing + slots - 2) % slots;
+  NRF_TIMER1->EVENTS_COMPARE[irqCompare] = 0;
+  NRF_TIMER1->INTENSET = 1UL << (TIMER_INTENSET_COMPARE0_Pos + irqCompare);
+  irqCount++;
+}
+
+#endif
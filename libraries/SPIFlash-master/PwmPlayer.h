@@ -0,0 +1,116 @@
+// PWM audio output on one pin of the nRF51 with one interrupt per sample (or per two samples)
+// instead of one per PWM period. As in rfduino2timersaudio, TIMER2, PPI and GPIOTE toggle the pin
+// without the CPU, but the CPU no longer moves the edges along every period: TIMER2 is cleared
+// every PWM period by CC3, which also toggles the rising edge, and each of the "slots" CC0..CC2
+// holds the falling edge of one sample. TIMER1 counts the PWM periods; at every sample boundary
+// its compare events switch PPI channel groups from one slot's channel to the next, so the new
+// sample starts exactly at a period start without the CPU. The TIMER1 interrupt comes when a slot
+// has started and loads the other slots with the samples that follow: the CC registers are a
+// queue of slots - 1 samples (the nRF51 has no EasyDMA for its timers).
+//
+// The PWM period is picked per sample rate so that a sample lasts a whole number of periods
+// (8 kHz: 5 periods of 400 ticks of 16 MHz, a 40 kHz carrier). Both edges keep PWMPLAYER_MARGIN
+// ticks from the period start, which the slot switch takes, so sample s is high for
+// dutyTicks(s) = PWMPLAYER_MARGIN + s * (period - 2 * PWMPLAYER_MARGIN) / 256 ticks. An interrupt
+// that comes late repeats samples but never breaks the waveform.
+//
+//   int nextSample() { return player.nextSample(); }
+//   PwmPlayer pwm(3, nextSample);                // speaker pin, called from the TIMER1 interrupt
+//   pwm.start(player.sampleRate());
+//
+// Takes TIMER1, TIMER2, GPIOTE channel PWMPLAYER_GPIOTE_CHANNEL, 2 + 3 * slots PPI channels from
+// PWMPLAYER_PPI_CHANNEL on and slots channel groups from PWMPLAYER_PPI_GROUP on. Two slots fit in
+// PPI channels 0-7 and groups 0-1, next to the BLE stack; three (11 channels, 3 groups) halve the
+// interrupts again. host/pwmbench.cpp checks the output period by period against the samples.
+
+#ifndef _PWMPLAYER_H_
+#define _PWMPLAYER_H_
+
+#include <Arduino.h>
+
+#ifndef PWMPLAYER_SLOTS
+#define PWMPLAYER_SLOTS 2
+#endif
+
+#ifndef PWMPLAYER_GPIOTE_CHANNEL
+#define PWMPLAYER_GPIOTE_CHANNEL 0
+#endif
+
+#ifndef PWMPLAYER_PPI_CHANNEL
+#define PWMPLAYER_PPI_CHANNEL 0
+#endif
+
+#ifndef PWMPLAYER_PPI_GROUP
+#define PWMPLAYER_PPI_GROUP 0
+#endif
+
+// ticks between the period start and either edge: the count, compare and group tasks each go
+// through PPI one cycle after the event
+#ifndef PWMPLAYER_MARGIN
+#define PWMPLAYER_MARGIN 4
+#endif
+
+#define PWMPLAYER_CLOCK_HZ 16000000UL
+#define PWMPLAYER_MIN_PERIOD (256 + 2 * PWMPLAYER_MARGIN)
+
+// next 8 bit sample, -1 when there is none (the last one is held)
+typedef int (*PwmSampleSource)();
+
+struct PwmTiming {
+  uint16_t period;           // ticks of 16 MHz, TIMER2 counts 0..period - 1
+  uint16_t periodsPerSample;
+};
+
+// The most periods per sample that fit give the highest carrier; of those down to half as many
+// (carriers from about 30 kHz up) the one that comes closest to the rate wins.
+static inline PwmTiming pwmTimingFor(uint32_t rate) {
+  PwmTiming timing = { PWMPLAYER_MIN_PERIOD, 1 };
+  if(rate == 0) return timing;
+  uint32_t ticks = (PWMPLAYER_CLOCK_HZ + rate / 2) / rate;
+  uint32_t most = ticks / PWMPLAYER_MIN_PERIOD;
+  uint32_t bestError = 0xFFFFFFFFUL;
+  for(uint32_t n = most; n >= 1 && n * 2 >= most; n--) {
+    uint32_t period = (ticks + n / 2) / n;
+    uint32_t error = period * n > ticks ? period * n - ticks : ticks - period * n;
+    if(error < bestError) {
+      bestError = error;
+      timing.period = period;
+      timing.periodsPerSample = n;
+    }
+  }
+  return timing;
+}
+
+// the sample rate these settings really play at
+static inline uint32_t pwmTimingRate(PwmTiming timing) {
+  return PWMPLAYER_CLOCK_HZ / ((uint32_t)timing.period * timing.periodsPerSample);
+}
+
+class PwmPlayer {
+public:
+  PwmPlayer(uint8_t pin, PwmSampleSource source, uint8_t slots = PWMPLAYER_SLOTS);
+  void start(uint32_t rate);
+  void stop();
+  boolean isRunning();
+  PwmTiming timing();
+  uint16_t dutyTicks(uint8_t sample);
+  uint32_t interruptCount();
+  uint32_t samplesLoaded();
+private:
+  static PwmPlayer *active; // the one the TIMER1 interrupt feeds
+  uint8_t pin;
+  PwmSampleSource source;
+  uint8_t slots;
+  PwmTiming pwm;
+  boolean running;
+  uint8_t held;
+  uint8_t irqCompare;       // the TIMER1 compare the next interrupt comes from
+  volatile uint32_t irqCount;
+  volatile uint32_t sampleCount;
+  static void timerInterrupt();
+  void refillSlots();
+  void load(uint8_t slot);
+  uint32_t channelMask();
+};
+
+#endif
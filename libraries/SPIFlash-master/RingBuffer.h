@@ -0,0 +1,122 @@
+// Single producer / single consumer ring buffer, e.g. serialEvent() -> loop() or loop() -> a timer
+// interrupt. No locks and no disabled interrupts: the producer only writes head, the consumer
+// only writes tail. Data is published with a release store of the index and picked up with an
+// acquire load, so the other side never sees an index before the bytes it covers.
+//
+// Besides single elements there are bulk push/pop and zero-copy regions:
+//   T *p; uint16_t n = ring.writeRegion(p);  fill p[0..n) ...  ring.commitWrite(n);
+//   const T *p; uint16_t n = ring.readRegion(p);  use p[0..n) ...  ring.commitRead(n);
+// A region is the contiguous part up to the end of the storage; after committing it the
+// wrapped-around remainder is returned by the next call.
+
+#ifndef _RINGBUFFER_H_
+#define _RINGBUFFER_H_
+
+#include <stdint.h>
+#include <string.h>
+
+// N: capacity in elements, a power of 2 up to 32768. Indices run freely over 16 bits and are
+// masked on access, so all N slots can be used.
+template <typename T, uint16_t N>
+class RingBuffer {
+  static_assert(N > 0 && (N & (N - 1)) == 0 && N <= 32768, "RingBuffer size must be a power of 2 up to 32768");
+public:
+  RingBuffer() : head(0), tail(0) {}
+
+  // producer side
+  bool push(const T &value) {
+    uint16_t h = head;
+    if((uint16_t)(h - loadTail()) == N) return false;
+    data[h & (N - 1)] = value;
+    storeHead(h + 1);
+    return true;
+  }
+
+  // copies as many elements as fit, returns how many
+  uint16_t push(const T *buf, uint16_t len) {
+    uint16_t h = head;
+    uint16_t n = N - (uint16_t)(h - loadTail());
+    if(n > len) n = len;
+    uint16_t first = N - (h & (N - 1));
+    if(first > n) first = n;
+    memcpy(&data[h & (N - 1)], buf, first * sizeof(T));
+    memcpy(&data[0], buf + first, (n - first) * sizeof(T));
+    storeHead(h + n);
+    return n;
+  }
+
+  uint16_t writeRegion(T *&ptr) {
+    uint16_t h = head;
+    uint16_t n = N - (uint16_t)(h - loadTail());
+    uint16_t first = N - (h & (N - 1));
+    ptr = &data[h & (N - 1)];
+    return n < first ? n : first;
+  }
+
+  void commitWrite(uint16_t n) {
+    storeHead(head + n);
+  }
+
+  // consumer side
+  bool pop(T &value) {
+    uint16_t t = tail;
+    if(loadHead() == t) return false;
+    value = data[t & (N - 1)];
+    storeTail(t + 1);
+    return true;
+  }
+
+  uint16_t pop(T *buf, uint16_t len) {
+    uint16_t t = tail;
+    uint16_t n = (uint16_t)(loadHead() - t);
+    if(n > len) n = len;
+    uint16_t first = N - (t & (N - 1));
+    if(first > n) first = n;
+    memcpy(buf, &data[t & (N - 1)], first * sizeof(T));
+    memcpy(buf + first, &data[0], (n - first) * sizeof(T));
+    storeTail(t + n);
+    return n;
+  }
+
+  uint16_t readRegion(const T *&ptr) {
+    uint16_t t = tail;
+    uint16_t n = (uint16_t)(loadHead() - t);
+    uint16_t first = N - (t & (N - 1));
+    ptr = &data[t & (N - 1)];
+    return n < first ? n : first;
+  }
+
+  void commitRead(uint16_t n) {
+    storeTail(tail + n);
+  }
+
+  // drops everything that's in the ring; consumer side
+  void clear() {
+    storeTail(loadHead());
+  }
+
+  // either side; a snapshot, the other side may have moved on already
+  uint16_t size() {
+    return (uint16_t)(loadHead() - loadTail());
+  }
+
+  uint16_t space() {
+    return N - size();
+  }
+
+  static uint16_t capacity() {
+    return N;
+  }
+
+private:
+  uint16_t loadHead() { return __atomic_load_n(&head, __ATOMIC_ACQUIRE); }
+  uint16_t loadTail() { return __atomic_load_n(&tail, __ATOMIC_ACQUIRE); }
+  void storeHead(uint16_t h) { __atomic_store_n(&head, h, __ATOMIC_RELEASE); }
+  void storeTail(uint16_t t) { __atomic_store_n(&tail, t, __ATOMIC_RELEASE); }
+
+  uint16_t head; // written by the producer only
+  uint16_t tail; // written by the consumer only
+  T data[N];
+};
+
+#endif
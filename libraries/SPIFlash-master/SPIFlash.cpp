@@ -34,118 +34,265 @@
 
 #include <SPIFlash.h>
 
-volatile byte SerialBuffer::ring_data[RING_SIZE]={0};
-
 int SerialBuffer::add(byte b) {
-  uint16_t next_head = (ring_head + 1) & (RING_SIZE - 1); //or % 512, but less compute-intensive.
-  if(next_head != ring_tail) {
-    // there is room
-    ring_data[ring_head] = b;
-    ring_head = next_head;
-    return 0;
-  } else {
-    return -1;
-  }
+  return push(b) ? 0 : -1;
 }
 
 int SerialBuffer::remove(void) {
-  if(ring_head != ring_tail) {
-    int b = ring_data[ring_tail];
-    ring_tail = (ring_tail + 1 ) & (RING_SIZE - 1);
-    return b;
-  } else {
-    return -1;
-  }
+  byte b;
+  return pop(b) ? b : -1;
 }
 
 void SerialBuffer::reset(void) {
-  ring_tail = ring_head;
+  clear();
 }
 
 uint16_t SerialBuffer::numberOfElements(void) {
-  if(ring_head >= ring_tail) {
-    return ring_head - ring_tail;
-  } else {
-    return RING_SIZE - ring_tail + ring_head;
-  }
+  return size();
 }
 
+uint16_t SerialBuffer::freeSpace(void) {
+  return space();
+}
 
-FlashBuffer::FlashBuffer(uint8_t pin) : flash(pin, 0x140) {
-  // initialize indexTable properly
-  memcpy(indexTable + 1, indexTable, 244); // copy the first FF to all other array elements
-  // read bytes at block beginnings and check header
-  flash.initialize();
-  currentItemAddress = 0;
-  isContinuationOfItem = false;
-  uint8_t blockHeaders[16];
-  for(uint8_t i = 0; i < 16; i++) {
-    blockHeaders[i] = flash.readByte((uint32_t)i << 16 ); // shift to block addresses
-  }
+// add as many bytes as fit, returns how many were added
+uint16_t SerialBuffer::add(const byte *buf, uint16_t len) {
+  return push(buf, len);
+}
 
-  for (latestBlockId = 0; latestBlockId < 15; latestBlockId++) {
-    if (((blockHeaders[latestBlockId] + 1) & 31) != blockHeaders[latestBlockId + 1]) { // see https://www.approxion.com/?p=199, no problem with empty blocks ff, since latest block comes before empty block
-      // block counter wraps around at 32 > 16; difference with 255 (FF) is clear
-      break;
+
+// check byte of a checkpoint entry; never matches an empty (all 0xFF) entry
+static uint8_t checkpointCheck(const uint8_t *entry) {
+  uint8_t sum = 0;
+  for(uint8_t i = 0; i < FLASHBUFFER_CHECKPOINT_SIZE - 1; i++) sum += entry[i];
+  return ~sum;
+}
+
+// the block sequence number after sequence, skipping 0xFFFF (an unwritten block)
+static uint16_t nextSequence(uint16_t sequence) {
+  sequence++;
+  return sequence == 0xFFFF ? 0 : sequence;
+}
+
+FlashBuffer::FlashBuffer(uint8_t pin) : flash(pin, FLASHBUFFER_CHIP_JEDEC >> 8) {
+  memset(directory, 0xFF, sizeof(directory)); // id 0xFF marks a free slot
+  directoryCount = 0;
+  openId = 0xFF;
+  maxBurst = FLASHBUFFER_PAGE_SIZE;
+  invalidateCache();
+  resetCacheStats();
+  resetWriteStats();
+  resumeCallback = 0;
+  pauseCallback = 0;
+  writeState = FLASHBUFFER_WRITE_IDLE;
+  itemPending = itemActive = idleCleaning = directoryDirty = erasedSinceCheckpoint = false;
+  writeOpen = writeOpenHeaders = false;
+  verifyWrites = false;
+  verifyFailureCount = 0;
+  eraseCountAddress = 0xFFFFFFFF;
+  // the chip must be the one the layout was made for, and at least as large (when it says)
+  chipOk = flash.initialize() && (flash.capacity() == 0 || flash.capacity() >= FLASHBUFFER_CAPACITY);
+  latestIndexAddress = 0xFFFFFFFF;
+  uint32_t erasedAhead = 0;
+  boolean reclaimed;
+  if(readCheckpoint(erasedAhead)) {
+    // only what was written after the checkpoint (normally nothing) needs walking
+    uint32_t checkpointAddress = (uint32_t)nextPageId << FLASHBUFFER_PAGE_SHIFT;
+    reclaimed = rollForward(checkpointAddress);
+    uint32_t written = (((uint32_t)nextPageId << FLASHBUFFER_PAGE_SHIFT) - checkpointAddress) & (FLASHBUFFER_CAPACITY - 1);
+    erasedAhead = erasedAhead > written ? erasedAhead - written : 0;
+  } else {
+    // no journal yet: the latest block is the written one the next block's sequence number doesn't
+    // follow on from (the blocks ahead of it are erased or older); walk it (and the block before,
+    // the latest one may start with the rest of an item)
+    uint16_t sequence = readSequence(0);
+    uint16_t latest = 0xFFFF;
+    latestBlockId = 0;
+    for(uint16_t block = 0; block < FLASHBUFFER_BLOCKS; block++) {
+      uint16_t next = readSequence((uint32_t)(block + 1) << FLASHBUFFER_BLOCK_SHIFT); // wraps to block 0 on the last one
+      if(sequence != 0xFFFF && next != nextSequence(sequence)) {
+        latestBlockId = block;
+        latest = sequence;
+        break;
+      }
+      sequence = next;
     }
+    sequence = latest;
+    uint8_t first = latestBlockId;
+    uint8_t previous = (latestBlockId - 1) & (FLASHBUFFER_BLOCKS - 1);
+    if(sequence != 0xFFFF && nextSequence(readSequence((uint32_t)previous << FLASHBUFFER_BLOCK_SHIFT)) == sequence) first = previous;
+    blockSequence = readSequence((uint32_t)first << FLASHBUFFER_BLOCK_SHIFT); // 0xFFFF on a fresh chip: the first block gets 0
+    latestBlockId = first;
+    reclaimed = rollForward((uint32_t)first << FLASHBUFFER_BLOCK_SHIFT);
   }
-  blockCounter = blockHeaders[latestBlockId] > 31 ? 0 : blockHeaders[latestBlockId];
-  checkForLatestItemAddress(((uint32_t)latestBlockId << 16) + 1); //add 1 to skip block header
-  // normally we're on the last iteration of the index table if we look at the last item
-  uint8_t indexTableWithHeader[249]; //if we're on a block boundary we already skipped the header, so 35 * 7 + itemHeader (=4)
-  flash.readBytes(latestItemAddress, indexTableWithHeader, 249);
-  if(indexTableWithHeader[0] == 0x7F) { //largest number with most significant bit (=no partial item) 0 -> this is fixed id for index table by agreement
-    memcpy(indexTable, indexTableWithHeader + 4, 245);
+  // sectors are erased whole before anything is written into them, so the rest of the sector
+  // the next record goes to is still empty; the journal knows how much was erased beyond that
+  uint32_t head = (uint32_t)nextPageId << FLASHBUFFER_PAGE_SHIFT;
+  erasedUntil = (head + FLASHBUFFER_SECTOR_MASK) & ~FLASHBUFFER_SECTOR_MASK;
+  if(head + erasedAhead > erasedUntil) erasedUntil = head + erasedAhead;
+  blankCheck = erasedUntil;
+  eraseTarget = 0;
+  if(latestIndexAddress != 0xFFFFFFFF) loadDirectory(latestIndexAddress);
+  // an item that starts in the erased stretch was erased after the index was written (power loss
+  // before the next index)
+  for(uint16_t slot = 0; slot < FLASHBUFFER_DIRECTORY_SIZE; slot++) {
+    while(directory[slot].id != 0xFF && ((((uint32_t)directory[slot].page << FLASHBUFFER_PAGE_SHIFT) - head) & (FLASHBUFFER_CAPACITY - 1)) < erasedUntil - head) {
+      removeEntry(slot);
+    }
   }
+  // records now go where the torn one claimed to be; a later mount must not walk its header
+  if(reclaimed) while(writeCheckpoint() != FLASHBUFFER_WRITE_IDLE) {}
+}
+
+// sequence number in the header of the block address lies in, 0xFFFF: not written since the erase
+uint16_t FlashBuffer::readSequence(uint32_t address) {
+  uint8_t header[2];
+  flash.readBytes((address & (FLASHBUFFER_CAPACITY - 1) & ~FLASHBUFFER_BLOCK_MASK) + 2, header, 2);
+  return (uint16_t)header[0] << 8 | header[1];
 }
 
+// Finds the latest valid entry of the checkpoint journal and takes the write position, block
+// sequence, index address and the erased stretch ahead from it. Returns false when there is none
+// (fresh chip); the next checkpoint then formats it.
+boolean FlashBuffer::readCheckpoint(uint32_t &erasedAhead) {
+  uint8_t entry[FLASHBUFFER_CHECKPOINT_SIZE];
+  boolean valid[2];
+  uint8_t generation[2];
+  for(uint8_t i = 0; i < 2; i++) {
+    flash.readBytes(FLASHBUFFER_CHECKPOINT_ADDRESS + i * FLASHBUFFER_SECTOR_SIZE, entry, FLASHBUFFER_CHECKPOINT_SIZE);
+    valid[i] = entry[FLASHBUFFER_CHECKPOINT_SIZE - 1] == checkpointCheck(entry);
+    generation[i] = entry[0];
+  }
+  if(!valid[0] && !valid[1]) {
+    checkpointSector = 1;
+    checkpointSlot = FLASHBUFFER_CHECKPOINT_ENTRIES; // full: the first checkpoint erases sector 0
+    checkpointGeneration = 254;
+    return false;
+  }
+  // the sectors take turns, the newer one has the next generation
+  checkpointSector = valid[1] && (!valid[0] || generation[1] == (generation[0] + 1) % 255) ? 1 : 0;
+  checkpointGeneration = generation[checkpointSector];
+  uint32_t sector = FLASHBUFFER_CHECKPOINT_ADDRESS + checkpointSector * FLASHBUFFER_SECTOR_SIZE;
+  // entries are appended in order: binary search for the first free one
+  uint16_t low = 1, high = FLASHBUFFER_CHECKPOINT_ENTRIES;
+  while(low < high) {
+    uint16_t middle = (low + high) / 2;
+    if(flash.readByte(sector + middle * FLASHBUFFER_CHECKPOINT_SIZE) == 0xFF) high = middle;
+    else low = middle + 1;
+  }
+  checkpointSlot = low;
+  // a power loss may have torn the last one, then the one before it counts
+  for(uint16_t slot = low; slot-- > 0;) {
+    flash.readBytes(sector + slot * FLASHBUFFER_CHECKPOINT_SIZE, entry, FLASHBUFFER_CHECKPOINT_SIZE);
+    if(entry[0] != checkpointGeneration || entry[FLASHBUFFER_CHECKPOINT_SIZE - 1] != checkpointCheck(entry)) continue;
+    nextPageId = (uint16_t)entry[1] << 8 | entry[2];
+    uint16_t indexPage = (uint16_t)entry[3] << 8 | entry[4];
+    blockSequence = (uint16_t)entry[5] << 8 | entry[6];
+    latestBlockId = entry[7];
+    erasedAhead = (uint32_t)((uint16_t)entry[8] << 8 | entry[9]) << FLASHBUFFER_PAGE_SHIFT;
+    if(indexPage != 0xFFFF) {
+      latestIndexAddress = (uint32_t)indexPage << FLASHBUFFER_PAGE_SHIFT;
+      if((latestIndexAddress & FLASHBUFFER_BLOCK_MASK) == 0) latestIndexAddress += FLASHBUFFER_BLOCK_HEADER;
+    }
+    return true;
+  }
+  return false;
+}
 
-uint16_t FlashBuffer::checkForLatestItemAddress(uint32_t address) {
-  uint8_t itemHeader[4]; //1 byte id; 3 bytes length. Indicate partial items in most significant bit -> still 127 items possible
-  flash.readBytes(address, itemHeader, 4);
-  if(itemHeader[0] == 0xFF) { //still empty
-    // next case only occurs when mem is empty; otherwise latestBlockId would still be the previous blockHeaders
-    if(currentItemAddress == 0 && !isContinuationOfItem) {//
-      latestItemAddress = 0;
-      nextPageId = 0;
-      return latestItemAddress;
-    } else if(currentItemAddress == 0 && isContinuationOfItem){
-       return checkForLatestItemAddress(((uint32_t)(latestBlockId - 1 & 15) << 16) + 1);
+// Walks the records from address (the start of a page) up to the first empty page, one header
+// read per record, and sets nextPageId, latestBlockId, blockSequence and latestIndexAddress.
+// Continuations at block starts only count when their sequence number follows on: a record whose
+// header promises more than was written (power loss) ends where the writing stopped. The last
+// record isn't indexed yet, so the writer goes on right after the part of it that was programmed
+// (a torn copy would otherwise take all the room it promised); returns true when that moved the
+// write position back.
+boolean FlashBuffer::rollForward(uint32_t address) {
+  uint32_t lastRecord = 0xFFFFFFFF, lastEnd = 0;
+  for(uint32_t records = 0; records < FLASHBUFFER_PAGES; records++) { // at most one record per page
+    uint8_t header[FLASHBUFFER_BLOCK_HEADER + 4];
+    uint8_t *record = header + FLASHBUFFER_BLOCK_HEADER;
+    boolean onNewBlock = (address & FLASHBUFFER_BLOCK_MASK) == 0;
+    if(onNewBlock) {
+      flash.readBytes(address & (FLASHBUFFER_CAPACITY - 1), header, sizeof(header));
+      uint16_t sequence = (uint16_t)header[2] << 8 | header[3];
+      if(sequence == 0xFFFF || (sequence != blockSequence && sequence != nextSequence(blockSequence))) break; // empty or older
+      blockSequence = sequence;
+      latestBlockId = address >> FLASHBUFFER_BLOCK_SHIFT & (FLASHBUFFER_BLOCKS - 1);
     } else {
-      latestItemAddress = currentItemAddress;
-      return latestItemAddress;
+      flash.readBytes(address & (FLASHBUFFER_CAPACITY - 1), record, 4);
+    }
+    if(record[0] == 0xFF) break; //still empty
+    uint32_t length = (uint32_t)record[1] << 16 | (uint32_t)record[2] << 8 | record[3];
+    uint8_t entry = 7;
+    if(record[0] == 0x7F && (length & FLASHBUFFER_INDEX_CRC)) {
+      length &= ~FLASHBUFFER_INDEX_CRC;
+      entry = FLASHBUFFER_INDEX_ENTRY;
     }
-  } else{
-    isContinuationOfItem = itemHeader[0] >> 7; // long items can span multiple blocks; in that case backtrack on previous block
-    if(!isContinuationOfItem) {
-      currentItemAddress = address;
+    uint32_t end = recordEnd(address, length);
+    // the index, fixed id by agreement; only once its last entry was programmed (it never crosses a block)
+    lastRecord = address;
+    if(record[0] == 0x7F && (length == 0 || flash.readByte((end - entry) & (FLASHBUFFER_CAPACITY - 1)) != 0xFF)) {
+      latestIndexAddress = (address & (FLASHBUFFER_CAPACITY - 1)) + (onNewBlock ? FLASHBUFFER_BLOCK_HEADER : 0);
+      lastRecord = 0xFFFFFFFF;
     }
-    uint32_t length = itemHeader[1] << 16 | itemHeader[2] << 8 | itemHeader[3];
-    uint32_t nextAddress = address + 4 + length;
-    uint32_t realNextAddress = nextAddress;
-    uint8_t i = 0;
-    while(realNextAddress > (uint32_t)latestBlockId + 1 + i << 16) { //check for block crosses
-      realNextAddress = nextAddress + 5 * (i + 1); // block header plus repeat file header
+    // the blocks the record goes on into must have been started
+    uint32_t block = (address | FLASHBUFFER_BLOCK_MASK) + 1;
+    while(block < end) {
+      uint16_t sequence = readSequence(block);
+      if(sequence != nextSequence(blockSequence)) {
+        end = block;
+        break;
+      }
+      blockSequence = sequence;
+      latestBlockId = block >> FLASHBUFFER_BLOCK_SHIFT & (FLASHBUFFER_BLOCKS - 1);
+      block += FLASHBUFFER_BLOCK_SIZE;
     }
-    nextPageId = (realNextAddress >> 8) + 1 * ((realNextAddress & 255) != 0); //divide by 256 and if remainder != 0 add 1
-    realNextAddress = (uint32_t)nextPageId << 8;
-    if((realNextAddress & 65535) == 0) realNextAddress++; //add byte for block header if it's on a block
-    return checkForLatestItemAddress(realNextAddress);
+    lastEnd = (end + FLASHBUFFER_PAGE_MASK) & ~FLASHBUFFER_PAGE_MASK;
+    address = nextRecordAddress(end);
+  }
+  boolean reclaimed = false;
+  if(lastRecord != 0xFFFFFFFF) {
+    while(lastEnd > lastRecord + FLASHBUFFER_PAGE_SIZE) {
+      if(((lastEnd - FLASHBUFFER_PAGE_SIZE) & (FLASHBUFFER_CAPACITY - 1)) >= FLASHBUFFER_CHECKPOINT_ADDRESS) {
+        lastEnd -= FLASHBUFFER_CAPACITY - FLASHBUFFER_CHECKPOINT_ADDRESS; // the record goes around the journal
+        continue;
+      }
+      if(!pageBlank(lastEnd - FLASHBUFFER_PAGE_SIZE)) break;
+      lastEnd -= FLASHBUFFER_PAGE_SIZE;
+      reclaimed = true;
+    }
+    if(reclaimed) address = skipJournal(lastEnd);
+  }
+  nextPageId = (address & (FLASHBUFFER_CAPACITY - 1)) >> FLASHBUFFER_PAGE_SHIFT;
+  return reclaimed;
+}
+
+// true when the page at address reads all 0xFF
+boolean FlashBuffer::pageBlank(uint32_t address) {
+  uint8_t page[FLASHBUFFER_PAGE_SIZE];
+  flash.readBytes(address & (FLASHBUFFER_CAPACITY - 1), page, FLASHBUFFER_PAGE_SIZE);
+  for(uint16_t i = 0; i < FLASHBUFFER_PAGE_SIZE; i++) {
+    if(page[i] != 0xFF) return false;
   }
+  return true;
 }
 
 void FlashBuffer::print(void) {
 
   Serial.print("latestBlockId: ");
   Serial.println(latestBlockId);
-  Serial.print("blockCounter: ");
-  Serial.println(blockCounter);
-  Serial.print("latestItemAddress: ");
-  Serial.println(latestItemAddress);
-  Serial.print("currentItemAddress: ");
-  Serial.println(currentItemAddress);
+  Serial.print("blockSequence: ");
+  Serial.println(blockSequence);
+  Serial.print("latestIndexAddress: ");
+  Serial.println(latestIndexAddress);
+  Serial.print("checkpoint: ");
+  Serial.println(checkpointSector * FLASHBUFFER_CHECKPOINT_ENTRIES + checkpointSlot);
   Serial.print("nextPageId: ");
   Serial.println(nextPageId);
+  Serial.print("erasedUntil: ");
+  Serial.println(erasedUntil);
+  Serial.print("items: ");
+  Serial.println(directoryCount);
 }
 
 void FlashBuffer::setResumeCallback(void (*aFunc) ()) {
@@ -156,264 +303,1150 @@ void FlashBuffer::setPauseCallback(void (*aFunc) ()) {
   pauseCallback = aFunc;
 }
 
-void FlashBuffer::writeItemToFlash(uint8_t id, uint32_t length, SerialBuffer &serialBuffer) {
-    // we start at beginning of page
-  uint32_t originalLength = length;
-  uint32_t startAddress = (uint32_t)nextPageId << 8;
-  uint32_t addressInIndex = startAddress;
-  uint16_t n;
-  boolean onNewBlock = false;
-  if((startAddress & 65535) == 0) {
-    onNewBlock = true;
-    if(flash.readByte(startAddress) != 0xFF) {//not an empty block -> erase it
-      flash.blockErase64K(startAddress);
-      // erase elements from array if necessary
-      for(uint8_t i = 0; i < 35; i++) {
-        uint32_t itemAddress = indexTable[i * 7 + 1] << 16 | indexTable[i * 7 + 2] << 8 | indexTable[i * 7 + 3];
-        if(itemAddress != 0xFFFFFF && startAddress <=  itemAddress && itemAddress < startAddress + 65536) {
-          for(uint8_t j = 0; j < 7; j++) {
-            indexTable[i * 7 + j] = 0xFF;
-          }
-        }
-      }
+// Blocking: writes the whole item, waiting for the sender while the ring is empty.
+void FlashBuffer::writeItemToFlash(uint8_t id, uint32_t length, SerialBuffer &serialBuffer, uint8_t format) {
+  if(!startItem(id, length, serialBuffer, format)) return;
+  uint8_t state;
+  while((state = writeStep()) != FLASHBUFFER_WRITE_IDLE) {
+    if(state == FLASHBUFFER_WRITE_WAITING) delayMicroseconds(50); // the UART interrupt keeps filling the ring
+  }
+}
+
+// Non-blocking: start writing an item whose payload will arrive in serialBuffer, then call
+// writeStep() from loop() until it returns FLASHBUFFER_WRITE_IDLE. Returns false while the
+// previous item is still being written, and for ids outside 0..0x7E (0x7F is the index record,
+// bit 7 marks the continuation of an item in the next block).
+boolean FlashBuffer::startItem(uint8_t id, uint32_t length, SerialBuffer &serialBuffer, uint8_t format) {
+  if(itemActive || id >= 0x7F) return false;
+  writeItemId = id;
+  writeItemFormat = format;
+  writeItemLength = length;
+  writeItemSource = &serialBuffer;
+  itemActive = itemPending = true;
+  writeOpen = writeOpenHeaders = false;
+  idleCleaning = false; // cleaning started by eraseStep goes on for the item
+  if(writeState == FLASHBUFFER_WRITE_IDLE) writeState = WRITE_CLEAN;
+  return true;
+}
+
+boolean FlashBuffer::writing() {
+  return itemActive;
+}
+
+// Non-blocking, like startItem(), for an item whose length isn't known yet: the payload is
+// whatever goes into serialBuffer (directly or through appendStream()) until closeStream().
+// Call writeStep() from loop() meanwhile and afterwards, until it returns FLASHBUFFER_WRITE_IDLE.
+// The cleaner makes room for reserve bytes first (relocating or evicting live items, as for an
+// upload of that length); beyond that the stream only goes on through flash that holds no live
+// items, and is closed as it is once it runs out of that (streaming() turns false, the bytes
+// left in the ring aren't part of it).
+boolean FlashBuffer::openStream(uint8_t id, SerialBuffer &serialBuffer, uint8_t format, uint32_t reserve) {
+  uint32_t most = FLASHBUFFER_CHECKPOINT_ADDRESS / 100 * FLASHBUFFER_MAX_FILL;
+  if(!startItem(id, reserve < most ? reserve : most, serialBuffer, format)) return false;
+  writeOpen = true;
+  return true;
+}
+
+// adds as much of buf to the open stream as the ring takes, returns how much that was
+uint16_t FlashBuffer::appendStream(const byte *buf, uint16_t len) {
+  return writeOpen ? writeItemSource->add(buf, len) : 0;
+}
+
+// Ends the stream: what is in the ring now is the rest of it. Returns false when no stream is open
+// (never opened, or closed because it ran out of room).
+boolean FlashBuffer::closeStream() {
+  if(!writeOpen) return false;
+  endStream(false);
+  return true;
+}
+
+boolean FlashBuffer::streaming() {
+  return writeOpen;
+}
+
+// One step of the writer, never waits: first makes room for the item (see cleanStep), then
+// programs the next page once the ring holds all of its bytes and the chip is done with the
+// previous page. While it waits for data it erases ahead (see eraseAhead). While the chip
+// programs or erases, loop() goes on and the UART interrupt fills the ring for the next page.
+// Returns FLASHBUFFER_WRITE_WAITING when there was nothing to do yet (no data or
+// chip busy), FLASHBUFFER_WRITE_PROGRESS when it did something, FLASHBUFFER_WRITE_IDLE when the
+// item and its index are written.
+uint8_t FlashBuffer::writeStep() {
+  if(eraseCountAddress != 0xFFFFFFFF) {
+    // the erase count goes back into the block header as soon as the erase is done
+    if(flash.busy()) return FLASHBUFFER_WRITE_WAITING;
+    writeEraseCount();
+    return FLASHBUFFER_WRITE_PROGRESS;
+  }
+  switch(writeState) {
+  case WRITE_CLEAN:
+    return cleanStep();
+  case WRITE_RELOCATE:
+    if(writeRemaining > 0) return writePage();
+    setNextPage(nextRecordAddress(writeAddress));
+    putEntry(writeCopy.id, writeRecordAddress >> FLASHBUFFER_PAGE_SHIFT & (FLASHBUFFER_PAGES - 1), writeOffset, writeCopyFormat, writeCopyCrc);
+    openId = 0xFF;
+    relocationCount++;
+    writeState = WRITE_CLEAN;
+    return FLASHBUFFER_WRITE_PROGRESS;
+  case WRITE_ITEM:
+    if(writeOpen) streamRoom();
+    if(writeRemaining > 0) return writePage();
+    if(writeOpenHeaders) return sealHeader(); // a stream: its headers get their lengths first
+    // the item is complete: (re)index it, then write the index on the next page
+    setNextPage(nextRecordAddress(writeAddress));
+    if(verifyWrites) {
+      writeState = WRITE_VERIFY; // what wasn't read back while waiting for data first
+      return FLASHBUFFER_WRITE_PROGRESS;
     }
+    putEntry(writeItemId, writeRecordAddress >> FLASHBUFFER_PAGE_SHIFT & (FLASHBUFFER_PAGES - 1), writeOffset,
+             writeItemFormat | FLASHBUFFER_FORMAT_CHECKED, crc32Final(writeCrc));
+    openId = 0xFF;
+    writeState = WRITE_INDEX_START;
+    return FLASHBUFFER_WRITE_PROGRESS;
+  case WRITE_VERIFY:
+    // a page per step, once the chip has programmed the last one; an item that doesn't read back
+    // as it went in isn't indexed (its old version is gone already: it has to be uploaded again)
+    if(flash.busy()) return FLASHBUFFER_WRITE_WAITING;
+    if(verifyCursor.remaining > 0) {
+      verifyPage();
+      return FLASHBUFFER_WRITE_PROGRESS;
+    }
+    if(verifyCursor.crc == writeCrc) {
+      putEntry(writeItemId, writeRecordAddress >> FLASHBUFFER_PAGE_SHIFT & (FLASHBUFFER_PAGES - 1), writeOffset,
+               writeItemFormat | FLASHBUFFER_FORMAT_CHECKED, crc32Final(writeCrc));
+    } else {
+      verifyFailureCount++;
+    }
+    openId = 0xFF;
+    writeState = WRITE_INDEX_START;
+    return FLASHBUFFER_WRITE_PROGRESS;
+  case WRITE_INDEX_START: {
+    // The index never crosses a block: its continuation id (0x7F | 0x80) would read as empty flash.
+    // If it doesn't fit, leave the rest of the block unused and start it on the next block.
+    uint32_t address = (uint32_t)nextPageId << FLASHBUFFER_PAGE_SHIFT;
+    if((address & FLASHBUFFER_BLOCK_MASK) != 0 && 4UL + directoryCount * (uint32_t)FLASHBUFFER_INDEX_ENTRY > blockEnd(address) - address) {
+      if(erasedUntil < (address | FLASHBUFFER_BLOCK_MASK) + 1) erasedUntil = blankCheck = (address | FLASHBUFFER_BLOCK_MASK) + 1; // the skipped pages are never read
+      setNextPage((address | FLASHBUFFER_BLOCK_MASK) + 1);
+      address = (uint32_t)nextPageId << FLASHBUFFER_PAGE_SHIFT;
+    }
+    // erase all of it first: that may drop items, and the index length must be known up front
+    eraseTarget = indexEnd(address, directoryCount);
+    uint8_t state = eraseAhead(eraseTarget);
+    if(state != FLASHBUFFER_WRITE_IDLE) return state;
+    beginRecord(0x7F, directoryCount * (uint32_t)FLASHBUFFER_INDEX_ENTRY, SOURCE_INDEX); // 0x7F: fixed id for the index by agreement
+    latestIndexAddress = writeAddress + ((writeAddress & FLASHBUFFER_BLOCK_MASK) == 0 ? FLASHBUFFER_BLOCK_HEADER : 0);
+    directoryDirty = false;
+    writeState = WRITE_INDEX;
+    return FLASHBUFFER_WRITE_PROGRESS;
   }
-  uint16_t maxBytes = 256;  // aligned with page
-  boolean firstPage = onNewBlock? false : true; //on new block have to rewrite headers anyway
-  while (length > 0)
-  {
-    // n: number of bytes that will be written to the page
-    n = (length + 5 * onNewBlock + 4 * firstPage <= maxBytes) ? length : maxBytes - 5 * onNewBlock - 4 * firstPage; //how much is written of the file itself without headers.
-    flash.command(SPIFLASH_BYTEPAGEPROGRAM, true);  // Byte/Page Program
-    SPI.transfer(startAddress >> 16);
-    SPI.transfer(startAddress >> 8);
-    SPI.transfer(startAddress);
-    if(onNewBlock) {
-      blockCounter = blockCounter + 1 & 31;
-      latestBlockId = latestBlockId + 1 & 15;
-      SPI.transfer(blockCounter);
+  case WRITE_INDEX:
+    if(writeRemaining > 0) return writePage();
+    setNextPage(nextRecordAddress(writeAddress));
+    writeState = WRITE_CHECKPOINT;
+    return FLASHBUFFER_WRITE_PROGRESS;
+  case WRITE_CHECKPOINT: {
+    uint8_t state = writeCheckpoint();
+    if(state != FLASHBUFFER_WRITE_IDLE) return state;
+    if(itemPending || idleCleaning) {
+      writeState = WRITE_CLEAN; // that index was for moved or evicted items, go on cleaning
+      return FLASHBUFFER_WRITE_PROGRESS;
     }
-    if(firstPage || onNewBlock) {
-      SPI.transfer(id);
-      SPI.transfer(length >> 16);
-      SPI.transfer(length >> 8);
-      SPI.transfer(length);
+    writeState = FLASHBUFFER_WRITE_IDLE;
+    itemActive = false;
+    return FLASHBUFFER_WRITE_IDLE;
+  }
+  }
+  return FLASHBUFFER_WRITE_IDLE;
+}
+
+// The log is cleaned from its tail, an erase unit at a time: the live items in the next unit are
+// copied to the head first (relocated), or evicted when the chip is too full to keep them, and the
+// index is written before the unit is erased, so a power loss never leaves it pointing at erased
+// flash. Every block is erased once per pass through the chip, so wear is spread evenly however
+// often one item is rewritten. Ahead of an item the whole span of the item and its index is
+// cleaned (what isn't live is erased while the item is written), between items (eraseStep) the
+// rest of the current block and the next one. Beyond that it keeps room for the largest live item
+// erased (reserveBytes), otherwise the cleaner could find an item at the tail and no room to
+// copy it to; between items room for two, so a copy torn by a power loss doesn't use it up. The
+// reserve never reaches further than the free space: one big item mustn't evict the others.
+uint8_t FlashBuffer::cleanStep() {
+  uint32_t head = (uint32_t)nextPageId << FLASHBUFFER_PAGE_SHIFT;
+  uint32_t start = itemPending ? indexEnd(nextRecordAddress(recordEnd(head, writeItemLength)), directoryCount + 1) : head;
+  uint32_t until = start + (itemPending ? reserveBytes() : 2 * reserveBytes());
+  uint32_t reach = head + FLASHBUFFER_CHECKPOINT_ADDRESS - liveBytes(); // beyond the free space there are only live items
+  if(until > reach) until = reach > start ? reach : start;
+  if(!itemPending && until < (head | FLASHBUFFER_BLOCK_MASK) + 1 + FLASHBUFFER_BLOCK_SIZE) until = (head | FLASHBUFFER_BLOCK_MASK) + 1 + FLASHBUFFER_BLOCK_SIZE;
+  until = (until + FLASHBUFFER_SECTOR_MASK) & ~FLASHBUFFER_SECTOR_MASK; // erased a sector at a time
+  if((erasedUntil & (FLASHBUFFER_CAPACITY - 1)) == FLASHBUFFER_CHECKPOINT_ADDRESS) erasedUntil = blankCheck = skipJournal(erasedUntil);
+  if(erasedUntil < until) {
+    // the oldest live item on the way goes once it fits in the erased room (between items: with
+    // the reserve to spare, what a copy torn by a power loss takes), right away when it will be
+    // evicted, or once it is in the next sector; until then the dead sectors before it are erased
+    // to make room
+    uint16_t slot = oldestIn(erasedUntil, until - erasedUntil);
+    if(slot != FLASHBUFFER_NO_SLOT && (fitsRoom(slot, itemPending ? 0 : reserveBytes()) || overFull() || oldestIn(erasedUntil, FLASHBUFFER_SECTOR_SIZE) != FLASHBUFFER_NO_SLOT)) {
+      moveOut(slot);
+      return FLASHBUFFER_WRITE_PROGRESS;
     }
+  }
+  if(directoryDirty) {
+    writeState = WRITE_INDEX_START; // before erasing where the old copies were
+    return FLASHBUFFER_WRITE_PROGRESS;
+  }
+  if(itemPending && (erasedUntil >= until || oldestIn(erasedUntil, until - erasedUntil) == FLASHBUFFER_NO_SLOT)) {
+    itemPending = false;
+    beginRecord(writeItemId, writeItemLength, SOURCE_RING);
+    if(writeOpen) writeRemaining = FLASHBUFFER_LENGTH_OPEN; // until closeStream()
+    writeState = WRITE_ITEM;
+    return FLASHBUFFER_WRITE_PROGRESS;
+  }
+  uint8_t state = eraseAhead(until);
+  if(state != FLASHBUFFER_WRITE_IDLE) return state;
+  if(erasedSinceCheckpoint) {
+    writeState = WRITE_CHECKPOINT; // so the next mount knows what is erased already
+    return FLASHBUFFER_WRITE_PROGRESS;
+  }
+  idleCleaning = false;
+  writeState = FLASHBUFFER_WRITE_IDLE;
+  return FLASHBUFFER_WRITE_IDLE;
+}
 
-    for (uint16_t i = 0; i < n; i++)  {
-      int readValue;
-      while((readValue = serialBuffer.remove()) == -1) {
-        delay(200);
-      }
-      SPI.transfer((uint8_t) readValue);
+// Gets the item in slot out of the way of the cleaner: copies it to the head when there is erased
+// room for it (and its index) and the live items, the item being uploaded and the reserve stay
+// within FLASHBUFFER_MAX_FILL, otherwise drops it. The old version of the item being uploaded is
+// just dropped.
+void FlashBuffer::moveOut(uint16_t slot) {
+  DirEntry &entry = directory[slot];
+  ItemCursor cursor;
+  if(itemPending && entry.id == writeItemId) {
+    removeEntry(slot);
+  } else if(!overFull() && fitsRoom(slot, 0) && openItem(entry.id, cursor)) {
+    writeCopy = cursor;
+    writeCopyFormat = entry.format;
+    writeCopyCrc = entry.crc; // the copy is checked against the original's
+    beginRecord(entry.id, entry.length, SOURCE_FLASH);
+    eraseTarget = erasedUntil;
+    writeState = WRITE_RELOCATE;
+  } else {
+    removeEntry(slot);
+    evictionCount++;
+  }
+  directoryDirty = true;
+  openId = 0xFF;
+}
+
+// whether the live items, the item being uploaded and the reserve go beyond FLASHBUFFER_MAX_FILL
+boolean FlashBuffer::overFull() {
+  uint32_t live = liveBytes() + (itemPending ? writeItemLength + 4 : 0) + reserveBytes();
+  return live > FLASHBUFFER_CHECKPOINT_ADDRESS / 100 * FLASHBUFFER_MAX_FILL;
+}
+
+// whether a copy of the item in slot and the index after it fit in the erased room at the head,
+// with spare bytes left over
+boolean FlashBuffer::fitsRoom(uint16_t slot, uint32_t spare) {
+  uint32_t head = (uint32_t)nextPageId << FLASHBUFFER_PAGE_SHIFT;
+  return indexEnd(nextRecordAddress(recordEnd(head, directory[slot].length)), directoryCount) + spare <= erasedUntil;
+}
+
+// A record (header + payload) starts on the next free page. The payload comes from the ring
+// (SOURCE_RING), the directory (SOURCE_INDEX) or another place in flash (SOURCE_FLASH, writeCopy).
+void FlashBuffer::beginRecord(uint8_t id, uint32_t length, uint8_t source) {
+  writeAddress = (uint32_t)nextPageId << FLASHBUFFER_PAGE_SHIFT;
+  writeRecordAddress = writeAddress;
+  writeId = id;
+  writeRemaining = length;
+  writeOffset = 0;
+  writeCrc = CRC32_INIT;
+  writeFirstPage = true;
+  writeSource = source;
+  if(source == SOURCE_RING) {
+    // erase ahead for the whole item, its index and the page after that (where mounting stops)
+    eraseTarget = indexEnd(nextRecordAddress(recordEnd(writeAddress, length)), directoryCount + 1);
+    // the verify pass follows the payload as it is programmed (remaining: programmed, not read back)
+    uint32_t address = writeAddress & (FLASHBUFFER_CAPACITY - 1);
+    if((address & FLASHBUFFER_BLOCK_MASK) == 0) address += FLASHBUFFER_BLOCK_HEADER;
+    verifyCursor.id = id;
+    verifyCursor.address = address + 4;
+    verifyCursor.remaining = 0;
+    verifyCursor.crc = CRC32_INIT;
+    verifyCursor.whole = true;
+  }
+  invalidateCache(); // cached pages may be erased or programmed below
+}
+
+uint8_t FlashBuffer::writePage() {
+  // this page and the next one must be erased: mounting stops at the first empty page after a record
+  uint32_t needed = nextRecordAddress(writeAddress + FLASHBUFFER_PAGE_SIZE) + FLASHBUFFER_PAGE_SIZE;
+  if(needed > eraseTarget) needed = eraseTarget;
+  if(erasedUntil < needed) return eraseAhead(eraseTarget);
+  boolean onNewBlock = (writeAddress & FLASHBUFFER_BLOCK_MASK) == 0;
+  uint16_t header = onNewBlock ? FLASHBUFFER_BLOCK_HEADER + 4 : writeFirstPage ? 4 : 0; // on a new block the headers are repeated
+  // n: number of bytes of the record itself that go into this page
+  uint16_t n = writeRemaining + header <= FLASHBUFFER_PAGE_SIZE ? writeRemaining : FLASHBUFFER_PAGE_SIZE - header;
+  if(writeSource == SOURCE_RING && writeItemSource->numberOfElements() < n) {
+    // meanwhile erase ahead for the rest of the item, while the chip would be idle anyway; a
+    // stream can't be held back, so only right after a page, with the ring as empty as it gets
+    if((!writeOpen || writeItemSource->numberOfElements() < FLASHBUFFER_PAGE_SIZE / 8) &&
+       eraseAhead(eraseTarget) == FLASHBUFFER_WRITE_PROGRESS) return FLASHBUFFER_WRITE_PROGRESS;
+    // or read back what was programmed, so little is left for the verify pass at the end
+    if(verifyWrites && verifyCursor.remaining > 0 && !flash.busy()) {
+      verifyPage();
+      return FLASHBUFFER_WRITE_PROGRESS;
+    }
+    if(resumeCallback) resumeCallback(); // the sender may be waiting for credits
+    return FLASHBUFFER_WRITE_WAITING;
+  }
+  if(flash.busy()) return FLASHBUFFER_WRITE_WAITING;
+  uint8_t copy[FLASHBUFFER_PAGE_SIZE];
+  if(writeSource == SOURCE_FLASH) readItemBytes(writeCopy, copy, n); // before the program command takes the bus
+  // on a new block the program starts after the erase count, which was programmed after the erase;
+  // writeAddress runs on past the end of the layout until setNextPage() takes it back, the chip doesn't
+  uint32_t address = (onNewBlock ? writeAddress + 2 : writeAddress) & (FLASHBUFFER_CAPACITY - 1);
+  flash.command(SPIFLASH_BYTEPAGEPROGRAM, true);  // Byte/Page Program
+  // address, erase count and item header go out in one call
+  uint8_t prefix[9] = { (uint8_t)(address >> 16), (uint8_t)(address >> 8), (uint8_t)address };
+  uint8_t p = 3;
+  if(onNewBlock) {
+    blockSequence = nextSequence(blockSequence);
+    latestBlockId = writeAddress >> FLASHBUFFER_BLOCK_SHIFT & (FLASHBUFFER_BLOCKS - 1);
+    prefix[p++] = blockSequence >> 8;
+    prefix[p++] = blockSequence;
+  }
+  if(header) {
+    uint32_t length = writeOpen ? FLASHBUFFER_LENGTH_OPEN : writeRemaining;
+    if(writeOpen) writeOpenHeaders = true;
+    if(writeSource == SOURCE_INDEX) length |= FLASHBUFFER_INDEX_CRC; // its entries have CRCs
+    prefix[p++] = writeId;
+    prefix[p++] = length >> 16;
+    prefix[p++] = length >> 8;
+    prefix[p++] = length;
+  }
+  SpiBus::send(prefix, p);
+  if(writeSource == SOURCE_RING) {
+    // straight from the ring's storage, a contiguous region at a time
+    for(uint16_t i = 0; i < n;) {
+      const byte *region;
+      uint16_t available = writeItemSource->readRegion(region);
+      if(available > n - i) available = n - i;
+      SpiBus::send(region, available);
+      writeCrc = crc32Update(writeCrc, region, available);
+      writeItemSource->commitRead(available);
+      i += available;
     }
-    flash.unselect();
-
-    startAddress+= n + 5 * onNewBlock + 4 * firstPage;  // adjust the addresses and remaining bytes by what we've just transferred.
-    length -= n;
-    if((startAddress & 65535) == 0) {
-      onNewBlock = true;
-      id = id | 0x80; // set most significant bit to 1 for partials
-      if(flash.readByte(startAddress) != 0xFF) {//not an empty block -> erase it
-        flash.blockErase64K(startAddress);
-        // erase elements from array if necessary
-        for(uint8_t i = 0; i < 35; i++) {
-          uint32_t itemAddress = indexTable[i * 7 + 1] << 16 | indexTable[i * 7 + 2] << 8 | indexTable[i * 7 + 3];
-          if(itemAddress != 0xFFFFFF && startAddress <=  itemAddress && itemAddress < startAddress + 65536) {
-            for(uint8_t j = 0; j < 7; j++) {
-              indexTable[i * 7 + j] = 0xFF;
-            }
-          }
-        }
+    writtenBytes += n;
+    verifyCursor.remaining += n;
+  } else if(writeSource == SOURCE_FLASH) {
+    SpiBus::send(copy, n);
+  } else {
+    transferIndex(writeOffset, n);
+  }
+  flash.unselect(); // the chip programs the page now, we don't wait for it
+  programmedBytes += n + header - (onNewBlock ? 2 : 0);
+
+  writeAddress += n + header;
+  writeRemaining -= n;
+  writeOffset += n;
+  writeFirstPage = false;
+  if(writeAddress == blockEnd(writeAddress - 1)) {
+    writeAddress = skipJournal(writeAddress);
+    writeId |= 0x80; // set most significant bit to 1 for partials
+  }
+  if(writeSource == SOURCE_RING && resumeCallback) resumeCallback(); // a page worth of ring space was freed; the callback decides whether that's enough to resume
+  return FLASHBUFFER_WRITE_PROGRESS;
+}
+
+// reads back up to a page of what the writer programmed from the ring, into verifyCursor's CRC
+void FlashBuffer::verifyPage() {
+  uint8_t page[FLASHBUFFER_PAGE_SIZE];
+  readItemBytes(verifyCursor, page, FLASHBUFFER_PAGE_SIZE);
+}
+
+// An open stream keeps FLASHBUFFER_STREAM_AHEAD erased ahead of it, a sector at a time, but only
+// through flash without live items: dropping one takes an index first, which can't go in the
+// middle of a record. Once the next page, the index and the page mounting stops at don't fit any
+// more, the stream is closed as it is.
+void FlashBuffer::streamRoom() {
+  uint32_t needed = indexEnd(nextRecordAddress(writeAddress + FLASHBUFFER_PAGE_SIZE), directoryCount + 1);
+  if(!streamErasable(needed)) {
+    endStream(true);
+    return;
+  }
+  if(eraseTarget < needed) eraseTarget = needed;
+  uint32_t ahead = indexEnd(nextRecordAddress(writeAddress + FLASHBUFFER_STREAM_AHEAD), directoryCount + 1);
+  if(eraseTarget < ahead && streamErasable(eraseTarget + FLASHBUFFER_SECTOR_SIZE)) eraseTarget += FLASHBUFFER_SECTOR_SIZE;
+}
+
+// whether everything up to until is erased or can be erased for the stream: no live items, and
+// short of the block the stream started in
+boolean FlashBuffer::streamErasable(uint32_t until) {
+  if(until > (writeRecordAddress & ~FLASHBUFFER_BLOCK_MASK) + FLASHBUFFER_CAPACITY) return false;
+  for(uint32_t address = erasedUntil; address < until; address += FLASHBUFFER_SECTOR_SIZE) {
+    address = skipJournal(address);
+    if(address < until && oldestIn(address, FLASHBUFFER_SECTOR_SIZE) != FLASHBUFFER_NO_SLOT) return false;
+  }
+  return true;
+}
+
+// The stream ends with what is in the ring now (full: with what was written). Before its record
+// started it simply becomes an item of that length.
+void FlashBuffer::endStream(boolean full) {
+  uint32_t rest = full ? 0 : writeItemSource->numberOfElements();
+  writeOpen = false;
+  if(itemPending) {
+    writeItemLength = rest;
+    return;
+  }
+  writeRemaining = rest;
+  sealAddress = writeRecordAddress;
+  sealRemaining = writeOffset + rest;
+}
+
+// Programs the length into the next header of a closed stream, from the first one on: the bytes
+// after the first header count down block by block, as recordEnd() counts them.
+uint8_t FlashBuffer::sealHeader() {
+  if(flash.busy()) return FLASHBUFFER_WRITE_WAITING;
+  uint32_t header = (sealAddress & FLASHBUFFER_BLOCK_MASK) == 0 ? FLASHBUFFER_BLOCK_HEADER + 4 : 4;
+  uint8_t length[3] = { (uint8_t)(sealRemaining >> 16), (uint8_t)(sealRemaining >> 8), (uint8_t)sealRemaining };
+  flash.writeBytes((sealAddress + header - 3) & (FLASHBUFFER_CAPACITY - 1), length, 3);
+  programmedBytes += 3;
+  uint32_t room = blockEnd(sealAddress) - sealAddress - header;
+  if(sealRemaining > room) {
+    sealRemaining -= room;
+    sealAddress = (sealAddress | FLASHBUFFER_BLOCK_MASK) + 1;
+  } else {
+    writeOpenHeaders = false;
+  }
+  return FLASHBUFFER_WRITE_PROGRESS;
+}
+
+// The unit eraseAhead erases next at address on its way to until. The erase size follows what is
+// left to erase: a short item only costs a sector, a long one is erased a block at a time. A
+// larger aligned erase is taken once more than half of it is needed, it takes less time than the
+// 4K erases it replaces (64K: 150 ms, 4K: 30 ms), but never across the journal or into live items.
+// A stream takes the shortest: its data can't wait for the chip.
+uint32_t FlashBuffer::eraseSize(uint32_t address, uint32_t until) {
+  uint32_t need = (until - address + FLASHBUFFER_SECTOR_MASK) & ~FLASHBUFFER_SECTOR_MASK;
+  uint32_t size = FLASHBUFFER_SECTOR_SIZE;
+  if(writeOpen) return size;
+  if((address & FLASHBUFFER_BLOCK_MASK) == 0 && need > FLASHBUFFER_BLOCK_SIZE / 2) size = FLASHBUFFER_BLOCK_SIZE;
+  else if(FLASHBUFFER_MID_SIZE && (address & (FLASHBUFFER_MID_SIZE - 1)) == 0 && need > FLASHBUFFER_MID_SIZE / 2) size = FLASHBUFFER_MID_SIZE;
+  while(size > FLASHBUFFER_SECTOR_SIZE && (address + size > blockEnd(address) || oldestIn(address, size) != FLASHBUFFER_NO_SLOT)) {
+    size = size == FLASHBUFFER_BLOCK_SIZE && FLASHBUFFER_MID_SIZE ? FLASHBUFFER_MID_SIZE : FLASHBUFFER_SECTOR_SIZE;
+  }
+  return size;
+}
+
+// One step of erasing ahead of the writer, from erasedUntil towards until; never waits for the chip.
+// A sector that is still blank (fresh chip) isn't erased: it's checked a page per step first.
+// Erasing the start of a block counts up its erase count (written back by writeStep).
+// Returns FLASHBUFFER_WRITE_IDLE once everything up to until is erased.
+uint8_t FlashBuffer::eraseAhead(uint32_t until) {
+  if((erasedUntil & (FLASHBUFFER_CAPACITY - 1)) == FLASHBUFFER_CHECKPOINT_ADDRESS) erasedUntil = blankCheck = skipJournal(erasedUntil);
+  if(erasedUntil >= until) return FLASHBUFFER_WRITE_IDLE;
+  if(flash.busy()) return FLASHBUFFER_WRITE_WAITING;
+  uint32_t address = erasedUntil; // always on a sector boundary
+  uint32_t size = eraseSize(address, until);
+  uint32_t chipAddress = address & (FLASHBUFFER_CAPACITY - 1); // erasedUntil runs on past the end as writeAddress does
+  if(blankCheck < address + FLASHBUFFER_SECTOR_SIZE) {
+    uint8_t page[FLASHBUFFER_PAGE_SIZE];
+    flash.readBytes(blankCheck & (FLASHBUFFER_CAPACITY - 1), page, FLASHBUFFER_PAGE_SIZE);
+    if((blankCheck & FLASHBUFFER_BLOCK_MASK) == 0) page[0] = page[1] = 0xFF; // an erase count alone doesn't need erasing
+    uint16_t i = 0;
+    while(i < FLASHBUFFER_PAGE_SIZE && page[i] == 0xFF) i++;
+    if(i == FLASHBUFFER_PAGE_SIZE) {
+      blankCheck += FLASHBUFFER_PAGE_SIZE;
+      if(blankCheck == address + FLASHBUFFER_SECTOR_SIZE) {
+        erasedUntil = blankCheck; // a sector at a time
+        erasedSinceCheckpoint = true;
       }
+      return FLASHBUFFER_WRITE_PROGRESS;
+    }
+  }
+  if((address & FLASHBUFFER_BLOCK_MASK) == 0) {
+    uint8_t count[2];
+    flash.readBytes(chipAddress, count, 2);
+    eraseCountValue = (uint16_t)count[0] << 8 | count[1];
+    eraseCountValue = eraseCountValue >= 0xFFFE ? (eraseCountValue == 0xFFFF ? 1 : 0xFFFE) : eraseCountValue + 1;
+    eraseCountAddress = chipAddress;
+  }
+  if(size == FLASHBUFFER_BLOCK_SIZE) flash.erase(FLASHBUFFER_ERASE_BLOCK, chipAddress);
+  else if(size == FLASHBUFFER_SECTOR_SIZE) flash.erase(FLASHBUFFER_ERASE_SECTOR, chipAddress);
+  else flash.erase(FLASHBUFFER_ERASE_MID, chipAddress);
+  dropRange(address, size);
+  invalidateCache();
+  erasedUntil = blankCheck = address + size;
+  erasedSinceCheckpoint = true;
+  return FLASHBUFFER_WRITE_PROGRESS;
+}
+
+// Programs the erase count read before the last block erase into the block header. A power loss
+// in between loses the count of that block (it reads as 0 again).
+void FlashBuffer::writeEraseCount() {
+  uint8_t count[2] = { (uint8_t)(eraseCountValue >> 8), (uint8_t)eraseCountValue };
+  flash.writeBytes(eraseCountAddress, count, 2);
+  eraseCountAddress = 0xFFFFFFFF;
+  programmedBytes += 2;
+}
+
+// Call from loop() while no item is being written, e.g. between uploads: cleans (relocates live
+// items and erases) the rest of the block the next item goes to and all of the block after it, so
+// an upload only has to wait for an erase once it goes on into a third block (a 512 byte ring
+// can't cover even a 4K erase at full speed). Not while playing from flash: reads wait for the erase.
+// Returns FLASHBUFFER_WRITE_IDLE once everything is erased and the chip is ready.
+uint8_t FlashBuffer::eraseStep() {
+  if(itemActive) return FLASHBUFFER_WRITE_WAITING;
+  if(writeState == FLASHBUFFER_WRITE_IDLE) {
+    if(flash.busy()) return FLASHBUFFER_WRITE_WAITING;
+    if(checkpointSlot == FLASHBUFFER_CHECKPOINT_ENTRIES) {
+      switchCheckpointSector(); // the next checkpoint won't have to wait for it
+      return FLASHBUFFER_WRITE_PROGRESS;
+    }
+    idleCleaning = true;
+    writeState = WRITE_CLEAN;
+  }
+  uint8_t state = writeStep();
+  if(state == FLASHBUFFER_WRITE_IDLE && flash.busy()) return FLASHBUFFER_WRITE_WAITING; // last erase still running
+  return state;
+}
+
+// how often block was erased, 0 if never since the chip left the factory
+uint16_t FlashBuffer::eraseCount(uint16_t block) {
+  uint32_t address = (uint32_t)block << FLASHBUFFER_BLOCK_SHIFT;
+  if(address == eraseCountAddress) return eraseCountValue;
+  uint8_t count[2];
+  flash.readBytes(address, count, 2);
+  uint16_t value = (uint16_t)count[0] << 8 | count[1];
+  return value == 0xFFFF ? 0 : value;
+}
+
+// false when the chip didn't answer with the manufacturer and type of FLASHBUFFER_CHIP_JEDEC, or
+// reported (SFDP) less than FLASHBUFFER_CAPACITY: the layout doesn't fit it
+boolean FlashBuffer::chipFound() {
+  return chipOk;
+}
+
+// Puts the chip in deep power-down, e.g. between the refills of a player (PlaybackScheduler.h).
+// Anything that uses the flash afterwards wakes it again (SPIFlash::select()). Returns false,
+// leaving the chip on, while writing or erasing still needs it.
+boolean FlashBuffer::powerDown() {
+  if(flash.sleeping()) return true;
+  if(writeState != FLASHBUFFER_WRITE_IDLE || eraseCountAddress != 0xFFFFFFFF || flash.busy()) return false;
+  flash.sleep();
+  return true;
+}
+
+// Starts waking the chip ahead of its next use: the first command after it waits for
+// SPIFLASH_WAKE_US less the time spent in between.
+void FlashBuffer::powerUp() {
+  if(flash.sleeping()) flash.wakeup();
+}
+
+uint32_t FlashBuffer::bytesWritten() {
+  return writtenBytes;
+}
+
+uint32_t FlashBuffer::bytesProgrammed() {
+  return programmedBytes;
+}
+
+uint32_t FlashBuffer::relocations() {
+  return relocationCount;
+}
+
+uint32_t FlashBuffer::evictions() {
+  return evictionCount;
+}
+
+void FlashBuffer::resetWriteStats() {
+  writtenBytes = 0;
+  programmedBytes = 0;
+  relocationCount = 0;
+  evictionCount = 0;
+}
+
+// address just past a record of length payload bytes starting at address, with the headers
+// repeated at every block it continues in
+uint32_t FlashBuffer::recordEnd(uint32_t address, uint32_t length) {
+  uint32_t header = (address & FLASHBUFFER_BLOCK_MASK) == 0 ? FLASHBUFFER_BLOCK_HEADER + 4 : 4;
+  while(length > blockEnd(address) - address - header) {
+    length -= blockEnd(address) - address - header;
+    address = (address | FLASHBUFFER_BLOCK_MASK) + 1;
+    header = FLASHBUFFER_BLOCK_HEADER + 4;
+  }
+  return address + header + length;
+}
+
+// the page the next record starts on, after a record that ends at end
+uint32_t FlashBuffer::nextRecordAddress(uint32_t end) {
+  return skipJournal((end + FLASHBUFFER_PAGE_MASK) & ~FLASHBUFFER_PAGE_MASK);
+}
+
+// end of an index of entries items written at address (on the next block if it doesn't fit in
+// this one), plus the page after it
+uint32_t FlashBuffer::indexEnd(uint32_t address, uint16_t entries) {
+  uint32_t length = entries * (uint32_t)FLASHBUFFER_INDEX_ENTRY;
+  if((address & FLASHBUFFER_BLOCK_MASK) != 0 && 4UL + length > blockEnd(address) - address) address = (address | FLASHBUFFER_BLOCK_MASK) + 1;
+  return nextRecordAddress(recordEnd(address, length)) + FLASHBUFFER_PAGE_SIZE;
+}
+
+// end of the part of the block at address that holds records: the journal takes the end of the last block
+uint32_t FlashBuffer::blockEnd(uint32_t address) {
+  uint32_t end = (address | FLASHBUFFER_BLOCK_MASK) + 1;
+  if((address >> FLASHBUFFER_BLOCK_SHIFT & (FLASHBUFFER_BLOCKS - 1)) == FLASHBUFFER_CHECKPOINT_ADDRESS >> FLASHBUFFER_BLOCK_SHIFT) end -= FLASHBUFFER_CAPACITY - FLASHBUFFER_CHECKPOINT_ADDRESS;
+  return end;
+}
+
+// records go on at the next block where the journal starts
+uint32_t FlashBuffer::skipJournal(uint32_t address) {
+  if((address & (FLASHBUFFER_CAPACITY - 1)) == FLASHBUFFER_CHECKPOINT_ADDRESS) address += FLASHBUFFER_CAPACITY - FLASHBUFFER_CHECKPOINT_ADDRESS;
+  return address;
+}
+
+// the write position stays within the chip, what is erased ahead of it moves along
+void FlashBuffer::setNextPage(uint32_t address) {
+  if(address >= FLASHBUFFER_CAPACITY) {
+    address -= FLASHBUFFER_CAPACITY;
+    erasedUntil -= FLASHBUFFER_CAPACITY;
+    blankCheck -= FLASHBUFFER_CAPACITY;
+  }
+  nextPageId = address >> FLASHBUFFER_PAGE_SHIFT;
+}
+
+// Appends a checkpoint (write position, block sequence, index address, erased stretch) to the
+// journal, after the index record. Switches to the other sector when this one is full: erases it
+// first, the full one stays valid until the first entry of the new one is written.
+uint8_t FlashBuffer::writeCheckpoint() {
+  if(flash.busy()) return FLASHBUFFER_WRITE_WAITING;
+  if(checkpointSlot == FLASHBUFFER_CHECKPOINT_ENTRIES) {
+    switchCheckpointSector();
+    return FLASHBUFFER_WRITE_PROGRESS;
+  }
+  uint16_t indexPage = latestIndexAddress >> FLASHBUFFER_PAGE_SHIFT;
+  uint32_t erasedAhead = (erasedUntil - ((uint32_t)nextPageId << FLASHBUFFER_PAGE_SHIFT)) >> FLASHBUFFER_PAGE_SHIFT;
+  if(erasedAhead > 0xFFFF) erasedAhead = 0xFFFF;
+  uint8_t entry[FLASHBUFFER_CHECKPOINT_SIZE];
+  memset(entry, 0xFF, sizeof(entry));
+  entry[0] = checkpointGeneration;
+  entry[1] = nextPageId >> 8;
+  entry[2] = nextPageId;
+  entry[3] = indexPage >> 8;
+  entry[4] = indexPage;
+  entry[5] = blockSequence >> 8;
+  entry[6] = blockSequence;
+  entry[7] = latestBlockId;
+  entry[8] = erasedAhead >> 8;
+  entry[9] = erasedAhead;
+  entry[FLASHBUFFER_CHECKPOINT_SIZE - 1] = checkpointCheck(entry);
+  flash.writeBytes(FLASHBUFFER_CHECKPOINT_ADDRESS + checkpointSector * FLASHBUFFER_SECTOR_SIZE + checkpointSlot * FLASHBUFFER_CHECKPOINT_SIZE, entry, FLASHBUFFER_CHECKPOINT_SIZE);
+  checkpointSlot++;
+  erasedSinceCheckpoint = false;
+  programmedBytes += FLASHBUFFER_CHECKPOINT_SIZE;
+  return FLASHBUFFER_WRITE_IDLE;
+}
+
+void FlashBuffer::switchCheckpointSector() {
+  checkpointSector ^= 1;
+  checkpointGeneration = (checkpointGeneration + 1) % 255; // 0xFF would read as an empty entry
+  checkpointSlot = 0;
+  flash.erase(FLASHBUFFER_ERASE_SECTOR, FLASHBUFFER_CHECKPOINT_ADDRESS + checkpointSector * FLASHBUFFER_SECTOR_SIZE);
+}
+
+// index record, 11 bytes per item: id | page(2) | format | length(3) | crc(4). Sends bytes
+// offset..offset+n of it.
+void FlashBuffer::transferIndex(uint32_t offset, uint16_t n) {
+  uint16_t skip = offset / FLASHBUFFER_INDEX_ENTRY;
+  uint8_t field = offset % FLASHBUFFER_INDEX_ENTRY;
+  uint16_t slot = 0;
+  while(n > 0) {
+    DirEntry &entry = directory[slot];
+    if(entry.id == 0xFF || skip > 0) {
+      if(entry.id != 0xFF) skip--;
+      slot++;
+      continue;
     }
-    else {
-      onNewBlock = false;
+    if(field == 0) SpiBus::transfer(entry.id);
+    else if(field < 3) SpiBus::transfer(entry.page >> (16 - field * 8));
+    else if(field == 3) SpiBus::transfer(entry.format);
+    else if(field < 7) SpiBus::transfer(entry.length >> (48 - field * 8));
+    else SpiBus::transfer(entry.crc >> (80 - field * 8));
+    n--;
+    if(++field == FLASHBUFFER_INDEX_ENTRY) {
+      field = 0;
+      slot++;
     }
-    firstPage = false;
-    if(serialBuffer.numberOfElements() < RING_SIZE / 2) { // make sure there is some space in the buffer before allowing refill
-      resumeCallback();
-    } //else {
-      //pauseCallback(); //not necessary to do this within else, but pause will only happen if buffer is almost full
-    //}
-  }
-  // write index table on next page -> our limit for the number of items, since this makes everything easier :-p
-  // page has 256 bytes, 4 are taken by its own header. Maybe one by a block header (if on new block)
-  // 7 bytes per indexed item (id(1)|adres(3)|length(3)) -> room for (256-5) / 7 items = 35
-  boolean slotAvailable = false;
-  // restore id in case block boundaries where crossed
-  id = id & 0x7F;
-  for(uint8_t i = 0; i < 35; i++) {
-    // check for empty slot or overwrite existing entry if already present
-    if(indexTable[i * 7] == 0xFF || indexTable[i * 7] == id) {
-      indexTable[i * 7] = id;
-      for(uint8_t j = 0; j < 3; j++) {
-        indexTable[i * 7 + 1 + j] = addressInIndex >> 16 - j * 8;
-        indexTable[i * 7 + 4 + j] = originalLength >> 16 - j * 8;
+  }
+}
+
+void FlashBuffer::loadDirectory(uint32_t address) {
+  uint8_t header[4];
+  flash.readBytes(address, header, 4);
+  if(header[0] != 0x7F) return; //largest number with most significant bit (=no partial item) 0 -> this is fixed id for index table by agreement
+  ItemCursor cursor;
+  cursor.id = 0x7F;
+  cursor.address = address + 4;
+  cursor.remaining = (uint32_t)header[1] << 16 | (uint32_t)header[2] << 8 | header[3];
+  cursor.crc = CRC32_INIT;
+  cursor.whole = true;
+  // older indexes: 7 bytes per item, no CRC
+  uint8_t size = cursor.remaining & FLASHBUFFER_INDEX_CRC ? FLASHBUFFER_INDEX_ENTRY : 7;
+  cursor.remaining &= ~FLASHBUFFER_INDEX_CRC;
+  uint8_t entries[8 * FLASHBUFFER_INDEX_ENTRY];
+  uint16_t chunk = 8 * size;
+  while(cursor.remaining >= size) {
+    uint16_t n = readItemBytes(cursor, entries, cursor.remaining < chunk ? cursor.remaining - cursor.remaining % size : chunk);
+    for(uint16_t i = 0; i < n; i += size) {
+      if(entries[i] >= 0x7F) continue; // unused slot (older indexes had a fixed 35 slots)
+      uint16_t page = (uint16_t)entries[i + 1] << 8 | entries[i + 2];
+      uint32_t length = (uint32_t)entries[i + 4] << 16 | (uint32_t)entries[i + 5] << 8 | entries[i + 6];
+      uint8_t format = entries[i + 3] & ~FLASHBUFFER_FORMAT_CHECKED;
+      uint32_t crc = 0;
+      if(size == FLASHBUFFER_INDEX_ENTRY) {
+        crc = (uint32_t)entries[i + 7] << 24 | (uint32_t)entries[i + 8] << 16 | (uint32_t)entries[i + 9] << 8 | entries[i + 10];
+        format = entries[i + 3];
       }
-      slotAvailable = true;
-      break;
+      putEntry(entries[i], page, length, format, crc);
     }
   }
-  if(!slotAvailable) {
-    memmove(indexTable, indexTable + 7, 238); // shift array one element to the left by copying all but one items
-    indexTable[238] = id;
-    for(uint8_t j = 0; j < 3; j++) {
-      indexTable[238 + 1 + j] = addressInIndex >> 16 - j * 8;
-      indexTable[238 + 4 + j] = originalLength >> 16 - j * 8;
+}
+
+// slot of id, or of the free slot where it would go
+#define DIRECTORY_MASK (FLASHBUFFER_DIRECTORY_SIZE - 1)
+
+DirEntry *FlashBuffer::findEntry(uint8_t id) {
+  uint16_t slot = id & DIRECTORY_MASK;
+  for(uint16_t probes = 0; probes < FLASHBUFFER_DIRECTORY_SIZE; probes++) {
+    if(directory[slot].id == id) return &directory[slot];
+    if(directory[slot].id == 0xFF) return 0;
+    slot = (slot + 1) & DIRECTORY_MASK;
+  }
+  return 0;
+}
+
+void FlashBuffer::putEntry(uint8_t id, uint16_t page, uint32_t length, uint8_t format, uint32_t crc) {
+  DirEntry *entry = findEntry(id);
+  if(!entry) {
+    if(directoryCount == FLASHBUFFER_DIRECTORY_SIZE - 1) evictOldest(); // keep one slot free so probing always ends
+    uint16_t slot = id & DIRECTORY_MASK;
+    while(directory[slot].id != 0xFF) slot = (slot + 1) & DIRECTORY_MASK;
+    entry = &directory[slot];
+    entry->id = id;
+    directoryCount++;
+  }
+  entry->page = page;
+  entry->length = length;
+  entry->format = format;
+  entry->crc = crc;
+}
+
+// backward shift deletion: pull later entries of the probe chain into the hole, no tombstones needed
+void FlashBuffer::removeEntry(uint16_t slot) {
+  uint16_t hole = slot;
+  uint16_t next = (slot + 1) & DIRECTORY_MASK;
+  while(directory[next].id != 0xFF) {
+    uint16_t home = directory[next].id & DIRECTORY_MASK;
+    if(((next - home) & DIRECTORY_MASK) >= ((next - hole) & DIRECTORY_MASK)) { // hole lies between home and next
+      directory[hole] = directory[next];
+      hole = next;
     }
+    next = (next + 1) & DIRECTORY_MASK;
   }
-  // write indexTable to next page!
-  // check again for block boundary; change counters if necessary, nextPageId...
-  if((startAddress & 255) != 0) {
-    // start on next page
-    startAddress = (startAddress / 256 + 1) * 256;
+  directory[hole].id = 0xFF;
+  directoryCount--;
+}
+
+// drop the item the log will overwrite first: the one closest ahead of the write position
+void FlashBuffer::evictOldest() {
+  uint16_t oldest = 0;
+  uint16_t oldestDistance = 0xFFFF;
+  for(uint16_t slot = 0; slot < FLASHBUFFER_DIRECTORY_SIZE; slot++) {
+    if(directory[slot].id == 0xFF) continue;
+    uint16_t distance = (directory[slot].page - nextPageId) & (FLASHBUFFER_PAGES - 1);
+    if(distance < oldestDistance) {
+      oldestDistance = distance;
+      oldest = slot;
+    }
   }
-  flash.command(SPIFLASH_BYTEPAGEPROGRAM, true);  // Byte/Page Program
-  SPI.transfer(startAddress >> 16);
-  SPI.transfer(startAddress >> 8);
-  SPI.transfer(startAddress);
-  if((startAddress & 65535) == 0) {
-    // only need one page; so block erase only necessary if now on start block
-    if(flash.readByte(startAddress) != 0xFF) {
-      flash.blockErase64K(startAddress);
-      // erase elements from array if necessary
-      for(uint8_t i = 0; i < 35; i++) {
-        uint32_t itemAddress = indexTable[i * 7 + 1] << 16 | indexTable[i * 7 + 2] << 8 | indexTable[i * 7 + 3];
-        if(startAddress <=  itemAddress && itemAddress < startAddress + 65536) {
-          for(uint8_t j = 0; j < 7; j++) {
-            indexTable[i * 7 + j] = 0xFF;
-          }
-        }
-      }
+  removeEntry(oldest);
+  evictionCount++;
+}
+
+// the slot of the oldest item (the first one the writer reaches) that lies (partly) in the size
+// bytes from address, FLASHBUFFER_NO_SLOT if none does
+uint16_t FlashBuffer::oldestIn(uint32_t address, uint32_t size) {
+  uint16_t oldest = FLASHBUFFER_NO_SLOT;
+  uint32_t oldestOffset = 0;
+  for(uint16_t slot = 0; slot < FLASHBUFFER_DIRECTORY_SIZE; slot++) {
+    if(directory[slot].id == 0xFF) continue;
+    uint32_t start = (uint32_t)directory[slot].page << FLASHBUFFER_PAGE_SHIFT;
+    uint32_t span = recordEnd(start, directory[slot].length) - start;
+    uint32_t offset = (start - address) & (FLASHBUFFER_CAPACITY - 1); // where the item starts, seen from address
+    if(offset + span > FLASHBUFFER_CAPACITY) offset = 0; // started before address
+    else if(offset >= size) continue;
+    if(oldest == FLASHBUFFER_NO_SLOT || offset < oldestOffset) {
+      oldest = slot;
+      oldestOffset = offset;
     }
-    blockCounter = blockCounter + 1 & 31;
-    latestBlockId = latestBlockId + 1 & 15;
-    SPI.transfer(blockCounter);
   }
-  SPI.transfer(0x7F);
-  // next 3 are the length of the indexTable
-  SPI.transfer(0);
-  SPI.transfer(0);
-  SPI.transfer(245);
-  for(uint8_t i = 0; i < 245; i++) {
-    SPI.transfer(indexTable[i]);
+  return oldest;
+}
+
+// flash taken by the live items, headers included
+uint32_t FlashBuffer::liveBytes() {
+  uint32_t total = 0;
+  for(uint16_t slot = 0; slot < FLASHBUFFER_DIRECTORY_SIZE; slot++) {
+    if(directory[slot].id == 0xFF) continue;
+    uint32_t start = (uint32_t)directory[slot].page << FLASHBUFFER_PAGE_SHIFT;
+    total += recordEnd(start, directory[slot].length) - start;
+  }
+  return total;
+}
+
+// erased room the cleaner keeps ahead of an item: the largest live item, its index and the journal
+// it may have to skip, rounded up to sectors
+uint32_t FlashBuffer::reserveBytes() {
+  uint32_t largest = 0;
+  for(uint16_t slot = 0; slot < FLASHBUFFER_DIRECTORY_SIZE; slot++) {
+    if(directory[slot].id == 0xFF) continue;
+    uint32_t start = (uint32_t)directory[slot].page << FLASHBUFFER_PAGE_SHIFT;
+    uint32_t span = recordEnd(start, directory[slot].length) - start;
+    if(span > largest) largest = span;
+  }
+  return (largest + directoryCount * (uint32_t)FLASHBUFFER_INDEX_ENTRY + FLASHBUFFER_CAPACITY - FLASHBUFFER_CHECKPOINT_ADDRESS + FLASHBUFFER_SECTOR_MASK) & ~FLASHBUFFER_SECTOR_MASK;
+}
+
+// forget the items that lie (partly) in the erased range, positions taken modulo the chip
+void FlashBuffer::dropRange(uint32_t address, uint32_t size) {
+  uint16_t slot;
+  while((slot = oldestIn(address, size)) != FLASHBUFFER_NO_SLOT) {
+    removeEntry(slot);
+    evictionCount++;
   }
-  flash.unselect();
-  nextPageId = startAddress / 256 + 1;
+  openId = 0xFF;
+}
+
+uint8_t FlashBuffer::itemCount() {
+  return directoryCount;
 }
 
 uint32_t FlashBuffer::getItemLength(uint8_t id) {
-  uint32_t length = 0;
-  for(uint8_t i = 34; i >= 0; i--) { //loop backwards; more recent items were added to the back
-    if(indexTable[i * 7] == id) {
-      for(uint8_t j = 0; j < 3; j++) {
-        length |= indexTable[i * 7 + 4 + j] << 16 - j * 8;
-      }
-      break;
-    }
+  DirEntry *entry = findEntry(id);
+  return entry ? entry->length : 0;
+}
+
+// how the item's payload is coded (FLASHBUFFER_FORMAT_...), FLASHBUFFER_FORMAT_PCM8 when it doesn't exist
+uint8_t FlashBuffer::getItemFormat(uint8_t id) {
+  DirEntry *entry = findEntry(id);
+  return entry ? entry->format & FLASHBUFFER_CODING_MASK : FLASHBUFFER_FORMAT_PCM8;
+}
+
+// the rate the item was recorded at in Hz, 8000 when it doesn't exist
+uint16_t FlashBuffer::getItemSampleRate(uint8_t id) {
+  DirEntry *entry = findEntry(id);
+  return flashBufferSampleRate(entry ? entry->format : FLASHBUFFER_RATE_8000);
+}
+
+static const uint16_t sampleRates[] = { 8000, 11025, 12000, 16000, 22050, 24000, 32000, 44100, 48000 };
+#define SAMPLE_RATES (sizeof(sampleRates) / sizeof(sampleRates[0]))
+
+uint16_t flashBufferSampleRate(uint8_t format) {
+  uint8_t i = format >> 4;
+  return i < SAMPLE_RATES ? sampleRates[i] : sampleRates[0];
+}
+
+uint8_t flashBufferRateBits(uint16_t rate) {
+  uint8_t best = 0;
+  for(uint8_t i = 1; i < SAMPLE_RATES; i++) {
+    if(abs((int32_t)sampleRates[i] - rate) < abs((int32_t)sampleRates[best] - rate)) best = i;
   }
-  return length;
+  return best << 4;
 }
 
+// Random access to one byte of an item, e.g. from the sample interrupt. The last item used stays
+// open, so consecutive calls cost a single readByte.
 uint8_t FlashBuffer::readItemAtIndex(uint8_t id, uint32_t index) {
-  uint32_t address = 0;
-  uint32_t length = 0;
-  for(uint8_t i = 34; i >= 0; i--) { //loop backwards; more recent items were added to the back
-    if(indexTable[i * 7] == id) {
-      for(uint8_t j = 0; j < 3; j++) {
-        address |= indexTable[i * 7 + 1 + j] << 16 - j * 8;
-        length |= indexTable[i * 7 + 4 + j] << 16 - j * 8;
-      }
-      break;
+  if(!openCached(id) || index >= openLength) return 0xFF;
+  if(index < segmentStart || index >= segmentEnd) locateSegment(index);
+  return flash.readByte(segmentAddress + index - segmentStart);
+}
+
+// Same as readItemAtIndex, but served from the page cache: sequential reads cost one page read
+// every page, done when the previous page starts being used (so still within this call;
+// at 4MHz a page takes ~0.6ms, keep that in mind when calling from the sample interrupt).
+uint8_t FlashBuffer::readItemCached(uint8_t id, uint32_t index) {
+  if(!openCached(id) || index >= openLength) return 0xFF;
+  if(index < segmentStart || index >= segmentEnd) locateSegment(index);
+  uint32_t address = segmentAddress + index - segmentStart;
+  CachedPage *page = findCachedPage(address >> FLASHBUFFER_PAGE_SHIFT);
+  if(page) {
+    cacheHitCount++;
+  } else {
+    cacheMissCount++;
+    page = loadPage(address >> FLASHBUFFER_PAGE_SHIFT);
+  }
+  page->lastUse = ++cacheUseCounter;
+  uint8_t value = page->data[address & FLASHBUFFER_PAGE_MASK];
+  // prefetch the next page if the item continues there (a block header just shifts the data in it)
+  if(FLASHBUFFER_CACHE_PAGES > 1 && index + FLASHBUFFER_PAGE_SIZE - (address & FLASHBUFFER_PAGE_MASK) < openLength) {
+    // past the journal the item goes on in the first block
+    uint32_t next = (skipJournal((address | FLASHBUFFER_PAGE_MASK) + 1) & (FLASHBUFFER_CAPACITY - 1)) >> FLASHBUFFER_PAGE_SHIFT;
+    if(!findCachedPage(next)) {
+      cachePrefetchCount++;
+      loadPage(next);
     }
   }
-  if((address & 65535) == 0) address++;
-  address += 4;
-  address += ((index >> 16) - (address >> 16)) * 5; // aantal blockboundaries * 5 bijtellen (delen door 65536 of 2^16)
-  address += index;
-  return flash.readByte(address);
+  return value;
 }
 
-int FlashBuffer::fastReadItemFromFlash(uint8_t id, uint32_t &length, SerialBuffer &serialBuffer) {
-  int result = -1;
-  uint32_t address = 0;
-  length = 0;
-  for(uint8_t i = 34; i >= 0; i--) { //loop backwards; more recent items were added to the back
-    if(indexTable[i * 7] == id) {
-      for(uint8_t j = 0; j < 3; j++) {
-        address |= indexTable[i * 7 + 1 + j] << 16 - j * 8;
-        length |= indexTable[i * 7 + 4 + j] << 16 - j * 8;
-      }
-      break;
-    }
+CachedPage *FlashBuffer::findCachedPage(uint32_t page) {
+  for(uint8_t i = 0; i < FLASHBUFFER_CACHE_PAGES; i++) {
+    if(cache[i].page == page) return &cache[i];
+  }
+  return 0;
+}
+
+// read page into the least recently used slot
+CachedPage *FlashBuffer::loadPage(uint32_t page) {
+  CachedPage *slot = &cache[0];
+  for(uint8_t i = 1; i < FLASHBUFFER_CACHE_PAGES; i++) {
+    if(cache[i].lastUse < slot->lastUse) slot = &cache[i];
+  }
+  flash.readBytes(page << FLASHBUFFER_PAGE_SHIFT, slot->data, FLASHBUFFER_PAGE_SIZE);
+  slot->page = page;
+  slot->lastUse = cacheUseCounter;
+  return slot;
+}
+
+void FlashBuffer::invalidateCache() {
+  for(uint8_t i = 0; i < FLASHBUFFER_CACHE_PAGES; i++) {
+    cache[i].page = 0xFFFFFFFF;
+    cache[i].lastUse = 0;
+  }
+  cacheUseCounter = 0;
+}
+
+uint32_t FlashBuffer::cacheHits() {
+  return cacheHitCount;
+}
+
+uint32_t FlashBuffer::cacheMisses() {
+  return cacheMissCount;
+}
+
+uint32_t FlashBuffer::cachePrefetches() {
+  return cachePrefetchCount;
+}
+
+void FlashBuffer::resetCacheStats() {
+  cacheHitCount = 0;
+  cacheMissCount = 0;
+  cachePrefetchCount = 0;
+}
+
+boolean FlashBuffer::openCached(uint8_t id) {
+  if(id == openId) return true;
+  ItemCursor cursor;
+  if(!openItem(id, cursor)) return false;
+  openId = id;
+  openLength = cursor.remaining;
+  openAddress = cursor.address;
+  locateSegment(0);
+  return true;
+}
+
+// find the part of the open item that holds index: the first block holds what's left after the
+// item header, every next block what's left after the block header and the repeated item header
+void FlashBuffer::locateSegment(uint32_t index) {
+  segmentStart = 0;
+  segmentAddress = openAddress;
+  segmentEnd = blockEnd(openAddress) - openAddress;
+  while(index >= segmentEnd) {
+    segmentAddress = (((segmentAddress | FLASHBUFFER_BLOCK_MASK) + 1) & (FLASHBUFFER_CAPACITY - 1)) + FLASHBUFFER_BLOCK_HEADER + 4;
+    segmentStart = segmentEnd;
+    segmentEnd += blockEnd(segmentAddress) - segmentAddress;
+  }
+}
+
+// look the item up and point the cursor at its first payload byte
+boolean FlashBuffer::openItem(uint8_t id, ItemCursor &cursor) {
+  DirEntry *entry = findEntry(id);
+  if(!entry) return false;
+  uint32_t address = (uint32_t)entry->page << FLASHBUFFER_PAGE_SHIFT;
+  if((address & FLASHBUFFER_BLOCK_MASK) == 0) address += FLASHBUFFER_BLOCK_HEADER; //skip blockheader
+  if(flash.readByte(address) != id) return false; //check whether we're at the correct item
+  // we already got length from the directory so skip it in flash
+  cursor.id = id;
+  cursor.address = address + 4;
+  cursor.remaining = entry->length;
+  cursor.crc = CRC32_INIT;
+  cursor.whole = true;
+  return true;
+}
+
+// Caps the reads of readItemChunk(), readItemBytes() and so FlashPlayer at bytes per
+// transaction (1..FLASHBUFFER_PAGE_SIZE), so a sample interrupt sharing the bus with the flash (SpiBus::post())
+// is held back for one short read at most: at 4MHz a read of n bytes takes about 2 * (n + 4) us,
+// a sample at 32kHz 31us, so 6 bytes (host/dacbench.cpp).
+void FlashBuffer::setMaxBurst(uint16_t bytes) {
+  maxBurst = bytes < 1 ? 1 : bytes > FLASHBUFFER_PAGE_SIZE ? FLASHBUFFER_PAGE_SIZE : bytes;
+}
+
+// bytes that can be read at the cursor in one go: never past the end of the flash page,
+// so a burst never runs into a block header
+uint16_t FlashBuffer::burstLength(ItemCursor &cursor, uint16_t max) {
+  uint16_t n = FLASHBUFFER_PAGE_SIZE - (cursor.address & FLASHBUFFER_PAGE_MASK);
+  if(n > maxBurst) n = maxBurst;
+  if(n > max) n = max;
+  if(n > cursor.remaining) n = cursor.remaining;
+  return n;
+}
+
+// returns true when the cursor moved on to the next block
+boolean FlashBuffer::advanceCursor(ItemCursor &cursor, uint16_t n) {
+  cursor.address += n;
+  cursor.remaining -= n;
+  if(cursor.address != blockEnd(cursor.address - 1)) return false;
+  cursor.address = (skipJournal(cursor.address) & (FLASHBUFFER_CAPACITY - 1)) + FLASHBUFFER_BLOCK_HEADER + 4; //skip blockheader and rewrite of item header; wraps after the last block
+  return true;
+}
+
+// Non-blocking: moves as much of the item as fits into the ring, one page-sized burst
+// per transaction, and returns the number of bytes added. Call it again (e.g. from loop())
+// while the consumer (e.g. the audio interrupt) empties the ring; done when cursor.remaining == 0.
+uint16_t FlashBuffer::readItemChunk(ItemCursor &cursor, SerialBuffer &serialBuffer) {
+  uint16_t total = 0;
+  uint16_t space = serialBuffer.freeSpace();
+  uint16_t minBurst = cursor.remaining < FLASHBUFFER_MIN_BURST ? cursor.remaining : FLASHBUFFER_MIN_BURST;
+  if(space < minBurst) return 0; // not worth the command overhead yet
+  while(cursor.remaining > 0 && space > 0) {
+    // read straight into the ring's free region, no copy through a page buffer
+    byte *region;
+    uint16_t room = serialBuffer.writeRegion(region);
+    uint16_t n = burstLength(cursor, room < space ? room : space);
+    flash.readBytes(cursor.address, region, n);
+    cursor.crc = crc32Update(cursor.crc, region, n);
+    serialBuffer.commitWrite(n);
+    advanceCursor(cursor, n);
+    space -= n;
+    total += n;
   }
-  if(address == 0 && length == 0) return -1; // address itself can be zero; first sector
-  if((address & 65535) == 0) address++; //skip blockheader
-  uint8_t idInFlash = flash.readByte(address);
-  if(idInFlash != id) return result; //check whether we're at the correct item if not return -1.
-  // no speed advantage in using fastread so read byte per byte since rfduino is slow
-  // we already got length from indexTable so skip it in flash
-  else result = id;
-  address += 4;
-  uint32_t bytesRead = 0;
-  flash.command(SPIFLASH_ARRAYREADLOWFREQ);
-  SPI.transfer(address >> 16);
-  SPI.transfer(address >> 8);
-  SPI.transfer(address);
-  // SPI.transfer(0); //don't care
-  while(bytesRead < length) {
-    uint8_t data = SPI.transfer(0);
-    // serialBuffer.add(data);
-    while(serialBuffer.add(data) == -1);
-    address++;
-    bytesRead++;
-    if((address & 65535) == 0) {
-      address += 5;
-      flash.unselect();
-      flash.command(SPIFLASH_ARRAYREADLOWFREQ);
-      SPI.transfer(address >> 16);
-      SPI.transfer(address >> 8);
-      SPI.transfer(address);
-      // SPI.transfer(0); //don't care
+  return total;
+}
+
+// copy up to len bytes at the cursor into buf, returns the number of bytes copied
+uint16_t FlashBuffer::readItemBytes(ItemCursor &cursor, uint8_t *buf, uint16_t len) {
+  uint16_t total = 0;
+  while(cursor.remaining > 0 && total < len) {
+    uint16_t n = burstLength(cursor, len - total);
+    flash.readBytes(cursor.address, buf + total, n);
+    cursor.crc = crc32Update(cursor.crc, buf + total, n);
+    advanceCursor(cursor, n);
+    total += n;
+  }
+  return total;
+}
+
+// move the cursor len bytes on without reading them (a block at a time), returns the number of
+// bytes skipped; the item can't be checked with that cursor any more
+uint32_t FlashBuffer::skipItemBytes(ItemCursor &cursor, uint32_t len) {
+  uint32_t total = 0;
+  while(cursor.remaining > 0 && total < len) {
+    uint32_t n = blockEnd(cursor.address) - cursor.address;
+    if(n > len - total) n = len - total;
+    if(n > cursor.remaining) n = cursor.remaining;
+    advanceCursor(cursor, n);
+    total += n;
+  }
+  if(total > 0) cursor.whole = false;
+  return total;
+}
+
+// Whether the item the cursor read is intact: FLASHBUFFER_CHECK_OK when it was read to the end and
+// the bytes match the CRC in its directory entry, FLASHBUFFER_CHECK_BAD when they don't (or the
+// item was replaced meanwhile), FLASHBUFFER_CHECK_UNKNOWN while there is more to read, after
+// skipItemBytes() and for items from indexes without CRCs.
+uint8_t FlashBuffer::checkItem(ItemCursor &cursor) {
+  if(cursor.remaining > 0 || !cursor.whole) return FLASHBUFFER_CHECK_UNKNOWN;
+  DirEntry *entry = findEntry(cursor.id);
+  if(!entry) return FLASHBUFFER_CHECK_BAD;
+  if(!(entry->format & FLASHBUFFER_FORMAT_CHECKED)) return FLASHBUFFER_CHECK_UNKNOWN;
+  return crc32Final(cursor.crc) == entry->crc ? FLASHBUFFER_CHECK_OK : FLASHBUFFER_CHECK_BAD;
+}
+
+// Blocking: reads the whole item as fastReadItemFromFlash does (one read command per block), but
+// only to check it; FLASHBUFFER_CHECK_BAD when it doesn't exist.
+uint8_t FlashBuffer::verifyItem(uint8_t id) {
+  ItemCursor cursor;
+  if(!openItem(id, cursor)) return FLASHBUFFER_CHECK_BAD;
+  uint8_t page[FLASHBUFFER_PAGE_SIZE];
+  flash.beginRead(cursor.address);
+  while(cursor.remaining > 0) {
+    uint16_t n = burstLength(cursor, FLASHBUFFER_PAGE_SIZE);
+    SpiBus::receive(page, n);
+    cursor.crc = crc32Update(cursor.crc, page, n);
+    if(advanceCursor(cursor, n) && cursor.remaining > 0) {
+      flash.endRead();
+      flash.beginRead(cursor.address);
     }
   }
-  flash.unselect();
-  return result;
+  flash.endRead();
+  return checkItem(cursor);
 }
 
-int FlashBuffer::readItemFromFlash(uint8_t id, uint32_t &length, SerialBuffer &serialBuffer) {
-  int result = -1;
-  uint32_t address = 0;
+// Read-after-write: the writer reads every item back from flash, a page per writeStep() while it
+// waits for data and the rest once the item is programmed, and only indexes it when that matches
+// the CRC taken on the way in. Relocated copies keep the CRC of the original, so a bad copy shows
+// up when it is read.
+void FlashBuffer::setVerify(boolean on) {
+  verifyWrites = on;
+}
+
+// items the verify pass found programmed wrong and dropped
+uint32_t FlashBuffer::verifyFailures() {
+  return verifyFailureCount;
+}
+
+// Blocking: streams the whole item into the ring in page-sized bursts over one open read
+// command, which is only restarted to skip the headers at the start of each block. Returns the id,
+// -1 when there is no such item, -2 when it doesn't match its CRC (it is in the ring all the same).
+int FlashBuffer::fastReadItemFromFlash(uint8_t id, uint32_t &length, SerialBuffer &serialBuffer) {
+  ItemCursor cursor;
   length = 0;
-  for(uint8_t i = 34; i >= 0; i--) { //loop backwards; more recent items were added to the back
-    if(indexTable[i * 7] == id) {
-      for(uint8_t j = 0; j < 3; j++) {
-        address |= indexTable[i * 7 + 1 + j] << 16 - j * 8;
-        length |= indexTable[i * 7 + 4 + j] << 16 - j * 8;
-      }
-      break;
+  if(!openItem(id, cursor)) return -1;
+  length = cursor.remaining;
+  uint8_t page[FLASHBUFFER_PAGE_SIZE];
+  flash.beginRead(cursor.address);
+  while(cursor.remaining > 0) {
+    uint16_t n = burstLength(cursor, FLASHBUFFER_PAGE_SIZE);
+    SpiBus::receive(page, n);
+    cursor.crc = crc32Update(cursor.crc, page, n);
+    // only waits when the ring can't take a whole page
+    for(uint16_t added = 0; added < n;) added += serialBuffer.add(page + added, n - added);
+    if(advanceCursor(cursor, n) && cursor.remaining > 0) {
+      flash.endRead();
+      flash.beginRead(cursor.address);
     }
   }
-  if(address == 0 && length == 0) return -1; // address itself can be zero; first sector
-  if((address & 65535) == 0) address++; //skip blockheader
-  uint8_t idInFlash = flash.readByte(address);
-  if(idInFlash != id) return result; //check whether we're at the correct item if not return -1.
-  // no speed advantage in using fastread so read byte per byte since rfduino is slow
-  // we already got length from indexTable so skip it in flash
-  else result = id;
-  address += 4;
-  uint32_t bytesRead = 0;
-  while(bytesRead < length) {
-    if((address & 65535) == 0) address += 5; //skip blockheader and rewrite of item header
-    uint8_t data = flash.readByte(address);
-    while(serialBuffer.add(data) == -1) {
-      // delay(200);
-    }
-    address++;
-    bytesRead++;
+  flash.endRead();
+  return checkItem(cursor) == FLASHBUFFER_CHECK_BAD ? -2 : id;
+}
+
+// Blocking as well, but a separate readBytes transaction per page, so the bus is released
+// between pages (e.g. for the DAC).
+int FlashBuffer::readItemFromFlash(uint8_t id, uint32_t &length, SerialBuffer &serialBuffer) {
+  ItemCursor cursor;
+  length = 0;
+  if(!openItem(id, cursor)) return -1;
+  length = cursor.remaining;
+  uint8_t page[FLASHBUFFER_PAGE_SIZE];
+  while(cursor.remaining > 0) {
+    uint16_t n = burstLength(cursor, FLASHBUFFER_PAGE_SIZE);
+    flash.readBytes(cursor.address, page, n);
+    cursor.crc = crc32Update(cursor.crc, page, n);
+    for(uint16_t added = 0; added < n;) added += serialBuffer.add(page + added, n - added);
+    advanceCursor(cursor, n);
   }
-  return result;
+  return checkItem(cursor) == FLASHBUFFER_CHECK_BAD ? -2 : id;
 }
 
 uint8_t SPIFlash::UNIQUEID[8];
@@ -430,42 +1463,41 @@ uint8_t SPIFlash::UNIQUEID[8];
 SPIFlash::SPIFlash(uint8_t slaveSelectPin, uint16_t jedecID) {
   _slaveSelectPin = slaveSelectPin;
   _jedecID = jedecID;
+  _capacity = 0;
+  _lines = SPIFLASH_IO_LINES;
+  _sleeping = _waking = false;
+  memset(_fastReads, 0, sizeof(_fastReads));
+  chooseRead();
 }
 
-/// Select the flash chip
+/// Select the flash chip, out of deep power-down first if it was put there
 void SPIFlash::select() {
-  //save current SPI settings
-#ifndef SPI_HAS_TRANSACTION
-  // noInterrupts();
-#endif
-  // _SPCR = SPCR;
-  // _SPSR = SPSR;
-
+  if(_sleeping) wakeup();
+  if(_waking) {
+    // micros() may have ticked once without the time having passed
+    uint32_t waited = micros() - _wakeStart;
+    if(waited < SPIFLASH_WAKE_US + SPIFLASH_MICROS_STEP) delayMicroseconds(SPIFLASH_WAKE_US + SPIFLASH_MICROS_STEP - waited);
+    _waking = false;
+  }
 #ifdef SPI_HAS_TRANSACTION
   SPI.beginTransaction(_settings);
-#else
-  // set FLASH SPI settings
-  SPI.setDataMode(SPI_MODE0);
-  SPI.setBitOrder(MSBFIRST);
-  // SPI.setClockDivider(SPI_CLOCK_DIV4); //decided to slow down from DIV2 after SPI stalling in some instances, especially visible on mega1284p when RFM69 and FLASH chip both present
-  // setClockDivider has empty implementation on RFduino but default is 4Mhz (equals DIV4)
-  SPI.setFrequency(4000);
-  SPI.begin();
 #endif
-  digitalWrite(_slaveSelectPin, LOW);
+  // without transactions the bus is set up once (mode 0, MSB first, 4MHz), see SpiBus.h
+  SpiBus::select(_slaveSelectPin);
 }
 
 /// UNselect the flash chip
 void SPIFlash::unselect() {
-  digitalWrite(_slaveSelectPin, HIGH);
-  //restore SPI settings to what they were before talking to the FLASH chip
+  SpiBus::deselect(_slaveSelectPin);
 #ifdef SPI_HAS_TRANSACTION
   SPI.endTransaction();
-#else
-  // interrupts();
 #endif
-  // SPCR = _SPCR;
-  // SPSR = _SPSR;
+}
+
+/// 24 bit address of a read, program or erase command, MSB first
+void SPIFlash::sendAddress(uint32_t addr) {
+  uint8_t bytes[3] = { (uint8_t)(addr >> 16), (uint8_t)(addr >> 8), (uint8_t)addr };
+  SpiBus::send(bytes, 3);
 }
 
 /// setup SPI, read device ID etc...
@@ -475,15 +1507,16 @@ boolean SPIFlash::initialize()
   // _SPSR = SPSR;
   pinMode(_slaveSelectPin, OUTPUT);
 #ifdef SPI_HAS_TRANSACTION
-  _settings = SPISettings(4000000, MSBFIRST, SPI_MODE0);
+  _settings = SPISettings(SpiBus::frequency() * 1000UL, MSBFIRST, SPI_MODE0);
 #endif
 
   unselect();
   wakeup();
+  detect();
 
   if (_jedecID == 0 || readDeviceId() == _jedecID) {
     command(SPIFLASH_STATUSWRITE, true); // Write Status Register
-    SPI.transfer(0);                     // Global Unprotect
+    SpiBus::transfer(0);                     // Global Unprotect
     unselect();
     return true;
   }
@@ -497,14 +1530,135 @@ uint16_t SPIFlash::readDeviceId()
   command(SPIFLASH_IDREAD); // Read JEDEC ID
 #else
   select();
-  SPI.transfer(SPIFLASH_IDREAD);
+  SpiBus::transfer(SPIFLASH_IDREAD);
 #endif
-  uint16_t jedecid = SPI.transfer(0) << 8;
-  jedecid |= SPI.transfer(0);
+  uint16_t jedecid = SpiBus::transfer(0) << 8;
+  jedecid |= SpiBus::transfer(0);
   unselect();
   return jedecid;
 }
 
+/// Get the manufacturer, memory type and capacity bytes (JEDEC, 3 bytes)
+uint32_t SPIFlash::readJedecId()
+{
+  command(SPIFLASH_IDREAD);
+  uint8_t id[3];
+  SpiBus::receive(id, 3);
+  unselect();
+  return (uint32_t)id[0] << 16 | (uint16_t)id[1] << 8 | id[2];
+}
+
+/// read from the SFDP tables (JESD216), like a fast read
+void SPIFlash::readSfdp(uint32_t addr, void* buf, uint16_t len) {
+  command(SPIFLASH_SFDPREAD);
+  sendAddress(addr);
+  SpiBus::transfer(0); //"dont care"
+  SpiBus::receive((uint8_t*) buf, len);
+  unselect();
+}
+
+static uint32_t sfdpDword(const uint8_t *bytes) {
+  return bytes[0] | (uint16_t)bytes[1] << 8 | (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+// one read command from its SFDP field: opcode << 8 | mode clocks << 5 | dummy clocks
+static SPIFlashRead sfdpRead(uint16_t field, uint8_t addressLines, uint8_t dataLines) {
+  SPIFlashRead read = { (uint8_t)(field >> 8), addressLines, dataLines, 0 };
+  uint8_t clocks = (field & 0x1F) + (field >> 5 & 7);
+  // bytes only: a mode + dummy phase that doesn't end on a byte can't be clocked by this bus
+  if(clocks * addressLines % 8 != 0 || clocks * addressLines / 8 > 8) read.opcode = 0;
+  read.dummyBytes = clocks * addressLines / 8;
+  return read;
+}
+
+/// Reads the SFDP basic flash parameter table, if the chip has one, for its capacity and the
+/// dual/quad reads it supports, then picks the fastest read the wiring allows (see setDataLines()).
+/// Chips without SFDP keep the single line reads (0x03, or 0x0B above SPIFLASH_LOWFREQ_KHZ). Returns false when no chip answers.
+boolean SPIFlash::detect()
+{
+  _capacity = 0;
+  memset(_fastReads, 0, sizeof(_fastReads));
+  uint32_t jedec = readJedecId();
+  uint8_t header[16];
+  readSfdp(0, header, sizeof(header));
+  // the first parameter header is the basic table (id 0x00), 9 dwords or more since JESD216
+  if(header[0] == 'S' && header[1] == 'F' && header[2] == 'D' && header[3] == 'P' && header[8] == 0x00 && header[11] >= 4) {
+    uint8_t table[16];
+    readSfdp(header[12] | (uint16_t)header[13] << 8 | (uint32_t)header[14] << 16, table, sizeof(table));
+    uint32_t features = sfdpDword(table), density = sfdpDword(table + 4);
+    // 2^n bits: only n from 3 (a byte) to 34 (2 GB, the largest that fits a 32 bit byte count) is taken,
+    // anything else (garbage from a floating bus) would be a shift out of range
+    uint32_t exponent = density & 0x7FFFFFFFUL;
+    if(density & 0x80000000UL) _capacity = exponent >= 3 && exponent <= 34 ? 1UL << (exponent - 3) : 0;
+    else _capacity = (density >> 3) + 1;
+    uint32_t quad = sfdpDword(table + 8), dual = sfdpDword(table + 12);
+    if(features & 1UL << 21) _fastReads[0] = sfdpRead(quad, 4, 4);
+    if(features & 1UL << 22) _fastReads[1] = sfdpRead(quad >> 16, 1, 4);
+    if(features & 1UL << 20) _fastReads[2] = sfdpRead(dual >> 16, 2, 2);
+    if(features & 1UL << 16) _fastReads[3] = sfdpRead(dual, 1, 2);
+  }
+  chooseRead();
+  return jedec != 0 && jedec != 0xFFFFFF;
+}
+
+/// capacity in bytes the chip reports through SFDP, 0 if it doesn't
+uint32_t SPIFlash::capacity() {
+  return _capacity;
+}
+
+void SPIFlash::chooseRead() {
+  // single line: 0x03 saves the dummy byte up to the clock it is specified for, 0x0B above it
+  SPIFlashRead single = { SPIFLASH_ARRAYREADLOWFREQ, 1, 1, 0 };
+  if(SpiBus::frequency() > SPIFLASH_LOWFREQ_KHZ) {
+    single.opcode = SPIFLASH_ARRAYREAD;
+    single.dummyBytes = 1;
+  }
+  _read = single;
+  for(uint8_t i = 0; i < 4; i++) {
+    if(_fastReads[i].opcode && _fastReads[i].addressLines <= _lines && _fastReads[i].dataLines <= _lines) {
+      _read = _fastReads[i];
+      return;
+    }
+  }
+}
+
+/// data lines wired to the chip (1, 2 or 4): the reads use the fastest command that fits
+void SPIFlash::setDataLines(uint8_t lines) {
+#ifndef SPI_HAS_DATA_LINES
+  lines = 1; // the SPI master only has MOSI/MISO
+#endif
+  _lines = lines >= 4 ? 4 : lines >= 2 ? 2 : 1;
+  chooseRead();
+}
+
+/// SPI clock in kHz, for the flash and everything else on the bus (4000 by default; nRF51 up to 8000)
+void SPIFlash::setClock(uint16_t khz) {
+  SpiBus::setFrequency(khz);
+#ifdef SPI_HAS_TRANSACTION
+  _settings = SPISettings(khz * 1000UL, MSBFIRST, SPI_MODE0);
+#endif
+  chooseRead();
+}
+
+/// the read command readBytes() uses
+SPIFlashRead SPIFlash::readMode() {
+  return _read;
+}
+
+/// Starts a read at addr: the data follows with SpiBus::receive() until endRead()
+void SPIFlash::beginRead(uint32_t addr) {
+  command(_read.opcode);
+  SpiBus::setDataLines(_read.addressLines);
+  uint8_t header[3 + 8] = { (uint8_t)(addr >> 16), (uint8_t)(addr >> 8), (uint8_t)addr }; // mode bits 0: no continuous read
+  SpiBus::send(header, 3 + _read.dummyBytes);
+  SpiBus::setDataLines(_read.dataLines);
+}
+
+void SPIFlash::endRead() {
+  SpiBus::setDataLines(1);
+  unselect();
+}
+
 /// Get the 64 bit unique identifier, stores it in UNIQUEID[8]. Only needs to be called once, ie after initialize
 /// Returns the byte pointer to the UNIQUEID byte array
 /// Read UNIQUEID like this:
@@ -514,37 +1668,28 @@ uint16_t SPIFlash::readDeviceId()
 uint8_t* SPIFlash::readUniqueId()
 {
   command(SPIFLASH_MACREAD);
-  SPI.transfer(0);
-  SPI.transfer(0);
-  SPI.transfer(0);
-  SPI.transfer(0);
+  SpiBus::transfer(0);
+  SpiBus::transfer(0);
+  SpiBus::transfer(0);
+  SpiBus::transfer(0);
   for (uint8_t i=0;i<8;i++)
-    UNIQUEID[i] = SPI.transfer(0);
+    UNIQUEID[i] = SpiBus::transfer(0);
   unselect();
   return UNIQUEID;
 }
 
 /// read 1 byte from flash memory
 uint8_t SPIFlash::readByte(uint32_t addr) {
-  command(SPIFLASH_ARRAYREADLOWFREQ);
-  SPI.transfer(addr >> 16);
-  SPI.transfer(addr >> 8);
-  SPI.transfer(addr);
-  uint8_t result = SPI.transfer(0);
-  unselect();
+  uint8_t result;
+  readBytes(addr, &result, 1);
   return result;
 }
 
-/// read unlimited # of bytes
+/// read unlimited # of bytes, with the fastest read the chip and the wiring allow
 void SPIFlash::readBytes(uint32_t addr, void* buf, uint16_t len) {
-  command(SPIFLASH_ARRAYREAD);
-  SPI.transfer(addr >> 16);
-  SPI.transfer(addr >> 8);
-  SPI.transfer(addr);
-  SPI.transfer(0); //"dont care"
-  for (uint16_t i = 0; i < len; ++i)
-    ((uint8_t*) buf)[i] = SPI.transfer(0);
-  unselect();
+  beginRead(addr);
+  SpiBus::receive((uint8_t*) buf, len);
+  endRead();
 }
 
 /// Send a command to the flash chip, pass TRUE for isWrite when its a write command
@@ -565,7 +1710,7 @@ void SPIFlash::command(uint8_t cmd, boolean isWrite){
   //  open drain MISO input which can read noise/static and hence return a non 0 status byte, causing the while() to hang when a flash chip is not present
   while(busy());
   select();
-  SPI.transfer(cmd);
+  SpiBus::transfer(cmd);
 }
 
 /// check if the chip is busy erasing/writing
@@ -573,8 +1718,8 @@ boolean SPIFlash::busy()
 {
   /*
   select();
-  SPI.transfer(SPIFLASH_STATUSREAD);
-  uint8_t status = SPI.transfer(0);
+  SpiBus::transfer(SPIFLASH_STATUSREAD);
+  uint8_t status = SpiBus::transfer(0);
   unselect();
   return status & 1;
   */
@@ -585,8 +1730,8 @@ boolean SPIFlash::busy()
 uint8_t SPIFlash::readStatus()
 {
   select();
-  SPI.transfer(SPIFLASH_STATUSREAD);
-  uint8_t status = SPI.transfer(0);
+  SpiBus::transfer(SPIFLASH_STATUSREAD);
+  uint8_t status = SpiBus::transfer(0);
   unselect();
   return status;
 }
@@ -597,10 +1742,8 @@ uint8_t SPIFlash::readStatus()
 ///          use the block erase commands to first clear memory (write 0xFFs)
 void SPIFlash::writeByte(uint32_t addr, uint8_t byt) {
   command(SPIFLASH_BYTEPAGEPROGRAM, true);  // Byte/Page Program
-  SPI.transfer(addr >> 16);
-  SPI.transfer(addr >> 8);
-  SPI.transfer(addr);
-  SPI.transfer(byt);
+  sendAddress(addr);
+  SpiBus::transfer(byt);
   unselect();
 }
 
@@ -617,12 +1760,9 @@ void SPIFlash::writeBytes(uint32_t addr, const void* buf, uint16_t len) {
   {
     n = (len<=maxBytes) ? len : maxBytes;
     command(SPIFLASH_BYTEPAGEPROGRAM, true);  // Byte/Page Program
-    SPI.transfer(addr >> 16);
-    SPI.transfer(addr >> 8);
-    SPI.transfer(addr);
+    sendAddress(addr);
 
-    for (uint16_t i = 0; i < n; i++)
-      SPI.transfer(((uint8_t*) buf)[offset + i]);
+    SpiBus::send((const uint8_t*) buf + offset, n);
     unselect();
 
     addr+=n;  // adjust the addresses and remaining bytes by what we've just transferred.
@@ -643,46 +1783,54 @@ void SPIFlash::chipErase() {
   unselect();
 }
 
+/// erase the sector or block at addr with the chip's erase command opcode (see FLASHBUFFER_ERASE_...)
+void SPIFlash::erase(uint8_t opcode, uint32_t addr) {
+  command(opcode, true); // Block Erase
+  sendAddress(addr);
+  unselect();
+}
+
 /// erase a 4Kbyte block
 void SPIFlash::blockErase4K(uint32_t addr) {
-  command(SPIFLASH_BLOCKERASE_4K, true); // Block Erase
-  SPI.transfer(addr >> 16);
-  SPI.transfer(addr >> 8);
-  SPI.transfer(addr);
-  unselect();
+  erase(SPIFLASH_BLOCKERASE_4K, addr);
 }
 
 /// erase a 32Kbyte block
 void SPIFlash::blockErase32K(uint32_t addr) {
-  command(SPIFLASH_BLOCKERASE_32K, true); // Block Erase
-  SPI.transfer(addr >> 16);
-  SPI.transfer(addr >> 8);
-  SPI.transfer(addr);
-  unselect();
+  erase(SPIFLASH_BLOCKERASE_32K, addr);
 }
 
 /// erase a 64Kbyte block
 void SPIFlash::blockErase64K(uint32_t addr) {
-  command(SPIFLASH_BLOCKERASE_64K, true); // Block Erase
-  SPI.transfer(addr >> 16);
-  SPI.transfer(addr >> 8);
-  SPI.transfer(addr);
-  unselect();
+  erase(SPIFLASH_BLOCKERASE_64K, addr);
 }
 
+/// deep power-down (a few uA instead of the standby current); any command wakes the chip again
 void SPIFlash::sleep() {
   command(SPIFLASH_SLEEP);
   unselect();
+  _sleeping = true;
 }
 
+/// release from deep power-down; the chip takes commands SPIFLASH_WAKE_US later, the next
+/// select() waits for what is left of that (so call this early and do something else meanwhile)
 void SPIFlash::wakeup() {
-  command(SPIFLASH_WAKE);
+  _sleeping = _waking = false;
+  select(); // no status poll first: a chip in deep power-down doesn't answer one
+  SpiBus::transfer(SPIFLASH_WAKE);
   unselect();
+  _wakeStart = micros();
+  _waking = true;
+}
+
+boolean SPIFlash::sleeping() {
+  return _sleeping;
 }
 
 /// cleanup
 void SPIFlash::end() {
   SPI.end();
+  SpiBus::invalidate();
 }
 
 // void Test::setCallback(void (*aFunc)()) {
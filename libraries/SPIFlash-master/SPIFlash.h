@@ -43,6 +43,9 @@
 // #endif
 
 #include <SPI.h>
+#include <SpiBus.h>
+#include <RingBuffer.h>
+#include <Crc32.h>
 
 /// IMPORTANT: NAND FLASH memory requires erase before write, because
 ///            it can only transition from 1s to 0s and only the erase command can reset all 0s to 1s
@@ -86,20 +89,56 @@
                                               // Example for Atmel-Adesto 4Mbit AT25DF041A: 0x1F44 (page 27: http://www.adestotech.com/sites/default/files/datasheets/doc3668.pdf)
                                               // Example for Winbond 4Mbit W25X40CL: 0xEF30 (page 14: http://www.winbond.com/NR/rdonlyres/6E25084C-0BFE-4B25-903D-AE10221A0929/0/W25X40CL.pdf)
 #define SPIFLASH_MACREAD          0x4B        // read unique ID number (MAC)
+#define SPIFLASH_SFDPREAD         0x5A        // read the SFDP parameter tables (3 address bytes, 1 dummy byte)
+#define SPIFLASH_FASTREAD_DUAL    0x3B        // 1-1-2: address on MOSI, data on IO0-1 (opcodes and dummy cycles come from SFDP)
+#define SPIFLASH_FASTREAD_DUALIO  0xBB        // 1-2-2: address and data on IO0-1
+#define SPIFLASH_FASTREAD_QUAD    0x6B        // 1-1-4: address on MOSI, data on IO0-3
+#define SPIFLASH_FASTREAD_QUADIO  0xEB        // 1-4-4: address and data on IO0-3
+
+// data lines wired between the SPI master and the flash: 1 (MOSI/MISO), 2 (IO0-1) or 4 (IO0-3, with
+// WP/HOLD as IO2-3). Only SPI libraries with SPI_HAS_DATA_LINES can use more than one.
+#ifndef SPIFLASH_IO_LINES
+#define SPIFLASH_IO_LINES 1
+#endif
+
+// fastest clock the plain read (0x03) is specified for on the slowest supported chips (AT25DF: 33MHz)
+#ifndef SPIFLASH_LOWFREQ_KHZ
+#define SPIFLASH_LOWFREQ_KHZ 33000
+#endif
+
+// release from deep power-down (tRES1) before the chip takes commands again: 3us on W25Q parts,
+// 30us on AT25DF. select() waits out what is left of it after wakeup().
+#ifndef SPIFLASH_WAKE_US
+#define SPIFLASH_WAKE_US 30
+#endif
+
+// resolution of micros(); raise it on cores where it ticks coarser, so the wait above is never cut short
+#ifndef SPIFLASH_MICROS_STEP
+#define SPIFLASH_MICROS_STEP 1
+#endif
+
+// a read command: how it is clocked and what comes between the address and the data
+struct SPIFlashRead {
+  uint8_t opcode;       // 0: not available
+  uint8_t addressLines; // lines for the address, mode and dummy bytes
+  uint8_t dataLines;
+  uint8_t dummyBytes;   // mode + dummy clocks, as bytes on addressLines
+};
 
 
 
 #define RING_SIZE 512 // size of 2 pages; write at least one page at once.
-class SerialBuffer {
+// Byte ring between the serial receiver (producer) and FlashBuffer (consumer), or FlashBuffer
+// (producer) and the audio interrupt (consumer). Every instance has its own storage; the bulk
+// push/pop and region calls of RingBuffer move whole pages without a call per byte.
+class SerialBuffer : public RingBuffer<byte, RING_SIZE> {
 public:
   int add(byte b);
+  uint16_t add(const byte *buf, uint16_t len);
   int remove();
   void reset();
   uint16_t numberOfElements();
-private:
-  volatile uint16_t ring_head = 0;
-  volatile uint16_t ring_tail = 0;
-  static volatile byte ring_data[RING_SIZE];
+  uint16_t freeSpace();
 };
 
 
@@ -117,20 +156,40 @@ public:
   void writeBytes(uint32_t addr, const void* buf, uint16_t len);
   boolean busy();
   void chipErase();
+  void erase(uint8_t opcode, uint32_t address);
   void blockErase4K(uint32_t address);
   void blockErase32K(uint32_t address);
   void blockErase64K(uint32_t address);
   uint16_t readDeviceId();
+  uint32_t readJedecId();
   uint8_t* readUniqueId();
+  boolean detect();
+  uint32_t capacity();
+  void setDataLines(uint8_t lines);
+  void setClock(uint16_t khz);
+  SPIFlashRead readMode();
+  void readSfdp(uint32_t addr, void* buf, uint16_t len);
+  void beginRead(uint32_t addr);
+  void endRead();
   void select();
   void unselect();
+  void sendAddress(uint32_t addr);
   void sleep();
   void wakeup();
+  boolean sleeping();
   void end();
 protected:
 
   uint8_t _slaveSelectPin;
   uint16_t _jedecID;
+  uint32_t _capacity; // from SFDP, 0: unknown
+  uint8_t _lines;
+  boolean _sleeping;  // in deep power-down: the next select() wakes the chip first
+  boolean _waking;    // woken at _wakeStart, select() waits until SPIFLASH_WAKE_US have passed
+  uint32_t _wakeStart;
+  SPIFlashRead _read;
+  SPIFlashRead _fastReads[4]; // from SFDP, fastest first: 1-4-4, 1-1-4, 1-2-2, 1-1-2
+  void chooseRead();
   uint8_t _SPCR;
   uint8_t _SPSR;
 #ifdef SPI_HAS_TRANSACTION
@@ -138,25 +197,336 @@ protected:
 #endif
 };
 
+// position inside a stored item, so an item can be read in chunks spread over many calls
+struct ItemCursor {
+  uint8_t id;
+  uint32_t address;   // flash address of the next payload byte
+  uint32_t remaining; // payload bytes not read yet
+  uint32_t crc;       // running CRC32 of the payload read so far (see checkItem())
+  boolean whole;      // read from the first byte on without skipping, so crc covers all of it
+};
+
+#define FLASHBUFFER_MIN_BURST 64 // don't start a read transaction for less than this (unless it's the end of the item)
+
+// Item directory: open addressing hash table on the item id, kept in RAM and written to flash
+// after every item (index record, id 0x7F, 11 bytes per item: id | page(2) | format | length(3) |
+// CRC32 of the payload(4)). Must be a power of 2 and holds up to FLASHBUFFER_DIRECTORY_SIZE - 1 items;
+// ids are 7 bit, so 128 covers every possible id. Costs 12 bytes of RAM per slot; lower it when RAM
+// is tight. The length in the index header has FLASHBUFFER_INDEX_CRC set; indexes written before
+// the CRCs have 7 byte entries without it, their items load unchecked.
+#ifndef FLASHBUFFER_DIRECTORY_SIZE
+#define FLASHBUFFER_DIRECTORY_SIZE 128
+#endif
+#define FLASHBUFFER_INDEX_ENTRY 11
+#define FLASHBUFFER_INDEX_CRC 0x800000UL
+
+// Read-through cache of flash pages for readItemCached, with sequential prefetch of the next page.
+// Costs FLASHBUFFER_PAGE_SIZE bytes of RAM per page; 2 is enough for sequential playback, more helps when several
+// items are read interleaved.
+#ifndef FLASHBUFFER_CACHE_PAGES
+#define FLASHBUFFER_CACHE_PAGES 2
+#endif
+
+// Chip descriptor: the part FlashBuffer lays its log out on. Pick one with FLASHBUFFER_CHIP
+// (e.g. -DFLASHBUFFER_CHIP=FLASHBUFFER_CHIP_W25Q128) or describe another one by defining
+// FLASHBUFFER_CHIP_JEDEC and FLASHBUFFER_CHIP_SHIFT (and whatever differs below) yourself.
+// FLASHBUFFER_CHIP_JEDEC is the 24 bit JEDEC id; initialize() checks its manufacturer and type
+// bytes, and the mount its capacity when the chip reports one in SFDP (FlashBuffer::chipFound()).
+#define FLASHBUFFER_CHIP_0140    1 // 01 40 14, 1 MB: the part FlashBuffer was written for
+#define FLASHBUFFER_CHIP_W25Q32  2 // EF 40 16, 4 MB
+#define FLASHBUFFER_CHIP_W25Q128 3 // EF 40 18, 16 MB
+#ifndef FLASHBUFFER_CHIP
+#define FLASHBUFFER_CHIP FLASHBUFFER_CHIP_0140
+#endif
+#ifndef FLASHBUFFER_CHIP_JEDEC
+#if FLASHBUFFER_CHIP == FLASHBUFFER_CHIP_W25Q32
+#define FLASHBUFFER_CHIP_JEDEC 0xEF4016
+#define FLASHBUFFER_CHIP_SHIFT 22
+#elif FLASHBUFFER_CHIP == FLASHBUFFER_CHIP_W25Q128
+#define FLASHBUFFER_CHIP_JEDEC 0xEF4018
+#define FLASHBUFFER_CHIP_SHIFT 24
+#else
+#define FLASHBUFFER_CHIP_JEDEC 0x014014
+#define FLASHBUFFER_CHIP_SHIFT 20
+#endif
+#endif
+
+// Geometry and command set, the same on all the parts above: 256 byte program pages, 4K sectors,
+// 32K and 64K blocks. FLASHBUFFER_MID_SHIFT 0: the chip has no 32K erase. The log needs the
+// 3 byte address commands (up to 16 MB) and 16 bit page numbers.
+#ifndef FLASHBUFFER_PAGE_SHIFT
+#define FLASHBUFFER_PAGE_SHIFT 8
+#endif
+#ifndef FLASHBUFFER_SECTOR_SHIFT
+#define FLASHBUFFER_SECTOR_SHIFT 12
+#endif
+#ifndef FLASHBUFFER_MID_SHIFT
+#define FLASHBUFFER_MID_SHIFT 15
+#endif
+#ifndef FLASHBUFFER_BLOCK_SHIFT
+#define FLASHBUFFER_BLOCK_SHIFT 16
+#endif
+#ifndef FLASHBUFFER_ERASE_SECTOR
+#define FLASHBUFFER_ERASE_SECTOR SPIFLASH_BLOCKERASE_4K
+#endif
+#ifndef FLASHBUFFER_ERASE_MID
+#define FLASHBUFFER_ERASE_MID SPIFLASH_BLOCKERASE_32K
+#endif
+#ifndef FLASHBUFFER_ERASE_BLOCK
+#define FLASHBUFFER_ERASE_BLOCK SPIFLASH_BLOCKERASE_64K
+#endif
+#define FLASHBUFFER_PAGE_SIZE (1U << FLASHBUFFER_PAGE_SHIFT)
+#define FLASHBUFFER_SECTOR_SIZE (1UL << FLASHBUFFER_SECTOR_SHIFT)
+#define FLASHBUFFER_MID_SIZE (FLASHBUFFER_MID_SHIFT ? 1UL << FLASHBUFFER_MID_SHIFT : 0)
+#define FLASHBUFFER_BLOCK_SIZE (1UL << FLASHBUFFER_BLOCK_SHIFT)
+#define FLASHBUFFER_PAGE_MASK (FLASHBUFFER_PAGE_SIZE - 1UL)
+#define FLASHBUFFER_SECTOR_MASK (FLASHBUFFER_SECTOR_SIZE - 1)
+#define FLASHBUFFER_BLOCK_MASK (FLASHBUFFER_BLOCK_SIZE - 1)
+
+// The items form a circular log over FLASHBUFFER_BLOCKS blocks, all of the chip unless set lower
+// (a power of 2, up to 256). Every block starts with a 4 byte header:
+// erase count(2) | sequence number(2). The erase count counts on with every erase of the block,
+// the sequence number with every block the log moves into (0xFFFF: not written since the erase).
+#ifndef FLASHBUFFER_BLOCKS
+#define FLASHBUFFER_BLOCKS (1UL << (FLASHBUFFER_CHIP_SHIFT - FLASHBUFFER_BLOCK_SHIFT))
+#endif
+#define FLASHBUFFER_CAPACITY ((uint32_t)FLASHBUFFER_BLOCKS << FLASHBUFFER_BLOCK_SHIFT)
+#define FLASHBUFFER_PAGES ((uint32_t)FLASHBUFFER_BLOCKS << (FLASHBUFFER_BLOCK_SHIFT - FLASHBUFFER_PAGE_SHIFT))
+#if FLASHBUFFER_BLOCKS > 256
+#error "FlashBuffer: at most 256 blocks (block ids are a byte)"
+#endif
+#if FLASHBUFFER_BLOCKS << (FLASHBUFFER_BLOCK_SHIFT - FLASHBUFFER_PAGE_SHIFT) > 65536
+#error "FlashBuffer: at most 65536 pages (page numbers are 16 bit)"
+#endif
+#if FLASHBUFFER_BLOCKS << FLASHBUFFER_BLOCK_SHIFT > 1L << 24 || FLASHBUFFER_PAGE_SHIFT > 8
+#error "FlashBuffer: at most 16 MB and 256 byte pages (3 byte addresses, one page per program command)"
+#endif
+#define FLASHBUFFER_BLOCK_HEADER 4
+
+// Checkpoint journal: the top two sectors of the chip (taken from the end of the last block)
+// holds 16 byte entries, one appended after every index record and after erasing between items:
+// generation | next page(2) | index page(2) | block sequence(2) | latest block |
+// erased pages ahead(2) | unused(5) | check. Mounting finds the latest entry with a binary search
+// and only walks the records written after it, so it takes about a dozen small reads however
+// full the chip is. The sectors take turns: when one is full the other is erased.
+#define FLASHBUFFER_CHECKPOINT_ADDRESS (FLASHBUFFER_CAPACITY - 2 * FLASHBUFFER_SECTOR_SIZE)
+#define FLASHBUFFER_CHECKPOINT_SIZE 16
+#define FLASHBUFFER_CHECKPOINT_ENTRIES (FLASHBUFFER_SECTOR_SIZE / FLASHBUFFER_CHECKPOINT_SIZE)
+
+// The cleaner relocates live items out of its way while they (plus the item being written and
+// room for relocating) take up to this percentage of the chip; beyond that it evicts the oldest,
+// like a ring buffer. Relocating costs at most 100 / (100 - FLASHBUFFER_MAX_FILL) bytes programmed
+// per byte uploaded.
+#ifndef FLASHBUFFER_MAX_FILL
+#define FLASHBUFFER_MAX_FILL 75
+#endif
+
+#define FLASHBUFFER_NO_SLOT 0xFFFF
+
+// How an item's payload is coded, kept in its directory entry: the coding in the low nibble and
+// the sample rate in the high one, e.g. FLASHBUFFER_FORMAT_IMA_ADPCM | FLASHBUFFER_RATE_16000.
+// Items from before the rate was stored read as 8 kHz, which is what all of them were recorded at.
+// FLASHBUFFER_FORMAT_CHECKED is set by FlashBuffer itself on items whose directory entry has a CRC.
+#define FLASHBUFFER_FORMAT_PCM8      0 // 8 bit unsigned PCM
+#define FLASHBUFFER_FORMAT_IMA_ADPCM 1 // 4 bit IMA ADPCM in 256 byte blocks, see ImaAdpcm.h
+#define FLASHBUFFER_CODING_MASK   0x07
+#define FLASHBUFFER_FORMAT_CHECKED 0x08
+
+#define FLASHBUFFER_RATE_8000     0x00
+#define FLASHBUFFER_RATE_11025    0x10
+#define FLASHBUFFER_RATE_12000    0x20
+#define FLASHBUFFER_RATE_16000    0x30
+#define FLASHBUFFER_RATE_22050    0x40
+#define FLASHBUFFER_RATE_24000    0x50
+#define FLASHBUFFER_RATE_32000    0x60
+#define FLASHBUFFER_RATE_44100    0x70
+#define FLASHBUFFER_RATE_48000    0x80
+#define FLASHBUFFER_RATE_MASK     0xF0
+
+uint16_t flashBufferSampleRate(uint8_t format); // Hz of the FLASHBUFFER_RATE_... bits in format
+uint8_t flashBufferRateBits(uint16_t rate);      // FLASHBUFFER_RATE_... closest to rate Hz
+
+// Streams (openStream): items whose length isn't known until they are closed, e.g. a recording.
+// Their headers say FLASHBUFFER_LENGTH_OPEN while they are written; closeStream() programs the
+// lengths into them afterwards (the bits are all still set, so the pages take a second program).
+// The cleaner makes room for the reserve passed to openStream() before the stream starts, the
+// writer then keeps FLASHBUFFER_STREAM_AHEAD erased ahead of it, a sector at a time.
+#define FLASHBUFFER_LENGTH_OPEN 0xFFFFFFUL
+#ifndef FLASHBUFFER_STREAM_AHEAD
+#define FLASHBUFFER_STREAM_AHEAD (4 * FLASHBUFFER_SECTOR_SIZE)
+#endif
+
+// Every item gets a CRC32 of its payload in its directory entry, computed while it is programmed
+// from the ring. Readers update the cursor's CRC after every burst, from the bytes the burst brought
+// in, so checking costs no extra flash read; checkItem() compares at the end of the item. With
+// setVerify() the writer reads every item back once it is programmed and only indexes it when
+// that matches.
+#define FLASHBUFFER_CHECK_OK      0 // read to the end, matches its CRC
+#define FLASHBUFFER_CHECK_BAD     1 // read to the end, doesn't match
+#define FLASHBUFFER_CHECK_UNKNOWN 2 // not read to the end, skipped over, or an item without a CRC
+
+// results of FlashBuffer::writeStep()
+#define FLASHBUFFER_WRITE_IDLE      0 // nothing (left) to write
+#define FLASHBUFFER_WRITE_WAITING   1 // waiting for data in the ring or for the chip
+#define FLASHBUFFER_WRITE_PROGRESS  2 // programmed a page or started an erase
+
+struct CachedPage {
+  uint32_t page;     // flash address >> FLASHBUFFER_PAGE_SHIFT, 0xFFFFFFFF: empty
+  uint32_t lastUse;
+  uint8_t data[FLASHBUFFER_PAGE_SIZE];
+};
+
+struct DirEntry {
+  uint32_t length;
+  uint16_t page;  // items always start on a page
+  uint8_t id;     // 0xFF: free slot
+  uint8_t format; // FLASHBUFFER_FORMAT_... | FLASHBUFFER_RATE_...
+  uint32_t crc;   // of the payload, when format has FLASHBUFFER_FORMAT_CHECKED
+};
+
 class FlashBuffer {
 public:
   FlashBuffer(uint8_t pin);
-  void writeItemToFlash(uint8_t id, uint32_t length, SerialBuffer &serialBuffer);
+  // items: ids 0..0x7E (0x7F is the index record, bit 7 marks continuations); false/nothing written otherwise
+  void writeItemToFlash(uint8_t id, uint32_t length, SerialBuffer &serialBuffer, uint8_t format = FLASHBUFFER_FORMAT_PCM8);
+  boolean startItem(uint8_t id, uint32_t length, SerialBuffer &serialBuffer, uint8_t format = FLASHBUFFER_FORMAT_PCM8);
+  uint8_t writeStep();
+  boolean writing();
+  boolean openStream(uint8_t id, SerialBuffer &serialBuffer, uint8_t format = FLASHBUFFER_FORMAT_PCM8, uint32_t reserve = FLASHBUFFER_STREAM_AHEAD);
+  uint16_t appendStream(const byte *buf, uint16_t len);
+  boolean closeStream();
+  boolean streaming();
+  uint8_t eraseStep();
+  uint16_t eraseCount(uint16_t block);
+  boolean chipFound();
+  boolean powerDown();
+  void powerUp();
+  // write amplification: bytesProgrammed() (relocations, indexes, headers included) / bytesWritten()
+  uint32_t bytesWritten();
+  uint32_t bytesProgrammed();
+  uint32_t relocations();
+  uint32_t evictions();
+  void resetWriteStats();
   int readItemFromFlash(uint8_t id, uint32_t &length, SerialBuffer &serialBuffer);
   int fastReadItemFromFlash(uint8_t id, uint32_t &length, SerialBuffer &serialBuffer);
   uint8_t readItemAtIndex(uint8_t id, uint32_t index);
+  uint8_t readItemCached(uint8_t id, uint32_t index);
+  uint32_t cacheHits();
+  uint32_t cacheMisses();
+  uint32_t cachePrefetches();
+  void resetCacheStats();
+  boolean openItem(uint8_t id, ItemCursor &cursor);
+  uint16_t readItemChunk(ItemCursor &cursor, SerialBuffer &serialBuffer);
+  uint16_t readItemBytes(ItemCursor &cursor, uint8_t *buf, uint16_t len);
+  uint32_t skipItemBytes(ItemCursor &cursor, uint32_t len);
+  uint8_t checkItem(ItemCursor &cursor);
+  uint8_t verifyItem(uint8_t id);
+  void setVerify(boolean on);
+  uint32_t verifyFailures();
+  void setMaxBurst(uint16_t bytes);
   uint32_t getItemLength(uint8_t id);
+  uint8_t getItemFormat(uint8_t id);
+  uint16_t getItemSampleRate(uint8_t id);
+  uint8_t itemCount();
   void print();
   void setResumeCallback(void (*aFunc) ());
   void setPauseCallback(void (*aFunc)());
 private:
-  uint8_t latestBlockId, blockCounter;
-  uint32_t latestItemAddress, currentItemAddress;
-  boolean isContinuationOfItem;
+  uint8_t latestBlockId;
+  uint16_t blockSequence;
+  uint32_t latestIndexAddress; // header of the latest index record, 0xFFFFFFFF: none
   uint16_t nextPageId;
   SPIFlash flash;
-  uint16_t checkForLatestItemAddress(uint32_t address);
-  uint8_t indexTable[245] = {0xFF}; //35 * 7; still fits in 1 page | the 0xFF only initializes the first element, which sucks -> copy its value with memset in constructor
+  boolean chipOk;
+  // mounting and the checkpoint journal
+  uint8_t checkpointSector, checkpointGeneration;
+  uint16_t checkpointSlot; // next free entry in checkpointSector
+  boolean readCheckpoint(uint32_t &erasedAhead);
+  uint16_t readSequence(uint32_t address);
+  boolean rollForward(uint32_t address);
+  boolean pageBlank(uint32_t address);
+  uint8_t writeCheckpoint();
+  void switchCheckpointSector();
+  uint32_t blockEnd(uint32_t address);
+  uint32_t skipJournal(uint32_t address);
+  uint32_t nextRecordAddress(uint32_t end);
+  void setNextPage(uint32_t address);
+  // item writer, driven by writeStep()
+  enum { WRITE_CLEAN = 1, WRITE_RELOCATE, WRITE_ITEM, WRITE_VERIFY, WRITE_INDEX_START, WRITE_INDEX, WRITE_CHECKPOINT }; // 0: FLASHBUFFER_WRITE_IDLE
+  enum { SOURCE_RING, SOURCE_INDEX, SOURCE_FLASH };
+  uint8_t writeState;
+  uint8_t writeItemId, writeId;  // writeId: id in the next header, MSB set once the record continues in a new block
+  uint32_t writeItemLength;
+  uint32_t writeRecordAddress, writeAddress;
+  uint32_t writeRemaining, writeOffset; // payload bytes still to program / programmed
+  boolean writeFirstPage;
+  uint8_t writeSource;
+  SerialBuffer *writeItemSource;
+  ItemCursor writeCopy;  // the item being relocated
+  uint8_t writeItemFormat, writeCopyFormat;
+  uint32_t writeCrc, writeCopyCrc; // of what was programmed from the ring / of the item being relocated
+  boolean verifyWrites;
+  ItemCursor verifyCursor; // reads the item being programmed back
+  uint32_t verifyFailureCount;
+  boolean itemActive;    // from startItem() until the item's checkpoint is written
+  boolean itemPending;   // the item waits for the cleaner to make room
+  boolean idleCleaning;  // eraseStep() cleans between items
+  boolean directoryDirty; // items were relocated or evicted since the last index
+  boolean writeOpen;        // a stream that hasn't been closed yet
+  boolean writeOpenHeaders; // headers of the stream were programmed with FLASHBUFFER_LENGTH_OPEN
+  uint32_t sealAddress, sealRemaining; // the next of them to get its length, and that length
+  void beginRecord(uint8_t id, uint32_t length, uint8_t source);
+  uint8_t writePage();
+  void verifyPage();
+  void streamRoom();
+  boolean streamErasable(uint32_t until);
+  void endStream(boolean full);
+  uint8_t sealHeader();
+  void transferIndex(uint32_t offset, uint16_t n);
+  // cleaning and erasing ahead of the writer
+  uint32_t erasedUntil;  // flash from the write position up to here is erased
+  uint32_t blankCheck;   // pages from erasedUntil up to here were found blank already
+  uint32_t eraseTarget;  // end of what the record being written (plus its index) needs
+  boolean erasedSinceCheckpoint;
+  uint32_t eraseCountAddress; // block whose erase count still has to be written, 0xFFFFFFFF: none
+  uint16_t eraseCountValue;
+  uint32_t writtenBytes, programmedBytes, relocationCount, evictionCount;
+  uint8_t cleanStep();
+  void moveOut(uint16_t slot);
+  boolean overFull();
+  boolean fitsRoom(uint16_t slot, uint32_t spare);
+  uint32_t eraseSize(uint32_t address, uint32_t until);
+  uint8_t eraseAhead(uint32_t until);
+  void writeEraseCount();
+  uint32_t recordEnd(uint32_t address, uint32_t length);
+  uint32_t indexEnd(uint32_t address, uint16_t entries);
+  uint16_t burstLength(ItemCursor &cursor, uint16_t max);
+  boolean advanceCursor(ItemCursor &cursor, uint16_t n);
+  // directory
+  DirEntry directory[FLASHBUFFER_DIRECTORY_SIZE];
+  uint8_t directoryCount;
+  DirEntry *findEntry(uint8_t id);
+  void putEntry(uint8_t id, uint16_t page, uint32_t length, uint8_t format, uint32_t crc);
+  void removeEntry(uint16_t slot);
+  void evictOldest();
+  uint16_t oldestIn(uint32_t address, uint32_t size);
+  uint32_t liveBytes();
+  uint32_t reserveBytes();
+  void dropRange(uint32_t address, uint32_t size);
+  void loadDirectory(uint32_t address);
+  // item opened by readItemAtIndex, and the stretch of it that is contiguous in flash
+  uint8_t openId;
+  uint32_t openLength, openAddress;
+  uint32_t segmentStart, segmentEnd, segmentAddress;
+  boolean openCached(uint8_t id);
+  void locateSegment(uint32_t index);
+  // page cache
+  CachedPage cache[FLASHBUFFER_CACHE_PAGES];
+  uint32_t cacheUseCounter, cacheHitCount, cacheMissCount, cachePrefetchCount;
+  uint16_t maxBurst;
+  CachedPage *findCachedPage(uint32_t page);
+  CachedPage *loadPage(uint32_t page);
+  void invalidateCache();
   void (*resumeCallback) ();
   void (*pauseCallback) ();
 };
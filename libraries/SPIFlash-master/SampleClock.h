@@ -0,0 +1,43 @@
+// Sample timer settings for a sample rate, for the nRF51 TIMERs the RFduino sketches drive the
+// sample interrupt with: the 16 MHz clock divided by 2^prescaler (0..9), counting up to a compare
+// value and cleared by the COMPARE0_CLEAR short. In 16 bit mode the compare value fits up to
+// 65535, so the smallest prescaler that fits gives the closest rate (prescaler 0 down to 245 Hz:
+// 8000 Hz exactly, 11025 Hz 0.02% fast).
+//
+//   SampleClock clock = sampleClockFor(player.sampleRate());
+//   NRF_TIMER1->PRESCALER = clock.prescaler;
+//   NRF_TIMER1->CC[0] = clock.compare;
+
+#ifndef _SAMPLECLOCK_H_
+#define _SAMPLECLOCK_H_
+
+#include <Arduino.h>
+
+#define SAMPLE_CLOCK_HZ 16000000UL
+
+struct SampleClock {
+  uint8_t prescaler;
+  uint16_t compare; // the timer counts 0..compare, compare + 1 ticks per sample
+};
+
+static inline SampleClock sampleClockFor(uint32_t rate) {
+  SampleClock clock;
+  clock.prescaler = 0;
+  uint32_t ticks = (SAMPLE_CLOCK_HZ + rate / 2) / rate;
+  while(ticks > 65536UL && clock.prescaler < 9) {
+    clock.prescaler++;
+    uint32_t hz = SAMPLE_CLOCK_HZ >> clock.prescaler;
+    ticks = (hz + rate / 2) / rate;
+  }
+  if(ticks > 65536UL) ticks = 65536UL;
+  if(ticks < 1) ticks = 1;
+  clock.compare = ticks - 1;
+  return clock;
+}
+
+// the rate the timer really runs at with these settings
+static inline uint32_t sampleClockRate(SampleClock clock) {
+  return (SAMPLE_CLOCK_HZ >> clock.prescaler) / ((uint32_t)clock.compare + 1);
+}
+
+#endif
@@ -0,0 +1,261 @@
+#include <SerialUpload.h>
+
+static const uint16_t crcTable[256] = {
+  0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+  0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+  0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
+  0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE,
+  0x2462, 0x3443, 0x0420, 0x1401, 0x64E6, 0x74C7, 0x44A4, 0x5485,
+  0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
+  0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4,
+  0xB75B, 0xA77A, 0x9719, 0x8738, 0xF7DF, 0xE7FE, 0xD79D, 0xC7BC,
+  0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
+  0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B,
+  0x5AF5, 0x4AD4, 0x7AB7, 0x6A96, 0x1A71, 0x0A50, 0x3A33, 0x2A12,
+  0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
+  0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41,
+  0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD, 0xAD2A, 0xBD0B, 0x8D68, 0x9D49,
+  0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
+  0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78,
+  0x9188, 0x81A9, 0xB1CA, 0xA1EB, 0xD10C, 0xC12D, 0xF14E, 0xE16F,
+  0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
+  0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E,
+  0x02B1, 0x1290, 0x22F3, 0x32D2, 0x4235, 0x5214, 0x6277, 0x7256,
+  0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
+  0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+  0xA7DB, 0xB7FA, 0x8799, 0x97B8, 0xE75F, 0xF77E, 0xC71D, 0xD73C,
+  0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
+  0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB,
+  0x5844, 0x4865, 0x7806, 0x6827, 0x18C0, 0x08E1, 0x3882, 0x28A3,
+  0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
+  0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92,
+  0xFD2E, 0xED0F, 0xDD6C, 0xCD4D, 0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9,
+  0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
+  0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
+  0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0,
+};
+
+// CRC-16/CCITT (poly 0x1021), start with 0xFFFF; a table lookup per byte, so the receive interrupt
+// can keep it up to date as the bytes come in
+uint16_t uploadCrc16(uint16_t crc, const uint8_t *data, uint16_t len) {
+  while(len--) crc = crc << 8 ^ crcTable[(crc >> 8 ^ *data++) & 0xFF];
+  return crc;
+}
+
+uint16_t uploadFrame(uint8_t *out, uint8_t type, uint8_t seq, const uint8_t *payload, uint8_t len) {
+  out[0] = UPLOAD_FRAME_START;
+  out[1] = type;
+  out[2] = seq;
+  out[3] = len;
+  memcpy(out + 4, payload, len);
+  uint16_t crc = uploadCrc16(0xFFFF, out + 1, 3 + len);
+  out[4 + len] = crc >> 8;
+  out[5 + len] = crc;
+  return len + 6;
+}
+
+UploadReceiver::UploadReceiver(SerialBuffer &serialBuffer) : serialBuffer(serialBuffer) {
+  framePos = 0;
+  frameCrc = 0xFFFF;
+  hunting = true;
+  sendCallback = 0;
+  started = finished = false;
+  id = 0;
+  format = FLASHBUFFER_FORMAT_PCM8;
+  length = 0;
+  expected = limit = ackSent = 0;
+  ackRequests = nackRequests = doneRequests = rejectRequests = 0;
+  acksHandled = nacksHandled = donesHandled = rejectsHandled = 0;
+  rejectSeq = 0;
+  nacked = false;
+  badFrameCount = 0;
+}
+
+// Called from serialEvent() for every received byte
+void UploadReceiver::receive(uint8_t b) {
+  receive(&b, 1);
+}
+
+// Called from the UART interrupt (UploadUart) with the bytes it drained in one go. The header is
+// taken a byte at a time, the rest of the frame a stretch at a time; the CRC is updated with every
+// stretch, so the last byte of a frame costs no more than the others.
+void UploadReceiver::receive(const uint8_t *data, uint16_t len) {
+  while(len > 0) {
+    if(hunting) {
+      const uint8_t *start = (const uint8_t *)memchr(data, UPLOAD_FRAME_START, len);
+      if(!start) return;
+      len -= start + 1 - data;
+      data = start + 1;
+      hunting = false;
+      framePos = 0;
+      frameCrc = 0xFFFF;
+      continue;
+    }
+    uint16_t end = framePos < 3 ? framePos + 1 : 5 + frame[2];
+    uint16_t n = end - framePos < len ? end - framePos : len;
+    memcpy(frame + framePos, data, n);
+    // the CRC covers type..payload, not itself
+    uint16_t covered = n;
+    if(framePos >= 3) {
+      uint16_t crcAt = 3 + frame[2];
+      covered = framePos >= crcAt ? 0 : framePos + n > crcAt ? crcAt - framePos : n;
+    }
+    frameCrc = uploadCrc16(frameCrc, data, covered);
+    framePos += n;
+    data += n;
+    len -= n;
+    if(framePos < 3) continue;
+    if(framePos == 3 && frame[2] > UPLOAD_FRAME_PAYLOAD) {
+      badFrameCount++;
+      hunting = true;
+      continue;
+    }
+    if(framePos < 5 + frame[2]) continue;
+    hunting = true;
+    frameDone();
+  }
+}
+
+void UploadReceiver::frameDone() {
+  uint8_t len = frame[2];
+  if(frame[3 + len] != (uint8_t)(frameCrc >> 8) || frame[4 + len] != (uint8_t)frameCrc) {
+    badFrameCount++;
+    if(started && !nacked) {
+      nacked = true;
+      nackRequests++;
+    }
+    return;
+  }
+  handleFrame(frame[0], frame[1], frame + 3, len);
+}
+
+void UploadReceiver::handleFrame(uint8_t type, uint8_t seq, const uint8_t *payload, uint8_t len) {
+  if(type == UPLOAD_BEGIN && (len == 4 || len == 5)) {
+    uint32_t itemLength = (uint32_t)payload[1] << 16 | (uint32_t)payload[2] << 8 | payload[3];
+    if(started) {
+      if(payload[0] == id && itemLength == length) ackRequests++; // our ack got lost
+      return;
+    }
+    if(payload[0] >= 0x7F) {
+      // 0x7F is the index record and bit 7 marks the continuation of an item in a new block:
+      // stored, either would be misread on the next mount
+      rejectSeq = seq;
+      rejectRequests++;
+      return;
+    }
+    id = payload[0];
+    length = itemLength;
+    format = len == 5 ? payload[4] : FLASHBUFFER_FORMAT_PCM8;
+    expected = seq + 1;
+    limit = seq + 1; // no credits until loop() has looked at the ring
+    nacked = false;
+    finished = false;
+    started = true;
+    ackRequests++;
+  } else if(type == UPLOAD_DATA) {
+    if(!started) {
+      if(finished) doneRequests++; // the sender missed our 'F'
+      return;
+    }
+    if(seq != expected) {
+      if((int8_t)(seq - expected) < 0) {
+        ackRequests++; // sent again because an ack got lost
+      } else if(!nacked) {
+        nacked = true; // one nack per gap, the frames behind it are on their way anyway
+        nackRequests++;
+      }
+      return;
+    }
+    // never past the credits we handed out, so the ring can't overflow
+    if((int8_t)(limit - seq) <= 0 || serialBuffer.freeSpace() < len) {
+      if(!nacked) {
+        nacked = true;
+        nackRequests++;
+      }
+      return;
+    }
+    serialBuffer.add(payload, len);
+    nacked = false;
+    expected = seq + 1; // after the data: loop() counts the frame as in flight until now
+  }
+}
+
+// Called from loop() and from the FlashBuffer resume callback: hands out the ring space FlashBuffer
+// has freed as credits, and sends the acks/nacks the interrupt asked for.
+void UploadReceiver::sendCredits() {
+  uint8_t payload[1] = { 0 };
+  if(!started) {
+    if(rejectRequests != rejectsHandled) {
+      rejectsHandled = rejectRequests;
+      payload[0] = rejectSeq; // no credits
+      sendFrame(UPLOAD_NACK, rejectSeq, payload, 1);
+      return;
+    }
+    if(finished && doneRequests != donesHandled) {
+      donesHandled = doneRequests;
+      sendFrame(UPLOAD_FINISHED, expected, payload, 0);
+    }
+    return;
+  }
+  uint8_t e = expected; // before the free space: a frame arriving in between is counted twice, never missed
+  uint8_t window = limit - e;
+  uint16_t reserved = window * UPLOAD_FRAME_PAYLOAD;
+  uint16_t space = serialBuffer.freeSpace();
+  uint8_t oldLimit = limit;
+  if(window < UPLOAD_WINDOW && space >= reserved + UPLOAD_FRAME_PAYLOAD) {
+    uint8_t grant = (space - reserved) / UPLOAD_FRAME_PAYLOAD;
+    if(grant > UPLOAD_WINDOW - window) grant = UPLOAD_WINDOW - window;
+    limit = oldLimit + grant;
+  }
+  payload[0] = limit;
+  if(nackRequests != nacksHandled) {
+    nacksHandled = nackRequests;
+    acksHandled = ackRequests;
+    ackSent = e;
+    sendFrame(UPLOAD_NACK, e, payload, 1);
+  } else if(e != ackSent || limit != oldLimit || ackRequests != acksHandled) {
+    acksHandled = ackRequests;
+    ackSent = e;
+    sendFrame(UPLOAD_ACK, e, payload, 1);
+  }
+}
+
+// Called from loop() once writeItemToFlash() returned
+void UploadReceiver::finish() {
+  uint8_t payload[1] = { 0 };
+  started = false;
+  finished = true;
+  donesHandled = doneRequests;
+  sendFrame(UPLOAD_FINISHED, expected, payload, 0);
+}
+
+boolean UploadReceiver::itemStarted() {
+  return started;
+}
+
+uint8_t UploadReceiver::itemId() {
+  return id;
+}
+
+uint32_t UploadReceiver::itemLength() {
+  return length;
+}
+
+uint8_t UploadReceiver::itemFormat() {
+  return format;
+}
+
+uint32_t UploadReceiver::badFrames() {
+  return badFrameCount;
+}
+
+void UploadReceiver::setSendCallback(void (*aFunc)(const uint8_t *frame, uint8_t len)) {
+  sendCallback = aFunc;
+}
+
+void UploadReceiver::sendFrame(uint8_t type, uint8_t seq, const uint8_t *payload, uint8_t len) {
+  uint8_t out[6 + 1];
+  uint16_t n = uploadFrame(out, type, seq, payload, len);
+  if(sendCallback) sendCallback(out, n);
+  else Serial.write(out, n);
+}
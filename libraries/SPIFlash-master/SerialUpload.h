@@ -0,0 +1,93 @@
+// Windowed upload of an item over the serial port, device side.
+//
+// Every message is a frame: 0x7E | type | seq | len | payload[len] | crc16 (CCITT, big endian,
+// over type..payload). Frames with a bad CRC are dropped and the receiver hunts for the next 0x7E.
+//
+// sender -> device
+//   'B' seq 0:  begin, payload id | length(3) [| format (FLASHBUFFER_FORMAT_..., PCM8 when left out)]
+//   'D' seq n:  the next up to UPLOAD_FRAME_PAYLOAD bytes of the item, seq counts on from 1 (mod 256)
+// device -> sender
+//   'A' seq a:  ack, every frame before a arrived; payload limit: frames up to (not including)
+//               limit may be sent. The limit only moves on when FlashBuffer frees ring space
+//               (credits), so the sender never overruns the ring and never has to be paused.
+//   'N' seq a:  nack, frame a was lost or broken: send again from a (go-back-n), payload limit;
+//               a nack of the begin frame with limit a rejects the item (id 0x7F or above)
+//   'F' seq a:  the item is stored in flash
+//
+// The sender keeps every frame below the limit in flight; a frame that isn't acked in time is
+// sent again from the oldest unacked one.
+//
+//   UploadUart uart(receiver); uart.begin(57600);   UART interrupt -> receiver.receive(burst, n), see UploadUart.h
+//   (or serialEvent(): while(Serial.available()) receiver.receive(Serial.read());)
+//   loop():         receiver.sendCredits();
+//                   if(flashBuffer.writing()) { if(flashBuffer.writeStep() == FLASHBUFFER_WRITE_IDLE) receiver.finish(); }
+//                   else if(receiver.itemStarted()) flashBuffer.startItem(receiver.itemId(), receiver.itemLength(), ring, receiver.itemFormat());
+//                   else flashBuffer.eraseStep();
+//   resume callback of FlashBuffer: receiver.sendCredits();
+
+#ifndef _SERIALUPLOAD_H_
+#define _SERIALUPLOAD_H_
+
+#include <SPIFlash.h>
+
+#define UPLOAD_FRAME_START  0x7E
+#define UPLOAD_BEGIN        'B'
+#define UPLOAD_DATA         'D'
+#define UPLOAD_ACK          'A'
+#define UPLOAD_NACK         'N'
+#define UPLOAD_FINISHED     'F'
+
+// payload bytes per data frame; 6 bytes of framing on top
+#ifndef UPLOAD_FRAME_PAYLOAD
+#define UPLOAD_FRAME_PAYLOAD 64
+#endif
+// frames in flight at most, must stay below 128 for the 8 bit sequence numbers
+#ifndef UPLOAD_WINDOW
+#define UPLOAD_WINDOW (RING_SIZE / UPLOAD_FRAME_PAYLOAD)
+#endif
+
+uint16_t uploadCrc16(uint16_t crc, const uint8_t *data, uint16_t len);
+// builds a frame in out (len + 6 bytes), returns its length
+uint16_t uploadFrame(uint8_t *out, uint8_t type, uint8_t seq, const uint8_t *payload, uint8_t len);
+
+class UploadReceiver {
+public:
+  UploadReceiver(SerialBuffer &serialBuffer);
+  void receive(uint8_t b);
+  void receive(const uint8_t *data, uint16_t len);
+  void sendCredits();
+  void finish();
+  boolean itemStarted();
+  uint8_t itemId();
+  uint32_t itemLength();
+  uint8_t itemFormat();
+  uint32_t badFrames();
+  // where acks go out, Serial.write() when not set
+  void setSendCallback(void (*aFunc)(const uint8_t *frame, uint8_t len));
+private:
+  SerialBuffer &serialBuffer;
+  // frame being parsed (interrupt side)
+  uint8_t frame[3 + UPLOAD_FRAME_PAYLOAD + 2];
+  uint16_t framePos;
+  uint16_t frameCrc;          // over the frame so far
+  boolean hunting;
+  boolean nacked;             // a nack went out for the current gap
+  void frameDone();
+  void handleFrame(uint8_t type, uint8_t seq, const uint8_t *payload, uint8_t len);
+  // item
+  volatile boolean started, finished;
+  uint8_t id, format;
+  uint32_t length;
+  volatile uint8_t expected;  // next data frame
+  volatile uint8_t limit;     // granted by loop(): frames before it may be sent
+  uint8_t ackSent;
+  // requests from the interrupt to loop(), as counters so none gets lost
+  volatile uint8_t ackRequests, nackRequests, doneRequests, rejectRequests;
+  uint8_t acksHandled, nacksHandled, donesHandled, rejectsHandled;
+  uint8_t rejectSeq;          // begin frame that was rejected
+  volatile uint32_t badFrameCount;
+  void (*sendCallback)(const uint8_t *frame, uint8_t len);
+  void sendFrame(uint8_t type, uint8_t seq, const uint8_t *payload, uint8_t len);
+};
+
+#endif
@@ -0,0 +1,159 @@
+#include <SpiBus.h>
+
+boolean SpiBus::configured = false;
+uint16_t SpiBus::khz = SPIBUS_KHZ;
+volatile uint8_t SpiBus::owner = SPIBUS_FREE;
+volatile uint8_t SpiBus::pendingPin = SPIBUS_FREE;
+uint8_t SpiBus::pendingLength = 0;
+uint8_t SpiBus::pending[SPIBUS_POST_MAX];
+uint32_t SpiBus::deferredCount = 0;
+uint32_t SpiBus::droppedCount = 0;
+
+// Sets up the SPI peripheral the first time only; every transaction calls it.
+void SpiBus::begin() {
+  if(configured) return;
+#ifndef SPI_HAS_TRANSACTION
+  SPI.setDataMode(SPI_MODE0);
+  SPI.setBitOrder(MSBFIRST);
+  // setClockDivider has empty implementation on RFduino but default is 4Mhz (equals DIV4)
+  SPI.setFrequency(khz);
+#endif
+  SPI.begin();
+  configured = true;
+}
+
+// the next begin() configures the bus again (e.g. after SPI.end() or another library's settings)
+void SpiBus::invalidate() {
+  configured = false;
+}
+
+// bus clock from the next transaction on
+void SpiBus::setFrequency(uint16_t khz) {
+  SpiBus::khz = khz;
+  configured = false;
+}
+
+uint16_t SpiBus::frequency() {
+  return khz;
+}
+
+// data lines the next bytes are clocked over: 1 (MOSI/MISO), 2 or 4
+void SpiBus::setDataLines(uint8_t lines) {
+#ifdef SPI_HAS_DATA_LINES
+  SPI.setDataLines(lines);
+#else
+  (void)lines; // MOSI/MISO only: SPIFlash never asks for more on these
+#endif
+}
+
+void SpiBus::setPin(uint8_t pin, uint8_t level) {
+#if defined(NRF_GPIO)
+  if(level) NRF_GPIO->OUTSET = 1UL << pin;
+  else NRF_GPIO->OUTCLR = 1UL << pin;
+#elif defined(__AVR__)
+  volatile uint8_t *port = portOutputRegister(digitalPinToPort(pin));
+  uint8_t mask = digitalPinToBitMask(pin);
+  uint8_t oldSREG = SREG; // the interrupt may change another pin on the same port
+  cli();
+  if(level) *port |= mask;
+  else *port &= ~mask;
+  SREG = oldSREG;
+#else
+  digitalWrite(pin, level);
+#endif
+}
+
+void SpiBus::select(uint8_t pin) {
+  begin();
+  owner = pin; // before the pin: from here on post() holds its writes back
+  setPin(pin, LOW);
+}
+
+// Ends the transaction and sends the write post() held back during it, if any.
+void SpiBus::deselect(uint8_t pin) {
+  setPin(pin, HIGH);
+  noInterrupts();
+  owner = SPIBUS_FREE;
+  flush();
+  interrupts();
+}
+
+// with interrupts masked
+void SpiBus::flush() {
+  if(pendingPin == SPIBUS_FREE) return;
+  uint8_t pin = pendingPin;
+  pendingPin = SPIBUS_FREE;
+  setPin(pin, LOW);
+  exchange(pending, 0, pendingLength);
+  setPin(pin, HIGH);
+}
+
+// n bytes out of out (zeros when 0) while n bytes come in to in (dropped when 0)
+void SpiBus::exchange(const uint8_t *out, uint8_t *in, uint16_t n) {
+  if(n == 0) return;
+#if defined(NRF_SPI0)
+  // the RFduino SPI library runs on SPI0: one byte shifting, the next one already in TXD
+  NRF_SPI0->TXD = out ? out[0] : 0;
+  for(uint16_t i = 0; i < n; i++) {
+    if(i + 1 < n) NRF_SPI0->TXD = out ? out[i + 1] : 0;
+    while(!NRF_SPI0->EVENTS_READY);
+    NRF_SPI0->EVENTS_READY = 0;
+    uint8_t data = NRF_SPI0->RXD;
+    if(in) in[i] = data;
+  }
+#else
+  for(uint16_t i = 0; i < n; i++) {
+    uint8_t data = SPI.transfer(out ? out[i] : 0);
+    if(in) in[i] = data;
+  }
+#endif
+}
+
+uint8_t SpiBus::transfer(uint8_t data) {
+  uint8_t in;
+  exchange(&data, &in, 1);
+  return in;
+}
+
+void SpiBus::send(const uint8_t *buf, uint16_t n) {
+  exchange(buf, 0, n);
+}
+
+void SpiBus::receive(uint8_t *buf, uint16_t n) {
+  exchange(0, buf, n);
+}
+
+// Called from an interrupt: writes n bytes to the device on pin as one transaction. Returns
+// false when a transaction is in progress; the write is then sent when it ends, replacing
+// (and dropping) any write held back before it.
+boolean SpiBus::post(uint8_t pin, const uint8_t *buf, uint8_t n) {
+  if(n > SPIBUS_POST_MAX) n = SPIBUS_POST_MAX;
+  if(owner == SPIBUS_FREE) {
+    begin();
+    pendingPin = SPIBUS_FREE; // older than this one
+    setPin(pin, LOW);
+    exchange(buf, 0, n);
+    setPin(pin, HIGH);
+    return true;
+  }
+  if(pendingPin != SPIBUS_FREE) droppedCount++;
+  memcpy(pending, buf, n);
+  pendingLength = n;
+  pendingPin = pin;
+  deferredCount++;
+  return false;
+}
+
+boolean SpiBus::isFree() {
+  return owner == SPIBUS_FREE;
+}
+
+// writes post() had to hold back
+uint32_t SpiBus::deferred() {
+  return deferredCount;
+}
+
+// held back writes replaced by a newer one before the bus came free
+uint32_t SpiBus::dropped() {
+  return droppedCount;
+}
@@ -0,0 +1,69 @@
+// The SPI bus shared by the flash chip and a DAC. The bus is configured once (mode 0, MSB first,
+// SPIBUS_KHZ) instead of before every command, chip selects are toggled through the GPIO/port
+// registers instead of digitalWrite(), and buffers go out in one call: on the nRF51 the SPI0
+// master is driven directly, keeping its double buffered TXD full so the bytes follow each
+// other without gaps.
+//
+// The sample interrupt can't wait for a flash transaction to finish, so it hands its DAC write to
+// post(): sent right away when the bus is free, otherwise held (the latest one only) and sent
+// when the current transaction deselects its chip. Keep flash transactions shorter than a
+// sample period (FlashBuffer::setMaxBurst()) and no sample is lost, it only arrives late.
+//
+//   ISR:    SpiBus::post(DAC_CS, word, 2);
+//   loop(): flashBuffer.setMaxBurst(6); player.refill();
+//
+// With SPI_HAS_TRANSACTION the flash still begins a transaction per command (other libraries may
+// change the settings in between); call invalidate() after changing them yourself otherwise.
+//
+// setFrequency() changes the clock for the next transaction (the nRF51 master runs up to 8MHz).
+// setDataLines() clocks the following bytes over 2 or 4 data lines (dual/quad reads), on SPI
+// libraries that offer it (SPI_HAS_DATA_LINES); the nRF51 and AVR masters only have MOSI/MISO.
+
+#ifndef _SPIBUS_H_
+#define _SPIBUS_H_
+
+#include <Arduino.h>
+#include <SPI.h>
+
+#ifndef SPIBUS_KHZ
+#define SPIBUS_KHZ 4000
+#endif
+
+// longest write post() can hold back
+#ifndef SPIBUS_POST_MAX
+#define SPIBUS_POST_MAX 4
+#endif
+
+#define SPIBUS_FREE 0xFF
+
+class SpiBus {
+public:
+  static void begin();
+  static void invalidate();
+  static void setFrequency(uint16_t khz);
+  static uint16_t frequency();
+  static void setDataLines(uint8_t lines);
+  static void select(uint8_t pin);
+  static void deselect(uint8_t pin);
+  static uint8_t transfer(uint8_t data);
+  static void send(const uint8_t *buf, uint16_t n);
+  static void receive(uint8_t *buf, uint16_t n);
+  static boolean post(uint8_t pin, const uint8_t *buf, uint8_t n);
+  static boolean isFree();
+  static uint32_t deferred();
+  static uint32_t dropped();
+private:
+  static void setPin(uint8_t pin, uint8_t level);
+  static void exchange(const uint8_t *out, uint8_t *in, uint16_t n);
+  static void flush();
+  static boolean configured;
+  static uint16_t khz;
+  static volatile uint8_t owner;
+  static volatile uint8_t pendingPin;
+  static uint8_t pendingLength;
+  static uint8_t pending[SPIBUS_POST_MAX];
+  static uint32_t deferredCount;
+  static uint32_t droppedCount;
+};
+
+#endif
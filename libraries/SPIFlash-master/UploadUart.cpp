@@ -0,0 +1,109 @@
+#include <Arduino.h>
+
+// the IDE builds every file of the library, so only bring UploadUart in where there is a UART0 to drive
+#if defined(NRF_UART0)
+
+#include <UploadUart.h>
+
+UploadUart *UploadUart::active = 0;
+
+UploadUart::UploadUart(UploadReceiver &receiver) : receiver(receiver) {
+  txHead = txTail = 0;
+  txBusy = false;
+  overrunCount = 0;
+  irqCount = 0;
+}
+
+void UploadUart::begin(uint32_t baud, uint8_t rxPin, uint8_t txPin) {
+  end();
+  NRF_UART0->PSELRXD = rxPin;
+  NRF_UART0->PSELTXD = txPin;
+  NRF_UART0->BAUDRATE = uploadUartBaudrate(baud);
+  NRF_UART0->CONFIG = 0; // no parity, no flow control
+  NRF_UART0->ENABLE = UART_ENABLE_ENABLE_Enabled;
+  NRF_UART0->EVENTS_RXDRDY = 0;
+  NRF_UART0->EVENTS_TXDRDY = 0;
+  NRF_UART0->EVENTS_ERROR = 0;
+  NRF_UART0->ERRORSRC = NRF_UART0->ERRORSRC;
+  txHead = txTail = 0;
+  txBusy = false;
+  active = this;
+  receiver.setSendCallback(sendFrame);
+  attachInterrupt(UART0_IRQn, uartInterrupt);
+  NRF_UART0->INTENSET = UART_INTENSET_RXDRDY_Msk | UART_INTENSET_TXDRDY_Msk | UART_INTENSET_ERROR_Msk;
+  NRF_UART0->TASKS_STARTTX = 1;
+  NRF_UART0->TASKS_STARTRX = 1;
+}
+
+void UploadUart::end() {
+  if(active != this) return;
+  NRF_UART0->INTENCLR = UART_INTENSET_RXDRDY_Msk | UART_INTENSET_TXDRDY_Msk | UART_INTENSET_ERROR_Msk;
+  NRF_UART0->TASKS_STOPRX = 1;
+  NRF_UART0->TASKS_STOPTX = 1;
+  NRF_UART0->ENABLE = 0;
+  detachInterrupt(UART0_IRQn);
+  receiver.setSendCallback(0);
+  active = 0;
+}
+
+// Queues bytes for the TXDRDY interrupt; the first one goes straight into TXD when the line is idle
+void UploadUart::write(const uint8_t *data, uint8_t len) {
+  for(uint8_t i = 0; i < len; i++) {
+    uint8_t next = (txHead + 1) % UPLOADUART_TX_SIZE;
+    while(next == txTail) __WFE(); // full: the interrupt makes room
+    noInterrupts();
+    if(!txBusy) {
+      txBusy = true;
+      NRF_UART0->TXD = data[i];
+    } else {
+      tx[txHead] = data[i];
+      txHead = next;
+    }
+    interrupts();
+  }
+}
+
+uint32_t UploadUart::overruns() {
+  return overrunCount;
+}
+
+uint32_t UploadUart::interruptCount() {
+  return irqCount;
+}
+
+void UploadUart::sendFrame(const uint8_t *frame, uint8_t len) {
+  active->write(frame, len);
+}
+
+void UploadUart::uartInterrupt() {
+  active->handleInterrupt();
+}
+
+void UploadUart::handleInterrupt() {
+  if(NRF_UART0->EVENTS_ERROR) {
+    NRF_UART0->EVENTS_ERROR = 0;
+    uint32_t source = NRF_UART0->ERRORSRC;
+    NRF_UART0->ERRORSRC = source;
+    if(source & UART_ERRORSRC_OVERRUN_Msk) overrunCount++;
+  }
+  // everything the FIFO holds, and what arrives while it is being read
+  uint8_t burst[16];
+  uint8_t n = 0;
+  while(n < sizeof(burst) && NRF_UART0->EVENTS_RXDRDY) {
+    NRF_UART0->EVENTS_RXDRDY = 0;
+    burst[n++] = NRF_UART0->RXD;
+  }
+  if(n) receiver.receive(burst, n);
+  if(NRF_UART0->EVENTS_TXDRDY) {
+    NRF_UART0->EVENTS_TXDRDY = 0;
+    if(txTail != txHead) {
+      NRF_UART0->TXD = tx[txTail];
+      txTail = (txTail + 1) % UPLOADUART_TX_SIZE;
+    } else {
+      txBusy = false;
+    }
+  }
+  irqCount++;
+}
+
+#endif
@@ -0,0 +1,68 @@
+// Interrupt driven UART0 for UploadReceiver (SerialUpload.h) on the nRF51, in place of Serial and
+// serialEvent(). serialEvent() only runs between two loop() iterations and takes the bytes one
+// Serial.read() at a time from the core's 64 byte buffer, so a loop() that is busy for longer than
+// 64 byte times (0.6 ms at 1 Mbaud) loses bytes and the sender has to go back. Here the RXDRDY
+// interrupt drains everything the UART's 6 byte FIFO holds in one go and hands the burst to
+// UploadReceiver::receive(data, n), which checks it and puts whole frames into the ring, however
+// long loop() is busy with the flash. The acks go out through a small ring of their own, a byte
+// per TXDRDY interrupt, so sending one never waits for the line either.
+//
+//   SerialBuffer ring;
+//   UploadReceiver receiver(ring);
+//   UploadUart uart(receiver);
+//   uart.begin(57600);          // instead of Serial.begin(); no serialEvent()
+//
+// Takes UART0 and its interrupt (attachInterrupt(UART0_IRQn, ...), as PwmPlayer takes TIMER1's), so
+// Serial must not be begun as well. host/uploadbench.cpp runs both receive paths against the
+// same line.
+
+#ifndef _UPLOADUART_H_
+#define _UPLOADUART_H_
+
+#include <SerialUpload.h>
+
+#if !defined(NRF_UART0)
+#error "UploadUart needs the nRF51 UART"
+#endif
+
+// RFduino's Serial pins
+#ifndef UPLOADUART_RX_PIN
+#define UPLOADUART_RX_PIN 0
+#endif
+
+#ifndef UPLOADUART_TX_PIN
+#define UPLOADUART_TX_PIN 1
+#endif
+
+// acks waiting to go out; a full ring makes write() wait
+#ifndef UPLOADUART_TX_SIZE
+#define UPLOADUART_TX_SIZE 32
+#endif
+
+// BAUDRATE register value for a baud rate: baud * 2^32 / 16 MHz, in steps of 0x1000 as in the
+// datasheet's table (57600: 0x00EBF000, 1000000: 0x10000000)
+static inline uint32_t uploadUartBaudrate(uint32_t baud) {
+  return (uint32_t)((((uint64_t)baud << 32) / 16000000UL + 0x800) & 0xFFFFF000UL);
+}
+
+class UploadUart {
+public:
+  UploadUart(UploadReceiver &receiver);
+  void begin(uint32_t baud, uint8_t rxPin = UPLOADUART_RX_PIN, uint8_t txPin = UPLOADUART_TX_PIN);
+  void end();
+  void write(const uint8_t *data, uint8_t len);
+  uint32_t overruns();       // receive FIFO overflows the UART reported
+  uint32_t interruptCount();
+private:
+  static UploadUart *active; // the one the UART0 interrupt feeds
+  UploadReceiver &receiver;
+  uint8_t tx[UPLOADUART_TX_SIZE];
+  volatile uint8_t txHead, txTail;
+  volatile boolean txBusy;  // a byte is on its way, TXDRDY will come
+  volatile uint32_t overrunCount, irqCount;
+  static void uartInterrupt();
+  static void sendFrame(const uint8_t *frame, uint8_t len);
+  void handleInterrupt();
+};
+
+#endif
@@ -1,6 +1,9 @@
 //see https://github.com/NordicSemiconductor/nrf51-TIMER-examples/blob/master/timer_example_timer_mode/main.c
 #include <avr/pgmspace.h>
 #include <SPI.h>
+#include <SpiBus.h>
+#include <SampleClock.h>
+#define SAMPLE_RATE 8000              // rate the samples below were recorded at
 
 unsigned char const *sounddata_data = 0;
 int sounddata_length = 0;
@@ -362,12 +365,13 @@ void startPlayback(unsigned char const *data, int totallength)
 //  pinMode(speakerPin, OUTPUT);
   lastSample = pgm_read_byte(&sounddata_data[sounddata_length - 1]);
   sample = 0;
+  SampleClock clock = sampleClockFor(SAMPLE_RATE);
   NRF_TIMER2->TASKS_STOP = 1;                                     // Stop timer
   NRF_TIMER2->MODE = TIMER_MODE_MODE_Timer;                        // sets the timer to TIME mode (instead of counter mode)
   NRF_TIMER2->BITMODE = TIMER_BITMODE_BITMODE_16Bit;               // with BLE only Timer 1 and Timer 2 and that too only in 16bit mode
-  NRF_TIMER2->PRESCALER = 3;                                     // 16M /2 ^ 3timer     ->2M                                                             
+  NRF_TIMER2->PRESCALER = clock.prescaler;                       // 0: 16M /2 ^ 0 -> 16M
   NRF_TIMER2->TASKS_CLEAR = 1;                                     // Clear timer
-  NRF_TIMER2->CC[0] = 249;                                        //CC[0] register holds interval count value i.e your desired cycle for PWM. 8MHz / 250 -> 32kHz delen door 4 = 8kHz sample rate audio
+  NRF_TIMER2->CC[0] = clock.compare;                               //CC[0] register holds interval count value: one sample per interrupt, 1999 -> 8kHz
 //  NRF_TIMER2->CC[1] = 0;  //set this in interrupt to modify duty cycle
   NRF_TIMER2->INTENSET = (TIMER_INTENSET_COMPARE0_Enabled << TIMER_INTENSET_COMPARE0_Pos);                                     // Enable COMPARE0 Interrupt
   NRF_TIMER2->SHORTS = (TIMER_SHORTS_COMPARE0_CLEAR_Enabled << TIMER_SHORTS_COMPARE0_CLEAR_Pos);                             // Count then Complete mode enabled -> ik denk dat dit terug op 0 zet?? Idd!
@@ -424,25 +428,25 @@ void TIMER2_Interrupt(void)
 void initDac(int pinNr) {
   dacCS = pinNr;
   pinMode(pinNr, OUTPUT);
-  SPI.begin();
+  digitalWrite(pinNr, HIGH);
+  SpiBus::begin();
 }
+// from the interrupt: register chip select and one buffered write; held back until the end of
+// a flash transaction when one is on the bus
 void writeToDac(byte data) {
-  digitalWrite(dacCS, LOW);
-  byte upper = B00110000 | (data >> 4);
-  byte lower = (data << 4) & 0xFF;
-  SPI.transfer(upper);
-  SPI.transfer(lower);
-  digitalWrite(dacCS, HIGH);
+  byte word[2];
+  word[0] = B00110000 | (data >> 4);
+  word[1] = (data << 4) & 0xFF;
+  SpiBus::post(dacCS, word, 2);
 }
 
 void shutdownDac() {
-  digitalWrite(dacCS, LOW);
-  byte upper = B00100000;
-  byte lower = 0;
-  SPI.transfer(upper);
-  SPI.transfer(lower);
-  digitalWrite(dacCS, HIGH);
+  byte word[2] = { B00100000, 0 };
+  SpiBus::select(dacCS);
+  SpiBus::send(word, 2);
+  SpiBus::deselect(dacCS);
   SPI.end();
+  SpiBus::invalidate();
 }
 
 void setup() 
@@ -1,4 +1,7 @@
+#include <SampleClock.h>
+
 #define MAX_SAMPLE_LEVELS (256UL)     /*!< Maximum number of sample levels */
+#define SAMPLE_RATE 8000              // rate the samples below were recorded at
 
 int PWM_OUTPUT_PIN_NUMBER = 2;        // hook up the speaker to this pin
 
@@ -6491,12 +6494,13 @@ void TIMER1_IRQHandler(void) {
 }
 
 static void timer1_init(void) {
+  SampleClock clock = sampleClockFor(SAMPLE_RATE);
   NRF_TIMER1->TASKS_STOP = 1;   
   NRF_TIMER1->MODE = TIMER_MODE_MODE_Timer; 
   NRF_TIMER1->BITMODE = TIMER_BITMODE_BITMODE_16Bit;
-  NRF_TIMER1->PRESCALER = 4;  
+  NRF_TIMER1->PRESCALER = clock.prescaler;                          // 0: 16MHz
   NRF_TIMER1->TASKS_CLEAR = 1; 
-  NRF_TIMER1->CC[0] = 124;  
+  NRF_TIMER1->CC[0] = clock.compare;                                // 1999 for 8kHz
   NRF_TIMER1->INTENSET = TIMER_INTENSET_COMPARE0_Enabled << TIMER_INTENSET_COMPARE0_Pos;  
   NRF_TIMER1->SHORTS = (TIMER_SHORTS_COMPARE0_CLEAR_Enabled << TIMER_SHORTS_COMPARE0_CLEAR_Pos);
   attachInterrupt(TIMER1_IRQn, TIMER1_IRQHandler);   
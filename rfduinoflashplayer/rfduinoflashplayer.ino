@@ -0,0 +1,52 @@
+// Plays an item stored with FlashBuffer (see serialcomtest) from the external SPI flash.
+// PWM output through PwmPlayer: TIMER2 + PPI + GPIOTE toggle the pin without the CPU, and the
+// TIMER1 interrupt comes once per sample (rfduino2timersaudio takes one per PWM period on top)
+// to queue the next sample from the player's buffers in a TIMER2 compare register.
+// loop() refills the buffer the interrupt released with burst reads, so clips are no longer
+// limited by the size of the on-chip flash. The output runs at the rate the item was uploaded with
+// (./uploader port file:id:pcm8:16000). Between refills the flash is in deep power-down and the CPU
+// sleeps until the next timer interrupt (PlaybackScheduler).
+#include <SPI.h>
+#include <SPIFlash.h>
+#include <FlashPlayer.h>
+#include <PlaybackScheduler.h>
+#include <PwmPlayer.h>
+
+#define FLASH_CS_PIN 2
+#define ITEM_ID 3
+
+int PWM_OUTPUT_PIN_NUMBER = 3;        // hook up the speaker to this pin (2 is the flash chip select)
+
+FlashBuffer *flashBuffer;
+FlashPlayer *player;
+PlaybackScheduler *scheduler;
+PwmPlayer *pwm;
+
+// called from the TIMER1 interrupt; -1 once the item is done, PwmPlayer holds the last sample
+static int nextSample() {
+  return player->nextSample();
+}
+
+void setup() {
+  *(uint32_t *)0x40000504 = 0xC007FFDF; // Workaround for PAN_028 rev1.1 anomaly 23 - System: Manual setup is required to enable use of peripherals
+  Serial.begin(57600);
+  flashBuffer = new FlashBuffer(FLASH_CS_PIN);
+  player = new FlashPlayer(*flashBuffer);
+  scheduler = new PlaybackScheduler(*flashBuffer, *player);
+  pwm = new PwmPlayer(PWM_OUTPUT_PIN_NUMBER, nextSample);
+  if(!player->start(ITEM_ID)) Serial.println("item not found");
+  pwm->start(player->sampleRate());
+}
+
+void loop() {
+  scheduler->run();
+  if(!player->isPlaying()) {
+    pwm->stop();
+    Serial.print("played ");
+    Serial.print(player->samplesPlayed());
+    Serial.print(" samples, underruns: ");
+    Serial.println(player->underruns());
+    delay(3000);
+    if(player->start(ITEM_ID)) pwm->start(player->sampleRate()); // the item may have been replaced
+  }
+}
@@ -0,0 +1,168 @@
+// Background loop with UI sounds on top: FlashMixer plays a looping FlashBuffer item at half volume
+// and mixes in a beep item from the external flash or a short tone from the on-chip flash whenever
+// 'b' or 't' arrives on the serial port. PWM output as in rfduinoflashplayer; TIMER1 takes the
+// next mixed sample, loop() refills the flash voices. Items recorded at another rate than
+// SAMPLE_RATE are resampled by the mixer.
+#include <SPI.h>
+#include <SPIFlash.h>
+#include <FlashMixer.h>
+#include <SampleClock.h>
+
+#define MAX_SAMPLE_LEVELS (256UL)     /*!< Maximum number of sample levels */
+#define SAMPLE_RATE 8000              // 8000 - 32000
+#define FLASH_CS_PIN 2
+#define BACKGROUND_ID 3
+#define BEEP_ID 4
+
+int PWM_OUTPUT_PIN_NUMBER = 3;        // hook up the speaker to this pin (2 is the flash chip select)
+
+static uint32_t last_cc0_sample;      /*!< CC0 register value in the previous round */
+static uint32_t last_cc2_sample;      /*!< CC2 register value in the previous round */
+volatile uint32_t sampleVal = 128;
+
+// 1 kHz square wave, recorded at 8 kHz
+const PROGMEM unsigned char tone1k[] = {192, 192, 192, 192, 64, 64, 64, 64};
+
+FlashBuffer *flashBuffer;
+FlashMixer *mixer;
+int8_t toneVoice = -1;
+unsigned long toneStart;
+
+static void gpiote_init(void) {
+  *(uint32_t *)0x40000504 = 0xC007FFDF; // Workaround for PAN_028 rev1.1 anomaly 23 - System: Manual setup is required to enable use of peripherals
+
+  // Configure GPIOTE channel 0 to toggle the PWM pin state
+  // Note that we can only connect one GPIOTE task to an output pin
+  nrf_gpiote_task_config(0, PWM_OUTPUT_PIN_NUMBER, NRF_GPIOTE_POLARITY_TOGGLE, NRF_GPIOTE_INITIAL_VALUE_LOW);
+}
+
+/** Initialises Programmable Peripheral Interconnect peripheral.
+ */
+static void ppi_init(void) {
+  // Configure PPI channel 0 to toggle PWM_OUTPUT_PIN on every TIMER2 COMPARE[0] match
+  NRF_PPI->CH[0].EEP = (uint32_t)&NRF_TIMER2->EVENTS_COMPARE[0];
+  NRF_PPI->CH[0].TEP = (uint32_t)&NRF_GPIOTE->TASKS_OUT[0];
+
+  // Configure PPI channel 1 to toggle PWM_OUTPUT_PIN on every TIMER2 COMPARE[1] match
+  NRF_PPI->CH[1].EEP = (uint32_t)&NRF_TIMER2->EVENTS_COMPARE[1];
+  NRF_PPI->CH[1].TEP = (uint32_t)&NRF_GPIOTE->TASKS_OUT[0];
+
+  // Configure PPI channel 1 to toggle PWM_OUTPUT_PIN on every TIMER2 COMPARE[2] match
+  NRF_PPI->CH[2].EEP = (uint32_t)&NRF_TIMER2->EVENTS_COMPARE[2];
+  NRF_PPI->CH[2].TEP = (uint32_t)&NRF_GPIOTE->TASKS_OUT[0];
+
+  // Enable PPI channels 0-2
+  NRF_PPI->CHEN = (PPI_CHEN_CH0_Enabled << PPI_CHEN_CH0_Pos)
+                | (PPI_CHEN_CH1_Enabled << PPI_CHEN_CH1_Pos)
+                | (PPI_CHEN_CH2_Enabled << PPI_CHEN_CH2_Pos);
+}
+
+static void timer2_init(void) {
+  /* Start 16 MHz crystal oscillator */
+  NRF_CLOCK->EVENTS_HFCLKSTARTED = 0;
+  NRF_CLOCK->TASKS_HFCLKSTART = 1;
+
+  /* Wait for the external oscillator to start up */
+  while (NRF_CLOCK->EVENTS_HFCLKSTARTED == 0)
+  {
+  }
+
+  NRF_TIMER2->MODE = TIMER_MODE_MODE_Timer;
+  NRF_TIMER2->PRESCALER = 0;
+
+  // Clears the timer, sets it to 0
+  NRF_TIMER2->TASKS_CLEAR = 1;
+
+  // Load initial values to TIMER2 CC registers.
+  // CC2 will be set on the first CC1 interrupt.
+  // Timer compare events will only happen after the first 2 values
+  last_cc0_sample = sampleVal;
+  last_cc2_sample = 0;
+  NRF_TIMER2->CC[0] = MAX_SAMPLE_LEVELS + last_cc0_sample;
+  NRF_TIMER2->CC[1] = MAX_SAMPLE_LEVELS;
+  NRF_TIMER2->CC[2] = 0;
+
+  // Interrupt setup
+  NRF_TIMER2->INTENSET = (TIMER_INTENSET_COMPARE1_Enabled << TIMER_INTENSET_COMPARE1_Pos);
+
+  attachInterrupt(TIMER2_IRQn, TIMER2_IRQHandler);    // also used in variant.cpp to configure the RTC1
+  NRF_TIMER2->TASKS_START = 1;
+}
+
+void TIMER2_IRQHandler(void) {
+  static bool cc0_turn = false; /*!< Variable to keep track which CC register is to be used */
+
+  if ((NRF_TIMER2->EVENTS_COMPARE[1] != 0) && ((NRF_TIMER2->INTENSET & TIMER_INTENSET_COMPARE1_Msk) != 0))
+  {
+    // Sets the next CC1 value
+    NRF_TIMER2->EVENTS_COMPARE[1] = 0;
+    NRF_TIMER2->CC[1] = (NRF_TIMER2->CC[1] + MAX_SAMPLE_LEVELS);
+
+    // Every other interrupt CC0 and CC2 will be set to their next values
+    // They each keep track of their last duty cycle so they can compute their next correctly
+    uint32_t next_sample = sampleVal;
+
+    if (cc0_turn)
+    {
+      NRF_TIMER2->CC[0] = (NRF_TIMER2->CC[0] - last_cc0_sample + 2*MAX_SAMPLE_LEVELS + next_sample);
+      last_cc0_sample = next_sample;
+    }
+    else
+    {
+      NRF_TIMER2->CC[2] = (NRF_TIMER2->CC[2] - last_cc2_sample + 2*MAX_SAMPLE_LEVELS + next_sample);
+      last_cc2_sample = next_sample;
+    }
+    // Next turn the other CC will get its value
+    cc0_turn = !cc0_turn;
+  }
+}
+
+void TIMER1_IRQHandler(void) {
+  NRF_TIMER1->EVENTS_COMPARE[0] = 0;
+  sampleVal = mixer->nextSample();
+}
+
+static void timer1_init(void) {
+  SampleClock clock = sampleClockFor(SAMPLE_RATE);
+  NRF_TIMER1->TASKS_STOP = 1;
+  NRF_TIMER1->MODE = TIMER_MODE_MODE_Timer;
+  NRF_TIMER1->BITMODE = TIMER_BITMODE_BITMODE_16Bit;
+  NRF_TIMER1->PRESCALER = clock.prescaler;         // 0: 16MHz
+  NRF_TIMER1->TASKS_CLEAR = 1;
+  NRF_TIMER1->CC[0] = clock.compare;               // 1999 for 8kHz
+  NRF_TIMER1->INTENSET = TIMER_INTENSET_COMPARE0_Enabled << TIMER_INTENSET_COMPARE0_Pos;
+  NRF_TIMER1->SHORTS = (TIMER_SHORTS_COMPARE0_CLEAR_Enabled << TIMER_SHORTS_COMPARE0_CLEAR_Pos);
+  attachInterrupt(TIMER1_IRQn, TIMER1_IRQHandler);
+  NRF_TIMER1->TASKS_START = 1;
+}
+
+void setup() {
+  Serial.begin(57600);
+  flashBuffer = new FlashBuffer(FLASH_CS_PIN);
+  mixer = new FlashMixer(*flashBuffer, SAMPLE_RATE);
+  gpiote_init();
+  ppi_init();
+  timer2_init();
+  if(mixer->play(BACKGROUND_ID, FLASHMIXER_UNITY / 2, true) < 0) Serial.println("background not found");
+  timer1_init();
+}
+
+void loop() {
+  mixer->refill();
+  if(Serial.available()) {
+    char c = Serial.read();
+    if(c == 'b' && mixer->play(BEEP_ID) < 0) Serial.println("no free voice or no beep item");
+    if(c == 't' && toneVoice < 0) {
+      toneVoice = mixer->playProgmem(tone1k, sizeof(tone1k), FLASHMIXER_UNITY / 2, true, 8000);
+      toneStart = millis();
+    }
+  }
+  if(toneVoice >= 0 && millis() - toneStart >= 100) {
+    mixer->stop(toneVoice);
+    toneVoice = -1;
+    Serial.print("underruns: ");
+    Serial.print(mixer->underruns());
+    Serial.print(", clipped: ");
+    Serial.println(mixer->clipped());
+  }
+}
@@ -1,177 +1,156 @@
 var SerialPort = require("serialport").SerialPort;
-var sleep = require('sleep');
-var async = require('async');
 var serialPort = new SerialPort("/dev/cu.usbserial-DN008Z9K", {
   baudrate: 57600
 });
-var send = true;
-var dataBuf;
-// var buffy;
-// var complete = false;
-var length = 0;
-var incomingByteCounter = 0;
-var incomingInt = 0;
 if(!process.argv[2] || !process.argv[3]) {
-	console.log('usage: node app.js /path/to/filetowrite itemid');
+	console.log('usage: node app.js /path/to/filetowrite itemid [pcm8|adpcm] [samplerate]');
+	process.exit(1);
+}
+// how the file is coded (FLASHBUFFER_FORMAT_...): raw 8 bit PCM, or 4 bit IMA ADPCM from host/adpcm
+var FORMATS = { pcm8: 0, adpcm: 1 };
+var format = FORMATS[process.argv[4] || 'pcm8'];
+if(format === undefined) {
+	console.log('unknown format ' + process.argv[4]);
+	process.exit(1);
+}
+// the rate the file was recorded at (FLASHBUFFER_RATE_..., high nibble of the format byte), 8000 when left out
+var RATES = [8000, 11025, 12000, 16000, 22050, 24000, 32000, 44100, 48000];
+var rate = RATES.indexOf(parseInt(process.argv[5] || '8000', 10));
+if(rate < 0) {
+	console.log('sample rate must be one of ' + RATES.join(', '));
 	process.exit(1);
 }
+format |= rate << 4;
+
+// Windowed upload, see libraries/SPIFlash-master/SerialUpload.h:
+// 0x7E | type | seq | len | payload | crc16. The device hands out credits (a frame limit) as it
+// writes pages to flash; every frame below the limit is sent right away, so the line stays busy.
+// A nack or 300 ms without progress sends everything again from the oldest unacked frame.
+var FRAME_START = 0x7E;
+var FRAME_PAYLOAD = 64;   // UPLOAD_FRAME_PAYLOAD
+var TIMEOUT = 300;
+
+var dataBuf;
+var id;
+var frames;               // begin frame + data frames
+var base = 0;             // oldest unacked frame
+var next = 0;             // next frame to send
+var limit = 1;            // credits: frames before this may be sent; the begin frame needs none
+var sentHigh = 0;
+var done = false;
+var timer = null;
+var rx = [];
+var hunting = true;
+
+function crc16(bytes) {
+	var crc = 0xFFFF;
+	for(var i = 0; i < bytes.length; i++) {
+		crc ^= bytes[i] << 8;
+		for(var j = 0; j < 8; j++) crc = (crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1) & 0xFFFF;
+	}
+	return crc;
+}
+
+function frame(type, seq, payload) {
+	var body = Buffer.concat([new Buffer([type.charCodeAt(0), seq & 0xFF, payload.length]), payload]);
+	var crc = crc16(body);
+	return Buffer.concat([new Buffer([FRAME_START]), body, new Buffer([crc >> 8, crc & 0xFF])]);
+}
+
+function buildFrame(n) {
+	if(n == 0) {
+		var length = dataBuf.length;
+		var begin = [id, (length >> 16) & 0xFF, (length >> 8) & 0xFF, length & 0xFF];
+		if(format != 0) begin.push(format); // older sketches only know the 4 byte begin frame
+		return frame('B', 0, new Buffer(begin));
+	}
+	var offset = (n - 1) * FRAME_PAYLOAD;
+	return frame('D', n, dataBuf.slice(offset, Math.min(offset + FRAME_PAYLOAD, dataBuf.length)));
+}
+
+// everything the window allows in one write, no waiting for a drain per byte
+function pump() {
+	var out = [];
+	while(next < limit && next < frames) {
+		out.push(buildFrame(next));
+		if(next >= sentHigh) sentHigh = next + 1;
+		next++;
+	}
+	if(out.length) serialPort.write(Buffer.concat(out));
+}
 
-// serialPort.open(function(error) {
-// 		serialPort.on('data', function(data) {
-// 			for(var i = 0; i < data.length; i++) {
-// 				console.log(data[i]);
-// 			}
-// 	});
+function restartTimer() {
+	clearTimeout(timer);
+	timer = setTimeout(function() {
+		console.log('timeout, resending from frame ' + base);
+		next = base < frames ? base : frames - 1;
+		restartTimer();
+		pump();
+	}, TIMEOUT);
+}
 
-// 	setTimeout(function(){
-// 		serialPort.write(new Buffer([2]));
-// 	}, 2000);
+function handle(type, seq, newLimit) {
+	var ack = base + ((seq - base) & 0xFF);
+	if(ack > sentHigh) return; // stale
+	if(type == 'F') {
+		done = true;
+		clearTimeout(timer);
+		console.log('sent file');
+		process.exit(0);
+	}
+	if(type != 'A' && type != 'N') return;
+	if(ack > base || type == 'N') restartTimer();
+	base = ack;
+	limit = ack + ((newLimit - seq) & 0xFF);
+	if(type == 'N' && ack == 0 && limit == 0) {
+		console.log('the device rejected item id ' + id);
+		process.exit(1);
+	}
+	if(type == 'N') {
+		console.log('nack, resending from frame ' + base);
+		next = base;
+	} else if(next < base) {
+		next = base;
+	}
+	pump();
+}
 
-// });
+function receive(b) {
+	if(hunting) {
+		if(b == FRAME_START) {
+			hunting = false;
+			rx = [];
+		}
+		return;
+	}
+	rx.push(b);
+	if(rx.length == 3 && rx[2] > 1) {
+		hunting = true;
+		return;
+	}
+	if(rx.length < 3 || rx.length < 5 + rx[2]) return;
+	hunting = true;
+	var crc = crc16(rx.slice(0, 3 + rx[2]));
+	if(rx[3 + rx[2]] != crc >> 8 || rx[4 + rx[2]] != (crc & 0xFF)) return;
+	handle(String.fromCharCode(rx[0]), rx[1], rx[2] ? rx[3] : 0);
+}
 
 // auto reset on serial connection: rfduino resets on open, therefore we need a timeout
 // http://playground.arduino.cc/Main/DisablingAutoResetOnSerialConnection
 serialPort.on("open", function() {
 	console.log('open... waiting 2 seconds');
-	var teller = 0;
 	setTimeout(sendFile, 2000);
 	serialPort.on('data', function(data) {
-		// console.log(data.length+": "+data[0].toString(16));
-		// console.log(data.toString('ascii'));
-		for(var i = 0; i < data.length; i++) {
-			if(send) {
-				if(incomingByteCounter < 3) {
-					incomingInt |= data[i] << (16 - incomingByteCounter * 8);
-					incomingByteCounter++;
-				}
-				if(incomingByteCounter == 3) {
-					send = false;
-					console.log('pausing send');
-					incomingInt = 0;
-					incomingByteCounter = 0;
-				}
-			} else {
-				if(incomingByteCounter < 3) {
-					incomingInt |= data[i] << (16 - incomingByteCounter * 8);
-					incomingByteCounter++;
-				}
-				if(incomingByteCounter == 3) {
-					send = true;
-					console.log('resuming send from: ' + incomingInt);
-					sendBufferFromPosition(dataBuf, incomingInt);
-					incomingInt = 0;
-					incomingByteCounter = 0;
-				}
-			}
-		}
-
-  	     //else console.log('received ' + teller++ + ": " + data[0].toString(16));
-  	    // else {
-  	    // 	if(teller>0){
-  	    // 		console.log(data[0].toString(16));
-  	    // 		buffy[teller -1 ] = data[0].toString(16);
-  	    // 	}
-  	    // 	teller++;
-  	    // 	// console.log(teller);
-  	    // }
-  	    // if(complete) {
-
-  	    // }
+		for(var i = 0; i < data.length; i++) receive(data[i]);
 	});
 });
 
-function sendBufferFromPosition(buf, index) {
-	var data = buf.slice(index);
-	async.eachSeries(data, function(value, callback) {
-		if(send) {
-			serialPort.write([value], function(error, results) {
-				serialPort.drain(function(err, res) {
-					callback(err);
-				});
-			});
-		} else {
-			callback (new Error("waiting for empty space in buffer"));
-		}
-	}, function (err) {
-		if(err) console.log(err);
-		else console.log('sent file');
-	});
-}
-
 function sendFile() {
 	dataBuf = require('fs').readFileSync(process.argv[2]);
-	// for(var i = 0; i < dataBuf.length; i++) {
-	// 	console.log(dataBuf[i].toString(16));
-	// }
-	length = dataBuf.length;
-	// buffy = new Buffer(length);
-	console.log('length ' + length);
-	var id = process.argv[3];
+	console.log('length ' + dataBuf.length);
+	id = parseInt(process.argv[3], 10) & 0x7F;
 	console.log('id ' + id);
-	serialPort.write([id[0] /* id.charCodeAt(0) for ascii code */, (length >> 16) & 0xFF, (length >> 8) & 0xFF, length & 0xFF]);
-	// for(var i = 0; i < dataBuf.length; i++) {
-	// 	// console.log(dataBuf[i].toString(16));
-	// 	serialPort.write([dataBuf[i]]);
-	// }
-	sendBufferFromPosition(dataBuf, 0);
-	// for(var i = 0; i < length; i++) {
-	// 	console.log(i);
-	// 	if(send) {
-	// 		// console.log('sending byte ' + i + ': ' + dataBuf[i].toString(16));
-	// 		serialPort.write([dataBuf[i]]);
-	// 	} else {
-	// 		i = i - 1;
-	// 		while(!send) {
-	// 			sleep.usleep(200000);
-	// 			console.log('resending byte ' + i + ': ' + dataBuf[i].toString(16));
-	// 			serialPort.write([dataBuf[i]]);
-	// 		}
-	// 	}
-	// }
+	frames = 1 + Math.ceil(dataBuf.length / FRAME_PAYLOAD);
+	restartTimer();
+	pump();
 }
-
-
-
-// serialPort.on("open", function () {
-//   console.log('open');
-//   serialPort.write(new Buffer([2,3,4,5,6]));
-//   serialPort.on('data', function(data) {
-//   	for(var i = 0; i < data.length; i++) {
-//   		console.log(data[i]);
-//   	}
-//     // console.log('data received: ' + data.length);
-//     if(data[0] == 0) {
-//     	console.log('pause');
-//     	send = false;
-//     }
-//     if(data[0] == 1) {
-//     	console.log('resume');
-//     	send = true;
-//     }
-//     // if(data[0] == 1) {
-//     // 	console.log('start');
-//     // 	send = true;
-//     // }
-//   });
-//   // serialPort.write(1, function(er, res){});
-//   // serialPort.write("ls\n", function(err, results) {
-//   // 	serialPort.drain(function(er, res) {
-//   // 		console.log('er ' + er);
-//   // 		console.log('res ' + res);
-//   // 	});
-//   //   console.log('err ' + err);
-//   //   console.log('results ' + results);
-//   // });
-//   setTimeout(function(){
-//   		serialPort.write(new Buffer([3]), function(err, res){});
-//   }, 2000);
-
-//   setInterval(function(){
-//   	if(send) {
-//   		serialPort.write(new Buffer([2]), function(err, res){
-//   			console.log('writing');
-//   		});
-
-//   	}
-//   }, 100);
-// });
@@ -1,107 +1,42 @@
 #include <SPI.h>
 #include <SPIFlash.h>
-
+#include <SerialUpload.h>
+#include <UploadUart.h>
+
+// Receives items from host/uploader (or app.js) and stores them with FlashBuffer.
+// Windowed protocol (see SerialUpload.h): data arrives in CRC checked frames, and the sender may
+// keep as many frames in flight as there is free space in the ring (credits). Credits are handed
+// out whenever FlashBuffer has programmed a page, so the line never has to stop.
+// The UART interrupt drains the receive FIFO and hands the bytes to the receiver in bursts
+// (UploadUart.h), so frames reach the ring while loop() is busy with the flash.
 SerialBuffer sBuffer;
-boolean lenTransferred[3] ={0};
-boolean transferOngoing = 0, idTransferred = 0;
-volatile boolean bufferNotEmpty = 0;
-volatile boolean paused = 0;
-volatile boolean writeStarted = 0;
-byte id;
-uint32_t length = 0;
-volatile uint32_t counter = 0; //32 bit processor so atomic operations
+UploadReceiver receiver(sBuffer);
+UploadUart uploadUart(receiver);
 FlashBuffer* flashBuffer;
 
 
-
-
 void setup() {
-  transferOngoing = false;
-  Serial.begin(57600);
+  uploadUart.begin(57600);
 //  FlashBuffer fb(2);
 //  flashBuffer = &fb; //or with new; but I guess this stuff stays alive the whole time ->not working with callback; address changes if you change field!?
 //  fb.print();
   flashBuffer = new FlashBuffer(2);
-  flashBuffer->setResumeCallback(resume); //resume will be executed when there is space available in the buffer
+  flashBuffer->setResumeCallback(resume); //resume will be executed when a page was written or the buffer ran empty
 }
 
-//void pause() {
-//  
-//}
 void resume() {
-  if(paused) {
-    Serial.write((byte) (counter >> 16));
-    Serial.write((byte) (counter >> 8) & 0xFF);
-    Serial.write((byte) (counter & 0xFF));
-    paused = 0;
-  }
-//  Serial.write((byte)0);
-//  Serial.write((byte)1);
-//  Serial.write((byte)2); 
+  receiver.sendCredits();
 }
 
 void loop() {
-  // put your main code here, to run repeatedly:
-//  Serial.write(6);
-//Serial.write("lala");
-
-  if(bufferNotEmpty && !writeStarted) { //initialisation variable
-    writeStarted = 1;
-//    fb.print();
-    flashBuffer->writeItemToFlash(id, length, sBuffer);
-    sBuffer.reset();
-    bufferNotEmpty = 0;
-//    byte value = sBuffer.remove();
-//    if(value != -1) {
-//      Serial.write(value);
-//      if(paused) {
-//        sBuffer.sendResumeOverSerial();
-//        paused = 0;
-//      }
-//    }
-  }
-}
-
-
-
-void serialEvent(void){
-  int ch;
-  ch = Serial.read();
-  if(!transferOngoing) {
-    if(!idTransferred) {
-      id = (byte) ch;
-//      Serial.write(id);
-      idTransferred = 1;
-    } else { //only execute this when id already initialized
-      for(byte i = 0; i < 3; i++) {
-        if(!lenTransferred[i]) {
-          length |= ch << 16 - i * 8;
-          lenTransferred[i] = 1;
-          if(i == 2) transferOngoing = 1;
-          break;
-        }
-      }
-    }
+  receiver.sendCredits();
+  if(flashBuffer->writing()) {
+    // programs a page whenever one is complete in the ring and the chip is ready, never waits
+    if(flashBuffer->writeStep() == FLASHBUFFER_WRITE_IDLE) receiver.finish();
+  } else if(receiver.itemStarted()) { // begin frame received
+    flashBuffer->startItem(receiver.itemId(), receiver.itemLength(), sBuffer, receiver.itemFormat());
   } else {
-//    Serial.write("lala");
-//    Serial.write((byte)ch);
-//    if(sBuffer.add((byte) ch) == -1) sBuffer.sendPauseOverSerial();
-      if(!paused) {
-        if(sBuffer.add((byte) ch) == -1) {
-          paused = 1;
-//        send 3 zero's to stop the writing on the other side (to resume it's also 3 bytes)
-          Serial.write((byte) 0x00);
-          Serial.write((byte) 0x00);
-          Serial.write((byte) 0x00);
-          
-        } else {
-          counter++;
-        }
-        if(counter==256) bufferNotEmpty = 1;
-      }
+    flashBuffer->eraseStep(); // between uploads: erase ahead, so the next one doesn't wait for it
   }
-//    Serial.write(id);
-//    Serial.write(length >> 16);
-//    Serial.write((length >> 8) /*& 0xFF*/); //mask is not necessary; lowest byte is picked automatically
-//    Serial.write(length /*& 0xFF*/);  
 }
+